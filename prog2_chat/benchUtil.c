@@ -0,0 +1,372 @@
+// --------------- benchUtil.c -----------------
+/*
+Connect/login/server start-up code for the benchmark tools. They open
+thousands of client sockets, so unlike tcpClientSetup() nothing here prints
+on success.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "benchUtil.h"
+#include "sendreceive.h"
+#include "makePDU.h"
+
+// Blocking TCP connect with Nagle off, exits if the server isn't there
+int benchConnect(char *host, char *port)
+{
+    struct addrinfo hints, *result = NULL;
+    int socketNum = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(host, port, &hints, &result) != 0)
+    {
+        fprintf(stderr, "Can't resolve %s\n", host);
+        exit(-1);
+    }
+
+    for (struct addrinfo *addr = result; addr != NULL; addr = addr->ai_next)
+    {
+        if ((socketNum = socket(addr->ai_family, addr->ai_socktype, 0)) < 0)
+        {
+            continue;
+        }
+        if (connect(socketNum, addr->ai_addr, addr->ai_addrlen) == 0)
+        {
+            break;
+        }
+        close(socketNum);
+        socketNum = -1;
+    }
+    freeaddrinfo(result);
+
+    if (socketNum < 0)
+    {
+        perror("connect");
+        exit(-1);
+    }
+
+    int on = 1;
+    setsockopt(socketNum, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return socketNum;
+}
+
+/*
+-- Log in as handle with the same initial PDU cclient sends
+-- Sets the global sender_handle, so only call it from one thread at a time
+-- Return value: 0 if the server confirmed, -1 if not
+*/
+int benchLogin(int socketNum, char *handle)
+{
+    return benchLoginWith(socketNum, handle, 0) < 0 ? -1 : 0;
+}
+
+// Same, asking for capabilities (LOGIN_CAP_*). Return value: the ones granted, -1 if the login failed
+int benchLoginWith(int socketNum, char *handle, uint8_t capabilities)
+{
+    uint8_t response[MAXBUF];
+
+    snprintf(sender_handle, MAX_HANDLE_LEN, "%s", handle);
+    uint8_t *loginPDU = makeInitialPDU(capabilities);
+    int responseLen = 0;
+
+    if (sendPDU(socketNum, loginPDU, 2 + strlen(sender_handle) + (capabilities ? 1 : 0)) < 0 ||
+        (responseLen = recvPDU(socketNum, response, MAXBUF)) <= 0 || response[2] != 2)
+    {
+        fprintf(stderr, "Login failed for %s\n", handle);
+        return -1;
+    }
+    return responseLen > 3 ? response[3] : 0;
+}
+
+// Shared memory client of the server listening on the Unix socket at path, exits if it isn't there
+ShmEndpoint_t *benchConnectShm(char *path)
+{
+    ShmEndpoint_t *shm = shmConnect(path);
+    if (shm == NULL)
+    {
+        perror(path);
+        exit(-1);
+    }
+    return shm;
+}
+
+// benchLoginWith() over a shared memory client's rings
+int benchLoginShm(ShmEndpoint_t *shm, char *handle, uint8_t capabilities)
+{
+    uint8_t pdu[MAXBUF];
+    int got = 0;
+
+    snprintf(sender_handle, MAX_HANDLE_LEN, "%s", handle);
+    uint8_t *loginPDU = makeInitialPDU(capabilities);
+    uint16_t pduLength = 2 + strlen(sender_handle) + (capabilities ? 1 : 0);
+
+    memcpy(pdu + 2, loginPDU, pduLength);
+    pduLength += 2;
+    pdu[0] = pduLength >> 8;
+    pdu[1] = pduLength & 0xff;
+    if (shmSendAll(shm, pdu, pduLength) < 0)
+    {
+        fprintf(stderr, "Login failed for %s\n", handle);
+        return -1;
+    }
+
+    // Exactly the reply, nothing that comes after it
+    int wanted = 2;
+    while (got < wanted)
+    {
+        int bytes = shmRecvWait(shm, pdu + got, wanted - got);
+        if (bytes <= 0)
+        {
+            fprintf(stderr, "Login failed for %s\n", handle);
+            return -1;
+        }
+        got += bytes;
+        if (got == 2)
+        {
+            wanted = (pdu[0] << 8) | pdu[1];
+            if (wanted < 3 || wanted > MAXBUF)
+            {
+                fprintf(stderr, "Login failed for %s\n", handle);
+                return -1;
+            }
+        }
+    }
+    if (pdu[4] != 2)
+    {
+        fprintf(stderr, "Login failed for %s\n", handle);
+        return -1;
+    }
+    return wanted > 5 ? pdu[5] : 0;
+}
+
+// fork/exec the server with -t threads on port (and -U shmPath unless it's NULL,
+// then extraArgs unless it's NULL, output thrown away) and wait until it takes connections
+pid_t benchStartServer(char *serverPath, int threads, char *port, char *shmPath, char **extraArgs)
+{
+    char threadArg[16];
+    char *args[BENCH_MAX_SERVER_ARGS];
+    int numArgs = 0;
+
+    snprintf(threadArg, sizeof(threadArg), "%d", threads);
+    args[numArgs++] = serverPath;
+    args[numArgs++] = "-t";
+    args[numArgs++] = threadArg;
+    if (shmPath != NULL)
+    {
+        args[numArgs++] = "-U";
+        args[numArgs++] = shmPath;
+    }
+    for (int i = 0; extraArgs != NULL && extraArgs[i] != NULL && numArgs < BENCH_MAX_SERVER_ARGS - 2; i++)
+    {
+        args[numArgs++] = extraArgs[i];
+    }
+    args[numArgs++] = port;
+    args[numArgs] = NULL;
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        exit(-1);
+    }
+    if (pid == 0)
+    {
+        int devNull = open("/dev/null", O_WRONLY);
+        dup2(devNull, STDOUT_FILENO);
+        dup2(devNull, STDERR_FILENO);
+        execv(serverPath, args);
+        _exit(1);
+    }
+
+    for (int tries = 0; tries < 100; tries++)
+    {
+        struct addrinfo hints, *result = NULL;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo("localhost", port, &hints, &result) == 0)
+        {
+            int probe = socket(result->ai_family, SOCK_STREAM, 0);
+            int ok = connect(probe, result->ai_addr, result->ai_addrlen) == 0;
+            close(probe);
+            freeaddrinfo(result);
+            if (ok)
+            {
+                return pid;
+            }
+        }
+        usleep(50000);
+    }
+    fprintf(stderr, "Server didn't start on port %s\n", port);
+    kill(pid, SIGKILL);
+    exit(-1);
+}
+
+void benchStopServer(pid_t server)
+{
+    kill(server, SIGKILL);
+    waitpid(server, NULL, 0);
+}
+
+// Times the server's threads have gone to sleep waiting (each epoll_wait() that blocked), -1 if unknown
+long benchServerWakeups(pid_t server)
+{
+    char path[300];
+    char line[256];
+    long wakeups = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/task", (int)server);
+    DIR *tasks = opendir(path);
+    if (tasks == NULL)
+    {
+        return -1;
+    }
+    for (struct dirent *task = readdir(tasks); task != NULL; task = readdir(tasks))
+    {
+        if (task->d_name[0] == '.')
+        {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/proc/%d/task/%s/status", (int)server, task->d_name);
+        FILE *status = fopen(path, "r");
+        if (status == NULL)
+        {
+            continue;
+        }
+        long switches = 0;
+        while (fgets(line, sizeof(line), status) != NULL)
+        {
+            if (sscanf(line, "voluntary_ctxt_switches: %ld", &switches) == 1)
+            {
+                wakeups += switches;
+            }
+        }
+        fclose(status);
+    }
+    closedir(tasks);
+    return wakeups;
+}
+
+// The syscalls counter from a server's admin socket (its -A), -1 if it didn't answer
+long benchServerSyscalls(char *adminPath)
+{
+    struct sockaddr_un address;
+    char reply[4096];
+    int replyLen = 0;
+    int received = 0;
+    long syscalls = -1;
+
+    int socketNum = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socketNum < 0)
+    {
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", adminPath);
+    if (connect(socketNum, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        close(socketNum);
+        return -1;
+    }
+
+    // An empty request gets the text report, one "name total rate/s" line per metric
+    shutdown(socketNum, SHUT_WR);
+    while (replyLen < (int)sizeof(reply) - 1 &&
+           (received = read(socketNum, reply + replyLen, sizeof(reply) - 1 - replyLen)) > 0)
+    {
+        replyLen += received;
+    }
+    close(socketNum);
+    reply[replyLen] = '\0';
+
+    for (char *line = strtok(reply, "\n"); line != NULL; line = strtok(NULL, "\n"))
+    {
+        if (sscanf(line, "syscalls %ld", &syscalls) == 1)
+        {
+            break;
+        }
+    }
+    return syscalls;
+}
+
+uint64_t benchNowNanos()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/*
+-- Wait until every node of a cluster (one port each) lists at least
+   expected handles, so a message to any client is routed from the start
+-- One probe client per node stays logged in while it looks, they count too
+-- Return value: 0, -1 if it didn't happen within 10 seconds
+*/
+int benchWaitForHandles(char *host, char **ports, int numPorts, int expected)
+{
+    int probes[numPorts];
+    int status = -1;
+
+    for (int i = 0; i < numPorts; i++)
+    {
+        char handle[MAX_HANDLE_LEN];
+        snprintf(handle, sizeof(handle), "probe%d_%d", (int)getpid(), i);
+        probes[i] = benchConnect(host, ports[i]);
+        if (benchLogin(probes[i], handle) < 0)
+        {
+            exit(-1);
+        }
+    }
+
+    for (int tries = 0; tries < 200 && status < 0; tries++)
+    {
+        int ready = 0;
+        for (int i = 0; i < numPorts; i++)
+        {
+            // The first page of a listing carries the total
+            uint8_t request[5] = {LIST_PAGE_REQUEST_FLAG, 0, 0, 0, 0};
+            uint8_t reply[MAXBUF];
+            uint32_t total = 0;
+
+            if (sendPDU(probes[i], request, sizeof(request)) < 0 || recvPDU(probes[i], reply, MAXBUF) < 5 ||
+                reply[0] != LIST_PAGE_FLAG)
+            {
+                break;
+            }
+            memcpy(&total, reply + 1, 4);
+            ready += (ntohl(total) >= (uint32_t)(expected + numPorts));
+        }
+        if (ready == numPorts)
+        {
+            status = 0;
+        }
+        else
+        {
+            usleep(50000);
+        }
+    }
+
+    for (int i = 0; i < numPorts; i++)
+    {
+        close(probes[i]);
+    }
+    return status;
+}
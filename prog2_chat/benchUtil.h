@@ -0,0 +1,25 @@
+#ifndef BENCHUTIL_H
+#define BENCHUTIL_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "shmRing.h"
+
+// Helpers shared by the benchmark/load tools (chatbench, chatload)
+
+#define BENCH_MAX_SERVER_ARGS 32
+
+int benchConnect(char *host, char *port);
+int benchLogin(int socketNum, char *handle);
+int benchLoginWith(int socketNum, char *handle, uint8_t capabilities);
+ShmEndpoint_t *benchConnectShm(char *path);
+int benchLoginShm(ShmEndpoint_t *shm, char *handle, uint8_t capabilities);
+pid_t benchStartServer(char *serverPath, int threads, char *port, char *shmPath, char **extraArgs);
+int benchWaitForHandles(char *host, char **ports, int numPorts, int expected);
+void benchStopServer(pid_t server);
+long benchServerWakeups(pid_t server);
+long benchServerSyscalls(char *adminPath);
+uint64_t benchNowNanos();
+
+#endif
@@ -20,6 +20,7 @@
 #include <netinet/in.h>
 #include <netdb.h>
 #include <stdint.h>
+#include <errno.h>
 
 #include "networks.h"
 #include "safeUtil.h"
@@ -30,12 +31,46 @@
 #include "cclient.h"
 #include "makePDU.h"
 #include "shared.h"
+#include "clientBot.h"
+#include "pduCodec.h"
 
 #define MAX_HANDLE_LEN 100
 #define MAX_MSG_SIZE 199
 
 char sender_handle[MAX_HANDLE_LEN] = {0}; // Global variable to store the sender handle
 volatile int listInProgress = 0; // Flag to indicate if a list is in progress
+uint32_t listCursor = 0; // cursor of the list page we asked for last
+
+#define SERVER_BUFFER_SIZE (16 * MAXBUF) // what one recv() from the server can take
+
+// Bytes from the server not handled yet: every complete PDU is handled as
+// soon as it's read, a partial one waits here for the rest
+uint8_t serverBuffer[SERVER_BUFFER_SIZE];
+int serverBufferLen = 0;
+
+// What's been typed (or read from a bot's script) since the last newline
+int commandFd = STDIN_FILENO;
+char stdinBuffer[MAXBUF];
+int stdinLen = 0;
+int stdinOpen = 1;
+
+#define MAX_INCOMING_STREAMS 16
+#define STREAM_READ_SEGMENTS 60 // segments read and sent per send() when streaming
+
+// A streamed message coming in, printed as it arrives
+typedef struct
+{
+	uint32_t streamId;
+	uint32_t remaining;
+	char sender[MAX_HANDLE_LEN];
+} IncomingStream_t;
+
+IncomingStream_t incomingStreams[MAX_INCOMING_STREAMS];
+int numIncomingStreams = 0;
+uint32_t lastPrintedStream = 0; // whose text the last line printed belongs to
+uint32_t nextStreamId = 1;
+uint32_t outgoingStream = 0;    // the one we're sending, 0 if none
+volatile int outgoingAborted = 0;
 
 /* Parse what command that client would like to send */
 CommandType parseCommand(char *buffer)
@@ -75,6 +110,22 @@ CommandType parseCommand(char *buffer)
 	{
 		return CMD_LIST_HANDLES;
 	}
+	else if (strncasecmp(trimmedBuffer, "%j", 2) == 0)
+	{
+		return CMD_JOIN_CHANNEL;
+	}
+	else if (strncasecmp(trimmedBuffer, "%q", 2) == 0)
+	{
+		return CMD_LEAVE_CHANNEL;
+	}
+	else if (strncasecmp(trimmedBuffer, "%g", 2) == 0)
+	{
+		return CMD_CHANNEL_MESSAGE;
+	}
+	else if (strncasecmp(trimmedBuffer, "%f", 2) == 0)
+	{
+		return CMD_SEND_FILE;
+	}
 	else
 	{
 		printf("Invalid buffer: %s\n", trimmedBuffer); // Debug output
@@ -99,13 +150,23 @@ void waitForServerResponse(int socketNum)
 		exit(0);
 	}
 
-	uint8_t flag = buffer[2];
-	// printf("Server response: %d\n", flag);
-	if (flag == 2)
+	// The reply carries its own length inside the usual one
+	PduView_t reply;
+	if (recvBytes < 3 || pduParse(buffer + 2, recvBytes - 2, PDU_TO_CLIENT, &reply) < 0)
+	{
+		printf("Unknown server response.\n");
+		return;
+	}
+	if (reply.flag == 2)
 	{
 		printf("Confirmed login!\n");
+
+		// A server that knows about capabilities says which ones we got
+		uint8_t granted = reply.numBytes > 0 ? reply.bytes[0] : 0;
+		pduBatching = (granted & LOGIN_CAP_BATCH) != 0;
+		pduStreaming = (granted & LOGIN_CAP_STREAM) != 0;
 	}
-	else if (flag == 3)
+	else if (reply.flag == 3)
 	{
 		printf("Error on initial packet (handle already exists).\n");
 		exit(-1);
@@ -127,11 +188,23 @@ int handleSendMessage(int socketNum, const char *buffer)
 
 	// add a byte to the text_message len for the null terminator
 	int text_message_len = strlen((char *)text_message);
+
+	// Too long for one %m: stream it as one message if the server lets us
+	if (pduStreaming && text_message_len > MAX_MSG_SIZE)
+	{
+		FILE *source = fmemopen(text_message, text_message_len, "r");
+		int streamed = streamMessage(socketNum, destinationHandle, source, text_message_len);
+		fclose(source);
+		return streamed;
+	}
 	text_message_len += 1; // Add 1 for the null terminator
 
 
 	int sentBytes = 0;
 	int chunkSize = 0;
+	PDUBatch_t batch;
+	initPDUBatch(&batch, socketNum);
+
 	// Check if the message length exceeds the maximum size
 	while (sentBytes < text_message_len)
 	{
@@ -152,7 +225,7 @@ int handleSendMessage(int socketNum, const char *buffer)
 		
 		// Send the message packet in chunks
 		// int sent = sendMessageInChunks(socketNum, destinationHandle, packetInfo.packet, packetInfo.packet_len);
-		int sent = sendPDU(socketNum, packetInfo.packet, packetInfo.packet_len);
+		int sent = batchPDU(&batch, packetInfo.packet, packetInfo.packet_len);
 		if (sent < 0)
 		{
 			printf("Error sending message packet.\n");
@@ -163,7 +236,7 @@ int handleSendMessage(int socketNum, const char *buffer)
 			printf("Message sent successfully.\n");
 		}
 	}
-	return 0;
+	return flushPDUBatch(&batch);
 }
 
 void readMessageCommand(const char *buffer, char destinationHandle[100], uint8_t text_message[MAXBUF])
@@ -280,6 +353,167 @@ void handleBroadcastMessage(int socketNum, const char *buffer)
 }
 
 
+// %J <channel> joins, %Q <channel> leaves
+void handleChannelMembership(int socketNum, const char *buffer, uint8_t flag)
+{
+	char channel[MAXBUF];
+
+	if (sscanf(buffer + 2, " %s", channel) != 1)
+	{
+		printf("Invalid channel command format. Use: %%J <channel> or %%Q <channel>\n");
+		return;
+	}
+	if (strlen(channel) >= MAX_CHANNEL_NAME_LEN)
+	{
+		printf("Channel name must be shorter than %d characters.\n", MAX_CHANNEL_NAME_LEN);
+		return;
+	}
+
+	uint8_t channelPDU[MAXBUF];
+	int pduLen = makeChannelPDU(channelPDU, flag, channel);
+	if (sendPDU(socketNum, channelPDU, pduLen) < 0)
+	{
+		printf("Error sending channel PDU.\n");
+	}
+}
+
+// %G <channel> <message>
+void handleChannelMessage(int socketNum, const char *buffer)
+{
+	char channel[MAXBUF];
+	char message[MAXBUF];
+
+	if (sscanf(buffer + 2, " %s %[^\n]", channel, message) != 2)
+	{
+		printf("Invalid channel message format. Use: %%G <channel> <message>\n");
+		return;
+	}
+	if (strlen(channel) >= MAX_CHANNEL_NAME_LEN)
+	{
+		printf("Channel name must be shorter than %d characters.\n", MAX_CHANNEL_NAME_LEN);
+		return;
+	}
+
+	uint8_t channelPDU[MAXBUF];
+	if (sendChannelMessagePDU(channelPDU, socketNum, channel, message) < 0)
+	{
+		printf("Error sending channel message.\n");
+	}
+}
+
+
+// %F <handle> <file>: the whole file as one streamed message
+void handleSendFile(int socketNum, const char *buffer)
+{
+	char destinationHandle[MAXBUF];
+	char path[MAXBUF];
+
+	if (sscanf(buffer + 2, " %s %[^\n]", destinationHandle, path) != 2)
+	{
+		printf("Invalid file command format. Use: %%F <handle> <file>\n");
+		return;
+	}
+	if (!pduStreaming)
+	{
+		printf("The server doesn't take streamed messages.\n");
+		return;
+	}
+
+	FILE *source = fopen(path, "r");
+	struct stat fileInfo;
+	if (source == NULL || fstat(fileno(source), &fileInfo) < 0)
+	{
+		perror(path);
+		if (source != NULL)
+		{
+			fclose(source);
+		}
+		return;
+	}
+	if ((uint64_t)fileInfo.st_size > UINT32_MAX)
+	{
+		printf("%s is too big to send.\n", path);
+		fclose(source);
+		return;
+	}
+
+	if (streamMessage(socketNum, destinationHandle, source, fileInfo.st_size) == 0)
+	{
+		printf("Sent %ld bytes to %s.\n", (long)fileInfo.st_size, destinationHandle);
+	}
+	fclose(source);
+}
+
+/*
+-- Send length bytes from source to destination as one streamed message:
+   a start PDU, then STREAM_READ_SEGMENTS segments per send()
+-- Whatever the server sends us in between is handled as we go, so two
+   clients streaming at each other don't both wait forever
+-- Return value: 0 once it is all sent, -1 if it failed or was aborted
+*/
+int streamMessage(int socketNum, char *destinationHandle, FILE *source, uint32_t length)
+{
+	static uint8_t data[STREAM_READ_SEGMENTS * STREAM_SEGMENT_SIZE];
+	static uint8_t out[STREAM_READ_SEGMENTS * (2 + STREAM_HEADER_LEN + STREAM_SEGMENT_SIZE)];
+	uint8_t startPDU[MAXBUF];
+
+	if (strlen(destinationHandle) >= MAX_TABLE_HANDLE_LEN)
+	{
+		printf("Invalid handle.\n");
+		return -1;
+	}
+
+	outgoingStream = nextStreamId++;
+	outgoingAborted = 0;
+
+	int startLen = makeStreamStartPDU(startPDU, outgoingStream, length, sender_handle, destinationHandle);
+	if (sendPDU(socketNum, startPDU, startLen) < 0)
+	{
+		outgoingStream = 0;
+		return -1;
+	}
+
+	uint32_t sent = 0;
+	while (sent < length && !outgoingAborted)
+	{
+		uint32_t want = (length - sent < sizeof(data)) ? length - sent : sizeof(data);
+		size_t got = fread(data, 1, want, source);
+		if (got == 0)
+		{
+			// The file got shorter under us, tell the other end it isn't coming
+			uint8_t abort[STREAM_HEADER_LEN + 1];
+			PduView_t abortView;
+			pduStart(&abortView, STREAM_ABORT_FLAG);
+			pduAddNumber(&abortView, outgoingStream);
+			pduAddByte(&abortView, STREAM_BAD_DATA);
+			sendPDU(socketNum, abort, pduEncode(abort, sizeof(abort), PDU_TO_SERVER, &abortView));
+			printf("Couldn't read the rest of the message.\n");
+			break;
+		}
+
+		int outLen = appendStreamData(out, outgoingStream, data, got);
+		if (safeSend(socketNum, out, outLen, 0) != outLen)
+		{
+			printf("Error sending stream.\n");
+			break;
+		}
+		sent += got;
+
+		drainServer(socketNum);
+	}
+
+	int done = (sent == length && !outgoingAborted) ? 0 : -1;
+	outgoingStream = 0;
+	return done;
+}
+
+// Handle everything the server has already sent us, without waiting
+void drainServer(int socketNum)
+{
+	processMsgFromServer(socketNum);
+}
+
+
 void handleMulticastMessage(int socketNum, char *buffer)
 {
 
@@ -297,7 +531,8 @@ void handleMulticastMessage(int socketNum, char *buffer)
 
 	// Now, we can construct the multicast packet
 	uint8_t multicastPDU[MAXBUF];
-
+	PDUBatch_t batch;
+	initPDUBatch(&batch, socketNum);
 
 	int sentBytes = 0;
 	int chunkSize = 0;
@@ -319,7 +554,7 @@ void handleMulticastMessage(int socketNum, char *buffer)
 		}
 
 		// Send the multicast PDU
-		int sent = sendPDU(socketNum, multicastPDU, pduLen);
+		int sent = batchPDU(&batch, multicastPDU, pduLen);
 		if (sent < 0)
 		{
 			printf("Error sending multicast PDU.\n");
@@ -331,18 +566,30 @@ void handleMulticastMessage(int socketNum, char *buffer)
 		}
 
 	}
+	if (flushPDUBatch(&batch) < 0)
+	{
+		printf("Error sending multicast PDU.\n");
+	}
 }
 
 void handleListHandles(int socketNum, const char *buffer)
 {
 	// all we need to do is list the current handles in the handle table
+	// ask for the first page, processListPage() asks for the rest
 	uint8_t listPDU[MAXBUF];
-	int done = makeListPDU(listPDU, socketNum);
+	if (listInProgress)
+	{
+		printf("List in progress, please wait...\n");
+		return; // the listing going on keeps its cursor
+	}
+	listCursor = 0;
+	int done = makeListPagePDU(listPDU, socketNum, listCursor);
 	if (done < 0)
 	{
 		printf("Error sending list PDU.\n");
 		return;
 	}
+	listInProgress = 1;
 }
 
 void handleInvalidCommand(int socketNum, const char *buffer)
@@ -355,13 +602,20 @@ int main(int argc, char *argv[])
 	int socketNum = 0; // socket descriptor
 	checkArgs(argc, argv);
 
-	strncpy(sender_handle, argv[1], MAX_HANDLE_LEN - 1);
+	strncpy(sender_handle, argv[optind], MAX_HANDLE_LEN - 1);
 	printf("sender_handle: %s\n", sender_handle);
 
 	/* set up the TCP Client socket  */
-	socketNum = tcpClientSetup(argv[2], argv[3], DEBUG_FLAG);
+	socketNum = tcpClientSetup(argv[optind + 1], argv[optind + 2], DEBUG_FLAG);
 
-	clientControl(socketNum);
+	if (botMode())
+	{
+		botControl(socketNum);
+	}
+	else
+	{
+		clientControl(socketNum);
+	}
 
 	return 0;
 }
@@ -391,6 +645,22 @@ void sendCommand(int socketNum, char *buffer)
 		handleListHandles(socketNum, buffer);
 		break;
 
+	case CMD_JOIN_CHANNEL:
+	case CMD_LEAVE_CHANNEL:
+
+		handleChannelMembership(socketNum, buffer, commandType == CMD_JOIN_CHANNEL ? CHANNEL_JOIN_FLAG : CHANNEL_LEAVE_FLAG);
+		break;
+
+	case CMD_CHANNEL_MESSAGE:
+
+		handleChannelMessage(socketNum, buffer);
+		break;
+
+	case CMD_SEND_FILE:
+
+		handleSendFile(socketNum, buffer);
+		break;
+
 	case CMD_INVALID:
 		
 		handleInvalidCommand(socketNum, buffer);
@@ -405,6 +675,8 @@ void sendCommand(int socketNum, char *buffer)
 
 void clientControl(int socketNum)
 {
+	int readyFds[2];
+
 	setupPollSet();
 
 	// Add STDIN and the socket to the poll set
@@ -414,39 +686,41 @@ void clientControl(int socketNum)
 	initialConnection(socketNum, 1);
 
 	// Continously loop through the to accept user input and process messages from the user
+	// Every wakeup handles everything that is ready: all the PDUs the server
+	// has sent so far and every line typed, neither one waits on the other
 	while (1)
 	{
-		printf("$: ");
-		fflush(stdout);
-		int returned_socket = pollCall(-1);
-
-		if (returned_socket < 0)
+		// No prompt in the middle of a streamed message that is being printed
+		if (numIncomingStreams == 0 && stdinOpen)
 		{
-			perror("Polling failed in clientControl()");
-			exit(-1);
+			printf("$: ");
+			fflush(stdout);
 		}
-		else if (returned_socket == socketNum)
-		{
-			// If the returned socket is the server socket, a new client is connecting
-			processMsgFromServer(socketNum);
-		}
-		else if (returned_socket == STDIN_FILENO)
+		int numReady = pollCallAll(POLL_WAIT_FOREVER, readyFds, 2);
+
+		for (int i = 0; i < numReady; i++)
 		{
-			// If the returned socket is a client socket, process its data
-			if (!listInProgress)
+			if (readyFds[i] == socketNum)
+			{
+				// The server sent us something (or hung up)
+				processMsgFromServer(socketNum);
+			}
+			else if (readyFds[i] == STDIN_FILENO)
 			{
-				sendToServer(socketNum);
+				// The user typed something, send every whole line of it
+				if (sendToServer(socketNum) < 0)
+				{
+					// End of input, keep printing what comes in until the server goes
+					removeFromPollSet(STDIN_FILENO);
+					stdinOpen = 0;
+				}
 			}
 			else
 			{
-				printf("List in progress, please wait...\n");
+				printf("The returned socket was not a server or client socket!\n");
+				return;
 			}
 		}
-		else
-		{
-			printf("The returned socket was not a server or client socket!\n");
-			return;
-		}
 	}
 	// If we break out of the loop, print "Server terminated" and the client will exit
 	printf("Server terminated.\n");
@@ -470,10 +744,10 @@ void printPacket(const uint8_t *packet, size_t length)
 
 int initialConnection(int clientSocket, uint8_t flag)
 {
-	uint8_t *initial_packet = makeInitialPDU();
+	uint8_t *initial_packet = makeInitialPDU(LOGIN_CAP_BATCH | LOGIN_CAP_STREAM);
 
 	int handle_len = strlen(sender_handle);
-	int initial_packet_len = 1 + handle_len + 1 + 1; // 2 bytes for length, 1 byte for flag
+	int initial_packet_len = 1 + 1 + handle_len + 1; // flag, handle length, handle, capabilities
 
 	int sent = sendPDU(clientSocket, initial_packet, initial_packet_len);
 
@@ -487,112 +761,300 @@ int initialConnection(int clientSocket, uint8_t flag)
 	return 0;
 }
 
-void receiveMessage(uint8_t *buffer, int totalBytes)
+// %m and %c: [flag][len][sender][count]([len][destination])*[text], printed as sender: text
+void receiveMessage(PduView_t *message)
 {
+	PduBytes_t *sender = &message->handles[0];
 
-	int offset = 0;
+	if (message->text.len > 0)
+	{
+		printf("%.*s: %.*s\n", sender->len, sender->data, message->text.len, message->text.data);
+	}
+	else
+	{
+		printf("No message payload.\n");
+	}
+	botLog(message->flag == 0x06 ? "multicast" : "message", (char *)sender->data, sender->len, sender_handle,
+	       strlen(sender_handle), (char *)message->text.data, message->text.len);
+}
 
-	offset++;
 
-	uint8_t sender_handle_len = buffer[offset++];
+// %b: [0x04][len][sender][text]
+int receiveBroadcastMessage(PduView_t *broadcast)
+{
+	PduBytes_t *sender = &broadcast->handles[0];
 
-	char sender_handle_rec[sender_handle_len];
-	memcpy(sender_handle_rec, buffer + offset, sender_handle_len);
-	offset += sender_handle_len;
+	if (broadcast->text.len > 0)
+	{
+		printf("%.*s: %.*s\n", sender->len, sender->data, broadcast->text.len, broadcast->text.data);
+	}
+	else
+	{
+		printf("No message payload.\n");
+	}
+	botLog("broadcast", (char *)sender->data, sender->len, "*", 1, (char *)broadcast->text.data, broadcast->text.len);
+	return 0;
+}
 
-	uint8_t numDestHandles = buffer[offset++];
+// [0x14][len][channel][len][sender][text], printed as [channel] sender: text
+void receiveChannelMessage(PduView_t *message)
+{
+	PduBytes_t *channel = &message->channel;
+	PduBytes_t *sender = &message->handles[0];
 
-	// each destination handle has a length then the handle name
-	DestHandle_t handles[numDestHandles];
-	for (int i = 0; i < numDestHandles; i++)
+	int messageLen = message->text.len;
+	if (messageLen > 0 && message->text.data[messageLen - 1] == '\0')
 	{
-		handles[i].dest_handle_len = buffer[offset++];
-		memcpy(handles[i].handle_name, buffer + offset, handles[i].dest_handle_len);
-		offset += handles[i].dest_handle_len;
+		messageLen--;
 	}
+	printf("[%.*s] %.*s: %.*s\n", channel->len, channel->data, sender->len, sender->data, messageLen, message->text.data);
+	botLog("channel", (char *)sender->data, sender->len, (char *)channel->data, channel->len, (char *)message->text.data,
+	       messageLen);
+}
 
-	int message_length = totalBytes - offset;
-	
-	if (message_length > 0)
+// [0x15][status][len][channel][members 4 bytes]
+void processChannelReply(PduView_t *reply)
+{
+	int channelLen = reply->channel.len;
+	const uint8_t *channel = reply->channel.data;
+	uint32_t members = reply->numbers[0];
+
+	switch (reply->bytes[0])
 	{
-		// Copy the message into a printable string
-		char message[message_length + 1];
-		memcpy(message, buffer + offset, message_length);
-		message[message_length] = '\0'; // null-terminate
-		sender_handle_rec[sender_handle_len] = '\0'; // null-terminate the sender handle
-		printf("%s: %s\n", sender_handle_rec, message);
+	case CHANNEL_JOINED:
+		printf("Joined channel %.*s (%u members).\n", channelLen, channel, members);
+		break;
+	case CHANNEL_LEFT:
+		printf("Left channel %.*s (%u members left).\n", channelLen, channel, members);
+		break;
+	case CHANNEL_NOT_MEMBER:
+		printf("You are not in channel %.*s.\n", channelLen, channel);
+		break;
+	case CHANNEL_TOO_MANY:
+		printf("Can't join %.*s, you are in too many channels.\n", channelLen, channel);
+		break;
+	case CHANNEL_BAD_NAME:
+		printf("Invalid channel name.\n");
+		break;
+	default:
+		printf("Unknown channel reply status: %d\n", reply->bytes[0]);
+		break;
 	}
-	else
+}
+
+static IncomingStream_t *findIncomingStream(uint32_t streamId)
+{
+	for (int i = 0; i < numIncomingStreams; i++)
 	{
-		printf("No message payload.\n");
+		if (incomingStreams[i].streamId == streamId)
+		{
+			return &incomingStreams[i];
+		}
 	}
+	return NULL;
 }
 
+static void endIncomingStream(IncomingStream_t *stream)
+{
+	*stream = incomingStreams[--numIncomingStreams];
+	lastPrintedStream = 0;
+}
 
-int receiveBroadcastMessage(uint8_t *buffer, int totalBytes)
+// [0x17][id][length][slen][sender][dlen][destination]: print who it's from, the text follows
+void receiveStreamStart(PduView_t *start)
 {
-	int offset = 0;
+	uint32_t streamId = start->numbers[0];
+	uint32_t length = start->numbers[1];
+	const char *sender = (const char *)start->handles[0].data;
+	int senderLen = start->handles[0].len < MAX_HANDLE_LEN ? start->handles[0].len : MAX_HANDLE_LEN - 1;
 
-	offset++;
+	printf("\n%.*s: ", senderLen, sender);
+	if (botMode())
+	{
+		// Just that it's coming and how long, not the text
+		char lengthText[16];
+		botLog("stream", sender, senderLen, sender_handle, strlen(sender_handle), lengthText,
+		       snprintf(lengthText, sizeof(lengthText), "%u", length));
+	}
+	if (length == 0)
+	{
+		printf("\n");
+		return;
+	}
+	if (numIncomingStreams == MAX_INCOMING_STREAMS)
+	{
+		printf("(too many messages coming in at once, skipping this one)\n");
+		return;
+	}
 
-	uint8_t sender_handle_len = buffer[offset++];
+	IncomingStream_t *stream = &incomingStreams[numIncomingStreams++];
+	stream->streamId = streamId;
+	stream->remaining = length;
+	memcpy(stream->sender, sender, senderLen);
+	stream->sender[senderLen] = '\0';
+	lastPrintedStream = streamId;
+	fflush(stdout);
+}
 
-	char sender_handle_rec[sender_handle_len];
-	memcpy(sender_handle_rec, buffer + offset, sender_handle_len);
-	offset += sender_handle_len;
+// [0x18][id][text]: printed as it comes, a segment from a different message gets its sender again
+void receiveStreamData(PduView_t *segment)
+{
+	uint32_t streamId = segment->numbers[0];
 
-	int message_length = totalBytes - offset;
-	
-	if (message_length > 0)
+	if (segment->text.len == 0)
+	{
+		return;
+	}
+
+	IncomingStream_t *stream = findIncomingStream(streamId);
+	if (stream == NULL)
 	{
-		// Copy the message into a printable string
-		char message[message_length + 1];
-		memcpy(message, buffer + offset, message_length);
-		message[message_length] = '\0'; // null-terminate
+		return;
+	}
+	if (streamId != lastPrintedStream)
+	{
+		printf("\n%s: ", stream->sender);
+		lastPrintedStream = streamId;
+	}
 
-		sender_handle_rec[sender_handle_len] = '\0'; // null-terminate the sender handle
-		printf("%s: %s\n", sender_handle_rec, message);
+	uint32_t dataLen = segment->text.len;
+	if (dataLen > stream->remaining)
+	{
+		dataLen = stream->remaining;
 	}
-	else
+	fwrite(segment->text.data, 1, dataLen, stdout);
+	stream->remaining -= dataLen;
+	if (stream->remaining == 0)
 	{
-		printf("No message payload.\n");
+		printf("\n");
+		endIncomingStream(stream);
+	}
+	fflush(stdout);
+}
+
+// [0x19][id][reason]: either a message coming to us got cut off, or the one we're sending was refused
+void receiveStreamAbort(PduView_t *abort)
+{
+	uint32_t streamId = abort->numbers[0];
+	uint8_t reason = abort->bytes[0];
+
+	if (outgoingStream != 0 && streamId == outgoingStream)
+	{
+		outgoingAborted = 1;
+		switch (reason)
+		{
+		case STREAM_NO_DEST:
+			printf("Error, destination handle does not exist.\n");
+			break;
+		case STREAM_NOT_SUPPORTED:
+			printf("Error, destination can't take streamed messages.\n");
+			break;
+		case STREAM_GONE:
+			printf("Error, destination disconnected.\n");
+			break;
+		default:
+			printf("Message stopped by the server (reason %d).\n", reason);
+			break;
+		}
+		return;
+	}
+
+	IncomingStream_t *stream = findIncomingStream(streamId);
+	if (stream != NULL)
+	{
+		botLog("stream_abort", stream->sender, strlen(stream->sender), sender_handle, strlen(sender_handle), NULL, 0);
+		printf("\n[message from %s cut off]\n", stream->sender);
+		endIncomingStream(stream);
 	}
-	return 0;
 }
 
-int handleFlagsFromServer(int flag, uint8_t *buffer, int totalBytes)
+/*
+-- Everything the server sends comes through here, taken apart by pduParse()
+   first so none of the handlers has to check a length
+-- Return value: 0, -1 if the PDU didn't fit the layout of its flag
+*/
+int handleFlagsFromServer(int socketNum, int flag, uint8_t *buffer, int totalBytes)
 {
+	PduView_t pdu;
+
+	if (pduParse(buffer, totalBytes, PDU_TO_CLIENT, &pdu) < 0)
+	{
+		printf("Invalid or unknown PDU from the server, flag %d\n", flag);
+		if (flag == LIST_PAGE_FLAG)
+		{
+			listInProgress = 0;
+		}
+		return -1;
+	}
+
 	// Handle the flags from the server
 	switch (flag)
 	{
 	case 0x04:
 		printf("Received a message from the server.\n");
-		receiveBroadcastMessage(buffer, totalBytes);
+		receiveBroadcastMessage(&pdu);
 		break;
 	case 0x05:
 		printf("Incoming message...\n");
-		receiveMessage(buffer, totalBytes);
+		receiveMessage(&pdu);
 		break;
 	case 0x06:
 		printf("Multicast message command received.\n");
-		receiveMessage(buffer, totalBytes);
+		receiveMessage(&pdu);
 		break;
 	case 0x07:
 		printf("Error packet, destination handle does not exist.\n");
+		botLog("no_handle", NULL, 0, NULL, 0, (char *)pdu.text.data, pdu.text.len);
 		break;
 	case 0xB:
 		printf("Received a number of handles from the server.\n");
 		listInProgress = 1;
-		processListHandles(buffer, totalBytes);
+		processListHandles(&pdu);
 		break;
 	case 0xC:
 		printf("Received a list of handles from the server.\n");
-		processListHandles(buffer, totalBytes);
+		processListHandles(&pdu);
 		break;
 	case 0xD:
 		printf("Done receiving handles from the server.\n");
 		listInProgress = 0;
 		break;
+	case LIST_PAGE_FLAG:
+		processListPage(socketNum, &pdu);
+		break;
+	case CHANNEL_MESSAGE_FLAG:
+		receiveChannelMessage(&pdu);
+		break;
+	case CHANNEL_REPLY_FLAG:
+		processChannelReply(&pdu);
+		break;
+	case STREAM_START_FLAG:
+		receiveStreamStart(&pdu);
+		break;
+	case STREAM_DATA_FLAG:
+		receiveStreamData(&pdu);
+		break;
+	case STREAM_ABORT_FLAG:
+		receiveStreamAbort(&pdu);
+		break;
+	case RATE_LIMITED_FLAG:
+		if (pdu.bytes[0] == RATE_OVERLOADED)
+		{
+			printf("Server is overloaded, dropping messages to other clients.\n");
+		}
+		else
+		{
+			printf("Sending too fast, the server is dropping messages.\n");
+		}
+		botLog("rate_limited", NULL, 0, NULL, 0, NULL, 0);
+		break;
+	case KEEPALIVE_PING_FLAG:
+	{
+		// The server hasn't heard from us in a while, let it know we're still here
+		uint8_t pong = KEEPALIVE_PONG_FLAG;
+		sendPDU(socketNum, &pong, 1);
+		break;
+	}
 	default:
 		printf("Unknown flag received: %d\n", flag);
 		break;
@@ -600,98 +1062,213 @@ int handleFlagsFromServer(int flag, uint8_t *buffer, int totalBytes)
 	return 0;
 }
 
-void processListHandles(uint8_t *buffer, int totalBytes)
+void processListHandles(PduView_t *list)
 {
-	if (buffer[0] == 0xb)
+	if (list->flag == 0xb)
 	{
-		uint32_t numHandles;
-		memcpy(&numHandles, buffer + 1, sizeof(uint32_t));
-		numHandles = ntohl(numHandles); // Convert from network byte order to host byte order
-		printf("Number of handles: %d\n", numHandles);
+		printf("Number of handles: %u\n", list->numbers[0]);
 	}
-	else if(buffer[0] == 0xC)
+	else
 	{
+		printf("Handle name: %.*s\n", list->handles[0].len, list->handles[0].data);
+	}
+}
 
-		int handleLen = buffer[1];
+// [0x0F][total 4][next cursor 4][count][len][handle]...
+void processListPage(int socketNum, PduView_t *page)
+{
+	uint32_t numHandles = page->numbers[0];
+	uint32_t nextCursor = page->numbers[1];
+	int count = page->bytes[0];
+	PduBytes_t handles = page->text;
+	PduBytes_t handle;
 
-		printf("Handle name: ");
-		for (int i = 0; i < handleLen; i++)
+	if (listCursor == 0)
+	{
+		// first of the pages
+		printf("Number of handles: %d\n", numHandles);
+		if (botMode())
 		{
-			printf("%c", buffer[2 + i]);	
+			char countText[16];
+			botLog("handles", NULL, 0, NULL, 0, countText, snprintf(countText, sizeof(countText), "%u", numHandles));
 		}
-		printf("\n");
+	}
+
+	for (int i = 0; i < count && pduNextHandle(&handles, &handle) > 0; i++)
+	{
+		printf("Handle name: %.*s\n", handle.len, handle.data);
+		botLog("handle", NULL, 0, NULL, 0, (char *)handle.data, handle.len);
+	}
+
+	if (nextCursor != 0)
+	{
+		uint8_t listPDU[MAXBUF];
+		listCursor = nextCursor;
+		makeListPagePDU(listPDU, socketNum, listCursor);
 	}
 	else
 	{
-		printf("Invalid flag for list handles: %d\n", buffer[0]);
-		return;
+		listInProgress = 0;
 	}
 }
 
+/*
+-- Read everything the server has sent so far without blocking (recv() with
+   MSG_DONTWAIT, a buffer at a time) and handle every complete PDU in it
+-- A partial PDU stays in serverBuffer until the rest of it comes in
+-- Exits if the server closed the connection or sent a bad length
+*/
 void processMsgFromServer(int socketNum)
 {
-	uint8_t buffer[MAXBUF]; // data buffer
-	int recvBytes = 0;
+	while (1)
+	{
+		int space = SERVER_BUFFER_SIZE - serverBufferLen;
+		int recvBytes = recv(socketNum, serverBuffer + serverBufferLen, space, MSG_DONTWAIT);
 
-	recvBytes = recvPDU(socketNum, buffer, MAXBUF);
+		if (recvBytes == 0)
+		{
+			// Server closed connection
+			printf("Server has terminated.\n");
+			close(socketNum);
+			exit(0);
+		}
+		if (recvBytes < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			{
+				return; // that's all of it for now
+			}
+			perror("recv call");
+			exit(-1);
+		}
 
-	handleFlagsFromServer(buffer[0], buffer, recvBytes);
-	
-	if (recvBytes == 0)
-	{
-		// Server closed connection
-		printf("Server has terminated.\n");
-		close(socketNum);
-		exit(0);
+		serverBufferLen += recvBytes;
+		int consumed = parsePDUs(serverBuffer, serverBufferLen, MAXBUF, serverPDU, &socketNum);
+		if (consumed < 0)
+		{
+			printf("Bad PDU from the server.\n");
+			close(socketNum);
+			exit(-1);
+		}
+		serverBufferLen -= consumed;
+		memmove(serverBuffer, serverBuffer + consumed, serverBufferLen);
+
+		if (recvBytes < space)
+		{
+			return; // it had less than we asked for, so there's no more yet
+		}
 	}
+}
+
+// parsePDUs() handler for processMsgFromServer(), context is the socket
+void serverPDU(void *context, uint8_t *pdu, int pduLen)
+{
+	handleFlagsFromServer(*(int *)context, pdu[0], pdu, pduLen);
+}
+
+/*
+-- Read what's been typed and send every complete line as a command
+-- A line longer than MAXBUF - 1 is cut there, the rest is the next command
+-- Return value: 0, -1 at the end of input (whatever is left of the last
+   line is sent first)
+*/
+int sendToServer(int socketNum)
+{
+	char line[MAXBUF];
+	int inputLen = readFromStdin();
 
-	if (recvBytes < MAXBUF)
+	while (nextCommand(line, inputLen == 0))
 	{
-		buffer[recvBytes] = '\0'; // Null terminate the string
+		sendCommand(socketNum, line);
 	}
+	return (inputLen == 0) ? -1 : 0;
 }
 
-void sendToServer(int socketNum)
+/*
+-- Take the next line read so far out of stdinBuffer, without its newline
+-- atEnd: no more is coming, so an unfinished last line counts too
+-- Return value: 1 if line got one, 0 if there isn't a whole one yet
+*/
+int nextCommand(char *line, int atEnd)
 {
-	uint8_t buffer[MAXBUF];
-	int inputLen = readFromStdin(buffer);
-	if (inputLen < 1)
+	for (int i = 0; i < stdinLen; i++)
 	{
-		printf("Error reading from stdin.\n");
-		return;
+		if (stdinBuffer[i] == '\n' || i == MAXBUF - 2 || (atEnd && i == stdinLen - 1))
+		{
+			int lineLen = (stdinBuffer[i] == '\n') ? i : i + 1;
+
+			memcpy(line, stdinBuffer, lineLen);
+			line[lineLen] = '\0';
+			stdinLen -= i + 1;
+			memmove(stdinBuffer, stdinBuffer + i + 1, stdinLen);
+			return 1;
+		}
 	}
-	sendCommand(socketNum, (char *)buffer);
+	return 0;
 }
 
-int readFromStdin(uint8_t *buffer)
+/*
+-- One read() of whatever is waiting on stdin (or the bot's script), onto the end of stdinBuffer
+-- Only called when poll() says stdin is readable, so it doesn't block.
+   stdin isn't made O_NONBLOCK: the terminal is shared with the shell.
+-- Return value: bytes read, 0 at the end of input
+*/
+int readFromStdin()
 {
-	char aChar = 0;
-	int inputLen = 0;
+	int inputLen = read(commandFd, stdinBuffer + stdinLen, sizeof(stdinBuffer) - stdinLen);
 
-	buffer[0] = '\0';
-	while (inputLen < (MAXBUF - 1) && aChar != '\n')
+	if (inputLen < 0)
 	{
-		aChar = getchar();
-		if (aChar != '\n')
+		if (errno == EAGAIN || errno == EINTR)
 		{
-			buffer[inputLen] = aChar;
-			inputLen++;
+			return 1; // nothing after all, not the end either
 		}
+		perror("read stdin");
+		return 0;
 	}
-
-	// Null terminate the string
-	buffer[inputLen] = '\0';
-	inputLen++;
-
+	stdinLen += inputLen;
 	return inputLen;
 }
 
+// -f (and the options that go with it) runs cclient as a bot, see clientBot.c
 void checkArgs(int argc, char *argv[])
 {
+	BotOptions_t bot = {NULL, 0, NULL, BOT_DEFAULT_LINGER_MS, 0};
+	int option = 0;
+
+	while ((option = getopt(argc, argv, "f:r:o:l:v")) != -1)
+	{
+		switch (option)
+		{
+		case 'f':
+			bot.scriptPath = optarg;
+			break;
+		case 'r':
+			bot.commandsPerSecond = atoi(optarg);
+			break;
+		case 'o':
+			bot.logPath = optarg;
+			break;
+		case 'l':
+			bot.lingerMs = atoi(optarg) * 1000;
+			break;
+		case 'v':
+			bot.verbose = 1;
+			break;
+		default:
+			argc = 0; // usage below
+		}
+	}
+
 	/* check command line arguments  */
-	if (argc != 4)
+	if (argc - optind != 3 || bot.commandsPerSecond < 0 || bot.lingerMs < 0 ||
+		(bot.scriptPath == NULL && (bot.commandsPerSecond != 0 || bot.logPath != NULL || bot.verbose)))
 	{
-		printf("usage: %s handle host-name port-number \n", argv[0]);
+		printf("usage: %s [-f command file|- [-r commands/sec] [-o log file] [-l linger seconds] [-v]] handle host-name port-number \n", argv[0]);
 		exit(1);
 	}
+	if (bot.scriptPath != NULL)
+	{
+		startBot(&bot);
+	}
 }
@@ -8,6 +8,7 @@
 #include <sys/types.h>
 #include <stdint.h> // For uint8_t and other fixed-width integer types
 #include "shared.h"
+#include "pduCodec.h"
 
 #define MAXBUF 1400
 #define DEBUG_FLAG 1
@@ -17,16 +18,20 @@
 
 
 extern char sender_handle[MAX_HANDLE_LEN];
+extern volatile int listInProgress;
+extern int commandFd;
 
 
 // Functions
 void readMulticastCommand(char *buffer, uint8_t *numHandles, DestHandle_t handles[], char *message);
 void printPacket(const uint8_t *packet, size_t length);
-void sendToServer(int socketNum);
-int readFromStdin(uint8_t *buffer);
+int sendToServer(int socketNum);
+int readFromStdin();
+int nextCommand(char *line, int atEnd);
 void checkArgs(int argc, char *argv[]);
 void clientControl(int socketNum);
 void processMsgFromServer(int socketNum);
+void serverPDU(void *context, uint8_t *pdu, int pduLen);
 void sendCommand(int socketNum, char *buffer);
 int handleSendMessage(int socketNum, const char *buffer);
 void readMessageCommand(const char *buffer, char destinationHandle[100], uint8_t text_message[MAXBUF]);
@@ -35,13 +40,24 @@ void handleBroadcastMessage(int socketNum, const char *buffer);
 void handleListHandles(int socketNum, const char *buffer);
 void handleInvalidCommand(int socketNum, const char *buffer);
 int initialConnection(int socketNum, uint8_t flag);
-void receiveMessage(uint8_t *buffer, int totalBytes);
+void receiveMessage(PduView_t *message);
 void waitForServerResponse(int socketNum);
 void handleMulticastMessage(int socketNum, char *buffer);
-int handleFlagsFromServer(int flag, uint8_t *buffer, int totalBytes);
-void processListHandles(uint8_t *buffer, int totalBytes);
+int handleFlagsFromServer(int socketNum, int flag, uint8_t *buffer, int totalBytes);
+void processListHandles(PduView_t *list);
+void processListPage(int socketNum, PduView_t *page);
 int validateMulticastMessage(uint8_t *buffer, int socketNum, int messageLen);
-int receiveBroadcastMessage(uint8_t *buffer, int socketNum);
+int receiveBroadcastMessage(PduView_t *broadcast);
+void handleChannelMembership(int socketNum, const char *buffer, uint8_t flag);
+void handleChannelMessage(int socketNum, const char *buffer);
+void receiveChannelMessage(PduView_t *message);
+void processChannelReply(PduView_t *reply);
+void handleSendFile(int socketNum, const char *buffer);
+int streamMessage(int socketNum, char *destinationHandle, FILE *source, uint32_t length);
+void drainServer(int socketNum);
+void receiveStreamStart(PduView_t *start);
+void receiveStreamData(PduView_t *segment);
+void receiveStreamAbort(PduView_t *abort);
 
 
 #endif // CCLIENT_H
@@ -0,0 +1,354 @@
+// --------------- channel.c -----------------
+/*
+Named channels for the chat server: join (0x12), leave (0x13) and send
+(0x14) instead of listing every recipient in a %c PDU.
+
+A channel keeps its members in one dense array per reactor, holding the
+Connection_t pointers themselves, and each connection remembers where it
+sits in every channel it has joined. Joining and leaving are an append and
+a swap-with-last on both sides, so a channel with thousands of members
+costs nothing extra per message. Sending needs no table lookup at all:
+the sender has to be a member, so the channel comes straight off its own
+membership list. The PDU is built once and the reactor fans it out to its
+local members. Every other reactor with members gets one inbox message and
+does the same for its own, the same way a %b goes out.
+
+The name -> channel table is sharded like the handle table and only used
+to join. A channel is freed once it has no members and nothing in flight
+refers to it.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "channel.h"
+#include "safeUtil.h"
+#include "log.h"
+#include "metrics.h"
+#include "pduCodec.h"
+
+#define INITIAL_MEMBER_LIST_SIZE 8
+
+typedef struct
+{
+    pthread_rwlock_t lock;
+    Channel_t *buckets[CHANNEL_SHARD_BUCKETS];
+} __attribute__((aligned(64))) ChannelShard_t;
+
+static ChannelShard_t channelShards[NUM_CHANNEL_SHARDS];
+static uint32_t nextChannelId = 1;
+
+static Channel_t *getChannel(char *name, int nameLen);
+static void releaseChannel(Channel_t *channel);
+static void deleteChannel(uint32_t hash, uint32_t channelId);
+static void removeMembership(Connection_t *conn, int membershipIndex);
+static int findMembership(Connection_t *conn, char *name, int nameLen);
+static void fanOutLocal(Channel_t *channel, int reactorId, ConnRef_t *sender, PDUSlice_t *pdu);
+static uint32_t hashChannel(const char *name, int nameLen);
+
+void initChannelTable()
+{
+    for (int i = 0; i < NUM_CHANNEL_SHARDS; i++)
+    {
+        pthread_rwlock_init(&channelShards[i].lock, NULL);
+    }
+}
+
+/*
+-- Add conn to the channel, creating it if nobody is in it yet
+-- memberCount gets the channel's size afterwards
+-- Return value: CHANNEL_JOINED (also if it was already in it),
+                 CHANNEL_BAD_NAME or CHANNEL_TOO_MANY
+*/
+int joinChannel(Connection_t *conn, char *name, int nameLen, int *memberCount)
+{
+    if (nameLen <= 0 || nameLen >= MAX_CHANNEL_NAME_LEN)
+    {
+        return CHANNEL_BAD_NAME;
+    }
+
+    int existing = findMembership(conn, name, nameLen);
+    if (existing >= 0)
+    {
+        *memberCount = __atomic_load_n(&conn->channels[existing].channel->memberCount, __ATOMIC_RELAXED);
+        return CHANNEL_JOINED;
+    }
+    if (conn->numChannels == MAX_CHANNELS_PER_CONN)
+    {
+        return CHANNEL_TOO_MANY;
+    }
+
+    Channel_t *channel = getChannel(name, nameLen); // the membership keeps this reference
+    ChannelMembers_t *local = &channel->local[conn->reactorId];
+
+    if (local->count == local->size)
+    {
+        local->size = (local->size == 0) ? INITIAL_MEMBER_LIST_SIZE : local->size * 2;
+        local->members = srealloc(local->members, local->size * sizeof(ChannelMember_t));
+    }
+    if (conn->numChannels == conn->channelsSize)
+    {
+        conn->channelsSize = (conn->channelsSize == 0) ? INITIAL_MEMBER_LIST_SIZE : conn->channelsSize * 2;
+        conn->channels = srealloc(conn->channels, conn->channelsSize * sizeof(ChannelMembership_t));
+    }
+
+    local->members[local->count].conn = conn;
+    local->members[local->count].membershipIndex = conn->numChannels;
+    conn->channels[conn->numChannels].channel = channel;
+    conn->channels[conn->numChannels].index = local->count;
+    conn->numChannels++;
+
+    // Other reactors peek at the count to decide whether to send us the channel's messages
+    __atomic_store_n(&local->count, local->count + 1, __ATOMIC_RELEASE);
+    *memberCount = __atomic_add_fetch(&channel->memberCount, 1, __ATOMIC_RELAXED);
+    return CHANNEL_JOINED;
+}
+
+// Return value: CHANNEL_LEFT, or CHANNEL_NOT_MEMBER if conn wasn't in it
+int leaveChannel(Connection_t *conn, char *name, int nameLen, int *memberCount)
+{
+    int membershipIndex = findMembership(conn, name, nameLen);
+    if (membershipIndex < 0)
+    {
+        *memberCount = 0;
+        return CHANNEL_NOT_MEMBER;
+    }
+
+    Channel_t *channel = conn->channels[membershipIndex].channel;
+    *memberCount = __atomic_load_n(&channel->memberCount, __ATOMIC_RELAXED) - 1;
+    removeMembership(conn, membershipIndex);
+    return CHANNEL_LEFT;
+}
+
+// The connection is going away (owning reactor only)
+void leaveAllChannels(Connection_t *conn)
+{
+    while (conn->numChannels > 0)
+    {
+        removeMembership(conn, conn->numChannels - 1);
+    }
+    free(conn->channels);
+    conn->channels = NULL;
+    conn->channelsSize = 0;
+}
+
+/*
+-- Send text to every other member of a channel the sender is in
+-- Out: [0x14][channel len][channel][sender len][sender][text]
+-- Return value: CHANNEL_SENT, or CHANNEL_NOT_MEMBER
+*/
+int sendToChannel(Connection_t *sender, char *name, int nameLen, uint8_t *text, int textLen)
+{
+    int membershipIndex = findMembership(sender, name, nameLen);
+    if (membershipIndex < 0)
+    {
+        return CHANNEL_NOT_MEMBER;
+    }
+    Channel_t *channel = sender->channels[membershipIndex].channel;
+
+    // Encode it once, straight into the buffer every member's queue will share
+    int pduLen = 2 + 1 + 1 + channel->nameLen + 1 + sender->handleLen + textLen;
+    PDUBuffer_t *pduBuffer = allocPDUBuffer(pduLen);
+    uint16_t networkLen = htons(pduLen);
+    PduView_t message;
+
+    pduStart(&message, CHANNEL_MESSAGE_FLAG);
+    pduSetChannel(&message, channel->name, channel->nameLen);
+    pduAddHandle(&message, sender->handle, sender->handleLen);
+    pduSetText(&message, text, textLen);
+    memcpy(pduBuffer->data, &networkLen, 2);
+    pduEncode(pduBuffer->data + 2, pduLen - 2, PDU_TO_CLIENT, &message);
+
+    PDUSlice_t pdu = {pduBuffer, pduBuffer->data, pduLen};
+    ConnRef_t senderRef;
+    getConnRef(sender, &senderRef);
+
+    for (int i = 0; i < getNumReactors(); i++)
+    {
+        if (i != sender->reactorId && __atomic_load_n(&channel->local[i].count, __ATOMIC_ACQUIRE) > 0)
+        {
+            InboxMessage_t *message = createInboxMessage(INBOX_CHANNEL, NULL, &senderRef, &pdu);
+            __atomic_add_fetch(&channel->refCount, 1, __ATOMIC_RELAXED); // dropped by channelFanOutLocal()
+            message->channel = channel;
+            postToReactor(i, message);
+        }
+    }
+    fanOutLocal(channel, sender->reactorId, &senderRef, &pdu);
+    metricRecord(&threadMetrics->fanOut, __atomic_load_n(&channel->memberCount, __ATOMIC_RELAXED) - 1);
+
+    releasePDUBuffer(pduBuffer); // the send queues hold it now
+    return CHANNEL_SENT;
+}
+
+// INBOX_CHANNEL: another reactor's member sent to a channel we have members in
+void channelFanOutLocal(InboxMessage_t *message)
+{
+    Channel_t *channel = message->channel;
+
+    fanOutLocal(channel, getCurrentReactor()->reactorId, &message->sender, &message->pdu);
+    releaseChannel(channel);
+}
+
+static void fanOutLocal(Channel_t *channel, int reactorId, ConnRef_t *sender, PDUSlice_t *pdu)
+{
+    ChannelMembers_t *local = &channel->local[reactorId];
+
+    for (int i = 0; i < local->count; i++)
+    {
+        Connection_t *conn = local->members[i].conn;
+
+        if (conn->connId != sender->connId)
+        {
+            queueFromSender(sender, conn, pdu);
+        }
+    }
+}
+
+// The channel called name with a reference for the caller, created if it doesn't exist
+static Channel_t *getChannel(char *name, int nameLen)
+{
+    uint32_t hash = hashChannel(name, nameLen);
+    ChannelShard_t *shard = &channelShards[hash & (NUM_CHANNEL_SHARDS - 1)];
+    Channel_t **bucket = &shard->buckets[(hash / NUM_CHANNEL_SHARDS) & (CHANNEL_SHARD_BUCKETS - 1)];
+    Channel_t *channel;
+
+    pthread_rwlock_rdlock(&shard->lock);
+    for (channel = *bucket; channel != NULL; channel = channel->next)
+    {
+        if (channel->hash == hash && channel->nameLen == nameLen && memcmp(channel->name, name, nameLen) == 0)
+        {
+            __atomic_add_fetch(&channel->refCount, 1, __ATOMIC_RELAXED);
+            pthread_rwlock_unlock(&shard->lock);
+            return channel;
+        }
+    }
+    pthread_rwlock_unlock(&shard->lock);
+
+    // Not there: look again under the write lock in case someone beat us to it
+    pthread_rwlock_wrlock(&shard->lock);
+    for (channel = *bucket; channel != NULL; channel = channel->next)
+    {
+        if (channel->hash == hash && channel->nameLen == nameLen && memcmp(channel->name, name, nameLen) == 0)
+        {
+            __atomic_add_fetch(&channel->refCount, 1, __ATOMIC_RELAXED);
+            pthread_rwlock_unlock(&shard->lock);
+            return channel;
+        }
+    }
+
+    channel = (Channel_t *)sCalloc(1, sizeof(Channel_t));
+    channel->hash = hash;
+    channel->channelId = __atomic_fetch_add(&nextChannelId, 1, __ATOMIC_RELAXED);
+    channel->nameLen = nameLen;
+    memcpy(channel->name, name, nameLen);
+    channel->name[nameLen] = '\0';
+    channel->refCount = 1;
+
+    channel->next = *bucket;
+    *bucket = channel;
+    pthread_rwlock_unlock(&shard->lock);
+
+    LOG_INFO("Channel %s created\n", channel->name);
+    return channel;
+}
+
+static void releaseChannel(Channel_t *channel)
+{
+    // Once the count hits 0 someone else may free it, so take what we need first
+    uint32_t hash = channel->hash;
+    uint32_t channelId = channel->channelId;
+
+    if (__atomic_sub_fetch(&channel->refCount, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        deleteChannel(hash, channelId);
+    }
+}
+
+// Free the channel if it is still unused (a join may have picked it up again since)
+static void deleteChannel(uint32_t hash, uint32_t channelId)
+{
+    ChannelShard_t *shard = &channelShards[hash & (NUM_CHANNEL_SHARDS - 1)];
+    Channel_t **link = &shard->buckets[(hash / NUM_CHANNEL_SHARDS) & (CHANNEL_SHARD_BUCKETS - 1)];
+
+    pthread_rwlock_wrlock(&shard->lock);
+    for (; *link != NULL; link = &(*link)->next)
+    {
+        Channel_t *channel = *link;
+        if (channel->channelId != channelId)
+        {
+            continue;
+        }
+        if (__atomic_load_n(&channel->refCount, __ATOMIC_ACQUIRE) == 0)
+        {
+            *link = channel->next;
+            LOG_INFO("Channel %s is empty, removed\n", channel->name);
+            for (int i = 0; i < MAX_REACTORS; i++)
+            {
+                free(channel->local[i].members);
+            }
+            free(channel);
+        }
+        break;
+    }
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+// Swap-with-last out of both the channel's member array and the connection's membership list
+static void removeMembership(Connection_t *conn, int membershipIndex)
+{
+    ChannelMembership_t membership = conn->channels[membershipIndex];
+    Channel_t *channel = membership.channel;
+    ChannelMembers_t *local = &channel->local[conn->reactorId];
+
+    int lastMember = local->count - 1;
+    if (membership.index != lastMember)
+    {
+        ChannelMember_t moved = local->members[lastMember];
+        local->members[membership.index] = moved;
+        moved.conn->channels[moved.membershipIndex].index = membership.index;
+    }
+    __atomic_store_n(&local->count, lastMember, __ATOMIC_RELEASE);
+
+    int lastMembership = conn->numChannels - 1;
+    if (membershipIndex != lastMembership)
+    {
+        ChannelMembership_t moved = conn->channels[lastMembership];
+        conn->channels[membershipIndex] = moved;
+        moved.channel->local[conn->reactorId].members[moved.index].membershipIndex = membershipIndex;
+    }
+    conn->numChannels--;
+
+    __atomic_sub_fetch(&channel->memberCount, 1, __ATOMIC_RELAXED);
+    releaseChannel(channel);
+}
+
+// Return value: where the channel is in conn->channels, -1 if conn isn't in it
+static int findMembership(Connection_t *conn, char *name, int nameLen)
+{
+    for (int i = 0; i < conn->numChannels; i++)
+    {
+        Channel_t *channel = conn->channels[i].channel;
+        if (channel->nameLen == nameLen && memcmp(channel->name, name, nameLen) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// FNV-1a, same as the handle table
+static uint32_t hashChannel(const char *name, int nameLen)
+{
+    uint32_t hash = 2166136261u;
+
+    for (int i = 0; i < nameLen; i++)
+    {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
@@ -0,0 +1,49 @@
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <stdint.h>
+
+#include "connection.h"
+#include "reactor.h"
+
+#define MAX_CHANNELS_PER_CONN 32
+#define NUM_CHANNEL_SHARDS 16        // must be a power of 2
+#define CHANNEL_SHARD_BUCKETS 256    // must be a power of 2
+
+// One member on the reactor that owns it
+typedef struct
+{
+    Connection_t *conn;
+    int membershipIndex;             // where this channel is in conn->channels
+} ChannelMember_t;
+
+// A channel's members that live on one reactor, only that reactor touches it
+typedef struct
+{
+    ChannelMember_t *members;
+    int count;
+    int size;
+} ChannelMembers_t;
+
+// A named group. Sending to it is one lookup, one encode and a walk over
+// the dense member arrays, no handle is resolved per message.
+typedef struct Channel
+{
+    struct Channel *next;            // next channel in the same hash bucket
+    uint32_t hash;
+    uint32_t channelId;              // unique, a freed channel's address can come back
+    int nameLen;
+    char name[MAX_CHANNEL_NAME_LEN];
+    int refCount;                    // one per member plus one per send/inbox message in flight
+    int memberCount;                 // all reactors
+    ChannelMembers_t local[MAX_REACTORS];
+} Channel_t;
+
+void initChannelTable();
+int joinChannel(Connection_t *conn, char *name, int nameLen, int *memberCount);
+int leaveChannel(Connection_t *conn, char *name, int nameLen, int *memberCount);
+void leaveAllChannels(Connection_t *conn);
+int sendToChannel(Connection_t *sender, char *name, int nameLen, uint8_t *text, int textLen);
+void channelFanOutLocal(InboxMessage_t *message);
+
+#endif
@@ -0,0 +1,799 @@
+/******************************************************************************
+ * chatbench.c
+ *
+ * Throughput benchmark for the chat server.
+ *
+ * Opens pairs of clients that bounce %m messages back and forth (each keeps
+ * a window of messages in flight) and reports messages/sec delivered.  With
+ * -S it starts the server itself once per thread count in -T so you get a
+ * scaling table, e.g.
+ *
+ *   ./chatbench -S ./server -T 1,2,4,8,16 -c 200 -d 5
+ *   ./chatbench -c 200 localhost 44444        (server already running)
+ *
+ * -M picks how clients hand their messages to the kernel: stream (default)
+ * writes everything queued in one send(), pdu does a send() per message like
+ * cclient always did, and batch wraps them in BATCH_FLAG frames.  Each run
+ * also reports the client's syscalls per message and, with -S, how many
+ * times the server's threads woke up per message.
+ *
+ * -U path runs the clients over the server's shared memory transport (the
+ * server's -U) instead of TCP loopback.  The latency column is the average
+ * time a message spends in flight (Little's law: messages in flight over
+ * messages/sec), so -c 2 -w 1 gives the one message ping-pong latency:
+ *
+ *   ./chatbench -S ./server -c 2 -w 1                     (TCP)
+ *   ./chatbench -S ./server -c 2 -w 1 -U /tmp/chat.sock   (shared memory)
+ *
+ * -N nodes starts that many servers linked into a cluster (the server's -N,
+ * -C and -P) instead of one, and spreads the clients over them so the two
+ * halves of every pair are on different nodes: every message crosses a
+ * cluster link.  Against a cluster that is already running, give its ports
+ * as a list:
+ *
+ *   ./chatbench -S ./server -N 3 -c 200 -d 5
+ *   ./chatbench -c 200 localhost 44444,44446,44448
+ *
+ * -E epoll|uring is passed on to the servers it starts (their -E), and each
+ * one gets an admin socket (-A) so the table can show how many syscalls the
+ * server made per message:
+ *
+ *   ./chatbench -S ./server -T 1,4 -c 200 -E uring
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+
+#include "sendreceive.h"
+#include "safeUtil.h"
+#include "makePDU.h"
+#include "shared.h"
+#include "benchUtil.h"
+
+#define BENCH_OUT_BUFFER_SIZE (64 * 1024)
+#define BENCH_IN_BUFFER_SIZE (16 * 1024)
+#define MAX_THREAD_COUNTS 32
+#define MAX_BENCH_NODES 32
+
+typedef enum
+{
+    SEND_STREAM,   // one send() for everything queued
+    SEND_PDU,      // one send() per PDU
+    SEND_BATCH     // BATCH_FLAG frames, one send() for everything queued
+} SendMode;
+
+char sender_handle[MAX_HANDLE_LEN] = {0}; // makePDU.c builds PDUs for this handle
+
+typedef struct
+{
+    int socketNum;
+    ShmEndpoint_t *shm;       // -U: the rings, NULL over TCP
+    uint64_t shmSignals;      // shm->signals already counted as syscalls
+    int worker;
+    uint8_t *messagePDU;      // wire PDU (length included) to our peer, built once
+    int messagePDULen;
+    uint8_t inBuffer[BENCH_IN_BUFFER_SIZE];
+    int inLen;
+    uint8_t outBuffer[BENCH_OUT_BUFFER_SIZE];
+    int outLen;
+    int frameStart;           // SEND_BATCH: where the frame still being filled starts, -1 if none
+    int wantOut;
+    uint64_t received;
+} BenchClient_t;
+
+typedef struct
+{
+    int id;
+    pthread_t thread;
+    int epollFd;
+    BenchClient_t **clients;
+    int numClients;
+    uint64_t syscalls;        // send/recv/epoll calls made so far
+} BenchWorker_t;
+
+typedef struct
+{
+    double rate;              // messages/sec
+    double latencyMicros;     // average time in flight per message
+    double clientSyscalls;    // per message
+    double serverWakeups;     // per message, -1 if we didn't start the server
+    double serverSyscalls;    // per message, -1 if we didn't start the server
+} BenchResult_t;
+
+static int numClients = 100;
+static int numWorkers = 2;
+static int durationSeconds = 5;
+static int messageSize = 64;
+static int window = 8;
+static volatile int running = 0;
+static SendMode sendMode = SEND_STREAM;
+static pid_t serverPids[MAX_BENCH_NODES]; // the servers we started
+static int numServers = 0;                // 0 if they were already running
+static int numNodes = 1;                  // -N
+static char *backend = NULL;              // -E, the servers' event loop backend
+static char adminPaths[MAX_BENCH_NODES][64]; // the servers' admin sockets (-A), for their syscall counts
+static char *shmPath = NULL;  // -U, Unix socket of the server's shared memory transport
+
+static BenchClient_t *clients = NULL;
+
+static void usage(char *name);
+static int parseThreadList(char *list, int *counts);
+static int parsePortList(char *list, char **ports);
+static void startCluster(char *serverPath, int threads, int basePort, char **ports);
+static long serverWakeups();
+static long serverSyscalls();
+static char **serverArgs(char **args, int numArgs, int node);
+static BenchResult_t runBenchmark(char *host, char **ports, int numPorts);
+static void loginClient(BenchClient_t *client, int index);
+static void *workerThread(void *arg);
+static void queueBytes(BenchWorker_t *worker, BenchClient_t *client, uint8_t *data, int len);
+static void flushClient(BenchWorker_t *worker, BenchClient_t *client);
+static void serviceShmClient(BenchWorker_t *worker, BenchClient_t *client);
+static int sendClient(BenchWorker_t *worker, BenchClient_t *client, int len);
+static void countShmSignals(BenchWorker_t *worker, BenchClient_t *client);
+static void benchPDU(void *context, uint8_t *pdu, int pduLen);
+static double nowSeconds();
+
+int main(int argc, char *argv[])
+{
+    char *serverPath = NULL;
+    int threadCounts[MAX_THREAD_COUNTS] = {1};
+    int numThreadCounts = 1;
+    int option = 0;
+
+    while ((option = getopt(argc, argv, "S:T:c:d:s:w:W:M:U:N:E:")) != -1)
+    {
+        switch (option)
+        {
+        case 'S':
+            serverPath = optarg;
+            break;
+        case 'T':
+            numThreadCounts = parseThreadList(optarg, threadCounts);
+            break;
+        case 'c':
+            numClients = atoi(optarg) & ~1; // clients come in pairs
+            break;
+        case 'd':
+            durationSeconds = atoi(optarg);
+            break;
+        case 's':
+            messageSize = atoi(optarg);
+            break;
+        case 'w':
+            window = atoi(optarg);
+            break;
+        case 'W':
+            numWorkers = atoi(optarg);
+            break;
+        case 'U':
+            shmPath = optarg;
+            break;
+        case 'N':
+            numNodes = atoi(optarg);
+            break;
+        case 'E':
+            backend = optarg;
+            break;
+        case 'M':
+            if (strcmp(optarg, "stream") == 0)
+            {
+                sendMode = SEND_STREAM;
+            }
+            else if (strcmp(optarg, "pdu") == 0)
+            {
+                sendMode = SEND_PDU;
+            }
+            else if (strcmp(optarg, "batch") == 0)
+            {
+                sendMode = SEND_BATCH;
+            }
+            else
+            {
+                usage(argv[0]);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (numClients < 2 || numWorkers < 1 || messageSize < 1 || messageSize > MAX_MSG_SIZE || window < 1 || durationSeconds < 1 ||
+        numNodes < 1 || numNodes > MAX_BENCH_NODES || (numNodes > 1 && (serverPath == NULL || shmPath != NULL)))
+    {
+        usage(argv[0]);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    if (serverPath == NULL)
+    {
+        // Over shared memory the Unix socket is all we need
+        if (argc - optind != (shmPath != NULL ? 0 : 2))
+        {
+            usage(argv[0]);
+        }
+        char *ports[MAX_BENCH_NODES] = {NULL};
+        int numPorts = shmPath != NULL ? 1 : parsePortList(argv[optind + 1], ports);
+        BenchResult_t result = runBenchmark(argv[optind], ports, numPorts);
+        printf("%-8s %-8s %14s %12s %14s\n", "threads", "clients", "msgs/sec", "latency us", "client sys/msg");
+        printf("%-8s %-8d %14.0f %12.1f %14.2f\n", "-", numClients, result.rate, result.latencyMicros,
+               result.clientSyscalls);
+        return 0;
+    }
+
+    // Start the server once per thread count and run the same load against it
+    printf("%-8s %-8s %14s %10s %12s %14s %16s %15s\n", "threads", "clients", "msgs/sec", "speedup", "latency us",
+           "client sys/msg", "server wake/msg", "server sys/msg");
+    double baseRate = 0;
+    for (int i = 0; i < numThreadCounts; i++)
+    {
+        char portStrings[MAX_BENCH_NODES][16];
+        char *ports[MAX_BENCH_NODES];
+        int basePort = 20000 + (getpid() + i) % 20000;
+
+        if (numNodes > 1)
+        {
+            for (int n = 0; n < numNodes; n++)
+            {
+                ports[n] = portStrings[n];
+            }
+            startCluster(serverPath, threadCounts[i], basePort, ports);
+        }
+        else
+        {
+            ports[0] = portStrings[0];
+            snprintf(ports[0], 16, "%d", basePort);
+            char *extraArgs[8];
+            serverPids[0] = benchStartServer(serverPath, threadCounts[i], ports[0], shmPath,
+                                             serverArgs(extraArgs, 0, 0));
+            numServers = 1;
+        }
+        BenchResult_t result = runBenchmark("localhost", ports, numNodes);
+        for (int n = 0; n < numServers; n++)
+        {
+            benchStopServer(serverPids[n]);
+            unlink(adminPaths[n]);
+        }
+
+        if (i == 0)
+        {
+            baseRate = result.rate;
+        }
+        printf("%-8d %-8d %14.0f %9.2fx %12.1f %14.2f %16.3f %15.3f\n", threadCounts[i], numClients, result.rate,
+               baseRate > 0 ? result.rate / baseRate : 0, result.latencyMicros, result.clientSyscalls,
+               result.serverWakeups, result.serverSyscalls);
+        fflush(stdout);
+    }
+    return 0;
+}
+
+static void usage(char *name)
+{
+    fprintf(stderr, "Usage: %s [-S server binary -T thread,counts] [-c clients] [-d seconds] [-s message bytes]\n"
+                    "          [-w messages in flight per client] [-W benchmark threads] [-M stream|pdu|batch]\n"
+                    "          [-U shared memory socket path] [-N cluster nodes] [-E epoll|uring] [host port[,port...]]\n", name);
+    exit(1);
+}
+
+static int parseThreadList(char *list, int *counts)
+{
+    int n = 0;
+    for (char *token = strtok(list, ","); token != NULL && n < MAX_THREAD_COUNTS; token = strtok(NULL, ","))
+    {
+        counts[n++] = atoi(token);
+    }
+    return n;
+}
+
+// "44444,44446" into ports (pointing into list), returns how many
+static int parsePortList(char *list, char **ports)
+{
+    int n = 0;
+    for (char *token = strtok(list, ","); token != NULL && n < MAX_BENCH_NODES; token = strtok(NULL, ","))
+    {
+        ports[n++] = token;
+    }
+    return n;
+}
+
+// numNodes servers, node n (id n + 1) takes clients on basePort + 2n and links
+// to the others on basePort + 2n + 1, ports[n] gets filled in with the client port
+static void startCluster(char *serverPath, int threads, int basePort, char **ports)
+{
+    for (int n = 0; n < numNodes; n++)
+    {
+        char nodeId[8];
+        char clusterPort[16];
+        char peerList[MAX_BENCH_NODES * 24] = {0};
+        int peerLen = 0;
+
+        for (int other = 0; other < numNodes; other++)
+        {
+            if (other != n)
+            {
+                peerLen += snprintf(peerList + peerLen, sizeof(peerList) - peerLen, "%s%d@localhost:%d",
+                                    peerLen > 0 ? "," : "", other + 1, basePort + 2 * other + 1);
+            }
+        }
+        snprintf(nodeId, sizeof(nodeId), "%d", n + 1);
+        snprintf(clusterPort, sizeof(clusterPort), "%d", basePort + 2 * n + 1);
+        snprintf(ports[n], 16, "%d", basePort + 2 * n);
+
+        char *extraArgs[12] = {"-N", nodeId, "-C", clusterPort, "-P", peerList};
+        serverPids[n] = benchStartServer(serverPath, threads, ports[n], NULL, serverArgs(extraArgs, 6, n));
+    }
+    numServers = numNodes;
+}
+
+// Wake-ups of every server we started added up, -1 if we didn't start them
+static long serverWakeups()
+{
+    long total = 0;
+    for (int n = 0; n < numServers; n++)
+    {
+        long wakeups = benchServerWakeups(serverPids[n]);
+        if (wakeups < 0)
+        {
+            return -1;
+        }
+        total += wakeups;
+    }
+    return numServers > 0 ? total : -1;
+}
+
+// Syscalls of every server we started added up (from their admin sockets), -1 if we didn't start them
+static long serverSyscalls()
+{
+    long total = 0;
+    for (int n = 0; n < numServers; n++)
+    {
+        long syscalls = benchServerSyscalls(adminPaths[n]);
+        if (syscalls < 0)
+        {
+            return -1;
+        }
+        total += syscalls;
+    }
+    return numServers > 0 ? total : -1;
+}
+
+// Add -E and the admin socket for server node to the numArgs already in args (room for 4 more)
+static char **serverArgs(char **args, int numArgs, int node)
+{
+    snprintf(adminPaths[node], sizeof(adminPaths[node]), "/tmp/chatbench-%d-%d.sock", (int)getpid(), node);
+    unlink(adminPaths[node]);
+    args[numArgs++] = "-A";
+    args[numArgs++] = adminPaths[node];
+    if (backend != NULL)
+    {
+        args[numArgs++] = "-E";
+        args[numArgs++] = backend;
+    }
+    args[numArgs] = NULL;
+    return args;
+}
+
+// Connect and log in every client (round robin over the ports), then let the
+// workers bounce messages for durationSeconds
+static BenchResult_t runBenchmark(char *host, char **ports, int numPorts)
+{
+    clients = (BenchClient_t *)sCalloc(numClients, sizeof(BenchClient_t));
+
+    for (int i = 0; i < numClients; i++)
+    {
+        if (shmPath != NULL)
+        {
+            clients[i].shm = benchConnectShm(shmPath);
+            clients[i].socketNum = clients[i].shm->socketNum;
+        }
+        else
+        {
+            clients[i].socketNum = benchConnect(host, ports[i % numPorts]);
+        }
+        loginClient(&clients[i], i);
+    }
+
+    // Every node has to know where the clients on the others are before the first message
+    if (numPorts > 1 && benchWaitForHandles(host, ports, numPorts, numClients) < 0)
+    {
+        fprintf(stderr, "Cluster nodes didn't all see every client\n");
+        exit(-1);
+    }
+
+    BenchWorker_t *workers = (BenchWorker_t *)sCalloc(numWorkers, sizeof(BenchWorker_t));
+    for (int w = 0; w < numWorkers; w++)
+    {
+        workers[w].id = w;
+        workers[w].clients = (BenchClient_t **)sCalloc(numClients, sizeof(BenchClient_t *));
+        if ((workers[w].epollFd = epoll_create1(0)) < 0)
+        {
+            perror("epoll_create1");
+            exit(-1);
+        }
+    }
+
+    // Both halves of a pair go to the same worker
+    for (int i = 0; i < numClients; i++)
+    {
+        BenchWorker_t *worker = &workers[(i / 2) % numWorkers];
+        struct epoll_event event;
+
+        clients[i].worker = worker->id;
+        worker->clients[worker->numClients++] = &clients[i];
+
+        event.events = EPOLLIN;
+        event.data.ptr = &clients[i];
+        if (clients[i].shm != NULL)
+        {
+            // The server signals its eventfd, the socket is never read
+            epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, clients[i].shm->wakeFd, &event);
+            continue;
+        }
+        fcntl(clients[i].socketNum, F_SETFL, fcntl(clients[i].socketNum, F_GETFL) | O_NONBLOCK);
+        epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, clients[i].socketNum, &event);
+    }
+
+    running = 1;
+    for (int w = 0; w < numWorkers; w++)
+    {
+        pthread_create(&workers[w].thread, NULL, workerThread, &workers[w]);
+    }
+
+    // Warm up for a second, then count what arrives during the run
+    sleep(1);
+    uint64_t startCount = 0;
+    uint64_t startSyscalls = 0;
+    long startWakeups = serverWakeups();
+    long startServerSyscalls = serverSyscalls();
+    for (int i = 0; i < numClients; i++)
+    {
+        startCount += __atomic_load_n(&clients[i].received, __ATOMIC_RELAXED);
+    }
+    for (int w = 0; w < numWorkers; w++)
+    {
+        startSyscalls += __atomic_load_n(&workers[w].syscalls, __ATOMIC_RELAXED);
+    }
+    double start = nowSeconds();
+
+    sleep(durationSeconds);
+
+    uint64_t endCount = 0;
+    uint64_t endSyscalls = 0;
+    long endWakeups = serverWakeups();
+    long endServerSyscalls = serverSyscalls();
+    for (int i = 0; i < numClients; i++)
+    {
+        endCount += __atomic_load_n(&clients[i].received, __ATOMIC_RELAXED);
+    }
+    for (int w = 0; w < numWorkers; w++)
+    {
+        endSyscalls += __atomic_load_n(&workers[w].syscalls, __ATOMIC_RELAXED);
+    }
+    double elapsed = nowSeconds() - start;
+
+    running = 0;
+    for (int w = 0; w < numWorkers; w++)
+    {
+        pthread_join(workers[w].thread, NULL);
+        close(workers[w].epollFd);
+        free(workers[w].clients);
+    }
+    for (int i = 0; i < numClients; i++)
+    {
+        if (clients[i].shm != NULL)
+        {
+            shmClose(clients[i].shm);
+        }
+        close(clients[i].socketNum);
+        free(clients[i].messagePDU);
+    }
+    free(workers);
+    free(clients);
+
+    BenchResult_t result;
+    double messages = endCount > startCount ? (double)(endCount - startCount) : 1;
+    result.rate = (endCount - startCount) / elapsed;
+    result.latencyMicros = result.rate > 0 ? (double)numClients * window / result.rate * 1e6 : 0;
+    result.clientSyscalls = (endSyscalls - startSyscalls) / messages;
+    result.serverWakeups = (startWakeups >= 0 && endWakeups >= 0) ? (endWakeups - startWakeups) / messages : -1;
+    result.serverSyscalls =
+        (startServerSyscalls >= 0 && endServerSyscalls >= 0) ? (endServerSyscalls - startServerSyscalls) / messages : -1;
+    return result;
+}
+
+// Log in as bench<index> and build the %m PDU this client will keep sending to its pair
+static void loginClient(BenchClient_t *client, int index)
+{
+    char handle[MAX_HANDLE_LEN];
+    char peer[MAX_HANDLE_LEN];
+    uint8_t text[MAX_MSG_SIZE + 1];
+
+    snprintf(handle, sizeof(handle), "bench%d", index);
+    if (client->shm != NULL)
+    {
+        int granted = benchLoginShm(client->shm, handle, sendMode == SEND_BATCH ? LOGIN_CAP_BATCH : 0);
+        if (granted < 0)
+        {
+            exit(-1);
+        }
+        if (sendMode == SEND_BATCH && !(granted & LOGIN_CAP_BATCH))
+        {
+            fprintf(stderr, "Server doesn't take batches\n");
+            exit(-1);
+        }
+    }
+    else if (sendMode == SEND_BATCH)
+    {
+        int granted = benchLoginWith(client->socketNum, handle, LOGIN_CAP_BATCH);
+        if (granted < 0)
+        {
+            exit(-1);
+        }
+        if (!(granted & LOGIN_CAP_BATCH))
+        {
+            fprintf(stderr, "Server doesn't take batches\n");
+            exit(-1);
+        }
+    }
+    else if (benchLogin(client->socketNum, handle) < 0)
+    {
+        exit(-1);
+    }
+    client->frameStart = -1;
+
+    snprintf(peer, sizeof(peer), "bench%d", index ^ 1);
+    memset(text, 'x', messageSize);
+    text[messageSize - 1] = '\0';
+
+    MessagePacket_t packet = constructMessagePacket(peer, messageSize, text, client->socketNum);
+    uint16_t pduLength = htons(packet.packet_len + 2);
+
+    client->messagePDULen = packet.packet_len + 2;
+    client->messagePDU = (uint8_t *)sCalloc(1, client->messagePDULen);
+    memcpy(client->messagePDU, &pduLength, 2);
+    memcpy(client->messagePDU + 2, packet.packet, packet.packet_len);
+}
+
+static void *workerThread(void *arg)
+{
+    BenchWorker_t *worker = (BenchWorker_t *)arg;
+    struct epoll_event events[64];
+
+    // Fill the window
+    for (int i = 0; i < worker->numClients; i++)
+    {
+        for (int w = 0; w < window; w++)
+        {
+            queueBytes(worker, worker->clients[i], worker->clients[i]->messagePDU, worker->clients[i]->messagePDULen);
+        }
+        if (worker->clients[i]->shm != NULL)
+        {
+            // Also arms the ring, so the server signals its next write before we first sleep
+            serviceShmClient(worker, worker->clients[i]);
+            continue;
+        }
+        flushClient(worker, worker->clients[i]);
+    }
+
+    while (running)
+    {
+        int numReady = epoll_wait(worker->epollFd, events, 64, 100);
+        __atomic_add_fetch(&worker->syscalls, 1, __ATOMIC_RELAXED);
+
+        for (int i = 0; i < numReady; i++)
+        {
+            BenchClient_t *client = (BenchClient_t *)events[i].data.ptr;
+
+            if (client->shm != NULL)
+            {
+                serviceShmClient(worker, client);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT)
+            {
+                flushClient(worker, client);
+            }
+            if (events[i].events & EPOLLIN)
+            {
+                int bytes = recv(client->socketNum, client->inBuffer + client->inLen, BENCH_IN_BUFFER_SIZE - client->inLen, 0);
+                __atomic_add_fetch(&worker->syscalls, 1, __ATOMIC_RELAXED);
+                if (bytes <= 0)
+                {
+                    if (bytes == 0 || (errno != EAGAIN && errno != EINTR))
+                    {
+                        fprintf(stderr, "Server closed client %d\n", client->socketNum);
+                        exit(-1);
+                    }
+                    continue;
+                }
+                client->inLen += bytes;
+
+                void *context[2] = {worker, client};
+                int used = parsePDUs(client->inBuffer, client->inLen, MAXBUF, benchPDU, context);
+                if (used < 0)
+                {
+                    fprintf(stderr, "Bad PDU from server\n");
+                    exit(-1);
+                }
+                client->inLen -= used;
+                memmove(client->inBuffer, client->inBuffer + used, client->inLen);
+                flushClient(worker, client);
+            }
+        }
+    }
+    return NULL;
+}
+
+// The server signalled a shared memory client: room in its ring, or something to read
+static void serviceShmClient(BenchWorker_t *worker, BenchClient_t *client)
+{
+    shmClearWakeup(client->shm);
+    __atomic_add_fetch(&worker->syscalls, 1, __ATOMIC_RELAXED);
+    flushClient(worker, client);
+
+    while (1)
+    {
+        int bytes = shmRead(client->shm, client->inBuffer + client->inLen, BENCH_IN_BUFFER_SIZE - client->inLen);
+        countShmSignals(worker, client);
+        if (bytes < 0)
+        {
+            fprintf(stderr, "Shared memory ring broken\n");
+            exit(-1);
+        }
+        if (bytes == 0)
+        {
+            if (shmArmWakeup(client->shm))
+            {
+                continue;
+            }
+            break; // empty, the server signals the next write
+        }
+        client->inLen += bytes;
+
+        void *context[2] = {worker, client};
+        int used = parsePDUs(client->inBuffer, client->inLen, MAXBUF, benchPDU, context);
+        if (used < 0)
+        {
+            fprintf(stderr, "Bad PDU from server\n");
+            exit(-1);
+        }
+        client->inLen -= used;
+        memmove(client->inBuffer, client->inBuffer + used, client->inLen);
+        flushClient(worker, client);
+    }
+}
+
+// Every message we get means one more goes back to the pair
+static void benchPDU(void *context, uint8_t *pdu, int pduLen)
+{
+    BenchWorker_t *worker = ((void **)context)[0];
+    BenchClient_t *client = ((void **)context)[1];
+
+    if (pdu[0] == 0x05)
+    {
+        __atomic_add_fetch(&client->received, 1, __ATOMIC_RELAXED);
+        queueBytes(worker, client, client->messagePDU, client->messagePDULen);
+    }
+}
+
+static void queueBytes(BenchWorker_t *worker, BenchClient_t *client, uint8_t *data, int len)
+{
+    int frameHeader = 0;
+
+    // In batch mode the PDU goes in the open frame, or starts a new one if it won't fit
+    if (sendMode == SEND_BATCH && (client->frameStart < 0 || client->outLen - client->frameStart + len > MAXBUF))
+    {
+        client->frameStart = -1;
+        frameHeader = 3;
+    }
+
+    if (client->outLen + frameHeader + len > BENCH_OUT_BUFFER_SIZE)
+    {
+        flushClient(worker, client);
+        if (client->outLen + frameHeader + len > BENCH_OUT_BUFFER_SIZE)
+        {
+            return; // server isn't keeping up, drop this one (the window shrinks)
+        }
+    }
+    if (frameHeader > 0)
+    {
+        client->frameStart = client->outLen;
+        client->outBuffer[client->outLen + 2] = BATCH_FLAG;
+        client->outLen += frameHeader;
+    }
+    memcpy(client->outBuffer + client->outLen, data, len);
+    client->outLen += len;
+
+    if (client->frameStart >= 0)
+    {
+        uint16_t frameLength = htons(client->outLen - client->frameStart);
+        memcpy(client->outBuffer + client->frameStart, &frameLength, 2);
+    }
+}
+
+static void flushClient(BenchWorker_t *worker, BenchClient_t *client)
+{
+    client->frameStart = -1; // whatever is queued is going out, nothing more goes in that frame
+    while (client->outLen > 0)
+    {
+        // pdu mode: the buffer is all copies of messagePDU, so send the rest of
+        // the one a short send() left behind, or the next whole one
+        int len = client->outLen;
+        if (sendMode == SEND_PDU)
+        {
+            len = (client->outLen % client->messagePDULen) ? client->outLen % client->messagePDULen : client->messagePDULen;
+        }
+
+        int sent = sendClient(worker, client, len);
+        if (sent <= 0)
+        {
+            break;
+        }
+        client->outLen -= sent;
+        memmove(client->outBuffer, client->outBuffer + sent, client->outLen);
+        if (sent < len)
+        {
+            break; // socket is full, wait for EPOLLOUT (or the server to signal)
+        }
+    }
+
+    if (client->shm != NULL)
+    {
+        return; // nothing to re-register, the server signals when the ring has room
+    }
+
+    int wantOut = client->outLen > 0;
+    if (wantOut != client->wantOut)
+    {
+        struct epoll_event event;
+        event.events = EPOLLIN | (wantOut ? EPOLLOUT : 0);
+        event.data.ptr = client;
+        epoll_ctl(worker->epollFd, EPOLL_CTL_MOD, client->socketNum, &event);
+        __atomic_add_fetch(&worker->syscalls, 1, __ATOMIC_RELAXED);
+        client->wantOut = wantOut;
+    }
+}
+
+// send() len bytes from the front of the out buffer, or copy them into the ring
+static int sendClient(BenchWorker_t *worker, BenchClient_t *client, int len)
+{
+    if (client->shm == NULL)
+    {
+        __atomic_add_fetch(&worker->syscalls, 1, __ATOMIC_RELAXED);
+        return send(client->socketNum, client->outBuffer, len, 0);
+    }
+
+    struct iovec iov = {client->outBuffer, len};
+    int sent = shmWrite(client->shm, &iov, 1);
+    countShmSignals(worker, client);
+    if (sent < 0)
+    {
+        fprintf(stderr, "Shared memory ring broken\n");
+        exit(-1);
+    }
+    return sent;
+}
+
+// Only the ring reads and writes that had to wake the server cost a syscall
+static void countShmSignals(BenchWorker_t *worker, BenchClient_t *client)
+{
+    __atomic_add_fetch(&worker->syscalls, client->shm->signals - client->shmSignals, __ATOMIC_RELAXED);
+    client->shmSignals = client->shm->signals;
+}
+
+static double nowSeconds()
+{
+    return benchNowNanos() / 1e9;
+}
@@ -0,0 +1,286 @@
+/******************************************************************************
+ * chatidle.c
+ *
+ * Idle connection footprint of the chat server.
+ *
+ * Logs in -c clients that then sit there saying nothing, and reports how
+ * much the server's resident memory grew per connection (from
+ * /proc/<pid>/status), plus the kernel's TCP buffer pages for both ends of
+ * the loopback sockets.  With -S it starts the server itself, e.g.
+ *
+ *   ./chatidle -S ./server -c 100000
+ *   ./chatidle -p <server pid> -c 100000 localhost 44444
+ *
+ * Every connection is a descriptor here and one in the server, so both need
+ * a big enough ulimit -n.  On loopback the clients are spread over source
+ * addresses 127.0.0.2, 127.0.0.3, ... so they don't run out of ports.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "shared.h"
+#include "benchUtil.h"
+
+#define DEFAULT_IDLE_CLIENTS 100000
+#define DEFAULT_IDLE_PORT "30466" // below the ephemeral range the clients take ports from
+#define CLIENTS_PER_SOURCE_ADDRESS 20000
+#define SPARE_DESCRIPTORS 64
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+char sender_handle[MAX_HANDLE_LEN] = {0}; // makePDU.c builds PDUs for this handle
+
+static void usage(char *name);
+static int raiseDescriptorLimit(int wanted);
+static int idleConnect(struct sockaddr_in *server, int index);
+static long readRSSKb(pid_t pid);
+static long readTCPMemPages();
+
+int main(int argc, char *argv[])
+{
+    char *serverPath = NULL;
+    int threads = 1;
+    int numClients = DEFAULT_IDLE_CLIENTS;
+    pid_t serverPid = 0;
+    int option;
+
+    while ((option = getopt(argc, argv, "S:t:c:p:")) != -1)
+    {
+        switch (option)
+        {
+        case 'S':
+            serverPath = optarg;
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'c':
+            numClients = atoi(optarg);
+            break;
+        case 'p':
+            serverPid = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (numClients < 1 || threads < 1 || (serverPath == NULL && serverPid <= 0))
+    {
+        usage(argv[0]);
+    }
+
+    char *host = "localhost";
+    char *port = DEFAULT_IDLE_PORT;
+    if (serverPath == NULL)
+    {
+        if (argc - optind != 2)
+        {
+            usage(argv[0]);
+        }
+        host = argv[optind];
+        port = argv[optind + 1];
+    }
+    else if (argc - optind == 1)
+    {
+        port = argv[optind];
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // The server we start inherits the raised limit too
+    int limit = raiseDescriptorLimit(numClients + SPARE_DESCRIPTORS);
+    if (numClients + SPARE_DESCRIPTORS > limit)
+    {
+        fprintf(stderr, "ulimit -n is %d, only opening %d connections\n", limit, limit - SPARE_DESCRIPTORS);
+        numClients = limit - SPARE_DESCRIPTORS;
+    }
+
+    if (serverPath != NULL)
+    {
+        serverPid = benchStartServer(serverPath, threads, port, NULL, NULL);
+    }
+
+    struct addrinfo hints, *result = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &result) != 0)
+    {
+        fprintf(stderr, "Can't resolve %s\n", host);
+        exit(-1);
+    }
+    struct sockaddr_in serverAddr = *(struct sockaddr_in *)result->ai_addr;
+    freeaddrinfo(result);
+
+    sleep(1); // let the server finish starting up before the baseline
+    long rssBefore = readRSSKb(serverPid);
+    long tcpPagesBefore = readTCPMemPages();
+
+    int *sockets = (int *)malloc(numClients * sizeof(int));
+    uint64_t start = benchNowNanos();
+    for (int i = 0; i < numClients; i++)
+    {
+        char handle[MAX_HANDLE_LEN];
+        snprintf(handle, sizeof(handle), "idle%d", i);
+
+        sockets[i] = idleConnect(&serverAddr, i);
+        if (sockets[i] < 0 || benchLogin(sockets[i], handle) < 0)
+        {
+            fprintf(stderr, "Stopped after %d connections\n", i);
+            numClients = i;
+            break;
+        }
+        if ((i + 1) % 10000 == 0)
+        {
+            fprintf(stderr, "%d connected\n", i + 1);
+        }
+    }
+    double seconds = (benchNowNanos() - start) / 1e9;
+
+    sleep(1); // and let it go quiet again
+    long rssAfter = readRSSKb(serverPid);
+    long tcpPagesAfter = readTCPMemPages();
+    long pageSize = sysconf(_SC_PAGESIZE);
+
+    printf("%-12s %10s %10s %10s %14s %14s\n", "connections", "rss before", "rss after", "login/sec",
+           "bytes/conn", "kernel tcp/conn");
+    printf("%-12d %8ldKB %8ldKB %10.0f %14.0f %14.0f\n", numClients, rssBefore, rssAfter,
+           numClients / seconds,
+           numClients > 0 ? (rssAfter - rssBefore) * 1024.0 / numClients : 0.0,
+           numClients > 0 ? (double)(tcpPagesAfter - tcpPagesBefore) * pageSize / numClients : 0.0);
+
+    for (int i = 0; i < numClients; i++)
+    {
+        close(sockets[i]);
+    }
+    free(sockets);
+
+    if (serverPath != NULL)
+    {
+        benchStopServer(serverPid);
+    }
+    return 0;
+}
+
+static void usage(char *name)
+{
+    fprintf(stderr, "Usage: %s -S server binary [-t server threads] [-c clients] [port]\n"
+                    "       %s -p server pid [-c clients] host port\n", name, name);
+    exit(1);
+}
+
+// Return value: the descriptor limit we ended up with
+static int raiseDescriptorLimit(int wanted)
+{
+    struct rlimit limit;
+
+    getrlimit(RLIMIT_NOFILE, &limit);
+    if (limit.rlim_cur < (rlim_t)wanted)
+    {
+        limit.rlim_cur = (limit.rlim_max < (rlim_t)wanted) ? limit.rlim_max : (rlim_t)wanted;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    getrlimit(RLIMIT_NOFILE, &limit);
+    return (int)limit.rlim_cur;
+}
+
+/*
+-- Blocking connect for the index'th client
+-- On loopback each source address gets CLIENTS_PER_SOURCE_ADDRESS clients
+   so 100k connections fit in the ephemeral port range
+*/
+static int idleConnect(struct sockaddr_in *server, int index)
+{
+    int socketNum = socket(AF_INET, SOCK_STREAM, 0);
+    if (socketNum < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+
+    if ((ntohl(server->sin_addr.s_addr) >> 24) == 127)
+    {
+        struct sockaddr_in source;
+        int on = 1;
+
+        memset(&source, 0, sizeof(source));
+        source.sin_family = AF_INET;
+        source.sin_addr.s_addr = htonl(INADDR_LOOPBACK + 1 + index / CLIENTS_PER_SOURCE_ADDRESS);
+        setsockopt(socketNum, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof(on));
+        if (bind(socketNum, (struct sockaddr *)&source, sizeof(source)) < 0)
+        {
+            perror("bind");
+            close(socketNum);
+            return -1;
+        }
+    }
+
+    if (connect(socketNum, (struct sockaddr *)server, sizeof(*server)) < 0)
+    {
+        perror("connect");
+        close(socketNum);
+        return -1;
+    }
+    return socketNum;
+}
+
+// VmRSS of the process in KB
+static long readRSSKb(pid_t pid)
+{
+    char path[64];
+    char line[256];
+    long rss = -1;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *status = fopen(path, "r");
+    if (status == NULL)
+    {
+        perror(path);
+        exit(-1);
+    }
+    while (fgets(line, sizeof(line), status) != NULL)
+    {
+        if (sscanf(line, "VmRSS: %ld", &rss) == 1)
+        {
+            break;
+        }
+    }
+    fclose(status);
+    return rss;
+}
+
+// Pages the kernel has charged to TCP socket buffers (the "mem" in /proc/net/sockstat)
+static long readTCPMemPages()
+{
+    char line[256];
+    long pages = 0;
+
+    FILE *sockstat = fopen("/proc/net/sockstat", "r");
+    if (sockstat == NULL)
+    {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), sockstat) != NULL)
+    {
+        char *mem = strstr(line, " mem ");
+        if (strncmp(line, "TCP:", 4) == 0 && mem != NULL)
+        {
+            pages = atol(mem + 5);
+        }
+    }
+    fclose(sockstat);
+    return pages;
+}
@@ -0,0 +1,663 @@
+/******************************************************************************
+ * chatload.c
+ *
+ * Load generator for the chat server.
+ *
+ * Logs in a crowd of clients (load0, load1, ...) over loopback and sends a
+ * mix of %m, %b, %c and %L at a fixed total rate. Every message carries the
+ * time it was sent in its text, so whoever receives it can work out the end
+ * to end latency. At the end it prints throughput and p50/p99/p999 latency
+ * with a histogram for each kind of message, e.g.
+ *
+ *   ./chatload -c 2000 -r 20000 -x 70,5,20,5 -d 10 localhost 44444
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+
+#include "sendreceive.h"
+#include "safeUtil.h"
+#include "makePDU.h"
+#include "shared.h"
+#include "benchUtil.h"
+
+#define LOAD_OUT_BUFFER_SIZE (64 * 1024)
+#define LOAD_IN_BUFFER_SIZE (16 * 1024)
+#define STAMP_LEN 16           // send time, nanoseconds as hex digits at the start of the text
+#define HIST_SUB_BUCKETS 16    // per power of 2, so buckets are within ~6%
+#define HIST_BUCKETS 1024
+
+typedef enum
+{
+    OP_MESSAGE,
+    OP_BROADCAST,
+    OP_MULTICAST,
+    OP_LIST,
+    NUM_OPS
+} LoadOp;
+
+static const char *opNames[NUM_OPS] = {"%m", "%b", "%c", "%L"};
+
+// Log-linear latency histogram in nanoseconds
+typedef struct
+{
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} Histogram_t;
+
+typedef struct
+{
+    int socketNum;
+    uint8_t *pdus[NUM_OPS];     // wire PDUs (length included) built once at login, only the stamp changes
+    int pduLens[NUM_OPS];
+    int stampOffsets[NUM_OPS];
+    uint64_t listStart;         // when the %L in progress was asked for, 0 if none
+    uint8_t inBuffer[LOAD_IN_BUFFER_SIZE];
+    int inLen;
+    uint8_t outBuffer[LOAD_OUT_BUFFER_SIZE];
+    int outLen;
+    int wantOut;
+} LoadClient_t;
+
+typedef struct
+{
+    int id;
+    pthread_t thread;
+    int epollFd;
+    unsigned int seed;
+    LoadClient_t **clients;
+    int numClients;
+    uint64_t sent[NUM_OPS];
+    uint64_t received[NUM_OPS];
+    uint64_t skipped;           // out buffer full, the server isn't keeping up
+    uint64_t errors;            // 0x07 replies
+    Histogram_t latency[NUM_OPS];
+} LoadWorker_t;
+
+static int numClients = 200;
+static int numWorkers = 2;
+static int durationSeconds = 10;
+static int warmupSeconds = 1;
+static int messageSize = 64;
+static int numDestHandles = 3;
+static double targetRate = 1000;
+static int mix[NUM_OPS] = {70, 5, 20, 5};
+
+static volatile int running = 0;
+static volatile int recording = 0;
+
+char sender_handle[MAX_HANDLE_LEN] = {0}; // makePDU.c builds PDUs for this handle
+
+static void usage(char *name);
+static void parseMix(char *list);
+static void setupClient(LoadClient_t *client, int index);
+static void storePDU(LoadClient_t *client, LoadOp op, uint8_t *pdu, int pduLen, int textOffset);
+static void *workerThread(void *arg);
+static void sendOne(LoadWorker_t *worker, LoadClient_t *client, LoadOp op);
+static void sendListRequest(LoadWorker_t *worker, LoadClient_t *client, uint32_t cursor);
+static void loadPDU(void *context, uint8_t *pdu, int pduLen);
+static void recordLatency(LoadWorker_t *worker, LoadOp op, uint8_t *text, int textLen);
+static int queueBytes(LoadWorker_t *worker, LoadClient_t *client, uint8_t *data, int len);
+static void flushClient(LoadWorker_t *worker, LoadClient_t *client);
+static void addSample(Histogram_t *hist, uint64_t value);
+static uint64_t bucketValue(int bucket);
+static uint64_t percentile(Histogram_t *hist, double fraction);
+static void printReport(LoadWorker_t *workers, double elapsed);
+
+int main(int argc, char *argv[])
+{
+    int option = 0;
+
+    while ((option = getopt(argc, argv, "c:d:r:x:s:n:W:")) != -1)
+    {
+        switch (option)
+        {
+        case 'c':
+            numClients = atoi(optarg);
+            break;
+        case 'd':
+            durationSeconds = atoi(optarg);
+            break;
+        case 'r':
+            targetRate = atof(optarg);
+            break;
+        case 'x':
+            parseMix(optarg);
+            break;
+        case 's':
+            messageSize = atoi(optarg);
+            break;
+        case 'n':
+            numDestHandles = atoi(optarg);
+            break;
+        case 'W':
+            numWorkers = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (argc - optind != 2 || numClients < 2 || numWorkers < 1 || durationSeconds < 1 || targetRate <= 0 ||
+        messageSize <= STAMP_LEN || messageSize > MAX_MSG_SIZE ||
+        numDestHandles < 1 || numDestHandles > MAX_DEST_HANDLES || numDestHandles >= numClients)
+    {
+        usage(argv[0]);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // Logins go one at a time (makeInitialPDU() and constructMessagePacket() use the global handle)
+    LoadClient_t *clients = (LoadClient_t *)sCalloc(numClients, sizeof(LoadClient_t));
+    for (int i = 0; i < numClients; i++)
+    {
+        clients[i].socketNum = benchConnect(argv[optind], argv[optind + 1]);
+        setupClient(&clients[i], i);
+    }
+    printf("%d clients logged in\n", numClients);
+
+    LoadWorker_t *workers = (LoadWorker_t *)sCalloc(numWorkers, sizeof(LoadWorker_t));
+    for (int w = 0; w < numWorkers; w++)
+    {
+        workers[w].id = w;
+        workers[w].seed = 12345 + w;
+        workers[w].clients = (LoadClient_t **)sCalloc(numClients, sizeof(LoadClient_t *));
+        if ((workers[w].epollFd = epoll_create1(0)) < 0)
+        {
+            perror("epoll_create1");
+            exit(-1);
+        }
+    }
+
+    for (int i = 0; i < numClients; i++)
+    {
+        LoadWorker_t *worker = &workers[i % numWorkers];
+        struct epoll_event event;
+
+        worker->clients[worker->numClients++] = &clients[i];
+
+        fcntl(clients[i].socketNum, F_SETFL, fcntl(clients[i].socketNum, F_GETFL) | O_NONBLOCK);
+        event.events = EPOLLIN;
+        event.data.ptr = &clients[i];
+        epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, clients[i].socketNum, &event);
+    }
+
+    running = 1;
+    for (int w = 0; w < numWorkers; w++)
+    {
+        pthread_create(&workers[w].thread, NULL, workerThread, &workers[w]);
+    }
+
+    sleep(warmupSeconds);
+    uint64_t start = benchNowNanos();
+    recording = 1;
+    sleep(durationSeconds);
+    recording = 0;
+    uint64_t end = benchNowNanos();
+
+    running = 0;
+    for (int w = 0; w < numWorkers; w++)
+    {
+        pthread_join(workers[w].thread, NULL);
+    }
+
+    printReport(workers, (end - start) / 1e9);
+    return 0;
+}
+
+static void usage(char *name)
+{
+    fprintf(stderr, "Usage: %s [-c clients] [-r total msgs/sec] [-x mix %%m,%%b,%%c,%%L] [-d seconds]\n"
+                    "          [-s message bytes] [-n %%c destinations] [-W load threads] host port\n", name);
+    exit(1);
+}
+
+static void parseMix(char *list)
+{
+    int i = 0;
+    for (char *token = strtok(list, ","); token != NULL && i < NUM_OPS; token = strtok(NULL, ","))
+    {
+        mix[i++] = atoi(token);
+    }
+    while (i < NUM_OPS)
+    {
+        mix[i++] = 0;
+    }
+}
+
+/*
+-- Log in as load<index> and build the one PDU of each kind this client sends,
+   using the same functions cclient does
+-- %m goes to the next client, %c to the next numDestHandles clients
+*/
+static void setupClient(LoadClient_t *client, int index)
+{
+    char handle[MAX_HANDLE_LEN];
+    uint8_t text[MAX_MSG_SIZE + 1];
+    uint8_t pdu[MAXBUF];
+
+    snprintf(handle, sizeof(handle), "load%d", index);
+    if (benchLogin(client->socketNum, handle) < 0)
+    {
+        exit(-1);
+    }
+
+    // The stamp is filled in at send time
+    memset(text, 'x', messageSize);
+    text[messageSize - 1] = '\0';
+
+    char peer[MAX_HANDLE_LEN];
+    snprintf(peer, sizeof(peer), "load%d", (index + 1) % numClients);
+    MessagePacket_t packet = constructMessagePacket(peer, messageSize, text, client->socketNum);
+    storePDU(client, OP_MESSAGE, packet.packet, packet.packet_len, packet.packet_len - messageSize);
+
+    int len = makeBroadcastPDU(pdu, sender_handle, (char *)text, messageSize - 1);
+    storePDU(client, OP_BROADCAST, pdu, len, len - messageSize);
+
+    DestHandle_t handles[MAX_DEST_HANDLES];
+    for (int i = 0; i < numDestHandles; i++)
+    {
+        snprintf(handles[i].handle_name, MAX_HANDLE_LEN, "load%d", (index + 1 + i) % numClients);
+        handles[i].dest_handle_len = strlen(handles[i].handle_name);
+    }
+    len = constructMulticastPDU(pdu, client->socketNum, sender_handle, numDestHandles, handles, (char *)text);
+    storePDU(client, OP_MULTICAST, pdu, len, len - (messageSize - 1));
+}
+
+// Keep a copy of pdu with its 2 byte length in front, remembering where the text starts
+static void storePDU(LoadClient_t *client, LoadOp op, uint8_t *pdu, int pduLen, int textOffset)
+{
+    uint16_t length = htons(pduLen + 2);
+
+    client->pdus[op] = (uint8_t *)sCalloc(1, pduLen + 2);
+    memcpy(client->pdus[op], &length, 2);
+    memcpy(client->pdus[op] + 2, pdu, pduLen);
+    client->pduLens[op] = pduLen + 2;
+    client->stampOffsets[op] = textOffset + 2;
+}
+
+static void *workerThread(void *arg)
+{
+    LoadWorker_t *worker = (LoadWorker_t *)arg;
+    struct epoll_event events[64];
+    double rate = targetRate / numWorkers;
+    int mixTotal = 0;
+    uint64_t due = 0;
+
+    for (int i = 0; i < NUM_OPS; i++)
+    {
+        mixTotal += mix[i];
+    }
+
+    uint64_t start = benchNowNanos();
+    while (running)
+    {
+        // Open loop: send whatever the rate says is due by now, whether or not replies came back
+        uint64_t target = (benchNowNanos() - start) * rate / 1e9;
+        for (; due < target; due++)
+        {
+            LoadClient_t *client = worker->clients[rand_r(&worker->seed) % worker->numClients];
+            int pick = mixTotal > 0 ? rand_r(&worker->seed) % mixTotal : 0;
+            LoadOp op = OP_MESSAGE;
+
+            while (op < NUM_OPS - 1 && pick >= mix[op])
+            {
+                pick -= mix[op];
+                op++;
+            }
+            sendOne(worker, client, op);
+        }
+
+        int numReady = epoll_wait(worker->epollFd, events, 64, 1);
+        for (int i = 0; i < numReady; i++)
+        {
+            LoadClient_t *client = (LoadClient_t *)events[i].data.ptr;
+
+            if (events[i].events & EPOLLOUT)
+            {
+                flushClient(worker, client);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            {
+                int bytes = recv(client->socketNum, client->inBuffer + client->inLen, LOAD_IN_BUFFER_SIZE - client->inLen, 0);
+                if (bytes <= 0)
+                {
+                    if (bytes == 0 || (errno != EAGAIN && errno != EINTR))
+                    {
+                        fprintf(stderr, "Server closed client %d\n", client->socketNum);
+                        exit(-1);
+                    }
+                    continue;
+                }
+                client->inLen += bytes;
+
+                void *context[2] = {worker, client};
+                int used = parsePDUs(client->inBuffer, client->inLen, MAXBUF, loadPDU, context);
+                if (used < 0)
+                {
+                    fprintf(stderr, "Bad PDU from server\n");
+                    exit(-1);
+                }
+                client->inLen -= used;
+                memmove(client->inBuffer, client->inBuffer + used, client->inLen);
+                flushClient(worker, client);
+            }
+        }
+
+        for (int i = 0; i < worker->numClients; i++)
+        {
+            if (worker->clients[i]->outLen > 0 && !worker->clients[i]->wantOut)
+            {
+                flushClient(worker, worker->clients[i]);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Stamp the client's prebuilt PDU for op with the time and queue it
+static void sendOne(LoadWorker_t *worker, LoadClient_t *client, LoadOp op)
+{
+    if (op == OP_LIST)
+    {
+        if (client->listStart != 0)
+        {
+            op = OP_MESSAGE; // one listing at a time per client
+        }
+        else
+        {
+            client->listStart = benchNowNanos();
+            sendListRequest(worker, client, 0);
+            return;
+        }
+    }
+
+    char stamp[STAMP_LEN + 1];
+    snprintf(stamp, sizeof(stamp), "%016llx", (unsigned long long)benchNowNanos());
+    memcpy(client->pdus[op] + client->stampOffsets[op], stamp, STAMP_LEN);
+
+    if (queueBytes(worker, client, client->pdus[op], client->pduLens[op]) < 0)
+    {
+        worker->skipped++;
+        return;
+    }
+    if (recording)
+    {
+        worker->sent[op]++;
+    }
+}
+
+// Paged list request, same PDU as makeListPagePDU() but queued instead of sent with a blocking send()
+static void sendListRequest(LoadWorker_t *worker, LoadClient_t *client, uint32_t cursor)
+{
+    uint8_t request[7];
+    uint16_t length = htons(sizeof(request));
+    uint32_t networkCursor = htonl(cursor);
+
+    memcpy(request, &length, 2);
+    request[2] = LIST_PAGE_REQUEST_FLAG;
+    memcpy(request + 3, &networkCursor, sizeof(networkCursor));
+
+    if (queueBytes(worker, client, request, sizeof(request)) < 0)
+    {
+        worker->skipped++;
+        client->listStart = 0;
+        return;
+    }
+    if (recording && cursor == 0)
+    {
+        worker->sent[OP_LIST]++;
+    }
+}
+
+static void loadPDU(void *context, uint8_t *pdu, int pduLen)
+{
+    LoadWorker_t *worker = ((void **)context)[0];
+    LoadClient_t *client = ((void **)context)[1];
+    int offset = 0;
+
+    switch (pdu[0])
+    {
+    case 0x05: // [5][len][sender][1][len][dest][text]
+        offset = 2 + pdu[1];
+        offset += 2 + pdu[offset + 1];
+        recordLatency(worker, OP_MESSAGE, pdu + offset, pduLen - offset);
+        break;
+    case 0x04: // [4][len][sender][text]
+        offset = 2 + pdu[1];
+        recordLatency(worker, OP_BROADCAST, pdu + offset, pduLen - offset);
+        break;
+    case 0x06: // [6][len][sender][count]([len][dest])*[text]
+    {
+        offset = 2 + pdu[1];
+        int count = pdu[offset++];
+        for (int i = 0; i < count && offset < pduLen; i++)
+        {
+            offset += 1 + pdu[offset];
+        }
+        recordLatency(worker, OP_MULTICAST, pdu + offset, pduLen - offset);
+        break;
+    }
+    case 0x07:
+        worker->errors++;
+        break;
+    case LIST_PAGE_FLAG:
+    {
+        uint32_t next;
+        memcpy(&next, pdu + 5, sizeof(next));
+        next = ntohl(next);
+        if (next != 0)
+        {
+            sendListRequest(worker, client, next);
+        }
+        else if (client->listStart != 0)
+        {
+            if (recording)
+            {
+                worker->received[OP_LIST]++;
+                addSample(&worker->latency[OP_LIST], benchNowNanos() - client->listStart);
+            }
+            client->listStart = 0;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+static void recordLatency(LoadWorker_t *worker, LoadOp op, uint8_t *text, int textLen)
+{
+    char stamp[STAMP_LEN + 1];
+
+    if (!recording || textLen < STAMP_LEN)
+    {
+        return;
+    }
+    memcpy(stamp, text, STAMP_LEN);
+    stamp[STAMP_LEN] = '\0';
+
+    uint64_t sentAt = strtoull(stamp, NULL, 16);
+    uint64_t now = benchNowNanos();
+
+    worker->received[op]++;
+    addSample(&worker->latency[op], now > sentAt ? now - sentAt : 0);
+}
+
+// Returns -1 (and queues nothing) if there isn't room
+static int queueBytes(LoadWorker_t *worker, LoadClient_t *client, uint8_t *data, int len)
+{
+    if (client->outLen + len > LOAD_OUT_BUFFER_SIZE)
+    {
+        flushClient(worker, client);
+        if (client->outLen + len > LOAD_OUT_BUFFER_SIZE)
+        {
+            return -1;
+        }
+    }
+    memcpy(client->outBuffer + client->outLen, data, len);
+    client->outLen += len;
+    return 0;
+}
+
+static void flushClient(LoadWorker_t *worker, LoadClient_t *client)
+{
+    if (client->outLen > 0)
+    {
+        int sent = send(client->socketNum, client->outBuffer, client->outLen, 0);
+        if (sent > 0)
+        {
+            client->outLen -= sent;
+            memmove(client->outBuffer, client->outBuffer + sent, client->outLen);
+        }
+    }
+
+    int wantOut = client->outLen > 0;
+    if (wantOut != client->wantOut)
+    {
+        struct epoll_event event;
+        event.events = EPOLLIN | (wantOut ? EPOLLOUT : 0);
+        event.data.ptr = client;
+        epoll_ctl(worker->epollFd, EPOLL_CTL_MOD, client->socketNum, &event);
+        client->wantOut = wantOut;
+    }
+}
+
+// Values under HIST_SUB_BUCKETS get their own bucket, above that 16 buckets per power of 2
+static void addSample(Histogram_t *hist, uint64_t value)
+{
+    int bucket = value;
+
+    if (value >= HIST_SUB_BUCKETS)
+    {
+        int exponent = 63 - __builtin_clzll(value);
+        bucket = (exponent - 3) * HIST_SUB_BUCKETS + ((value >> (exponent - 4)) & (HIST_SUB_BUCKETS - 1));
+    }
+    hist->counts[bucket]++;
+    hist->total++;
+    if (value > hist->max)
+    {
+        hist->max = value;
+    }
+}
+
+// Smallest value that lands in bucket
+static uint64_t bucketValue(int bucket)
+{
+    if (bucket < HIST_SUB_BUCKETS)
+    {
+        return bucket;
+    }
+    int exponent = bucket / HIST_SUB_BUCKETS + 3;
+    return (uint64_t)(HIST_SUB_BUCKETS + bucket % HIST_SUB_BUCKETS) << (exponent - 4);
+}
+
+static uint64_t percentile(Histogram_t *hist, double fraction)
+{
+    uint64_t wanted = hist->total * fraction;
+    uint64_t seen = 0;
+
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += hist->counts[i];
+        if (seen > wanted)
+        {
+            return bucketValue(i);
+        }
+    }
+    return hist->max;
+}
+
+static void printReport(LoadWorker_t *workers, double elapsed)
+{
+    Histogram_t totals[NUM_OPS];
+    uint64_t sent[NUM_OPS] = {0}, received[NUM_OPS] = {0}, skipped = 0, errors = 0;
+
+    memset(totals, 0, sizeof(totals));
+    for (int w = 0; w < numWorkers; w++)
+    {
+        for (int op = 0; op < NUM_OPS; op++)
+        {
+            sent[op] += workers[w].sent[op];
+            received[op] += workers[w].received[op];
+            for (int b = 0; b < HIST_BUCKETS; b++)
+            {
+                totals[op].counts[b] += workers[w].latency[op].counts[b];
+            }
+            totals[op].total += workers[w].latency[op].total;
+            if (workers[w].latency[op].max > totals[op].max)
+            {
+                totals[op].max = workers[w].latency[op].max;
+            }
+        }
+        skipped += workers[w].skipped;
+        errors += workers[w].errors;
+    }
+
+    printf("\n%d clients, target %.0f msgs/sec, %.1f seconds\n", numClients, targetRate, elapsed);
+    printf("%-4s %10s %12s %10s %10s %10s %10s\n", "op", "sent/s", "received/s", "p50 us", "p99 us", "p999 us", "max us");
+    for (int op = 0; op < NUM_OPS; op++)
+    {
+        if (sent[op] == 0)
+        {
+            continue;
+        }
+        printf("%-4s %10.0f %12.0f %10.1f %10.1f %10.1f %10.1f\n", opNames[op],
+               sent[op] / elapsed, received[op] / elapsed,
+               percentile(&totals[op], 0.50) / 1e3, percentile(&totals[op], 0.99) / 1e3,
+               percentile(&totals[op], 0.999) / 1e3, totals[op].max / 1e3);
+    }
+    if (skipped > 0 || errors > 0)
+    {
+        printf("not sent (client buffer full): %llu, unknown handle errors: %llu\n",
+               (unsigned long long)skipped, (unsigned long long)errors);
+    }
+
+    // One row per power of 2 microseconds
+    for (int op = 0; op < NUM_OPS; op++)
+    {
+        if (totals[op].total == 0)
+        {
+            continue;
+        }
+        printf("\n%s latency\n", opNames[op]);
+
+        uint64_t rows[64] = {0};
+        uint64_t biggest = 0;
+        for (int b = 0; b < HIST_BUCKETS; b++)
+        {
+            uint64_t micros = bucketValue(b) / 1000;
+            int row = micros == 0 ? 0 : 64 - __builtin_clzll(micros);
+            rows[row] += totals[op].counts[b];
+        }
+        for (int row = 0; row < 64; row++)
+        {
+            biggest = rows[row] > biggest ? rows[row] : biggest;
+        }
+        for (int row = 0; row < 64; row++)
+        {
+            if (rows[row] == 0)
+            {
+                continue;
+            }
+            printf("  < %8llu us %10llu |", 1ull << row, (unsigned long long)rows[row]);
+            for (int i = 0; i < (int)(rows[row] * 50 / biggest); i++)
+            {
+                putchar('#');
+            }
+            putchar('\n');
+        }
+    }
+}
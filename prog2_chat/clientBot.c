@@ -0,0 +1,249 @@
+// --------------- clientBot.c -----------------
+/*
+cclient without a terminal (-f): commands come from a file or a pipe and
+go out through the same sendCommand() the prompt uses, as fast as the
+server takes them or paced to -r a second. Nothing waits for a reply
+(the only exception is a %L while another is still coming in), so
+commands are pipelined, a burst at a time whenever the socket has room,
+and what comes back is read between bursts.
+
+Everything received is written to the log (-o, stdout by default) as
+one tab separated line per PDU:
+    receive time (epoch seconds.micro)  kind  from  to  text
+Tabs and newlines in the text become spaces. cclient's usual chatter
+goes to /dev/null (stderr with -v), so the log is all there is on stdout.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+
+#include "clientBot.h"
+#include "cclient.h"
+
+static BotOptions_t options;
+static int running = 0;            // set once startBot() has run
+static FILE *logFile = NULL;
+static uint64_t numLogged = 0;
+
+static uint64_t nowNanos();
+static int isListCommand(char *line);
+
+int botMode()
+{
+	return running;
+}
+
+/*
+-- Open the command script and the log before anything is printed, and
+   send cclient's own output out of the way
+-- Exits if either can't be opened
+*/
+void startBot(BotOptions_t *botOptions)
+{
+	options = *botOptions;
+
+	if (strcmp(options.scriptPath, "-") != 0)
+	{
+		commandFd = open(options.scriptPath, O_RDONLY);
+		if (commandFd < 0)
+		{
+			perror(options.scriptPath);
+			exit(1);
+		}
+	}
+
+	if (options.logPath != NULL)
+	{
+		logFile = fopen(options.logPath, "w");
+	}
+	else
+	{
+		logFile = fdopen(dup(STDOUT_FILENO), "w");
+	}
+	if (logFile == NULL)
+	{
+		perror(options.logPath != NULL ? options.logPath : "stdout");
+		exit(1);
+	}
+
+	if (options.verbose)
+	{
+		dup2(STDERR_FILENO, STDOUT_FILENO);
+	}
+	else if (freopen("/dev/null", "w", stdout) == NULL)
+	{
+		perror("/dev/null");
+		exit(1);
+	}
+	running = 1;
+}
+
+/*
+-- Log in, then send every command in the script and log whatever comes
+   back, until the script is done and nothing has come in for lingerMs
+-- Exits if the server goes away first (what's logged so far is kept)
+*/
+void botControl(int socketNum)
+{
+	char line[MAXBUF];
+	int havePending = 0;   // line holds the next command
+	int inputOpen = 1;
+	uint64_t numSent = 0;
+	uint64_t interval = (options.commandsPerSecond > 0) ? 1000000000ull / options.commandsPerSecond : 0;
+
+	initialConnection(socketNum, 1);
+
+	uint64_t start = nowNanos();
+	uint64_t nextDue = start;
+	uint64_t lastActive = start;
+	uint64_t lastSent = start;
+
+	while (1)
+	{
+		if (!havePending)
+		{
+			havePending = nextCommand(line, !inputOpen);
+		}
+
+		uint64_t now = nowNanos();
+		int blocked = havePending && listInProgress && isListCommand(line);
+		int done = !havePending && !inputOpen && !listInProgress;
+		int timeout = -1;
+
+		if (done)
+		{
+			uint64_t lingerEnd = lastActive + (uint64_t)options.lingerMs * 1000000;
+			if (now >= lingerEnd)
+			{
+				break;
+			}
+			timeout = (lingerEnd - now + 999999) / 1000000;
+		}
+		else if (havePending && !blocked && now < nextDue)
+		{
+			timeout = (nextDue - now + 999999) / 1000000;
+		}
+
+		// Room to send, anything from the server, and more of the script if we need it
+		struct pollfd fds[2];
+		fds[0].fd = socketNum;
+		fds[0].events = POLLIN | ((havePending && !blocked && now >= nextDue) ? POLLOUT : 0);
+		fds[1].fd = (!havePending && inputOpen) ? commandFd : -1;
+		fds[1].events = POLLIN;
+
+		fflush(logFile);
+		if (poll(fds, 2, timeout) < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			perror("poll");
+			exit(-1);
+		}
+
+		if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+		{
+			uint64_t before = numLogged;
+			processMsgFromServer(socketNum);
+			if (numLogged != before)
+			{
+				lastActive = nowNanos();
+			}
+		}
+		if (fds[1].revents != 0 && readFromStdin() == 0)
+		{
+			inputOpen = 0;
+		}
+		if (fds[0].revents & POLLOUT)
+		{
+			// A burst, then back to reading so the server never waits on us
+			for (int burst = 0; burst < BOT_SEND_BURST && havePending; burst++)
+			{
+				now = nowNanos();
+				if ((listInProgress && isListCommand(line)) || now < nextDue)
+				{
+					break;
+				}
+				sendCommand(socketNum, line);
+				numSent++;
+				lastActive = now;
+				lastSent = now;
+
+				// Paced: a second or more behind, don't try to catch it all up at once
+				nextDue = (nextDue + 1000000000ull < now) ? now : nextDue + interval;
+				havePending = nextCommand(line, !inputOpen);
+			}
+		}
+	}
+
+	double elapsed = (lastSent - start) / 1e9;
+	fflush(logFile);
+	fprintf(stderr, "%s: sent %llu commands in %.3f s (%.0f/s), logged %llu received\n", sender_handle,
+	        (unsigned long long)numSent, elapsed, elapsed > 0 ? numSent / elapsed : 0, (unsigned long long)numLogged);
+	close(socketNum);
+}
+
+/*
+-- One received PDU as a log line (a no-op unless running as a bot)
+-- from, to and text don't have to be null terminated, NULL (or a length of 0) logs as -
+*/
+void botLog(const char *kind, const char *from, int fromLen, const char *to, int toLen, const char *text, int textLen)
+{
+	struct timespec now;
+	const char *fields[3] = {from, to, text};
+	int lengths[3] = {fromLen, toLen, textLen};
+
+	if (!running)
+	{
+		return;
+	}
+	clock_gettime(CLOCK_REALTIME, &now);
+	fprintf(logFile, "%ld.%06ld\t%s", (long)now.tv_sec, now.tv_nsec / 1000, kind);
+
+	for (int i = 0; i < 3; i++)
+	{
+		putc_unlocked('\t', logFile);
+		if (fields[i] == NULL || lengths[i] <= 0)
+		{
+			putc_unlocked('-', logFile);
+			continue;
+		}
+		for (int c = 0; c < lengths[i]; c++)
+		{
+			char character = fields[i][c];
+			if (character == '\0' && i == 2 && c == lengths[i] - 1)
+			{
+				break; // the text's terminator
+			}
+			putc_unlocked((character == '\t' || character == '\n' || character == '\r') ? ' ' : character, logFile);
+		}
+	}
+	putc_unlocked('\n', logFile);
+	numLogged++;
+}
+
+static uint64_t nowNanos()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// Only one %L can be coming in at a time
+static int isListCommand(char *line)
+{
+	while (*line == ' ' || *line == '\t')
+	{
+		line++;
+	}
+	return strncasecmp(line, "%l", 2) == 0;
+}
@@ -0,0 +1,24 @@
+#ifndef CLIENTBOT_H
+#define CLIENTBOT_H
+
+#include <stdint.h>
+
+#define BOT_SEND_BURST 16        // commands sent per wakeup before looking at the socket again
+#define BOT_DEFAULT_LINGER_MS 1000
+
+// cclient -f: where the commands come from and how fast they go
+typedef struct
+{
+	char *scriptPath;            // "-" for stdin
+	int commandsPerSecond;       // 0 for as fast as the server takes them
+	char *logPath;               // NULL for stdout
+	int lingerMs;                // how long to keep logging after the last command
+	int verbose;                 // keep cclient's usual output (on stderr)
+} BotOptions_t;
+
+int botMode();
+void startBot(BotOptions_t *options);
+void botControl(int socketNum);
+void botLog(const char *kind, const char *from, int fromLen, const char *to, int toLen, const char *text, int textLen);
+
+#endif
@@ -0,0 +1,835 @@
+// --------------- cluster.c -----------------
+/*
+Several chat servers acting as one (-N node id, -C cluster port, -P peers).
+
+Each node keeps a TCP link open to every peer it was given with -P and
+accepts theirs on its cluster port, so every pair of nodes has two links
+and each one only carries traffic one way. All the link work happens on
+one cluster thread per node; the reactors never block on a peer.
+
+Handle ownership is replicated. When a client logs in or out here every
+peer is told, and puts the handle in its own handle table with the
+ConnRef the client has on this node (plus our node id). Looking a handle
+up is the same one hash lookup wherever the client is, a handle is taken
+across the whole cluster, and %L lists everybody. A link that (re)connects
+starts with all of the sending node's handles; when a node's link to us
+drops, its handles come out of our table until it is back.
+
+A %m, %c or stream segment for a client on another node goes through
+deliverPDUSlice() as usual, which hands it here instead of to a reactor
+inbox. The frame is appended to that peer's buffer and the cluster thread
+writes everything queued for a peer in one send(), so a busy link carries
+many PDUs per syscall. The receiving node already has the client's
+reactor, socket and connection id from the directory and posts the PDU
+straight to that reactor's inbox: one extra hop, no lookup. A %b goes to
+each peer once and each node fans it out to its own clients.
+
+Channels are per node. Two clients that log in with the same handle on
+different nodes at the same moment both get it; each node keeps sending
+to its own until one of them logs out. Cross-node senders aren't paused by
+a backed up client, the frames just wait in its send queue.
+*/
+
+#define _GNU_SOURCE // accept4()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include "cluster.h"
+#include "reactor.h"
+#include "connection.h"
+#include "epollLib.h"
+#include "networks.h"
+#include "safeUtil.h"
+#include "log.h"
+
+#define CLUSTER_REF_LEN 9            // socket 4, conn id 4, reactor 1
+
+// A node we send to. Reactors append frames to queued, the cluster thread
+// swaps it for sending and writes that.
+typedef struct
+{
+    int nodeId;
+    char host[NI_MAXHOST];
+    char port[NI_MAXSERV];
+
+    pthread_mutex_t lock;            // guards up, overflow and queued
+    int up;                          // hello and handles have gone down the link, frames for it are kept
+    int overflow;                    // it stopped reading, reset the link
+    uint8_t *queued;
+    int queuedLen;
+    int queuedSize;
+
+    // Cluster thread only
+    int socketNum;                   // -1 while the link is down
+    int connecting;                  // non-blocking connect() hasn't finished
+    uint32_t events;
+    uint64_t nextAttempt;            // ms (getTimeMs())
+    uint8_t *sending;
+    int sendingLen;
+    int sendingSize;
+    int sendingOffset;
+} ClusterPeer_t;
+
+// A node's link to us, it only ever sends
+typedef struct
+{
+    int socketNum;                   // -1 if the slot is free
+    int nodeId;                      // from its hello, 0 until then
+    PDUBuffer_t *recvBuffer;
+    int recvLen;
+} ClusterLink_t;
+
+static int localNodeId = 0;
+static int clusterListenSocket = -1;
+static int clusterWakeFd = -1;
+static int clusterWakePending = 0;   // like a reactor's wakePending
+static pthread_t clusterThreadId;
+
+static ClusterPeer_t peers[MAX_CLUSTER_NODES];
+static int numPeers = 0;
+static ClusterPeer_t *peerByNode[MAX_CLUSTER_NODES + 1];
+static ClusterLink_t links[2 * MAX_CLUSTER_NODES];
+
+static int parsePeer(char *spec, ClusterPeer_t *peer);
+static void *clusterThread(void *arg);
+static void wakeCluster();
+static void queueFrame(ClusterPeer_t *peer, uint8_t type, void *header, int headerLen, void *body, int bodyLen);
+static void appendFrame(ClusterPeer_t *peer, uint8_t type, void *header, int headerLen, void *body, int bodyLen);
+static void startConnect(ClusterPeer_t *peer);
+static void finishConnect(ClusterPeer_t *peer);
+static void linkUp(ClusterPeer_t *peer);
+static void flushPeer(ClusterPeer_t *peer);
+static void watchPeer(ClusterPeer_t *peer, uint32_t events);
+static void resetPeer(ClusterPeer_t *peer, const char *why);
+static void acceptLinks();
+static void readLink(ClusterLink_t *link);
+static int handleFrame(ClusterLink_t *link, uint8_t *frame, int frameLen);
+static void closeLink(ClusterLink_t *link);
+static void putRef(uint8_t *out, ConnRef_t *ref);
+static void getRef(uint8_t *in, ConnRef_t *ref);
+
+/*
+-- Set this node up to join a cluster: listen on clusterPort (0 for none) and
+   keep links to the nodes in peerList, "id@host:port,id@host:port"
+-- Return value: 0, -1 if an argument is no good (the caller prints the usage)
+*/
+int initCluster(int nodeId, int clusterPort, char *peerList)
+{
+    if (nodeId < 1 || nodeId > MAX_CLUSTER_NODES)
+    {
+        return -1;
+    }
+    localNodeId = nodeId;
+
+    char *save = NULL;
+    for (char *spec = strtok_r(peerList, ",", &save); spec != NULL; spec = strtok_r(NULL, ",", &save))
+    {
+        if (numPeers == MAX_CLUSTER_NODES || parsePeer(spec, &peers[numPeers]) < 0)
+        {
+            return -1;
+        }
+        ClusterPeer_t *peer = &peers[numPeers++];
+        if (peer->nodeId == nodeId || peerByNode[peer->nodeId] != NULL)
+        {
+            return -1;
+        }
+        peerByNode[peer->nodeId] = peer;
+        pthread_mutex_init(&peer->lock, NULL);
+        peer->socketNum = -1;
+    }
+
+    for (int i = 0; i < 2 * MAX_CLUSTER_NODES; i++)
+    {
+        links[i].socketNum = -1;
+    }
+    if (clusterPort > 0)
+    {
+        clusterListenSocket = tcpServerSetupReusePort(clusterPort, 0);
+        setNonBlocking(clusterListenSocket);
+    }
+    if ((clusterWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+    {
+        perror("eventfd");
+        exit(-1);
+    }
+    return 0;
+}
+
+// After initReactors(): frames from other nodes are posted to the reactors' inboxes
+void startCluster()
+{
+    if (localNodeId == 0)
+    {
+        return;
+    }
+    if (pthread_create(&clusterThreadId, NULL, clusterThread, NULL) != 0)
+    {
+        perror("pthread_create");
+        exit(-1);
+    }
+}
+
+int clusterEnabled()
+{
+    return numPeers > 0;
+}
+
+// A client here just logged in, every node we link to gets the handle and where it is
+void clusterAnnounceHandle(ConnRef_t *ref, char *handle, int handleLen)
+{
+    uint8_t header[CLUSTER_REF_LEN + 2];
+
+    putRef(header, ref);
+    header[CLUSTER_REF_LEN] = ref->capabilities;
+    header[CLUSTER_REF_LEN + 1] = handleLen;
+    for (int i = 0; i < numPeers; i++)
+    {
+        queueFrame(&peers[i], CLUSTER_HANDLE_ADD, header, sizeof(header), handle, handleLen);
+    }
+}
+
+// The client that had it logged out
+void clusterWithdrawHandle(uint32_t connId, char *handle, int handleLen)
+{
+    uint8_t header[5];
+    uint32_t id = htonl(connId);
+
+    memcpy(header, &id, 4);
+    header[4] = handleLen;
+    for (int i = 0; i < numPeers; i++)
+    {
+        queueFrame(&peers[i], CLUSTER_HANDLE_REMOVE, header, sizeof(header), handle, handleLen);
+    }
+}
+
+// Send a PDU to a client on another node (dest came out of the handle table)
+void clusterDeliver(ConnRef_t *dest, PDUSlice_t *pdu)
+{
+    ClusterPeer_t *peer = (dest->nodeId <= MAX_CLUSTER_NODES) ? peerByNode[dest->nodeId] : NULL;
+    uint8_t header[CLUSTER_REF_LEN];
+
+    if (peer == NULL)
+    {
+        LOG_DEBUG("No link to node %d, PDU dropped\n", dest->nodeId);
+        return;
+    }
+    putRef(header, dest);
+    queueFrame(peer, CLUSTER_DELIVER, header, sizeof(header), pdu->data, pdu->len);
+}
+
+// A %b from a client here, every other node fans it out to its own clients
+void clusterBroadcast(PDUSlice_t *pdu)
+{
+    for (int i = 0; i < numPeers; i++)
+    {
+        queueFrame(&peers[i], CLUSTER_BROADCAST, NULL, 0, pdu->data, pdu->len);
+    }
+}
+
+// "id@host:port"
+static int parsePeer(char *spec, ClusterPeer_t *peer)
+{
+    char *at = strchr(spec, '@');
+    char *colon = strrchr(spec, ':');
+
+    if (at == NULL || colon == NULL || colon < at || colon - at - 1 >= NI_MAXHOST || strlen(colon + 1) >= NI_MAXSERV)
+    {
+        return -1;
+    }
+    peer->nodeId = atoi(spec);
+    if (peer->nodeId < 1 || peer->nodeId > MAX_CLUSTER_NODES)
+    {
+        return -1;
+    }
+    memcpy(peer->host, at + 1, colon - at - 1);
+    peer->host[colon - at - 1] = '\0';
+    strcpy(peer->port, colon + 1);
+    return 0;
+}
+
+static void *clusterThread(void *arg)
+{
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+
+    setupEpollSet();
+    addToEpollSet(clusterWakeFd, EPOLLIN);
+    if (clusterListenSocket >= 0)
+    {
+        addToEpollSet(clusterListenSocket, EPOLLIN);
+    }
+
+    while (1)
+    {
+        // Try the nodes we have no link to yet
+        uint64_t now = getTimeMs();
+        int timeout = -1;
+        for (int i = 0; i < numPeers; i++)
+        {
+            ClusterPeer_t *peer = &peers[i];
+            if (peer->socketNum < 0 && now >= peer->nextAttempt)
+            {
+                startConnect(peer);
+            }
+            if (peer->socketNum < 0 && (timeout < 0 || (int)(peer->nextAttempt - now) < timeout))
+            {
+                timeout = (peer->nextAttempt > now) ? (int)(peer->nextAttempt - now) : 0;
+            }
+        }
+
+        int numReady = epollCall(timeout, events, EPOLL_MAX_EVENTS);
+        for (int i = 0; i < numReady; i++)
+        {
+            int socketNum = (int)(uint32_t)events[i].data.u64;
+
+            if (socketNum == clusterWakeFd)
+            {
+                uint64_t count;
+                if (read(clusterWakeFd, &count, sizeof(count)) < 0)
+                {
+                    count = 0; // already read
+                }
+                // Cleared before looking so a reactor queueing after this wakes us again
+                __atomic_store_n(&clusterWakePending, 0, __ATOMIC_RELEASE);
+                for (int p = 0; p < numPeers; p++)
+                {
+                    flushPeer(&peers[p]);
+                }
+                continue;
+            }
+            if (socketNum == clusterListenSocket)
+            {
+                acceptLinks();
+                continue;
+            }
+            for (int p = 0; p < numPeers; p++)
+            {
+                ClusterPeer_t *peer = &peers[p];
+                if (peer->socketNum != socketNum)
+                {
+                    continue;
+                }
+                if (peer->connecting)
+                {
+                    finishConnect(peer);
+                }
+                else if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                {
+                    // Nothing is ever sent back on our own link, so it's closing
+                    resetPeer(peer, "closed");
+                }
+                else
+                {
+                    flushPeer(peer);
+                }
+            }
+            for (int l = 0; l < 2 * MAX_CLUSTER_NODES; l++)
+            {
+                if (links[l].socketNum == socketNum)
+                {
+                    readLink(&links[l]);
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+static void wakeCluster()
+{
+    if (__atomic_exchange_n(&clusterWakePending, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        uint64_t one = 1;
+        if (write(clusterWakeFd, &one, sizeof(one)) < 0)
+        {
+            perror("eventfd write");
+        }
+    }
+}
+
+// Any thread: add a frame for peer, dropped if the link isn't up (it starts over with the handles when it is)
+static void queueFrame(ClusterPeer_t *peer, uint8_t type, void *header, int headerLen, void *body, int bodyLen)
+{
+    pthread_mutex_lock(&peer->lock);
+    if (!peer->up || peer->overflow)
+    {
+        pthread_mutex_unlock(&peer->lock);
+        return;
+    }
+    if (peer->queuedLen + CLUSTER_FRAME_HEADER_LEN + headerLen + bodyLen > CLUSTER_MAX_QUEUED)
+    {
+        peer->overflow = 1;
+    }
+    else
+    {
+        appendFrame(peer, type, header, headerLen, body, bodyLen);
+    }
+    pthread_mutex_unlock(&peer->lock);
+    wakeCluster();
+}
+
+// Caller holds peer->lock
+static void appendFrame(ClusterPeer_t *peer, uint8_t type, void *header, int headerLen, void *body, int bodyLen)
+{
+    int frameLen = CLUSTER_FRAME_HEADER_LEN + headerLen + bodyLen;
+    uint32_t length = htonl(frameLen);
+
+    if (peer->queuedLen + frameLen > peer->queuedSize)
+    {
+        peer->queuedSize = (peer->queuedLen + frameLen) * 2;
+        peer->queued = (uint8_t *)srealloc(peer->queued, peer->queuedSize);
+    }
+    uint8_t *out = peer->queued + peer->queuedLen;
+    memcpy(out, &length, 4);
+    out[4] = type;
+    if (headerLen > 0)
+    {
+        memcpy(out + CLUSTER_FRAME_HEADER_LEN, header, headerLen);
+    }
+    if (bodyLen > 0)
+    {
+        memcpy(out + CLUSTER_FRAME_HEADER_LEN + headerLen, body, bodyLen);
+    }
+    peer->queuedLen += frameLen;
+}
+
+static void startConnect(ClusterPeer_t *peer)
+{
+    struct addrinfo hints, *result = NULL;
+
+    peer->nextAttempt = getTimeMs() + CLUSTER_RETRY_MS;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(peer->host, peer->port, &hints, &result) != 0)
+    {
+        LOG_WARN("Node %d: can't resolve %s\n", peer->nodeId, peer->host);
+        return;
+    }
+
+    int socketNum = socket(result->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (socketNum < 0)
+    {
+        freeaddrinfo(result);
+        return;
+    }
+    int on = 1;
+    setsockopt(socketNum, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); // we batch, don't wait for more
+    int status = connect(socketNum, result->ai_addr, result->ai_addrlen);
+    freeaddrinfo(result);
+    if (status < 0 && errno != EINPROGRESS)
+    {
+        close(socketNum);
+        return;
+    }
+
+    peer->socketNum = socketNum;
+    peer->connecting = 1;
+    peer->events = EPOLLOUT;
+    addToEpollSet(socketNum, EPOLLOUT);
+}
+
+static void finishConnect(ClusterPeer_t *peer)
+{
+    int error = 0;
+    socklen_t len = sizeof(error);
+
+    if (getsockopt(peer->socketNum, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0)
+    {
+        // Not up yet (or gone), try again in a bit
+        removeFromEpollSet(peer->socketNum);
+        close(peer->socketNum);
+        peer->socketNum = -1;
+        peer->connecting = 0;
+        return;
+    }
+    peer->connecting = 0;
+    linkUp(peer);
+}
+
+/*
+-- The link to peer is connected: say who we are and send every handle on
+   this node before anything else
+-- The lock is held from the copy until the frames are queued, so a login
+   or logout racing with it is queued after the copy it may or may not be in
+*/
+static void linkUp(ClusterPeer_t *peer)
+{
+    uint8_t hello[2] = {localNodeId, CLUSTER_VERSION};
+    int local = 0;
+
+    pthread_mutex_lock(&peer->lock);
+    peer->up = 1;
+    peer->overflow = 0;
+    peer->queuedLen = 0;
+    appendFrame(peer, CLUSTER_HELLO, hello, sizeof(hello), NULL, 0);
+
+    // Room for logins that land while we copy (those are queued on their own as well)
+    int maxHandles = getHandleCount() + 1024;
+    Handle_t *handles = (Handle_t *)sCalloc(maxHandles, sizeof(Handle_t));
+    int count = copyHandles(handles, maxHandles);
+    for (int i = 0; i < count; i++)
+    {
+        if (handles[i].conn.nodeId != 0)
+        {
+            continue; // another node's, it tells peer itself
+        }
+        uint8_t header[CLUSTER_REF_LEN + 2];
+        putRef(header, &handles[i].conn);
+        header[CLUSTER_REF_LEN] = handles[i].conn.capabilities;
+        header[CLUSTER_REF_LEN + 1] = handles[i].handleLen;
+        appendFrame(peer, CLUSTER_HANDLE_ADD, header, sizeof(header), handles[i].handle, handles[i].handleLen);
+        local++;
+    }
+    pthread_mutex_unlock(&peer->lock);
+    free(handles);
+
+    LOG_INFO("Linked to node %d, sent %d handles\n", peer->nodeId, local);
+    flushPeer(peer); // leaves it watched for EPOLLIN (hangups) once it's all written
+}
+
+// Write what's queued for peer, EPOLLOUT stays armed while the socket is full
+static void flushPeer(ClusterPeer_t *peer)
+{
+    if (peer->socketNum < 0 || peer->connecting)
+    {
+        return;
+    }
+
+    while (1)
+    {
+        if (peer->sendingOffset == peer->sendingLen)
+        {
+            // Take everything the reactors queued since the last swap
+            pthread_mutex_lock(&peer->lock);
+            if (peer->overflow)
+            {
+                pthread_mutex_unlock(&peer->lock);
+                resetPeer(peer, "fell too far behind");
+                return;
+            }
+            uint8_t *swap = peer->sending;
+            int swapSize = peer->sendingSize;
+            peer->sending = peer->queued;
+            peer->sendingSize = peer->queuedSize;
+            peer->sendingLen = peer->queuedLen;
+            peer->queued = swap;
+            peer->queuedSize = swapSize;
+            peer->queuedLen = 0;
+            pthread_mutex_unlock(&peer->lock);
+
+            peer->sendingOffset = 0;
+            if (peer->sendingLen == 0)
+            {
+                watchPeer(peer, EPOLLIN);
+                return;
+            }
+        }
+
+        ssize_t sent = send(peer->socketNum, peer->sending + peer->sendingOffset, peer->sendingLen - peer->sendingOffset,
+                            MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                watchPeer(peer, EPOLLIN | EPOLLOUT);
+                return;
+            }
+            resetPeer(peer, strerror(errno));
+            return;
+        }
+        peer->sendingOffset += sent;
+    }
+}
+
+static void watchPeer(ClusterPeer_t *peer, uint32_t events)
+{
+    if (peer->events != events)
+    {
+        modifyEpollSet(peer->socketNum, events);
+        peer->events = events;
+    }
+}
+
+// Drop the link and whatever was waiting for it, it's tried again after CLUSTER_RETRY_MS
+static void resetPeer(ClusterPeer_t *peer, const char *why)
+{
+    LOG_WARN("Lost link to node %d: %s\n", peer->nodeId, why);
+
+    removeFromEpollSet(peer->socketNum);
+    close(peer->socketNum);
+    peer->socketNum = -1;
+    peer->connecting = 0;
+    peer->sendingLen = 0;
+    peer->sendingOffset = 0;
+    peer->nextAttempt = getTimeMs() + CLUSTER_RETRY_MS;
+
+    pthread_mutex_lock(&peer->lock);
+    peer->up = 0;
+    peer->overflow = 0;
+    peer->queuedLen = 0;
+    pthread_mutex_unlock(&peer->lock);
+}
+
+static void acceptLinks()
+{
+    while (1)
+    {
+        int socketNum = accept4(clusterListenSocket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (socketNum < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            return;
+        }
+
+        ClusterLink_t *link = NULL;
+        for (int i = 0; i < 2 * MAX_CLUSTER_NODES && link == NULL; i++)
+        {
+            if (links[i].socketNum < 0)
+            {
+                link = &links[i];
+            }
+        }
+        if (link == NULL)
+        {
+            LOG_WARN("Too many cluster links, refusing one\n");
+            close(socketNum);
+            continue;
+        }
+        link->socketNum = socketNum;
+        link->nodeId = 0;
+        link->recvLen = 0;
+        addToEpollSet(socketNum, EPOLLIN);
+    }
+}
+
+// Read what a node sent and act on every whole frame, PDUs are passed on straight out of the buffer
+static void readLink(ClusterLink_t *link)
+{
+    if (link->recvBuffer == NULL)
+    {
+        link->recvBuffer = allocPDUBuffer(CLUSTER_RECV_BUFFER_SIZE);
+    }
+
+    int received = recv(link->socketNum, link->recvBuffer->data + link->recvLen, CLUSTER_RECV_BUFFER_SIZE - link->recvLen, 0);
+    if (received <= 0)
+    {
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        {
+            return;
+        }
+        closeLink(link);
+        return;
+    }
+    link->recvLen += received;
+
+    int consumed = 0;
+    while (link->recvLen - consumed >= CLUSTER_FRAME_HEADER_LEN)
+    {
+        uint8_t *frame = link->recvBuffer->data + consumed;
+        uint32_t frameLen;
+        memcpy(&frameLen, frame, 4);
+        frameLen = ntohl(frameLen);
+
+        if (frameLen < CLUSTER_FRAME_HEADER_LEN || frameLen > CLUSTER_RECV_BUFFER_SIZE)
+        {
+            LOG_WARN("Node %d sent a bad frame\n", link->nodeId);
+            closeLink(link);
+            return;
+        }
+        if (link->recvLen - consumed < (int)frameLen)
+        {
+            break;
+        }
+        if (handleFrame(link, frame, frameLen) < 0)
+        {
+            closeLink(link);
+            return;
+        }
+        consumed += frameLen;
+    }
+
+    // Same as a client's receive buffer: keep the partial frame, in a new
+    // buffer if reactors still have PDUs in the old one queued
+    link->recvLen -= consumed;
+    if (link->recvLen == 0)
+    {
+        releasePDUBuffer(link->recvBuffer);
+        link->recvBuffer = NULL;
+    }
+    else if (consumed > 0)
+    {
+        if (__atomic_load_n(&link->recvBuffer->refCount, __ATOMIC_ACQUIRE) == 1)
+        {
+            memmove(link->recvBuffer->data, link->recvBuffer->data + consumed, link->recvLen);
+        }
+        else
+        {
+            PDUBuffer_t *recvBuffer = allocPDUBuffer(CLUSTER_RECV_BUFFER_SIZE);
+            memcpy(recvBuffer->data, link->recvBuffer->data + consumed, link->recvLen);
+            releasePDUBuffer(link->recvBuffer);
+            link->recvBuffer = recvBuffer;
+        }
+    }
+}
+
+// One frame from link's node, -1 if it makes no sense (the link is closed)
+static int handleFrame(ClusterLink_t *link, uint8_t *frame, int frameLen)
+{
+    uint8_t type = frame[4];
+    uint8_t *body = frame + CLUSTER_FRAME_HEADER_LEN;
+    int bodyLen = frameLen - CLUSTER_FRAME_HEADER_LEN;
+
+    if (link->nodeId == 0 && type != CLUSTER_HELLO)
+    {
+        return -1;
+    }
+
+    switch (type)
+    {
+    case CLUSTER_HELLO:
+        if (bodyLen < 2 || body[1] != CLUSTER_VERSION || body[0] < 1 || body[0] > MAX_CLUSTER_NODES || body[0] == localNodeId)
+        {
+            LOG_WARN("Cluster link with a bad hello\n");
+            return -1;
+        }
+        for (int i = 0; i < 2 * MAX_CLUSTER_NODES; i++)
+        {
+            if (&links[i] != link && links[i].socketNum >= 0 && links[i].nodeId == body[0])
+            {
+                // It reconnected before we noticed the old link go, drop that one's handles now
+                closeLink(&links[i]);
+            }
+        }
+        link->nodeId = body[0];
+        LOG_INFO("Node %d linked to us\n", link->nodeId);
+        return 0;
+
+    case CLUSTER_HANDLE_ADD:
+    {
+        if (bodyLen < CLUSTER_REF_LEN + 2 || bodyLen != CLUSTER_REF_LEN + 2 + body[CLUSTER_REF_LEN + 1])
+        {
+            return -1;
+        }
+        ConnRef_t ref;
+        getRef(body, &ref);
+        ref.capabilities = body[CLUSTER_REF_LEN];
+        ref.nodeId = link->nodeId;
+        addHandle((char *)body + CLUSTER_REF_LEN + 2, body[CLUSTER_REF_LEN + 1], &ref);
+        return 0;
+    }
+
+    case CLUSTER_HANDLE_REMOVE:
+    {
+        uint32_t connId;
+        if (bodyLen < 5 || bodyLen != 5 + body[4])
+        {
+            return -1;
+        }
+        memcpy(&connId, body, 4);
+        removeRemoteHandle((char *)body + 5, body[4], ntohl(connId), link->nodeId);
+        return 0;
+    }
+
+    case CLUSTER_DELIVER:
+    {
+        ConnRef_t dest;
+        ConnRef_t sender = {-1, 0, -1, 0, link->nodeId};
+
+        if (bodyLen < CLUSTER_REF_LEN + 3)
+        {
+            return -1;
+        }
+        getRef(body, &dest);
+        if (dest.reactorId >= getNumReactors())
+        {
+            return -1;
+        }
+        PDUSlice_t pdu = {link->recvBuffer, body + CLUSTER_REF_LEN, bodyLen - CLUSTER_REF_LEN};
+        postToReactor(dest.reactorId, createInboxMessage(INBOX_DELIVER, &dest, &sender, &pdu));
+        return 0;
+    }
+
+    case CLUSTER_BROADCAST:
+    {
+        ConnRef_t sender = {-1, 0, -1, 0, link->nodeId};
+        PDUSlice_t pdu = {link->recvBuffer, body, bodyLen};
+
+        if (bodyLen < 3)
+        {
+            return -1;
+        }
+        for (int i = 0; i < getNumReactors(); i++)
+        {
+            postToReactor(i, createInboxMessage(INBOX_BROADCAST, NULL, &sender, &pdu));
+        }
+        return 0;
+    }
+
+    default:
+        LOG_WARN("Node %d sent unknown frame type %d\n", link->nodeId, type);
+        return -1;
+    }
+}
+
+// The node's handles go until it links to us again (and sends them all)
+static void closeLink(ClusterLink_t *link)
+{
+    if (link->nodeId != 0)
+    {
+        int removed = removeNodeHandles(link->nodeId);
+        LOG_WARN("Node %d unlinked, dropped its %d handles\n", link->nodeId, removed);
+    }
+    removeFromEpollSet(link->socketNum);
+    close(link->socketNum);
+    if (link->recvBuffer != NULL)
+    {
+        releasePDUBuffer(link->recvBuffer);
+        link->recvBuffer = NULL;
+    }
+    link->socketNum = -1;
+    link->nodeId = 0;
+    link->recvLen = 0;
+}
+
+// [socket 4][conn id 4][reactor], where the client is on the node that owns it
+static void putRef(uint8_t *out, ConnRef_t *ref)
+{
+    uint32_t socketNum = htonl(ref->socketNum);
+    uint32_t connId = htonl(ref->connId);
+
+    memcpy(out, &socketNum, 4);
+    memcpy(out + 4, &connId, 4);
+    out[8] = ref->reactorId;
+}
+
+static void getRef(uint8_t *in, ConnRef_t *ref)
+{
+    uint32_t socketNum;
+    uint32_t connId;
+
+    memcpy(&socketNum, in, 4);
+    memcpy(&connId, in + 4, 4);
+    ref->socketNum = ntohl(socketNum);
+    ref->connId = ntohl(connId);
+    ref->reactorId = in[8];
+    ref->capabilities = 0;
+    ref->nodeId = 0;
+}
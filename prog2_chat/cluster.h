@@ -0,0 +1,31 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <stdint.h>
+
+#include "handle_table.h"
+#include "pduBuffer.h"
+
+#define MAX_CLUSTER_NODES 32                     // node ids are 1 to this
+#define CLUSTER_VERSION 1
+#define CLUSTER_FRAME_HEADER_LEN 5               // [length 4][type]
+#define CLUSTER_RECV_BUFFER_SIZE (128 * 1024)    // the biggest frame is a 64KB PDU and a few bytes
+#define CLUSTER_MAX_QUEUED (32 * 1024 * 1024)    // waiting for one peer before its link is reset
+#define CLUSTER_RETRY_MS 500                     // between attempts to reach a node that's down
+
+// Frame types, the length in front includes itself
+#define CLUSTER_HELLO 1              // [node id][version]  first on every link
+#define CLUSTER_HANDLE_ADD 2         // [socket 4][conn id 4][reactor][capabilities][len][handle]
+#define CLUSTER_HANDLE_REMOVE 3      // [conn id 4][len][handle]
+#define CLUSTER_DELIVER 4            // [socket 4][conn id 4][reactor][PDU, its length included]
+#define CLUSTER_BROADCAST 5          // [PDU, its length included]
+
+int initCluster(int nodeId, int clusterPort, char *peerList);
+void startCluster();
+int clusterEnabled();
+void clusterAnnounceHandle(ConnRef_t *ref, char *handle, int handleLen);
+void clusterWithdrawHandle(uint32_t connId, char *handle, int handleLen);
+void clusterDeliver(ConnRef_t *dest, PDUSlice_t *pdu);
+void clusterBroadcast(PDUSlice_t *pdu);
+
+#endif
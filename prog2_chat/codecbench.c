@@ -0,0 +1,200 @@
+/******************************************************************************
+ * codecbench.c
+ *
+ * Cost of the PDU codec (pduCodec.c) on its own, no sockets.
+ *
+ * For each kind of PDU the client and server pass around it builds one with
+ * pduEncode() -n times into the same buffer, then takes it apart with
+ * pduParse() -n times, and prints nanoseconds per PDU for each plus the
+ * PDU's size.  -s sets the text size of the messages.
+ *
+ *   ./codecbench -n 10000000 -s 100
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "shared.h"
+#include "pduCodec.h"
+#include "benchUtil.h"
+
+#define DEFAULT_CODEC_ITERATIONS 10000000
+#define DEFAULT_CODEC_TEXT_SIZE 100
+
+char sender_handle[MAX_HANDLE_LEN] = {0}; // makePDU.c builds PDUs for this handle
+
+// One row of the table: a PDU filled in by setup() from the text it is given
+typedef struct
+{
+    const char *name;
+    int direction;
+    void (*setup)(PduView_t *view, uint8_t *text, int textLen);
+} CodecCase_t;
+
+static const char *destinations[MAX_DEST_HANDLES] = {
+    "receiver0", "receiver1", "receiver2", "receiver3", "receiver4",
+    "receiver5", "receiver6", "receiver7", "receiver8", "receiver9",
+};
+
+static volatile uint32_t sink; // keeps the loops from being thrown away
+
+static void usage(char *name);
+static void runCase(const CodecCase_t *codecCase, long iterations, uint8_t *text, int textLen);
+
+static void setupLogin(PduView_t *view, uint8_t *text, int textLen)
+{
+    pduStart(view, 0x01);
+    pduAddHandle(view, "sender01", 8);
+    pduAddByte(view, LOGIN_CAP_BATCH | LOGIN_CAP_STREAM);
+}
+
+static void setupMessage(PduView_t *view, uint8_t *text, int textLen)
+{
+    pduStart(view, 0x05);
+    pduAddHandle(view, "sender01", 8);
+    pduAddHandle(view, destinations[0], strlen(destinations[0]));
+    pduSetText(view, text, textLen);
+}
+
+static void setupMulticast(PduView_t *view, uint8_t *text, int textLen)
+{
+    pduStart(view, 0x06);
+    pduAddHandle(view, "sender01", 8);
+    for (int i = 0; i < MAX_DEST_HANDLES; i++)
+    {
+        pduAddHandle(view, destinations[i], strlen(destinations[i]));
+    }
+    pduSetText(view, text, textLen);
+}
+
+static void setupBroadcast(PduView_t *view, uint8_t *text, int textLen)
+{
+    pduStart(view, 0x04);
+    pduAddHandle(view, "sender01", 8);
+    pduSetText(view, text, textLen);
+}
+
+static void setupChannelMessage(PduView_t *view, uint8_t *text, int textLen)
+{
+    pduStart(view, CHANNEL_MESSAGE_FLAG);
+    pduSetChannel(view, "general", 7);
+    pduAddHandle(view, "sender01", 8);
+    pduSetText(view, text, textLen);
+}
+
+static void setupChannelReply(PduView_t *view, uint8_t *text, int textLen)
+{
+    pduStart(view, CHANNEL_REPLY_FLAG);
+    pduAddByte(view, CHANNEL_JOINED);
+    pduSetChannel(view, "general", 7);
+    pduAddNumber(view, 42);
+}
+
+static void setupStreamStart(PduView_t *view, uint8_t *text, int textLen)
+{
+    pduStart(view, STREAM_START_FLAG);
+    pduAddNumber(view, 7);
+    pduAddNumber(view, 1 << 20);
+    pduAddHandle(view, "sender01", 8);
+    pduAddHandle(view, destinations[0], strlen(destinations[0]));
+}
+
+static void setupStreamData(PduView_t *view, uint8_t *text, int textLen)
+{
+    pduStart(view, STREAM_DATA_FLAG);
+    pduAddNumber(view, 7);
+    pduSetText(view, text, STREAM_SEGMENT_SIZE);
+}
+
+static const CodecCase_t codecCases[] = {
+    {"login 0x01", PDU_TO_SERVER, setupLogin},
+    {"%m 0x05", PDU_TO_SERVER, setupMessage},
+    {"%c 0x06 (10 handles)", PDU_TO_SERVER, setupMulticast},
+    {"%b 0x04", PDU_TO_SERVER, setupBroadcast},
+    {"channel message 0x14", PDU_TO_CLIENT, setupChannelMessage},
+    {"channel reply 0x15", PDU_TO_CLIENT, setupChannelReply},
+    {"stream start 0x17", PDU_TO_SERVER, setupStreamStart},
+    {"stream data 0x18", PDU_TO_SERVER, setupStreamData},
+};
+
+int main(int argc, char *argv[])
+{
+    long iterations = DEFAULT_CODEC_ITERATIONS;
+    int textLen = DEFAULT_CODEC_TEXT_SIZE;
+    int option;
+
+    while ((option = getopt(argc, argv, "n:s:")) != -1)
+    {
+        switch (option)
+        {
+        case 'n':
+            iterations = atol(optarg);
+            break;
+        case 's':
+            textLen = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (iterations < 1 || textLen < 0 || textLen > MAX_MSG_SIZE)
+    {
+        usage(argv[0]);
+    }
+
+    // Big enough for a whole stream segment, only textLen of it goes in the messages
+    uint8_t text[STREAM_SEGMENT_SIZE];
+    for (int i = 0; i < (int)sizeof(text); i++)
+    {
+        text[i] = 'a' + i % 26;
+    }
+
+    printf("%-24s %8s %12s %12s\n", "PDU", "bytes", "build ns", "parse ns");
+    for (int i = 0; i < (int)(sizeof(codecCases) / sizeof(codecCases[0])); i++)
+    {
+        runCase(&codecCases[i], iterations, text, textLen);
+    }
+    return 0;
+}
+
+static void usage(char *name)
+{
+    fprintf(stderr, "Usage: %s [-n iterations] [-s text size, up to %d]\n", name, MAX_MSG_SIZE);
+    exit(1);
+}
+
+// Build it iterations times, then parse it as many, and print a row
+static void runCase(const CodecCase_t *codecCase, long iterations, uint8_t *text, int textLen)
+{
+    uint8_t pdu[MAXBUF];
+    PduView_t view;
+    PduView_t parsed;
+    int pduLen = 0;
+
+    codecCase->setup(&view, text, textLen);
+
+    uint64_t start = benchNowNanos();
+    for (long i = 0; i < iterations; i++)
+    {
+        pduLen = pduEncode(pdu, sizeof(pdu), codecCase->direction, &view);
+        sink += pdu[pduLen - 1];
+    }
+    uint64_t built = benchNowNanos();
+    for (long i = 0; i < iterations; i++)
+    {
+        if (pduParse(pdu, pduLen, codecCase->direction, &parsed) < 0)
+        {
+            fprintf(stderr, "%s: doesn't parse\n", codecCase->name);
+            exit(-1);
+        }
+        sink += parsed.numHandles + parsed.text.len;
+    }
+    uint64_t parsedAt = benchNowNanos();
+
+    printf("%-24s %8d %12.1f %12.1f\n", codecCase->name, pduLen, (double)(built - start) / iterations,
+           (double)(parsedAt - built) / iterations);
+}
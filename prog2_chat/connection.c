@@ -0,0 +1,1465 @@
+// --------------- connection.c -----------------
+/*
+Per-client connection state for the chat server.
+
+Every client socket gets a Connection_t with its own receive buffer so a
+PDU can arrive over any number of wakeups. readConnection() does one
+non-blocking recv(), hands every complete PDU in the buffer to the handler
+and keeps whatever partial PDU is left over for the next wakeup. A client
+that sends half a PDU and stalls no longer freezes the whole server.
+
+Outbound PDUs go on the connection's send queue instead of straight to
+send(). Everything queued while handling one batch of events is written
+with a single writev() per client at the end of the batch, and anything the
+socket won't take yet is left queued with EPOLLOUT armed. A client whose
+queue goes over the high watermark stops us from reading the clients that
+are sending to it until it drains below the low watermark.
+
+An idle connection holds as little as possible: the Connection_t comes
+out of a slab, and the receive buffer and send queue ring are only held
+while there is a partial PDU or something queued. They go back to the
+reactor's slabs as soon as they're empty.
+
+A shared memory client (shmRing.c) is the same Connection_t with the same
+PDUs, only the bytes come out of and go into its rings instead of the
+socket: readConnection() copies out of one and flushConnection() into the
+other.
+
+Each connection has one timer on its reactor's timer wheel: the login
+deadline until it logs in, then the idle/keepalive timeout. A second one
+only runs while ratelimit.c is holding off reading it.
+
+With the io_uring backend (-E uring, uring.c) a TCP client's bytes come in
+through a multishot recv instead: receivedConnection() copies each
+completion's buffer in and dispatches it the same way, and a client whose
+reading is paused has its recv cancelled and anything that still arrives
+parked until it's resumed. flushPendingConnections() then prepares one
+sendmsg per client on the ring instead of calling writev(), and
+sendCompleted() does the rest of what flushConnection() would.
+
+A connection belongs to the reactor thread that accepted it. Sending to a
+client owned by another reactor goes through that reactor's inbox
+(deliverPDUBuffer()), and so do the pause/resume requests for backpressure.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <stddef.h>
+#include <arpa/inet.h>
+
+#include "connection.h"
+#include "channel.h"
+#include "stream.h"
+#include "cluster.h"
+#include "metrics.h"
+#include "epollLib.h"
+#include "uring.h"
+#include "safeUtil.h"
+#include "log.h"
+#include "slab.h"
+
+#define INITIAL_LIST_SIZE 8
+
+// Connections are indexed by socket number. The table is sized for every
+// descriptor we could ever get so it never moves under the other threads.
+static Connection_t **connectionTable = NULL;
+static int connectionTableSize = 0;
+static uint32_t nextConnId = 1;
+
+// Connections (of this reactor) with something queued since the last flush
+static __thread Connection_t **pendingFlush = NULL;
+static __thread int numPendingFlush = 0;
+static __thread int pendingFlushSize = 0;
+
+// io_uring backend: connections to (re)start reading at the start of the next pass
+static __thread ConnRef_t *resumeList = NULL;
+static __thread int numResume = 0;
+static __thread int resumeListSize = 0;
+static __thread int receivingStopped = 0; // a handoff is under way, nothing new is read or armed
+
+static int useUring = 0;
+static int highWatermark = DEFAULT_HIGH_WATERMARK;
+static int lowWatermark = DEFAULT_LOW_WATERMARK;
+static int loginTimeoutMs = DEFAULT_LOGIN_TIMEOUT * 1000;
+static int idleTimeoutMs = DEFAULT_IDLE_TIMEOUT * 1000;
+
+// What a pass over the timers needs (the context for connectionTimerExpired())
+typedef struct
+{
+    void (*closeConnection)(int socketNum);
+    uint64_t now;
+} ConnTimerRun_t;
+
+// This reactor's pools (send queues grown past INITIAL_LIST_SIZE are slabAllocUnpooled())
+static __thread Slab_t *connectionSlab = NULL;
+static __thread Slab_t *sendQueueSlab = NULL;
+
+static void growSendQueue(Connection_t *conn);
+static void freeSendQueue(Connection_t *conn);
+static void addToPendingFlush(Connection_t *conn);
+static void updateConnectionEvents(Connection_t *conn);
+static int readShmConnection(Connection_t *conn, PDUHandler handler);
+static int dispatchReceived(Connection_t *conn, int received_bytes, PDUHandler handler);
+static void waitForDrain(ConnRef_t *sender, Connection_t *target);
+static void releaseWaiters(Connection_t *target);
+static void pauseReading(ConnRef_t *ref);
+static void resumeReading(ConnRef_t *ref);
+static void broadcastLocal(Reactor_t *reactor, ConnRef_t *sender, PDUSlice_t *pdu);
+static void connectionTimerExpired(Timer_t *timer, void *context);
+static void addQueuedBytes(Connection_t *conn, int bytes);
+static int fillSendIov(Connection_t *conn, struct iovec *iov, int *wanted);
+static void sentBytes(Connection_t *conn, ssize_t sent);
+static void finishFlush(Connection_t *conn);
+static int queueUringSend(Connection_t *conn);
+static int feedConnection(Connection_t *conn, uint8_t *data, int len, PDUHandler handler, int force);
+static void parkReceived(Connection_t *conn, uint8_t *data, int len);
+static void queueResume(Connection_t *conn);
+static int connectionGone(int socketNum, uint32_t connId);
+
+void initConnectionTable()
+{
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur == RLIM_INFINITY)
+    {
+        limit.rlim_cur = 1024 * 1024;
+    }
+    connectionTableSize = (int)limit.rlim_cur;
+    connectionTable = (Connection_t **)sCalloc(connectionTableSize, sizeof(Connection_t *));
+}
+
+void setWriteWatermarks(int high, int low)
+{
+    highWatermark = high;
+    lowWatermark = low;
+}
+
+void setLoginTimeout(int seconds)
+{
+    loginTimeoutMs = seconds * 1000;
+}
+
+// Seconds of silence before a logged in client is pinged, 0 for no keepalives
+void setIdleTimeout(int seconds)
+{
+    idleTimeoutMs = seconds * 1000;
+}
+
+// Monotonic milliseconds, for timeouts
+uint64_t getTimeMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+Connection_t *createConnection(int socketNum)
+{
+    if (socketNum >= connectionTableSize)
+    {
+        LOG_ERROR("Error: socket %d is past the connection table (%d)\n", socketNum, connectionTableSize);
+        return NULL;
+    }
+
+    Reactor_t *reactor = getCurrentReactor();
+    if (connectionSlab == NULL)
+    {
+        connectionSlab = createSlab("connection", sizeof(Connection_t));
+    }
+    Connection_t *conn = (Connection_t *)slabAlloc(connectionSlab);
+    memset(conn, 0, sizeof(Connection_t));
+    conn->socketNum = socketNum;
+    conn->connId = __atomic_fetch_add(&nextConnId, 1, __ATOMIC_RELAXED);
+    conn->reactorId = reactor->reactorId;
+    conn->events = EPOLLIN;
+    conn->flushIndex = -1;
+    conn->lastActivity = getTimeMs();
+    conn->delayTimer.kind = CONN_TIMER_DELAY;
+
+    // Add it to the reactor's own list (broadcasts and stats walk this)
+    if (reactor->numConnections == reactor->connectionsSize)
+    {
+        reactor->connectionsSize = (reactor->connectionsSize == 0) ? INITIAL_LIST_SIZE : reactor->connectionsSize * 2;
+        reactor->connections = srealloc(reactor->connections, reactor->connectionsSize * sizeof(Connection_t *));
+    }
+    conn->localIndex = reactor->numConnections;
+    reactor->connections[reactor->numConnections++] = conn;
+
+    connectionTable[socketNum] = conn;
+    return conn;
+}
+
+Connection_t *getConnection(int socketNum)
+{
+    if (socketNum < 0 || socketNum >= connectionTableSize)
+    {
+        return NULL;
+    }
+    return connectionTable[socketNum];
+}
+
+// The connection a reference points at, if it is still the same one (owning thread only)
+Connection_t *getConnectionByRef(ConnRef_t *ref)
+{
+    Connection_t *conn = getConnection(ref->socketNum);
+
+    if (conn == NULL || conn->connId != ref->connId)
+    {
+        return NULL;
+    }
+    return conn;
+}
+
+void getConnRef(Connection_t *conn, ConnRef_t *ref)
+{
+    ref->socketNum = conn->socketNum;
+    ref->connId = conn->connId;
+    ref->reactorId = conn->reactorId;
+    ref->capabilities = conn->capabilities;
+    ref->nodeId = 0;
+}
+
+void destroyConnection(int socketNum)
+{
+    Connection_t *conn = getConnection(socketNum);
+    if (conn == NULL)
+    {
+        return;
+    }
+
+    // Anyone waiting on us to drain can go again, anyone we were streaming to gets cut off
+    abortAllStreams(conn);
+    releaseWaiters(conn);
+    leaveAllChannels(conn);
+    stopTimer(&getReactor(conn->reactorId)->timers, &conn->timer);
+    stopTimer(&getReactor(conn->reactorId)->timers, &conn->delayTimer);
+
+    if (conn->flushIndex >= 0)
+    {
+        pendingFlush[conn->flushIndex] = NULL;
+    }
+
+    if (conn->listSnapshot != NULL)
+    {
+        releaseHandleSnapshot(conn->listSnapshot);
+    }
+
+    // Drop whatever never got written
+    for (int i = 0; i < conn->sendCount; i++)
+    {
+        releasePDUBuffer(conn->sendQueue[(conn->sendHead + i) % conn->sendQueueSize].pduBuffer);
+    }
+    addQueuedBytes(conn, -conn->queuedBytes);
+    if (conn->recvBuffer != NULL)
+    {
+        releasePDUBuffer(conn->recvBuffer);
+    }
+    if (conn->shm != NULL)
+    {
+        // The client holds the same eventfd, so closing ours wouldn't take it out of the epoll set
+        removeFromEpollSet(conn->shm->wakeFd);
+        shmClose(conn->shm);
+    }
+
+    // Swap the last connection into our slot on the reactor's list
+    Reactor_t *reactor = getReactor(conn->reactorId);
+    Connection_t *last = reactor->connections[--reactor->numConnections];
+    reactor->connections[conn->localIndex] = last;
+    last->localIndex = conn->localIndex;
+
+    connectionTable[socketNum] = NULL;
+    freeSendQueue(conn);
+    free(conn->waiters);
+    free(conn->parked);
+    slabFree(conn);
+}
+
+/*
+-- One non-blocking recv() into the connection's buffer, then dispatch every
+   complete PDU to handler(conn, pdu, pduLen) (same pdu/pduLen as recvPDU())
+-- A partial PDU is moved to the front of the buffer and finished on a later wakeup
+-- The buffer is only held while there's a partial PDU in it
+-- Return value: 0 if the connection is still good
+--               -1 if it was closed by the other side, failed, or sent a bad length
+*/
+int readConnection(Connection_t *conn, PDUHandler handler)
+{
+    if (conn->shm != NULL)
+    {
+        return readShmConnection(conn, handler);
+    }
+    if (conn->recvBuffer == NULL)
+    {
+        conn->recvBuffer = allocPDUBuffer(CONN_RECV_BUFFER_SIZE);
+    }
+
+    int space = CONN_RECV_BUFFER_SIZE - conn->recvLen;
+    int received_bytes = recv(conn->socketNum, conn->recvBuffer->data + conn->recvLen, space, 0);
+    metricAdd(&threadMetrics->syscalls, 1);
+
+    if (received_bytes == 0)
+    {
+        return -1;
+    }
+    if (received_bytes < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        {
+            return 0; // nothing there after all, wait for the next wakeup
+        }
+        if (errno != ECONNRESET)
+        {
+            LOG_ERROR("recv failed: %s\n", strerror(errno));
+        }
+        return -1;
+    }
+    return dispatchReceived(conn, received_bytes, handler);
+}
+
+/*
+-- readConnection() for a shared memory client: copy out of its ring and
+   dispatch, until the ring is empty (and the client will signal the next
+   write) or SHM_READ_PASSES copies have been made
+-- Nothing here tells us the ring has more in it the way a level-triggered
+   socket would, so if it still does we signal ourselves to come back
+-- Return value: 0 if the connection is still good, -1 if the ring is broken
+   or it sent a bad length
+*/
+static int readShmConnection(Connection_t *conn, PDUHandler handler)
+{
+    for (int pass = 0; pass < SHM_READ_PASSES; pass++)
+    {
+        if (conn->readPaused > 0)
+        {
+            return 0; // resumeReading() signals us to pick the rest up
+        }
+        if (conn->recvBuffer == NULL)
+        {
+            conn->recvBuffer = allocPDUBuffer(CONN_RECV_BUFFER_SIZE);
+        }
+
+        int space = CONN_RECV_BUFFER_SIZE - conn->recvLen;
+        int received_bytes = shmRead(conn->shm, conn->recvBuffer->data + conn->recvLen, space);
+
+        if (received_bytes < 0)
+        {
+            LOG_WARN("Socket %d: shared memory ring is corrupt, dropping connection\n", conn->socketNum);
+            return -1;
+        }
+        if (received_bytes == 0)
+        {
+            if (shmArmWakeup(conn->shm))
+            {
+                continue; // written while we were arming
+            }
+            if (conn->recvLen == 0)
+            {
+                releasePDUBuffer(conn->recvBuffer);
+                conn->recvBuffer = NULL;
+            }
+            return 0;
+        }
+        if (dispatchReceived(conn, received_bytes, handler) < 0)
+        {
+            return -1;
+        }
+    }
+
+    shmWakeSelf(conn->shm);
+    return 0;
+}
+
+// received_bytes more just landed in recvBuffer: hand every complete PDU to handler and keep the rest
+static int dispatchReceived(Connection_t *conn, int received_bytes, PDUHandler handler)
+{
+    conn->recvLen += received_bytes;
+    conn->lastActivity = getTimeMs(); // anything at all counts as alive, the idle timer catches up lazily
+    if (conn->pingSent)
+    {
+        // Answered the keepalive: back to waiting out the idle time
+        conn->pingSent = 0;
+        startIdleTimer(conn);
+    }
+
+    int consumed = parsePDUs(conn->recvBuffer->data, conn->recvLen, MAXBUF, handler, conn);
+    if (consumed < 0)
+    {
+        LOG_WARN("Socket %d: invalid PDU length, dropping connection\n", conn->socketNum);
+        return -1;
+    }
+    if (conn->closeAfterRead)
+    {
+        return -1; // shed by ratelimit.c, or a bad login
+    }
+
+    // Keep the leftover partial PDU for next time. If a send queue is still
+    // holding a forwarded PDU out of this buffer, move to a fresh one instead.
+    // Nothing left over, the buffer goes back (send queues may still hold it).
+    if (consumed > 0)
+    {
+        conn->recvLen -= consumed;
+        if (conn->recvLen == 0)
+        {
+            releasePDUBuffer(conn->recvBuffer);
+            conn->recvBuffer = NULL;
+        }
+        else if (__atomic_load_n(&conn->recvBuffer->refCount, __ATOMIC_ACQUIRE) == 1)
+        {
+            memmove(conn->recvBuffer->data, conn->recvBuffer->data + consumed, conn->recvLen);
+        }
+        else
+        {
+            PDUBuffer_t *recvBuffer = allocPDUBuffer(CONN_RECV_BUFFER_SIZE);
+            memcpy(recvBuffer->data, conn->recvBuffer->data + consumed, conn->recvLen);
+            releasePDUBuffer(conn->recvBuffer);
+            conn->recvBuffer = recvBuffer;
+        }
+    }
+    return 0;
+}
+
+int setNonBlocking(int socketNum)
+{
+    int flags = fcntl(socketNum, F_GETFL, 0);
+    if (flags < 0 || fcntl(socketNum, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        LOG_ERROR("fcntl O_NONBLOCK: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// A new connection gets loginTimeoutMs to send its login PDU
+void startLoginTimer(Connection_t *conn)
+{
+    Reactor_t *reactor = getReactor(conn->reactorId);
+
+    startTimer(&reactor->timers, &conn->timer, getTimeMs() + loginTimeoutMs);
+}
+
+// Logged in: from now on the timer watches for the client going quiet
+void startIdleTimer(Connection_t *conn)
+{
+    Reactor_t *reactor = getReactor(conn->reactorId);
+
+    if (idleTimeoutMs == 0)
+    {
+        stopTimer(&reactor->timers, &conn->timer);
+        return;
+    }
+    startTimer(&reactor->timers, &conn->timer, conn->lastActivity + idleTimeoutMs);
+}
+
+/*
+-- Run every connection timer on this reactor that is due
+-- Return value: ms until the next one (the epoll timeout), -1 if none are armed
+*/
+int runConnectionTimers(void (*closeConnection)(int socketNum))
+{
+    Reactor_t *reactor = getCurrentReactor();
+    ConnTimerRun_t run = {closeConnection, getTimeMs()};
+
+    return expireTimers(&reactor->timers, run.now, connectionTimerExpired, &run);
+}
+
+/*
+-- A connection's timer went off
+-- Not logged in yet: the login deadline passed, close it
+-- Logged in: if nothing has come in for idleTimeoutMs send a keepalive ping,
+   and if the ping isn't answered within PING_TIMEOUT_MS close it. The timer
+   isn't touched on every PDU, when it goes off early it is just pushed back.
+*/
+static void connectionTimerExpired(Timer_t *timer, void *context)
+{
+    ConnTimerRun_t *run = (ConnTimerRun_t *)context;
+
+    if (timer->kind == CONN_TIMER_DELAY)
+    {
+        Connection_t *conn = (Connection_t *)((char *)timer - offsetof(Connection_t, delayTimer));
+        conn->readPaused--;
+        updateConnectionEvents(conn);
+        return;
+    }
+
+    Connection_t *conn = (Connection_t *)((char *)timer - offsetof(Connection_t, timer));
+    Reactor_t *reactor = getReactor(conn->reactorId);
+
+    if (conn->state == CONN_AWAITING_LOGIN)
+    {
+        LOG_INFO("Socket %d: no login after %d ms, closing\n", conn->socketNum, loginTimeoutMs);
+        run->closeConnection(conn->socketNum);
+        return;
+    }
+
+    if (run->now - conn->lastActivity < (uint64_t)idleTimeoutMs)
+    {
+        // Heard from it since the timer was set
+        startTimer(&reactor->timers, &conn->timer, conn->lastActivity + idleTimeoutMs);
+    }
+    else if (!conn->pingSent)
+    {
+        uint8_t ping = KEEPALIVE_PING_FLAG;
+
+        LOG_DEBUG("Socket %d: idle for %d ms, sending keepalive\n", conn->socketNum, idleTimeoutMs);
+        queuePDU(conn, &ping, 1);
+        conn->pingSent = 1;
+        startTimer(&reactor->timers, &conn->timer, run->now + PING_TIMEOUT_MS);
+    }
+    else
+    {
+        LOG_INFO("Socket %d: no answer to keepalive, closing\n", conn->socketNum);
+        run->closeConnection(conn->socketNum);
+    }
+}
+
+/*
+-- Stop reading conn until untilMs (ratelimit.c shedding by delay)
+-- A hold that already runs past untilMs is left alone, a shorter one is stretched
+*/
+void delayReading(Connection_t *conn, uint64_t untilMs)
+{
+    Reactor_t *reactor = getReactor(conn->reactorId);
+
+    if (timerPending(&conn->delayTimer))
+    {
+        if (conn->delayTimer.expires * TIMER_TICK_MS >= untilMs)
+        {
+            return;
+        }
+    }
+    else
+    {
+        conn->readPaused++;
+        updateConnectionEvents(conn);
+    }
+    startTimer(&reactor->timers, &conn->delayTimer, untilMs);
+}
+
+// Read TCP clients through the reactor's io_uring instead of epoll (-E uring, before the reactors start)
+void setUringBackend(int enabled)
+{
+    useUring = enabled;
+}
+
+// A new (or restored) TCP client, io_uring backend: start its multishot recv
+void startReceiving(Connection_t *conn)
+{
+    if (!useUring || conn->shm != NULL || conn->recvArmed || conn->readPaused > 0 || receivingStopped)
+    {
+        return;
+    }
+    if (uringRecv(conn->socketNum, conn->connId) < 0)
+    {
+        queueResume(conn); // the ring is full, the next pass starts it
+        return;
+    }
+    conn->recvArmed = 1;
+}
+
+/*
+-- A multishot recv completion for conn: res bytes at data, or res <= 0 for
+   why it stopped. more is whether the recv keeps going after this one.
+-- The bytes are copied into the receive buffer and dispatched to handler
+   the same as readConnection() does, unless reading is paused (or older
+   bytes are still parked), in which case they're parked until it resumes
+-- Return value: 0 if the connection is still good (or was closed by the
+   handler), -1 if it was closed by the other side, failed, or sent a bad length
+*/
+int receivedConnection(Connection_t *conn, uint8_t *data, int res, int more, PDUHandler handler)
+{
+    int socketNum = conn->socketNum;
+    uint32_t connId = conn->connId;
+
+    if (!more)
+    {
+        conn->recvArmed = 0;
+        conn->recvCancelling = 0;
+    }
+    if (res == 0)
+    {
+        return -1;
+    }
+    if (res < 0)
+    {
+        if (res != -ECANCELED && res != -ENOBUFS)
+        {
+            if (res != -ECONNRESET)
+            {
+                LOG_ERROR("recv failed: %s\n", strerror(-res));
+            }
+            return -1;
+        }
+    }
+    else if (conn->readPaused > 0 || conn->parkedLen > 0)
+    {
+        parkReceived(conn, data, res);
+    }
+    else if (feedConnection(conn, data, res, handler, 0) < 0)
+    {
+        return -1;
+    }
+
+    if (!more && !connectionGone(socketNum, connId))
+    {
+        queueResume(conn); // cancelled, out of buffers or done with its last bytes: start it again once it can go
+    }
+    return 0;
+}
+
+/*
+-- Start of a pass (io_uring backend): every connection that came off a
+   pause (or whose recv stopped) gets what's parked for it handled, then its
+   recv started again if it's still not paused
+*/
+void resumeConnections(PDUHandler handler, void (*closeConnection)(int socketNum))
+{
+    if (numResume == 0 || receivingStopped)
+    {
+        return;
+    }
+
+    // Handling parked bytes can queue more, they wait for the next pass
+    ConnRef_t *resuming = resumeList;
+    int numResuming = numResume;
+    resumeList = NULL;
+    numResume = 0;
+    resumeListSize = 0;
+
+    for (int i = 0; i < numResuming; i++)
+    {
+        Connection_t *conn = getConnectionByRef(&resuming[i]);
+        if (conn == NULL)
+        {
+            continue;
+        }
+        conn->resumeQueued = 0;
+        if (conn->readPaused > 0)
+        {
+            updateConnectionEvents(conn); // a cancel the ring had no room for goes again
+            continue; // back on the list when it resumes
+        }
+
+        if (conn->parkedLen > 0)
+        {
+            // Taken off the connection first, so whatever a new pause leaves over is parked again in order
+            uint8_t *parked = conn->parked;
+            int parkedLen = conn->parkedLen;
+            conn->parked = NULL;
+            conn->parkedLen = 0;
+            conn->parkedSize = 0;
+
+            int status = feedConnection(conn, parked, parkedLen, handler, 0);
+            free(parked);
+            if (status < 0)
+            {
+                closeConnection(resuming[i].socketNum);
+                continue;
+            }
+            if (connectionGone(resuming[i].socketNum, resuming[i].connId))
+            {
+                continue;
+            }
+        }
+        if (conn->parkedLen == 0)
+        {
+            startReceiving(conn);
+        }
+    }
+    free(resuming);
+}
+
+// Anything for resumeConnections() to do? Then the next wait can't block.
+int resumePending()
+{
+    return numResume > 0 && !receivingStopped;
+}
+
+// A handoff is starting (io_uring backend): nothing is started or resumed until restartReceiving()
+void stopReceiving()
+{
+    receivingStopped = 1;
+}
+
+/*
+-- A handoff, once every recv has finished: whatever is parked on this
+   reactor's connections is handled now, paused or not, so all that's left
+   over is the partial PDU in each receive buffer
+*/
+void handleParked(PDUHandler handler, void (*closeConnection)(int socketNum))
+{
+    Reactor_t *reactor = getCurrentReactor();
+
+    for (int i = 0; i < reactor->numConnections; i++)
+    {
+        Connection_t *conn = reactor->connections[i];
+        if (conn->parkedLen == 0)
+        {
+            continue;
+        }
+
+        int socketNum = conn->socketNum;
+        uint8_t *parked = conn->parked;
+        int parkedLen = conn->parkedLen;
+        conn->parked = NULL;
+        conn->parkedLen = 0;
+        conn->parkedSize = 0;
+
+        int status = feedConnection(conn, parked, parkedLen, handler, 1);
+        free(parked);
+        if (status < 0)
+        {
+            closeConnection(socketNum);
+        }
+        if (getConnection(socketNum) != conn)
+        {
+            i--; // closed, the last connection was swapped into its slot
+        }
+    }
+}
+
+// The handoff didn't happen: read every client again
+void restartReceiving()
+{
+    Reactor_t *reactor = getCurrentReactor();
+
+    receivingStopped = 0;
+    for (int i = 0; i < reactor->numConnections; i++)
+    {
+        startReceiving(reactor->connections[i]);
+    }
+}
+
+/*
+-- Copy len bytes into the receive buffer a buffer's worth at a time and dispatch them
+-- Stops (and parks the rest) if handling them paused the connection, unless force
+-- Return value: 0 (also if the handler closed it), -1 if it sent a bad length
+*/
+static int feedConnection(Connection_t *conn, uint8_t *data, int len, PDUHandler handler, int force)
+{
+    int socketNum = conn->socketNum;
+    uint32_t connId = conn->connId;
+
+    while (len > 0)
+    {
+        if (conn->readPaused > 0 && !force)
+        {
+            parkReceived(conn, data, len);
+            return 0;
+        }
+        if (conn->recvBuffer == NULL)
+        {
+            conn->recvBuffer = allocPDUBuffer(CONN_RECV_BUFFER_SIZE);
+        }
+
+        int space = CONN_RECV_BUFFER_SIZE - conn->recvLen;
+        int chunk = (len < space) ? len : space;
+        memcpy(conn->recvBuffer->data + conn->recvLen, data, chunk);
+        if (dispatchReceived(conn, chunk, handler) < 0)
+        {
+            return -1;
+        }
+        if (connectionGone(socketNum, connId))
+        {
+            return 0;
+        }
+        data += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+static void parkReceived(Connection_t *conn, uint8_t *data, int len)
+{
+    if (conn->parkedLen + len > conn->parkedSize)
+    {
+        conn->parkedSize = (conn->parkedLen + len) * 2;
+        conn->parked = srealloc(conn->parked, conn->parkedSize);
+    }
+    memcpy(conn->parked + conn->parkedLen, data, len);
+    conn->parkedLen += len;
+}
+
+static void queueResume(Connection_t *conn)
+{
+    if (conn->resumeQueued)
+    {
+        return;
+    }
+    if (numResume == resumeListSize)
+    {
+        resumeListSize = (resumeListSize == 0) ? INITIAL_LIST_SIZE : resumeListSize * 2;
+        resumeList = srealloc(resumeList, resumeListSize * sizeof(ConnRef_t));
+    }
+    getConnRef(conn, &resumeList[numResume++]);
+    conn->resumeQueued = 1;
+}
+
+// Did a handler close the connection that was at socketNum?
+static int connectionGone(int socketNum, uint32_t connId)
+{
+    Connection_t *conn = getConnection(socketNum);
+
+    return conn == NULL || conn->connId != connId;
+}
+
+/*
+-- Same arguments as sendPDU(), but the PDU (with its 2 byte length) is put on
+   the connection's send queue and written at the next flush
+-- Return value: number of data bytes queued (not including the 2 byte length)
+*/
+int queuePDU(Connection_t *conn, uint8_t *dataBuffer, int lengthOfData)
+{
+    PDUBuffer_t *pduBuffer = createPDUBuffer(dataBuffer, lengthOfData);
+
+    queuePDUBuffer(conn, pduBuffer);
+    releasePDUBuffer(pduBuffer); // the send queue holds the only reference now
+    return lengthOfData;
+}
+
+// Put a reference to an already built PDU on the send queue (fan-out shares one buffer)
+int queuePDUBuffer(Connection_t *conn, PDUBuffer_t *pduBuffer)
+{
+    PDUSlice_t pdu = {pduBuffer, pduBuffer->data, pduBuffer->len};
+
+    return queuePDUSlice(conn, &pdu);
+}
+
+// Queue a wire PDU that lives inside a shared buffer (taking a reference to the buffer)
+int queuePDUSlice(Connection_t *conn, PDUSlice_t *pdu)
+{
+    if (conn->sendCount == conn->sendQueueSize)
+    {
+        growSendQueue(conn);
+    }
+
+    retainPDUBuffer(pdu->pduBuffer);
+    conn->sendQueue[(conn->sendHead + conn->sendCount) % conn->sendQueueSize] = *pdu;
+
+    conn->sendCount++;
+    addQueuedBytes(conn, pdu->len);
+
+    conn->stats.pdusQueued++;
+    conn->stats.bytesQueued += pdu->len;
+    if (conn->sendCount > conn->stats.peakQueueDepth)
+    {
+        conn->stats.peakQueueDepth = conn->sendCount;
+    }
+    if (conn->queuedBytes > conn->stats.peakQueuedBytes)
+    {
+        conn->stats.peakQueuedBytes = conn->queuedBytes;
+    }
+
+    addToPendingFlush(conn);
+    return pdu->len - 2;
+}
+
+// queuePDU() by socket number, for replies that don't come from another client
+int queueSendPDU(int socketNum, uint8_t *dataBuffer, int lengthOfData)
+{
+    Connection_t *conn = getConnection(socketNum);
+    if (conn == NULL)
+    {
+        LOG_ERROR("Error: no connection for socket %d\n", socketNum);
+        return -1;
+    }
+    return queuePDU(conn, dataBuffer, lengthOfData);
+}
+
+/*
+-- Queue a PDU from sender for the client dest refers to, wherever it lives
+-- Local clients get it on their send queue now, a client on another reactor
+   gets it through that reactor's inbox
+-- If the destination's queue is over the high watermark, sender stops being read
+*/
+void deliverPDUBuffer(Connection_t *sender, ConnRef_t *dest, PDUBuffer_t *pduBuffer)
+{
+    PDUSlice_t pdu = {pduBuffer, pduBuffer->data, pduBuffer->len};
+
+    deliverPDUSlice(sender, dest, &pdu);
+}
+
+void deliverPDUSlice(Connection_t *sender, ConnRef_t *dest, PDUSlice_t *pdu)
+{
+    if (dest->nodeId != 0)
+    {
+        // A client of another cluster node, its node passes it on
+        clusterDeliver(dest, pdu);
+        return;
+    }
+
+    ConnRef_t senderRef;
+    getConnRef(sender, &senderRef);
+
+    if (dest->reactorId == sender->reactorId)
+    {
+        Connection_t *target = getConnectionByRef(dest);
+        if (target != NULL)
+        {
+            queueFromSender(&senderRef, target, pdu);
+        }
+        return;
+    }
+
+    postToReactor(dest->reactorId, createInboxMessage(INBOX_DELIVER, dest, &senderRef, pdu));
+}
+
+/*
+-- Pass a PDU sender just sent us on to dest exactly as it came in, without copying it
+-- pdu/pduLen are what readConnection()'s handler was given (the 2 byte length is
+   right in front of pdu in the receive buffer, and goes out with it)
+*/
+void forwardReceivedPDU(Connection_t *sender, ConnRef_t *dest, uint8_t *pdu, int pduLen)
+{
+    PDUSlice_t slice = {sender->recvBuffer, pdu - 2, pduLen + 2};
+
+    deliverPDUSlice(sender, dest, &slice);
+}
+
+// Queue a PDU for every logged in client except the sender, on every reactor
+void broadcastPDUBuffer(Connection_t *sender, PDUBuffer_t *pduBuffer)
+{
+    PDUSlice_t pdu = {pduBuffer, pduBuffer->data, pduBuffer->len};
+    ConnRef_t senderRef;
+    getConnRef(sender, &senderRef);
+
+    // One inbox message per other reactor, each fans out to its own clients
+    for (int i = 0; i < getNumReactors(); i++)
+    {
+        if (i != sender->reactorId)
+        {
+            postToReactor(i, createInboxMessage(INBOX_BROADCAST, NULL, &senderRef, &pdu));
+        }
+    }
+
+    broadcastLocal(getReactor(sender->reactorId), &senderRef, &pdu);
+    clusterBroadcast(&pdu);
+}
+
+// Work another reactor handed us (called from drainInbox() on the owning thread)
+void handleInboxMessage(InboxMessage_t *message)
+{
+    Connection_t *conn = NULL;
+
+    metricAdd(&threadMetrics->inboxMessages, 1);
+    switch (message->type)
+    {
+    case INBOX_DELIVER:
+        if ((conn = getConnectionByRef(&message->dest)) != NULL)
+        {
+            queueFromSender(&message->sender, conn, &message->pdu);
+        }
+        break;
+    case INBOX_BROADCAST:
+        broadcastLocal(getCurrentReactor(), &message->sender, &message->pdu);
+        break;
+    case INBOX_CHANNEL:
+        channelFanOutLocal(message);
+        break;
+    case INBOX_PAUSE:
+        pauseReading(&message->dest);
+        break;
+    case INBOX_RESUME:
+        resumeReading(&message->dest);
+        break;
+    default:
+        LOG_ERROR("Unknown inbox message type %d\n", message->type);
+        break;
+    }
+}
+
+/*
+-- writev() as much of the send queue as the socket will take
+-- Leaves EPOLLOUT armed while anything is still queued
+-- Return value: 0 if the connection is still good, -1 if the write failed
+*/
+int flushConnection(Connection_t *conn)
+{
+    if (conn->sendInFlight)
+    {
+        return 0; // the ring has the head of the queue, sendCompleted() carries on from there
+    }
+    if (conn->sendCount > 0)
+    {
+        metricRecord(&threadMetrics->queueBytes, conn->queuedBytes);
+    }
+    while (conn->sendCount > 0)
+    {
+        struct iovec iov[CONN_MAX_IOV];
+        int wanted = 0;
+        int numIov = fillSendIov(conn, iov, &wanted);
+
+        ssize_t sent;
+        if (conn->shm != NULL)
+        {
+            // A full ring is a short write, the client signals once it has read some
+            sent = shmWrite(conn->shm, iov, numIov);
+            if (sent < 0)
+            {
+                LOG_WARN("Socket %d: shared memory ring is corrupt\n", conn->socketNum);
+                return -1;
+            }
+        }
+        else
+        {
+            sent = writev(conn->socketNum, iov, numIov);
+            metricAdd(&threadMetrics->syscalls, 1);
+            if (sent < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    break;
+                }
+                if (errno != EPIPE && errno != ECONNRESET)
+                {
+                    LOG_ERROR("writev failed: %s\n", strerror(errno));
+                }
+                return -1;
+            }
+        }
+
+        sentBytes(conn, sent);
+        if (sent < wanted)
+        {
+            break; // socket buffer is full, the next writev() would just say EAGAIN
+        }
+    }
+
+    finishFlush(conn);
+    return 0;
+}
+
+/*
+-- Called once per event loop pass so every PDU queued for a client in that pass goes out in one writev()
+-- With the io_uring backend a TCP client's writev() is a sendmsg prepared on
+   the ring instead, they all go in with the next uringCall()
+*/
+void flushPendingConnections(void (*closeConnection)(int socketNum))
+{
+    int numKept = 0;
+
+    for (int i = 0; i < numPendingFlush; i++)
+    {
+        Connection_t *conn = pendingFlush[i];
+        if (conn == NULL)
+        {
+            continue; // destroyed after it was queued to
+        }
+
+        conn->flushIndex = -1;
+        if (useUring && conn->shm == NULL && !receivingStopped)
+        {
+            if (queueUringSend(conn) < 0)
+            {
+                conn->flushIndex = numKept; // the ring is full, it stays on the list for the next pass
+                pendingFlush[numKept++] = conn;
+            }
+        }
+        else if (flushConnection(conn) < 0)
+        {
+            closeConnection(conn->socketNum);
+        }
+    }
+    numPendingFlush = numKept;
+}
+
+/*
+-- A sendmsg of conn's queue came back (io_uring backend): res bytes went out, or -errno
+-- A full socket arms POLLOUT (connectionWritable()), a send that took all it
+   was given with more still queued goes again next pass
+-- Return value: 0 if the connection is still good, -1 if the write failed
+*/
+int sendCompleted(Connection_t *conn, int res)
+{
+    conn->sendInFlight = 0;
+    if (res < 0)
+    {
+        if (res != -EAGAIN && res != -EWOULDBLOCK && res != -EINTR)
+        {
+            if (res != -EPIPE && res != -ECONNRESET)
+            {
+                LOG_ERROR("send failed: %s\n", strerror(-res));
+            }
+            return -1;
+        }
+        res = 0;
+    }
+
+    sentBytes(conn, res);
+    if (res == conn->sendWanted && conn->sendCount > 0)
+    {
+        addToPendingFlush(conn);
+    }
+    finishFlush(conn);
+    return 0;
+}
+
+// POLLOUT came back (io_uring backend), what's queued can go at the next flush
+void connectionWritable(Connection_t *conn)
+{
+    conn->writeArmed = 0;
+    if (conn->sendCount > 0)
+    {
+        addToPendingFlush(conn);
+    }
+}
+
+// Dump the send queue numbers for the connections this reactor owns
+void printConnectionStats(FILE *out)
+{
+    Reactor_t *reactor = getCurrentReactor();
+
+    flockfile(out);
+    fprintf(out, "reactor %d: %d connections\n", reactor->reactorId, reactor->numConnections);
+    fprintf(out, "%-6s %-20s %7s %9s %7s %9s %10s %12s %10s %7s %6s %7s\n",
+            "socket", "handle", "queued", "qbytes", "peak", "peakbytes",
+            "pdus", "bytesout", "writevs", "backpr", "paused", "limited");
+
+    for (int i = 0; i < reactor->numConnections; i++)
+    {
+        Connection_t *conn = reactor->connections[i];
+
+        fprintf(out, "%-6d %-20s %7d %9d %7d %9d %10llu %12llu %10llu %7u %6d %7u\n",
+                conn->socketNum, conn->state == CONN_LOGGED_IN ? conn->handle : "-", conn->sendCount, conn->queuedBytes,
+                conn->stats.peakQueueDepth, conn->stats.peakQueuedBytes,
+                (unsigned long long)conn->stats.pdusQueued,
+                (unsigned long long)conn->stats.bytesWritten,
+                (unsigned long long)conn->stats.writevCalls,
+                conn->stats.backpressureEvents, conn->readPaused, conn->stats.rateLimited);
+    }
+    fflush(out);
+    funlockfile(out);
+}
+
+static void addToPendingFlush(Connection_t *conn)
+{
+    if (conn->flushIndex >= 0)
+    {
+        return; // already going out this pass
+    }
+
+    if (numPendingFlush == pendingFlushSize)
+    {
+        pendingFlushSize = (pendingFlushSize == 0) ? INITIAL_LIST_SIZE : pendingFlushSize * 2;
+        pendingFlush = srealloc(pendingFlush, pendingFlushSize * sizeof(Connection_t *));
+    }
+
+    conn->flushIndex = numPendingFlush;
+    pendingFlush[numPendingFlush++] = conn;
+}
+
+// Re-register the socket if what we want from it (read, write) changed
+static void updateConnectionEvents(Connection_t *conn)
+{
+    uint32_t events = 0;
+
+    if (conn->shm != NULL)
+    {
+        // Its eventfd stays registered for good. Coming off a pause, the ring
+        // may be holding data the client won't signal about again.
+        if (conn->readPaused == 0 && conn->events == 0)
+        {
+            shmWakeSelf(conn->shm);
+        }
+        conn->events = (conn->readPaused == 0) ? EPOLLIN : 0;
+        return;
+    }
+
+    if (useUring)
+    {
+        // Paused: stop the recv (what it already has is parked). Going again
+        // (or it ran out of buffers): the resume list restarts it next pass.
+        if (conn->readPaused > 0)
+        {
+            if (conn->recvArmed && !conn->recvCancelling)
+            {
+                if (uringCancelRecv(conn->socketNum, conn->connId) < 0)
+                {
+                    queueResume(conn); // the ring is full, tried again next pass (what comes in meanwhile is parked)
+                }
+                else
+                {
+                    conn->recvCancelling = 1;
+                }
+            }
+        }
+        else if (!conn->recvArmed || conn->parkedLen > 0)
+        {
+            queueResume(conn);
+        }
+        // A queue the next flush isn't going to try waits for room
+        if (conn->sendCount > 0 && !conn->sendInFlight && !conn->writeArmed && conn->flushIndex < 0 &&
+            !receivingStopped)
+        {
+            if (uringWaitWritable(conn->socketNum, conn->connId) < 0)
+            {
+                addToPendingFlush(conn); // the ring is full, the next flush tries the send instead
+            }
+            else
+            {
+                conn->writeArmed = 1;
+            }
+        }
+        return;
+    }
+
+    if (conn->readPaused == 0)
+    {
+        events |= EPOLLIN;
+    }
+    if (conn->sendCount > 0)
+    {
+        events |= EPOLLOUT;
+    }
+
+    if (events != conn->events)
+    {
+        modifyEpollSet(conn->socketNum, events);
+        metricAdd(&threadMetrics->syscalls, 1);
+        conn->events = events;
+    }
+}
+
+// Queue for target and pause sender if that put target over the high watermark (owning thread of target)
+void queueFromSender(ConnRef_t *sender, Connection_t *target, PDUSlice_t *pdu)
+{
+    queuePDUSlice(target, pdu);
+
+    // A sender on another cluster node can't be paused from here
+    if (sender->connId != target->connId && sender->nodeId == 0 && target->queuedBytes > highWatermark)
+    {
+        waitForDrain(sender, target);
+    }
+}
+
+static void waitForDrain(ConnRef_t *sender, Connection_t *target)
+{
+    for (int i = 0; i < target->numWaiters; i++)
+    {
+        if (target->waiters[i].connId == sender->connId)
+        {
+            return; // already waiting on this one
+        }
+    }
+
+    if (target->numWaiters == target->waitersSize)
+    {
+        target->waitersSize = (target->waitersSize == 0) ? INITIAL_LIST_SIZE : target->waitersSize * 2;
+        target->waiters = srealloc(target->waiters, target->waitersSize * sizeof(ConnRef_t));
+    }
+    target->waiters[target->numWaiters++] = *sender;
+    target->stats.backpressureEvents++;
+
+    pauseReading(sender);
+}
+
+static void releaseWaiters(Connection_t *target)
+{
+    for (int i = 0; i < target->numWaiters; i++)
+    {
+        resumeReading(&target->waiters[i]);
+    }
+    target->numWaiters = 0;
+}
+
+// Stop reading a connection, or ask its reactor to
+static void pauseReading(ConnRef_t *ref)
+{
+    if (ref->reactorId != getCurrentReactor()->reactorId)
+    {
+        postToReactor(ref->reactorId, createInboxMessage(INBOX_PAUSE, ref, NULL, NULL));
+        return;
+    }
+
+    // it may have closed (and the socket number been reused) since
+    Connection_t *conn = getConnectionByRef(ref);
+    if (conn != NULL)
+    {
+        conn->readPaused++;
+        updateConnectionEvents(conn);
+    }
+}
+
+static void resumeReading(ConnRef_t *ref)
+{
+    if (ref->reactorId != getCurrentReactor()->reactorId)
+    {
+        postToReactor(ref->reactorId, createInboxMessage(INBOX_RESUME, ref, NULL, NULL));
+        return;
+    }
+
+    Connection_t *conn = getConnectionByRef(ref);
+    if (conn != NULL && conn->readPaused > 0)
+    {
+        conn->readPaused--;
+        updateConnectionEvents(conn);
+    }
+}
+
+static void broadcastLocal(Reactor_t *reactor, ConnRef_t *sender, PDUSlice_t *pdu)
+{
+    for (int i = 0; i < reactor->numConnections; i++)
+    {
+        Connection_t *conn = reactor->connections[i];
+
+        if (conn->state == CONN_LOGGED_IN && conn->connId != sender->connId)
+        {
+            queueFromSender(sender, conn, pdu);
+        }
+    }
+}
+
+// Keep the connection's and its reactor's queued byte counts together (owning thread only)
+static void addQueuedBytes(Connection_t *conn, int bytes)
+{
+    Reactor_t *reactor = getReactor(conn->reactorId);
+
+    conn->queuedBytes += bytes;
+    __atomic_store_n(&reactor->queuedBytes, reactor->queuedBytes + bytes, __ATOMIC_RELAXED);
+}
+
+// As much of the send queue as one write takes (CONN_MAX_IOV PDUs). Return value: iovecs filled in, wanted is their bytes.
+static int fillSendIov(Connection_t *conn, struct iovec *iov, int *wanted)
+{
+    int numIov = 0;
+
+    *wanted = 0;
+    for (int i = 0; i < conn->sendCount && numIov < CONN_MAX_IOV; i++)
+    {
+        OutBuffer_t *out = &conn->sendQueue[(conn->sendHead + i) % conn->sendQueueSize];
+        int skip = (i == 0) ? conn->sendOffset : 0;
+
+        iov[numIov].iov_base = out->data + skip;
+        iov[numIov].iov_len = out->len - skip;
+        *wanted += out->len - skip;
+        numIov++;
+    }
+    return numIov;
+}
+
+// sent bytes off the front of the send queue went out: count them and drop every PDU that went completely
+static void sentBytes(Connection_t *conn, ssize_t sent)
+{
+    conn->stats.writevCalls++;
+    conn->stats.bytesWritten += sent;
+    addQueuedBytes(conn, -sent);
+    metricAdd(&threadMetrics->writevCalls, 1);
+    metricAdd(&threadMetrics->bytesOut, sent);
+
+    ssize_t left = sent;
+    while (left > 0)
+    {
+        OutBuffer_t *out = &conn->sendQueue[conn->sendHead];
+        int remaining = out->len - conn->sendOffset;
+
+        if (left < remaining)
+        {
+            conn->sendOffset += left;
+            break;
+        }
+
+        left -= remaining;
+        releasePDUBuffer(out->pduBuffer);
+        out->pduBuffer = NULL;
+        metricAdd(&threadMetrics->pdusOut, 1);
+        conn->sendOffset = 0;
+        conn->sendHead = (conn->sendHead + 1) % conn->sendQueueSize;
+        conn->sendCount--;
+    }
+}
+
+// After a write: give back an idle ring, wait for room if anything's left, let the senders go once it's drained
+static void finishFlush(Connection_t *conn)
+{
+    if (conn->sendCount == 0 && conn->sendQueueSize == INITIAL_LIST_SIZE)
+    {
+        // Idle again, the ring goes back to the slab. One that grew for a
+        // backed up client is kept so the next burst doesn't malloc() again.
+        freeSendQueue(conn);
+    }
+    updateConnectionEvents(conn);
+
+    if (conn->numWaiters > 0 && conn->queuedBytes <= lowWatermark)
+    {
+        releaseWaiters(conn);
+    }
+}
+
+/*
+-- flushConnection() for the io_uring backend: one sendmsg of the queue's head, submitted with the rest of the pass's
+-- Return value: 0, or -1 if the ring had no room for it and it has to wait for the next pass
+*/
+static int queueUringSend(Connection_t *conn)
+{
+    if (conn->sendInFlight || conn->writeArmed || conn->sendCount == 0)
+    {
+        return 0; // one at a time, and a full socket goes again once POLLOUT says so
+    }
+
+    struct iovec iov[CONN_MAX_IOV];
+    int numIov = fillSendIov(conn, iov, &conn->sendWanted);
+    if (uringSend(conn->socketNum, conn->connId, iov, numIov) < 0)
+    {
+        return -1;
+    }
+    metricRecord(&threadMetrics->queueBytes, conn->queuedBytes);
+    conn->sendInFlight = 1;
+    return 0;
+}
+
+static void growSendQueue(Connection_t *conn)
+{
+    int newSize = (conn->sendQueueSize == 0) ? INITIAL_LIST_SIZE : conn->sendQueueSize * 2;
+    OutBuffer_t *newQueue;
+
+    if (newSize == INITIAL_LIST_SIZE)
+    {
+        if (sendQueueSlab == NULL)
+        {
+            sendQueueSlab = createSlab("sendQueue", INITIAL_LIST_SIZE * sizeof(OutBuffer_t));
+        }
+        newQueue = (OutBuffer_t *)slabAlloc(sendQueueSlab);
+    }
+    else
+    {
+        newQueue = (OutBuffer_t *)slabAllocUnpooled(newSize * sizeof(OutBuffer_t));
+    }
+
+    // unwrap the ring into the new array
+    for (int i = 0; i < conn->sendCount; i++)
+    {
+        newQueue[i] = conn->sendQueue[(conn->sendHead + i) % conn->sendQueueSize];
+    }
+
+    if (conn->sendQueue != NULL)
+    {
+        slabFree(conn->sendQueue);
+    }
+    conn->sendQueue = newQueue;
+    conn->sendQueueSize = newSize;
+    conn->sendHead = 0;
+}
+
+static void freeSendQueue(Connection_t *conn)
+{
+    if (conn->sendQueue != NULL)
+    {
+        slabFree(conn->sendQueue);
+    }
+    conn->sendQueue = NULL;
+    conn->sendQueueSize = 0;
+    conn->sendHead = 0;
+}
@@ -0,0 +1,182 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "shared.h"
+#include "sendreceive.h"
+#include "pduBuffer.h"
+#include "handle_table.h"
+#include "reactor.h"
+#include "handleList.h"
+#include "shmRing.h"
+
+// Room for a few full PDUs so one recv() can pick up a burst of them
+#define CONN_RECV_BUFFER_SIZE (4 * MAXBUF)
+
+// Most PDUs handed to one writev()
+#define CONN_MAX_IOV 64
+
+// Most times one wakeup reads a shared memory client's ring before letting
+// the other clients have a turn
+#define SHM_READ_PASSES 16
+
+// Default send queue watermarks (bytes): senders to a client whose queue is
+// over the high mark stop being read until that queue drains below the low mark
+#define DEFAULT_HIGH_WATERMARK (256 * 1024)
+#define DEFAULT_LOW_WATERMARK (64 * 1024)
+
+// One queued outbound PDU (a slice holding a reference that is dropped once it is written)
+typedef PDUSlice_t OutBuffer_t;
+
+// Send queue numbers for the stats dump
+typedef struct
+{
+    uint64_t pdusQueued;
+    uint64_t bytesQueued;
+    uint64_t writevCalls;
+    uint64_t bytesWritten;
+    int peakQueueDepth;
+    int peakQueuedBytes;
+    uint32_t backpressureEvents; // times a sender was paused because of this connection
+    uint32_t rateLimited;        // PDUs from it rejected, delayed or cut off by ratelimit.c
+} ConnectionStats_t;
+
+// Token bucket (ratelimit.c), in thousandths of a token so a millisecond's refill isn't rounded away
+typedef struct
+{
+    int64_t tokens;
+    uint64_t refilledMs;
+} RateBucket_t;
+
+// A channel this connection is in, and where it sits in that channel's member array
+typedef struct
+{
+    struct Channel *channel;
+    int index;
+} ChannelMembership_t;
+
+// Default seconds a new connection gets to send its login PDU
+#define DEFAULT_LOGIN_TIMEOUT 10
+
+// Default seconds a logged in client can be silent before it's sent a
+// keepalive ping, and how long it then has to answer before it's closed
+#define DEFAULT_IDLE_TIMEOUT 60
+#define PING_TIMEOUT_MS (10 * 1000)
+
+// Timer_t kind of a connection's two timers
+#define CONN_TIMER_MAIN 0         // login deadline, then idle/keepalive
+#define CONN_TIMER_DELAY 1        // reading held off by delayReading()
+
+typedef enum
+{
+    CONN_AWAITING_LOGIN,   // accepted, the flag 1 PDU hasn't come in (or its handle was taken)
+    CONN_LOGGED_IN         // handle is in the handle table
+} ConnState;
+
+// Per-client state, only ever touched by the reactor thread that owns it
+typedef struct Connection
+{
+    int socketNum;
+    uint32_t connId;                           // unique, so a reused socket number isn't mistaken for this one
+    int reactorId;                             // owning reactor
+    int localIndex;                            // slot in the owning reactor's connection list
+    uint32_t events;                           // what the socket is registered for in the epoll set
+    ShmEndpoint_t *shm;                        // rings of a shared memory client (shmRing.c), NULL for TCP
+
+    ConnState state;
+    int handleLen;
+    char handle[MAX_TABLE_HANDLE_LEN];
+    uint8_t capabilities;                      // LOGIN_CAP_* granted at login
+    Timer_t timer;                             // login deadline, then idle/keepalive (on the reactor's wheel)
+    uint64_t lastActivity;                     // ms (getTimeMs()) anything was last read from the client
+    int pingSent;                              // keepalive sent, waiting for anything to come back
+
+    int recvLen;                               // bytes of partial PDU(s) waiting in recvBuffer
+    PDUBuffer_t *recvBuffer;                   // CONN_RECV_BUFFER_SIZE, shared with send queues forwarding out of it
+
+    OutBuffer_t *sendQueue;                    // ring of PDUs waiting for writev()
+    int sendQueueSize;
+    int sendHead;
+    int sendCount;
+    int sendOffset;                            // bytes of the head PDU already written
+    int queuedBytes;
+    int flushIndex;                            // slot on the pending flush list, -1 if not on it
+
+    int readPaused;                            // number of backed up clients this one is waiting on
+    ConnRef_t *waiters;                        // senders paused because of this client (any reactor)
+    int numWaiters;
+    int waitersSize;
+
+    ChannelMembership_t *channels;             // channels joined (channel.c)
+    int numChannels;
+    int channelsSize;
+
+    struct Stream *streams;                    // messages being streamed out (stream.c), NULL if none
+    int numStreams;
+
+    HandleSnapshot_t *listSnapshot;            // handle list this client is part way through paging, NULL if none
+
+    RateBucket_t messageBucket;                // -R and -B limits, topped up as PDUs come in (ratelimit.c)
+    RateBucket_t byteBucket;
+    Timer_t delayTimer;                        // reading is held off until it goes off (delayReading())
+    uint8_t rateNotified;                      // sent a RATE_LIMITED_FLAG, nothing has got through since
+    uint8_t closeAfterRead;                    // shed by disconnecting or a bad login, closed once this read is done
+
+    // io_uring backend (-E uring) only, a TCP client's requests on the reactor's ring
+    uint8_t recvArmed;                         // multishot recv running, until its last completion
+    uint8_t recvCancelling;                    // paused, asked the recv to stop
+    uint8_t sendInFlight;                      // a send of the queue's head is submitted, those bytes aren't ours to move
+    uint8_t writeArmed;                        // POLLOUT armed, the socket was full
+    uint8_t resumeQueued;                      // on the reactor's list to be read again
+    int sendWanted;                            // bytes in that send
+    uint8_t *parked;                           // received while reading was paused, handled before anything newer
+    int parkedLen;
+    int parkedSize;
+
+    ConnectionStats_t stats;
+} Connection_t;
+
+void initConnectionTable();
+void setWriteWatermarks(int high, int low);
+void setLoginTimeout(int seconds);
+void setIdleTimeout(int seconds);
+uint64_t getTimeMs();
+Connection_t *createConnection(int socketNum);
+Connection_t *getConnection(int socketNum);
+Connection_t *getConnectionByRef(ConnRef_t *ref);
+void getConnRef(Connection_t *conn, ConnRef_t *ref);
+void destroyConnection(int socketNum);
+int readConnection(Connection_t *conn, PDUHandler handler);
+int setNonBlocking(int socketNum);
+void startLoginTimer(Connection_t *conn);
+void startIdleTimer(Connection_t *conn);
+int runConnectionTimers(void (*closeConnection)(int socketNum));
+void delayReading(Connection_t *conn, uint64_t untilMs);
+void setUringBackend(int enabled);
+void startReceiving(Connection_t *conn);
+int receivedConnection(Connection_t *conn, uint8_t *data, int res, int more, PDUHandler handler);
+void resumeConnections(PDUHandler handler, void (*closeConnection)(int socketNum));
+int resumePending();
+int sendCompleted(Connection_t *conn, int res);
+void connectionWritable(Connection_t *conn);
+void stopReceiving();
+void handleParked(PDUHandler handler, void (*closeConnection)(int socketNum));
+void restartReceiving();
+
+int queuePDU(Connection_t *conn, uint8_t *dataBuffer, int lengthOfData);
+int queuePDUBuffer(Connection_t *conn, PDUBuffer_t *pduBuffer);
+int queuePDUSlice(Connection_t *conn, PDUSlice_t *pdu);
+int queueSendPDU(int socketNum, uint8_t *dataBuffer, int lengthOfData);
+void deliverPDUBuffer(Connection_t *sender, ConnRef_t *dest, PDUBuffer_t *pduBuffer);
+void deliverPDUSlice(Connection_t *sender, ConnRef_t *dest, PDUSlice_t *pdu);
+void forwardReceivedPDU(Connection_t *sender, ConnRef_t *dest, uint8_t *pdu, int pduLen);
+void broadcastPDUBuffer(Connection_t *sender, PDUBuffer_t *pduBuffer);
+void queueFromSender(ConnRef_t *sender, Connection_t *target, PDUSlice_t *pdu);
+void handleInboxMessage(InboxMessage_t *message);
+int flushConnection(Connection_t *conn);
+void flushPendingConnections(void (*closeConnection)(int socketNum));
+void printConnectionStats(FILE *out);
+
+#endif
@@ -0,0 +1,103 @@
+//
+// epoll() version of pollLib for the chat server.
+//
+// Differences from pollLib:
+// 1. epollCall() returns the number of ready descriptors and fills in the
+//    caller's event array, so one wakeup can service every ready socket
+//    (no more starving the high numbered file descriptors).
+// 2. The kernel keeps the interest list, so adding/removing a socket is
+//    O(1) and a wakeup costs O(ready) instead of O(maxFileDescriptor).
+// 3. The set is per thread: each thread calls setupEpollSet() and the
+//    other calls work on that thread's own set.
+//
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "epollLib.h"
+
+// epoll global variables (one epoll set per server thread)
+static __thread int epollFileDescriptor = -1;
+
+void setupEpollSet()
+{
+	if ((epollFileDescriptor = epoll_create1(EPOLL_CLOEXEC)) < 0)
+	{
+		perror("epoll_create1");
+		exit(-1);
+	}
+}
+
+void addToEpollSet(int socketNumber, uint32_t events)
+{
+	addToEpollSetTagged(socketNumber, events, (uint32_t)socketNumber);
+}
+
+// Same, but epollCall() hands back tag in data.u64 instead of just the
+// descriptor (everything else is tagged with its descriptor, upper half 0)
+void addToEpollSetTagged(int socketNumber, uint32_t events, uint64_t tag)
+{
+	struct epoll_event event;
+
+	event.events = events;
+	event.data.u64 = tag;
+
+	if (epoll_ctl(epollFileDescriptor, EPOLL_CTL_ADD, socketNumber, &event) < 0)
+	{
+		perror("addToEpollSet");
+		exit(-1);
+	}
+}
+
+void modifyEpollSet(int socketNumber, uint32_t events)
+{
+	struct epoll_event event;
+
+	event.events = events;
+	event.data.u64 = (uint32_t)socketNumber;
+
+	if (epoll_ctl(epollFileDescriptor, EPOLL_CTL_MOD, socketNumber, &event) < 0)
+	{
+		perror("modifyEpollSet");
+		exit(-1);
+	}
+}
+
+void removeFromEpollSet(int socketNumber)
+{
+	// closing the socket also drops it from the set, so don't die if it is already gone
+	if (epoll_ctl(epollFileDescriptor, EPOLL_CTL_DEL, socketNumber, NULL) < 0 && errno != ENOENT && errno != EBADF)
+	{
+		perror("removeFromEpollSet");
+	}
+}
+
+int epollCall(int timeInMilliSeconds, struct epoll_event *events, int maxEvents)
+{
+	// returns the number of ready sockets (filled into events)
+	// returns 0 if timeout occurred
+	// if timeInMilliSeconds == -1 blocks forever (until a socket ready)
+	// returns 0 if a signal interrupted the wait (so the caller can look at its signal flags)
+	int numReady = 0;
+
+	if ((numReady = epoll_wait(epollFileDescriptor, events, maxEvents, timeInMilliSeconds)) < 0)
+	{
+		if (errno == EINTR)
+		{
+			return 0;
+		}
+		perror("epollCall");
+		exit(-1);
+	}
+
+	return numReady;
+}
+
+// The set itself, for polling it from somewhere else (the io_uring backend)
+int getEpollFd()
+{
+	return epollFileDescriptor;
+}
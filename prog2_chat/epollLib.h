@@ -0,0 +1,26 @@
+//
+// epoll() based replacement for pollLib used by the chat server.
+//
+// Same shape as pollLib (setup, add, remove, call) but epollCall() hands
+// back every ready descriptor from a single epoll_wait() instead of only
+// the lowest numbered one, and add/remove are O(1) in the kernel.
+//
+
+#ifndef __EPOLLLIB_H__
+#define __EPOLLLIB_H__
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#define EPOLL_MAX_EVENTS 64
+#define EPOLL_WAIT_FOREVER -1
+
+void setupEpollSet();
+void addToEpollSet(int socketNumber, uint32_t events);
+void addToEpollSetTagged(int socketNumber, uint32_t events, uint64_t tag);
+void modifyEpollSet(int socketNumber, uint32_t events);
+void removeFromEpollSet(int socketNumber);
+int epollCall(int timeInMilliSeconds, struct epoll_event *events, int maxEvents);
+int getEpollFd();
+
+#endif
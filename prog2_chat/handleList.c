@@ -0,0 +1,130 @@
+// --------------- handleList.c -----------------
+/*
+Cached, pre-serialized pages of the handle list for the paged %L.
+
+The first listing after a login or logout copies the handle table once and
+packs it into as few 0x0F PDUs as fit in MAXBUF. Every listing after that
+just queues references to those same page buffers until the handle table
+version moves again, so a %L costs a handful of PDUs no matter how many
+clients ask.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "handleList.h"
+#include "handle_table.h"
+#include "shared.h"
+#include "safeUtil.h"
+#include "log.h"
+
+static pthread_mutex_t snapshotLock = PTHREAD_MUTEX_INITIALIZER;
+static HandleSnapshot_t *currentSnapshot = NULL; // one reference is held here
+
+static HandleSnapshot_t *buildSnapshot(uint32_t version);
+static void addPage(HandleSnapshot_t *snapshot, uint8_t *page, int pageLen, int count, int pagesSize);
+
+// The current snapshot (rebuilt first if anyone logged in or out), the caller owns a reference
+HandleSnapshot_t *getHandleSnapshot()
+{
+    uint32_t version = getHandleVersion();
+
+    // Rebuilding under the lock means a burst of %L after a change only builds once
+    pthread_mutex_lock(&snapshotLock);
+    if (currentSnapshot == NULL || currentSnapshot->version != version)
+    {
+        if (currentSnapshot != NULL)
+        {
+            releaseHandleSnapshot(currentSnapshot);
+        }
+        currentSnapshot = buildSnapshot(version);
+    }
+
+    HandleSnapshot_t *snapshot = currentSnapshot;
+    __atomic_add_fetch(&snapshot->refCount, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&snapshotLock);
+
+    return snapshot;
+}
+
+void releaseHandleSnapshot(HandleSnapshot_t *snapshot)
+{
+    if (__atomic_sub_fetch(&snapshot->refCount, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        for (int i = 0; i < snapshot->numPages; i++)
+        {
+            releasePDUBuffer(snapshot->pages[i]);
+        }
+        free(snapshot->pages);
+        free(snapshot);
+    }
+}
+
+// Tagged with the version read before copying, so a change during the copy just means a rebuild next time
+static HandleSnapshot_t *buildSnapshot(uint32_t version)
+{
+    int maxHandles = getHandleCount();
+    Handle_t *handles = (Handle_t *)sCalloc(maxHandles > 0 ? maxHandles : 1, sizeof(Handle_t));
+    int numHandles = copyHandles(handles, maxHandles);
+
+    HandleSnapshot_t *snapshot = (HandleSnapshot_t *)sCalloc(1, sizeof(HandleSnapshot_t));
+    snapshot->refCount = 1;
+    snapshot->version = version;
+    snapshot->numHandles = numHandles;
+
+    // Worst case is every handle at full length
+    int perPage = (MAXBUF - 2 - LIST_PAGE_HEADER_LEN) / MAX_TABLE_HANDLE_LEN;
+    int pagesSize = numHandles / perPage + 1;
+    snapshot->pages = (PDUBuffer_t **)sCalloc(pagesSize, sizeof(PDUBuffer_t *));
+
+    uint8_t page[MAXBUF];
+    int pageLen = LIST_PAGE_HEADER_LEN;
+    int count = 0;
+
+    for (int i = 0; i < numHandles; i++)
+    {
+        // +2 for the PDU length sendPDU() style buffers get in front
+        if (2 + pageLen + 1 + handles[i].handleLen > MAXBUF || count == UINT8_MAX)
+        {
+            addPage(snapshot, page, pageLen, count, pagesSize);
+            pageLen = LIST_PAGE_HEADER_LEN;
+            count = 0;
+        }
+        page[pageLen++] = handles[i].handleLen;
+        memcpy(page + pageLen, handles[i].handle, handles[i].handleLen);
+        pageLen += handles[i].handleLen;
+        count++;
+    }
+    addPage(snapshot, page, pageLen, count, pagesSize);
+
+    // Only now do we know which page is last
+    uint32_t done = 0;
+    memcpy(snapshot->pages[snapshot->numPages - 1]->data + 2 + 5, &done, sizeof(done));
+
+    free(handles);
+    return snapshot;
+}
+
+// Fill in the page header and keep it, assuming more pages follow
+static void addPage(HandleSnapshot_t *snapshot, uint8_t *page, int pageLen, int count, int pagesSize)
+{
+    if (snapshot->numPages == pagesSize)
+    {
+        LOG_ERROR("Error: handle list needs more than %d pages\n", pagesSize);
+        exit(-1);
+    }
+
+    uint32_t total = htonl(snapshot->numHandles);
+    uint32_t next = htonl(snapshot->numPages + 1);
+
+    page[0] = LIST_PAGE_FLAG;
+    memcpy(page + 1, &total, sizeof(total));
+    memcpy(page + 5, &next, sizeof(next));
+    page[9] = count;
+
+    snapshot->pages[snapshot->numPages++] = createPDUBuffer(page, pageLen);
+}
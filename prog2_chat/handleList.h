@@ -0,0 +1,23 @@
+#ifndef HANDLE_LIST_H
+#define HANDLE_LIST_H
+
+#include <stdint.h>
+
+#include "pduBuffer.h"
+#include "shared.h"
+
+// Every page of the handle list as of one login/logout, serialized once and
+// shared (by reference) with everyone listing until membership changes again
+typedef struct
+{
+    int refCount;
+    uint32_t version;     // getHandleVersion() it was built from
+    uint32_t numHandles;
+    int numPages;
+    PDUBuffer_t **pages;  // finished 0x0F PDUs, ready to queue
+} HandleSnapshot_t;
+
+HandleSnapshot_t *getHandleSnapshot();
+void releaseHandleSnapshot(HandleSnapshot_t *snapshot);
+
+#endif
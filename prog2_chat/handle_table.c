@@ -1,218 +1,279 @@
-/*// Struct for client information
-typedef struct
-{
-    int socketNum;
-    char handle[32];
-} Handle_t;
-
-void initHandleTable();
-int addHandle(int socketNum, char *handle);
-int removeHandle(int socketNum);
-int getHandle(int socketNum, char *handle);
-int getSocket(char *handle, int *socketNum);
-int showHandles();
-int resizeHandleTable(int newSize);*/
+// --------------- handle_table.c -----------------
+/*
+Handle -> client connection registry for the chat server.
 
+Handles are hashed (FNV-1a) into NUM_HANDLE_SHARDS independent shards, each
+a chained hash table behind its own read/write lock. Lookups from the
+reactor threads only take a read lock on one shard, and logins/logouts on
+different shards never touch the same lock, so every operation is O(1) and
+threads rarely wait on each other.
+*/
 
 #include "handle_table.h"
-#include "sendreceive.h"
-#include "safeUtil.h"
-#include "pollLib.h"
-#include "networks.h"
-
 
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <sys/uio.h>
-#include <sys/time.h>
-#include <fcntl.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <netdb.h>
-#include <poll.h> // Include poll.h for pollfd structure
-
-#define INITIAL_HANDLE_TABLE_SIZE 10
-static int tableSize = INITIAL_HANDLE_TABLE_SIZE; // Initial size of the handle table
-static int handleCount = 0; // Number of handles currently in use
-static Handle_t *handleTable = NULL; // Pointer to the handle table
+#include <pthread.h>
+
+#include "safeUtil.h"
+#include "log.h"
+#include "slab.h"
+
+#define INITIAL_SHARD_BUCKETS 16 // must be a power of 2
+
+typedef struct
+{
+    pthread_rwlock_t lock;
+    Handle_t **buckets;
+    int numBuckets;
+    int count;
+} __attribute__((aligned(64))) HandleShard_t;
+
+static HandleShard_t handleShards[NUM_HANDLE_SHARDS];
+static int handleCount = 0; // Number of handles currently in use (all shards)
+static uint32_t handleVersion = 0; // Bumped on every login/logout so cached lists know they are stale
+static __thread Slab_t *handleSlab = NULL; // entries added by this thread
+
+static uint32_t hashHandle(const char *handle, int handleLen);
+static void growShard(HandleShard_t *shard);
 
 // Function to initialize the handle table
 void initHandleTable()
 {
-
-    // Allocate memory for the handle table
-    handleTable = (Handle_t *)malloc(sizeof(Handle_t) * INITIAL_HANDLE_TABLE_SIZE);
-    if (handleTable == NULL)
+    for (int i = 0; i < NUM_HANDLE_SHARDS; i++)
     {
-        perror("Failed to allocate memory for handle table");
-        exit(EXIT_FAILURE);
+        pthread_rwlock_init(&handleShards[i].lock, NULL);
+        handleShards[i].numBuckets = INITIAL_SHARD_BUCKETS;
+        handleShards[i].buckets = (Handle_t **)sCalloc(INITIAL_SHARD_BUCKETS, sizeof(Handle_t *));
+        handleShards[i].count = 0;
     }
-
-    // Initialize the handle table
-    int tableSize = INITIAL_HANDLE_TABLE_SIZE;
     handleCount = 0;
 
-    for (int i = 0; i < tableSize; i++)
+    LOG_INFO("Handle table initialized with %d shards\n", NUM_HANDLE_SHARDS);
+}
+
+// Function to add a handle to the table, fails if the handle is already taken
+int addHandle(char *handle, int handleLen, ConnRef_t *conn)
+{
+    if (handleLen <= 0 || handleLen >= MAX_TABLE_HANDLE_LEN)
     {
-        handleTable[i].socketNum = -1; // Initialize socket number to -1
-        memset(handleTable[i].handle, 0, sizeof(handleTable[i].handle)); // Initialize handle to empty string
+        LOG_INFO("Error: handle size exceeds maximum allowed length\n");
+        return -1;
     }
 
-    printf("Handle table initialized with size %d\n", tableSize);
+    uint32_t hash = hashHandle(handle, handleLen);
+    HandleShard_t *shard = &handleShards[hash & (NUM_HANDLE_SHARDS - 1)];
 
-}
-
-// Function to add a handle to the table
-int addHandle(int socketNum, char *handle, int handleLen)
-{
-    printf("Adding handle: %s with socket number: %d\n", handle, socketNum);
+    pthread_rwlock_wrlock(&shard->lock);
 
     // Ensure that the handle doesn't already exist in the table
-    for (int i = 0; i < handleCount; i++)
+    int bucket = (hash / NUM_HANDLE_SHARDS) & (shard->numBuckets - 1);
+    for (Handle_t *entry = shard->buckets[bucket]; entry != NULL; entry = entry->next)
     {
-        if (strcmp(handleTable[i].handle, handle) == 0)
+        if (entry->hash == hash && entry->handleLen == handleLen && memcmp(entry->handle, handle, handleLen) == 0)
         {
-            printf("Error: the handle %s already exists in the table!\n", handle);
+            pthread_rwlock_unlock(&shard->lock);
+            LOG_INFO("Error: the handle %s already exists in the table!\n", LOG_STR(handle, handleLen));
             return -1;
         }
     }
 
-    // Check if the table needs to be resized if we add the new handle
-    printf("Handle count: %d, Table size: %d\n", handleCount, tableSize);
-    if (handleCount == tableSize)
+    // Keep the chains short
+    if (shard->count >= shard->numBuckets)
     {
-        // Resize the handle table
-        tableSize *= 2;
-        resizeHandleTable(tableSize);  // Ensure this function allocates new memory properly
+        growShard(shard);
+        bucket = (hash / NUM_HANDLE_SHARDS) & (shard->numBuckets - 1);
     }
 
-    // The next thing we must do is to actually add the new handle
-    // We also need to ensure the handle fits within the allocated space
-    if (strlen(handle) >= sizeof(handleTable[handleCount].handle))
+    if (handleSlab == NULL)
     {
-        printf("Error: handle size exceeds maximum allowed length\n");
-        return -1;
+        handleSlab = createSlab("handle", sizeof(Handle_t));
     }
+    Handle_t *entry = (Handle_t *)slabAlloc(handleSlab);
+    entry->hash = hash;
+    entry->handleLen = handleLen;
+    memcpy(entry->handle, handle, handleLen);
+    entry->handle[handleLen] = '\0';
+    entry->conn = *conn;
 
-    // Copy handle to the table
-    handleTable[handleCount].socketNum = socketNum;
-    strncpy(handleTable[handleCount].handle, handle, sizeof(handleTable[handleCount].handle) - 1);
-
-    // Ensure the handle is null-terminated
-    handleTable[handleCount].handle[sizeof(handleTable[handleCount].handle) - 1] = '\0';
-    handleTable[handleCount].handleLen = handleLen;
-    handleCount++;
+    entry->next = shard->buckets[bucket];
+    shard->buckets[bucket] = entry;
+    shard->count++;
+    __atomic_add_fetch(&handleCount, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&handleVersion, 1, __ATOMIC_RELEASE);
 
-    printf("Handle: %s was added with socket number: %d\n", handle, socketNum);
+    pthread_rwlock_unlock(&shard->lock);
     return 0;
 }
 
+// Remove a handle, only if it still belongs to the connection that is going away
+int removeHandle(char *handle, int handleLen, uint32_t connId)
+{
+    return removeRemoteHandle(handle, handleLen, connId, 0);
+}
 
-int resizeHandleTable(int newTableSize)
+// Same for a client of another cluster node (nodeId 0 is this server's own)
+int removeRemoteHandle(char *handle, int handleLen, uint32_t connId, int nodeId)
 {
-    Handle_t *newTable = realloc(handleTable, newTableSize * sizeof(Handle_t));
-    if (!newTable)
-    {
-        perror("Failed to reallocate memory for resizing the table.\n");
-        return -1; // Return value that shows realloc() error
-    }
-    handleTable = newTable;
-    int oldSize = tableSize;
-    tableSize = newTableSize;
+    uint32_t hash = hashHandle(handle, handleLen);
+    HandleShard_t *shard = &handleShards[hash & (NUM_HANDLE_SHARDS - 1)];
 
-    // Reinitalize the new memory
-    for (int i = oldSize; i < tableSize; i++)
+    pthread_rwlock_wrlock(&shard->lock);
+
+    int bucket = (hash / NUM_HANDLE_SHARDS) & (shard->numBuckets - 1);
+    for (Handle_t **link = &shard->buckets[bucket]; *link != NULL; link = &(*link)->next)
     {
-        handleTable[i].socketNum = -1;
-        memset(handleTable[i].handle, 0, sizeof(handleTable[i].handle));
+        Handle_t *entry = *link;
+        if (entry->conn.connId == connId && entry->conn.nodeId == nodeId && entry->handleLen == handleLen &&
+            memcmp(entry->handle, handle, handleLen) == 0)
+        {
+            *link = entry->next;
+            shard->count--;
+            __atomic_sub_fetch(&handleCount, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&handleVersion, 1, __ATOMIC_RELEASE);
+            pthread_rwlock_unlock(&shard->lock);
+            slabFree(entry);
+            return 0;
+        }
     }
-    printf("Handle table resized to %d entries.\n", tableSize);
-    return 0;
+
+    pthread_rwlock_unlock(&shard->lock);
+
+    // If you didn't find the handle you were looking for:
+    LOG_WARN("Error: handle %s was not found in the handle table.\n", LOG_STR(handle, handleLen));
+    return -1;
 }
 
-int removeHandle(int socketNum)
+// Drop every handle a cluster node told us about (its link went down), returns how many
+int removeNodeHandles(int nodeId)
 {
-    for (int i = 0; i < handleCount; i ++)
+    int removed = 0;
+
+    for (int i = 0; i < NUM_HANDLE_SHARDS; i++)
     {
-        if (handleTable[i].socketNum == socketNum)
-        {
-            printf("Removing handle: %s with socket number: %d\n", handleTable[i].handle, socketNum);
+        HandleShard_t *shard = &handleShards[i];
 
-            // To remove a handle, we would need to effectively need to shift all the other handles
-            for (int j = i; j < handleCount -1; j++)
+        pthread_rwlock_wrlock(&shard->lock);
+        for (int b = 0; b < shard->numBuckets; b++)
+        {
+            Handle_t **link = &shard->buckets[b];
+            while (*link != NULL)
             {
-                handleTable[j] = handleTable[j + 1];
-             }
-            
-            // Clear the last entry so we can see that there is nothing there
-            handleTable[handleCount-1].socketNum = -1;
-            memset(handleTable[handleCount-1].handle,0, sizeof(handleTable[handleCount-1].handle));
-
-            // decrement handle count;
-            handleCount --;
-            return 0;
+                Handle_t *entry = *link;
+                if (entry->conn.nodeId != nodeId)
+                {
+                    link = &entry->next;
+                    continue;
+                }
+                *link = entry->next;
+                shard->count--;
+                slabFree(entry);
+                removed++;
+            }
         }
+        pthread_rwlock_unlock(&shard->lock);
     }
 
-    // If you didn't find the socket you were looking for:
-    printf("Error: socket number %d was not found in the handle table.\n", socketNum);
-    return -1;
+    __atomic_sub_fetch(&handleCount, removed, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&handleVersion, 1, __ATOMIC_RELEASE);
+    return removed;
 }
 
-
-// returning the socket number from the handle  
-int getSocket(char *handle, int *socketNum)
+// Find the connection a handle belongs to (handle doesn't need to be null terminated)
+int lookupHandle(const char *handle, int handleLen, ConnRef_t *conn)
 {
-    for (int i = 0; i < handleCount; i++)
+    uint32_t hash = hashHandle(handle, handleLen);
+    HandleShard_t *shard = &handleShards[hash & (NUM_HANDLE_SHARDS - 1)];
+    int found = -1;
+
+    pthread_rwlock_rdlock(&shard->lock);
+
+    int bucket = (hash / NUM_HANDLE_SHARDS) & (shard->numBuckets - 1);
+    for (Handle_t *entry = shard->buckets[bucket]; entry != NULL; entry = entry->next)
     {
-        if (strcmp(handleTable[i].handle, handle) == 0)
+        if (entry->hash == hash && entry->handleLen == handleLen && memcmp(entry->handle, handle, handleLen) == 0)
         {
-            *socketNum = handleTable[i].socketNum;
-            return 0;
+            *conn = entry->conn;
+            found = 0;
+            break;
         }
     }
-    printf("Error: handle %s not found in the table.\n", handle);
-    return -1;
+
+    pthread_rwlock_unlock(&shard->lock);
+    return found;
 }
 
-// Add a validate function to check if the handle exists
-int getHandle(int socketNum, char *handle)
+// Copy up to maxHandles entries into handles (one shard locked at a time), returns how many
+int copyHandles(Handle_t *handles, int maxHandles)
 {
-    for (int i = 0; i < handleCount; i++)
+    int copied = 0;
+
+    for (int i = 0; i < NUM_HANDLE_SHARDS && copied < maxHandles; i++)
     {
-        if (handleTable[i].socketNum == socketNum)
+        HandleShard_t *shard = &handleShards[i];
+
+        pthread_rwlock_rdlock(&shard->lock);
+        for (int b = 0; b < shard->numBuckets && copied < maxHandles; b++)
         {
-            strncpy(handle, handleTable[i].handle, sizeof(handleTable[i].handle) - 1);
-            handle[sizeof(handleTable[i].handle) - 1] = '\0'; // Ensure null termination
-            return 0;
+            for (Handle_t *entry = shard->buckets[b]; entry != NULL && copied < maxHandles; entry = entry->next)
+            {
+                handles[copied] = *entry;
+                handles[copied].next = NULL;
+                copied++;
+            }
         }
+        pthread_rwlock_unlock(&shard->lock);
     }
-    printf("Error: socket number %d not found in the table.\n", socketNum);
-    return -1;
+    return copied;
+}
+
+// Get handle count
+int getHandleCount()
+{
+    return __atomic_load_n(&handleCount, __ATOMIC_RELAXED);
 }
-// Function to show all handles in the table
-int showHandles()
+
+// Changes whenever a handle is added or removed
+uint32_t getHandleVersion()
 {
-    printf("Current handles in the table:\n");
-    for (int i = 0; i < handleCount; i++)
-    {
-        printf("Socket: %d, Handle: %s\n", handleTable[i].socketNum, handleTable[i].handle);
-    }
-    return handleCount;
+    return __atomic_load_n(&handleVersion, __ATOMIC_ACQUIRE);
 }
 
-// Function to simply get handle table
-Handle_t *getHandleTable()
+static uint32_t hashHandle(const char *handle, int handleLen)
 {
-    return handleTable;
+    uint32_t hash = 2166136261u;
+
+    for (int i = 0; i < handleLen; i++)
+    {
+        hash ^= (uint8_t)handle[i];
+        hash *= 16777619u;
+    }
+    return hash;
 }
 
-// Get handle count
-int getHandleCount()
+// Double the bucket array (caller holds the write lock)
+static void growShard(HandleShard_t *shard)
 {
-    return handleCount;
-}
\ No newline at end of file
+    int newNumBuckets = shard->numBuckets * 2;
+    Handle_t **newBuckets = (Handle_t **)sCalloc(newNumBuckets, sizeof(Handle_t *));
+
+    for (int b = 0; b < shard->numBuckets; b++)
+    {
+        Handle_t *entry = shard->buckets[b];
+        while (entry != NULL)
+        {
+            Handle_t *next = entry->next;
+            int newBucket = (entry->hash / NUM_HANDLE_SHARDS) & (newNumBuckets - 1);
+
+            entry->next = newBuckets[newBucket];
+            newBuckets[newBucket] = entry;
+            entry = next;
+        }
+    }
+
+    free(shard->buckets);
+    shard->buckets = newBuckets;
+    shard->numBuckets = newNumBuckets;
+}
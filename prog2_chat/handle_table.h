@@ -6,23 +6,37 @@
 #include <stdint.h>
 #include <stdlib.h>
 
-// Struct for client information
+#define MAX_TABLE_HANDLE_LEN 32   // room in the table for a handle and its null terminator
+#define NUM_HANDLE_SHARDS 64      // must be a power of 2
+
+// Which client connection, on which reactor thread, a handle belongs to
 typedef struct
 {
-    int handleLen;
-    char handle[32];
     int socketNum;
+    uint32_t connId;
+    int reactorId;
+    uint8_t capabilities;         // LOGIN_CAP_* it logged in with, for senders on other reactors
+    uint8_t nodeId;               // 0 for a client of this server, else the cluster node it's on (cluster.c)
+} ConnRef_t;
 
+// Struct for client information
+typedef struct Handle
+{
+    struct Handle *next;          // next handle in the same hash bucket
+    uint32_t hash;
+    int handleLen;
+    char handle[MAX_TABLE_HANDLE_LEN];
+    ConnRef_t conn;
 } Handle_t;
 
 void initHandleTable();
-int addHandle(int socketNum, char *handle, int handleLen);
-int removeHandle(int socketNum);
-int getHandle(int socketNum, char *handle);
-int getSocket(char *handle, int *socketNum);
-int showHandles();
-int resizeHandleTable(int newSize);
-Handle_t *getHandleTable();
+int addHandle(char *handle, int handleLen, ConnRef_t *conn);
+int removeHandle(char *handle, int handleLen, uint32_t connId);
+int removeRemoteHandle(char *handle, int handleLen, uint32_t connId, int nodeId);
+int removeNodeHandles(int nodeId);
+int lookupHandle(const char *handle, int handleLen, ConnRef_t *conn);
+int copyHandles(Handle_t *handles, int maxHandles);
 int getHandleCount();
+uint32_t getHandleVersion();
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,817 @@
+// --------------- handoff.c -----------------
+/*
+Handing a running server's clients to a new server binary without
+dropping any of them (-X).
+
+The server listens on a Unix SOCK_SEQPACKET socket. A new server started
+with the same -X path connects to it, and the old one stops every reactor
+at a barrier: nothing is read from a client after that, inboxes are
+drained and whatever can be written is flushed. Reactor 0 then sends the
+listening sockets and every connection - socket (and for a shared memory
+client its memfd and eventfds) over SCM_RIGHTS, plus its handle, the
+partial PDU it was part way through receiving, the bytes still waiting in
+its send queue, its channels and the streams it was sending. The new
+server acks once it has all of it and the old one exits. If anything goes
+wrong before the ack the old server just carries on.
+
+Clients never see any of this: their sockets, the port and the shared
+memory rings stay exactly as they were, and anything they send meanwhile
+waits in the kernel until the new server reads it.
+
+The wire format is fixed width, host byte order (both ends are on the
+same machine) and starts with a magic and version, so a new binary that
+can't read the old one's state refuses it instead of guessing. Each
+record's descriptors go before (or in the same packet as) its bytes.
+*/
+
+#define _GNU_SOURCE // MSG_CMSG_CLOEXEC
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "handoff.h"
+#include "channel.h"
+#include "stream.h"
+#include "cluster.h"
+#include "ratelimit.h"
+#include "mailbox.h"
+#include "safeUtil.h"
+#include "log.h"
+
+// Start of the transfer, followed by the listeners' descriptors
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t numReactors;
+    uint32_t numConnections;
+    uint32_t nextStreamId;
+    uint32_t hasShmListener;
+} HandoffHeader_t;
+
+// One connection, followed by its handle, partial receive, unsent bytes, channel names ([len][name]) and streams
+typedef struct
+{
+    uint32_t reactorId;
+    uint8_t isShm;                   // socket, memfd, wakeFd, peerWakeFd instead of just the socket
+    uint8_t loggedIn;
+    uint8_t capabilities;
+    uint8_t handleLen;
+    uint32_t recvLen;
+    uint32_t sendLen;
+    uint16_t numChannels;
+    uint16_t numStreams;
+} HandoffConn_t;
+
+typedef struct
+{
+    uint32_t clientId;
+    uint32_t serverId;
+    uint32_t remaining;
+    uint32_t destHandleLen;
+    char destHandle[MAX_TABLE_HANDLE_LEN];
+} HandoffStream_t;
+
+// Packs bytes and descriptors into packets
+typedef struct
+{
+    int socketNum;
+    int len;
+    int numFds;
+    int failed;
+    int fds[HANDOFF_MAX_FDS];
+    uint8_t buffer[HANDOFF_PACKET_SIZE];
+} HandoffWriter_t;
+
+// Unpacks them, descriptors are handed out in the order they were sent
+typedef struct
+{
+    int socketNum;
+    int len;
+    int pos;
+    int failed;
+    int *fds;
+    int numFds;
+    int nextFd;
+    int fdsSize;
+    uint8_t buffer[HANDOFF_PACKET_SIZE];
+} HandoffReader_t;
+
+// A connection received from the old server, waiting for its reactor to pick it up
+typedef struct RestoredConn
+{
+    struct RestoredConn *next;
+    HandoffConn_t record;
+    int fds[4];
+    char handle[MAX_TABLE_HANDLE_LEN];
+    uint8_t *recvData;
+    uint8_t *sendData;
+    uint8_t *channelNames;           // numChannels * (1 + MAX_CHANNEL_NAME_LEN), [len][name]
+    HandoffStream_t *streams;
+    Connection_t *conn;
+} RestoredConn_t;
+
+static pthread_barrier_t handoffBarrier;
+static int handoffRequested = 0;     // set by reactor 0, every reactor parks when it sees it
+static int handoffSocket = -1;
+static HandoffListeners_t handoffListeners;
+static uint64_t handoffStartMs = 0;
+
+static RestoredConn_t *restoreLists[MAX_REACTORS];
+static int restoring = 0;
+static int restoredCount = 0;
+
+static int sendHandoff();
+static void putConnection(HandoffWriter_t *writer, Connection_t *conn);
+static void putFd(HandoffWriter_t *writer, int fd);
+static void putBytes(HandoffWriter_t *writer, const void *data, int len);
+static void sendPacket(HandoffWriter_t *writer);
+static RestoredConn_t *getRestoredConn(HandoffReader_t *reader, int numReactors);
+static int getFd(HandoffReader_t *reader);
+static int getBytes(HandoffReader_t *reader, void *data, int len);
+static int readPacket(HandoffReader_t *reader);
+static void freeRestored(RestoredConn_t *restored);
+
+// Both ends: the barrier every reactor meets at while the clients change hands
+void initHandoff(int numReactors)
+{
+    pthread_barrier_init(&handoffBarrier, NULL, numReactors);
+}
+
+// Non-blocking listening socket at path for a new server to take over from us, -1 on error
+int handoffListen(const char *path)
+{
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int socketNum = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (socketNum < 0)
+    {
+        return -1;
+    }
+    unlink(path);
+    if (bind(socketNum, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(socketNum, 1) < 0)
+    {
+        int saved = errno;
+        close(socketNum);
+        errno = saved;
+        return -1;
+    }
+    return socketNum;
+}
+
+// A server to take over from, -1 if nothing is listening at path
+int handoffConnect(const char *path)
+{
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int socketNum = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (socketNum < 0)
+    {
+        return -1;
+    }
+    if (connect(socketNum, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        int saved = errno;
+        close(socketNum);
+        errno = saved;
+        return -1;
+    }
+    handoffStartMs = getTimeMs();
+    return socketNum;
+}
+
+/*
+-- Reactor 0, a new server connected on socketNum: stop every reactor so the
+   clients can be sent to it (blocking socket)
+-- Only one at a time, another one that shows up meanwhile is turned away
+*/
+void beginHandoff(int socketNum, HandoffListeners_t *listeners)
+{
+    if (handoffPending())
+    {
+        close(socketNum);
+        return;
+    }
+    LOG_INFO("New server connected, handing over\n");
+    handoffSocket = socketNum;
+    handoffListeners = *listeners;
+    handoffStartMs = getTimeMs();
+    __atomic_store_n(&handoffRequested, 1, __ATOMIC_RELEASE);
+    wakeAllReactors();
+}
+
+int handoffPending()
+{
+    return __atomic_load_n(&handoffRequested, __ATOMIC_ACQUIRE);
+}
+
+/*
+-- Every reactor calls this once it sees handoffPending(), nothing of its
+   clients is touched by anyone else until it returns
+-- Doesn't return if the new server took the clients
+*/
+void parkForHandoff(Reactor_t *reactor, void (*closeConnection)(int socketNum))
+{
+    // Once everyone is here nothing more is read from a client, so the
+    // only messages still going between reactors are the ones already in
+    // the inboxes (and the pause/resume those cause, which don't matter)
+    pthread_barrier_wait(&handoffBarrier);
+    drainInbox(reactor, handleInboxMessage);
+    flushPendingConnections(closeConnection);
+    pthread_barrier_wait(&handoffBarrier);
+    drainInbox(reactor, handleInboxMessage);
+    flushPendingConnections(closeConnection);
+    pthread_barrier_wait(&handoffBarrier);
+
+    static int handedOver = 0;
+    if (reactor->reactorId == 0)
+    {
+        handedOver = (sendHandoff() == 0);
+        close(handoffSocket);
+        handoffSocket = -1;
+        __atomic_store_n(&handoffRequested, 0, __ATOMIC_RELEASE);
+    }
+    pthread_barrier_wait(&handoffBarrier);
+
+    if (!handedOver)
+    {
+        return; // back to serving them
+    }
+    if (reactor->reactorId == 0)
+    {
+        LOG_INFO("Handed over in %llu ms, exiting\n", (unsigned long long)(getTimeMs() - handoffStartMs));
+        logFlush();
+        exit(0);
+    }
+    while (1)
+    {
+        pause(); // until reactor 0's exit() takes the process down
+    }
+}
+
+/*
+-- The new server: read the old one's listeners and clients from socketNum
+   and tell it we have them
+-- Return value: 0, -1 if the transfer was cut short or isn't one we can read
+   (the old server keeps its clients)
+*/
+int receiveHandoff(int socketNum, HandoffListeners_t *listeners)
+{
+    HandoffReader_t *reader = (HandoffReader_t *)sCalloc(1, sizeof(HandoffReader_t));
+    HandoffHeader_t header;
+    int status = -1;
+
+    reader->socketNum = socketNum;
+    if (getBytes(reader, &header, sizeof(header)) < 0)
+    {
+        goto done;
+    }
+    if (header.magic != HANDOFF_MAGIC || header.version != HANDOFF_VERSION || header.numReactors < 1 ||
+        header.numReactors > MAX_REACTORS)
+    {
+        LOG_ERROR("Handoff: not a version %d transfer\n", HANDOFF_VERSION);
+        goto done;
+    }
+
+    listeners->numReactors = header.numReactors;
+    for (int i = 0; i < listeners->numReactors; i++)
+    {
+        listeners->serverSockets[i] = getFd(reader);
+    }
+    listeners->shmListenSocket = header.hasShmListener ? getFd(reader) : -1;
+    listeners->handoffListenSocket = getFd(reader);
+
+    for (uint32_t i = 0; i < header.numConnections; i++)
+    {
+        RestoredConn_t *restored = getRestoredConn(reader, header.numReactors);
+        if (restored == NULL)
+        {
+            goto done;
+        }
+        restored->next = restoreLists[restored->record.reactorId];
+        restoreLists[restored->record.reactorId] = restored;
+    }
+    if (reader->failed)
+    {
+        goto done;
+    }
+
+    // Everything's here, the old server can go
+    if (send(socketNum, "K", 1, 0) != 1)
+    {
+        LOG_ERROR("Handoff: can't ack: %s\n", strerror(errno));
+        goto done;
+    }
+    setStreamIdCounter(header.nextStreamId);
+    restoredCount = header.numConnections;
+    restoring = 1;
+    status = 0;
+
+done:
+    if (status < 0)
+    {
+        LOG_ERROR("Handoff from the old server failed\n");
+    }
+    free(reader->fds);
+    free(reader);
+    return status;
+}
+
+/*
+-- Each reactor of the new server, before it starts its event loop: make
+   connections out of the clients the old server's same reactor had
+-- watch puts a connection's descriptors in this thread's epoll set
+*/
+void restoreConnections(Reactor_t *reactor, void (*watch)(Connection_t *conn))
+{
+    if (!restoring)
+    {
+        return;
+    }
+
+    for (RestoredConn_t *restored = restoreLists[reactor->reactorId]; restored != NULL; restored = restored->next)
+    {
+        HandoffConn_t *record = &restored->record;
+        int numFds = record->isShm ? 4 : 1;
+        Connection_t *conn = createConnection(restored->fds[0]);
+
+        if (conn != NULL && record->isShm &&
+            (conn->shm = shmAdopt(restored->fds[0], restored->fds[1], restored->fds[2], restored->fds[3])) == NULL)
+        {
+            destroyConnection(restored->fds[0]);
+            conn = NULL;
+        }
+        if (conn == NULL)
+        {
+            LOG_ERROR("Handoff: can't restore socket %d, dropping it\n", restored->fds[0]);
+            for (int i = 0; i < numFds; i++)
+            {
+                close(restored->fds[i]);
+            }
+            continue;
+        }
+        conn->capabilities = record->capabilities;
+        watch(conn);
+
+        if (record->loggedIn)
+        {
+            ConnRef_t ref;
+
+            conn->handleLen = record->handleLen;
+            memcpy(conn->handle, restored->handle, record->handleLen);
+            conn->handle[record->handleLen] = '\0';
+            getConnRef(conn, &ref);
+            if (addHandle(conn->handle, conn->handleLen, &ref) < 0)
+            {
+                LOG_WARN("Handoff: handle %s was already taken\n", conn->handle);
+                startLoginTimer(conn);
+            }
+            else
+            {
+                conn->state = CONN_LOGGED_IN;
+                clusterAnnounceHandle(&ref, conn->handle, conn->handleLen);
+                mailboxRegister(conn->handle, conn->handleLen); // it logged in, just not here
+                startIdleTimer(conn);
+                startRateLimit(conn);
+            }
+        }
+        else
+        {
+            startLoginTimer(conn);
+        }
+
+        if (record->recvLen > 0)
+        {
+            conn->recvBuffer = allocPDUBuffer(CONN_RECV_BUFFER_SIZE);
+            memcpy(conn->recvBuffer->data, restored->recvData, record->recvLen);
+            conn->recvLen = record->recvLen;
+        }
+        if (record->sendLen > 0)
+        {
+            // One slice for all of it, it only has to get onto the wire in order
+            PDUBuffer_t *pending = allocPDUBuffer(record->sendLen);
+            memcpy(pending->data, restored->sendData, record->sendLen);
+            queuePDUBuffer(conn, pending);
+            releasePDUBuffer(pending);
+        }
+        for (int i = 0; i < record->numChannels; i++)
+        {
+            uint8_t *name = restored->channelNames + i * (1 + MAX_CHANNEL_NAME_LEN);
+            int memberCount;
+            joinChannel(conn, (char *)name + 1, name[0], &memberCount);
+        }
+        if (conn->shm != NULL)
+        {
+            shmWakeSelf(conn->shm); // there may be PDUs in its ring already
+        }
+        restored->conn = conn;
+    }
+
+    // Streams need their destination's handle in the table, which may be another reactor's client
+    pthread_barrier_wait(&handoffBarrier);
+
+    RestoredConn_t *restored = restoreLists[reactor->reactorId];
+    while (restored != NULL)
+    {
+        RestoredConn_t *next = restored->next;
+
+        for (int i = 0; restored->conn != NULL && i < restored->record.numStreams; i++)
+        {
+            HandoffStream_t *stream = &restored->streams[i];
+            adoptStream(restored->conn, stream->clientId, stream->serverId, stream->remaining, stream->destHandle,
+                        stream->destHandleLen);
+        }
+        freeRestored(restored);
+        restored = next;
+    }
+    restoreLists[reactor->reactorId] = NULL;
+
+    if (reactor->reactorId == 0)
+    {
+        LOG_INFO("Took over %d connections in %llu ms\n", restoredCount, (unsigned long long)(getTimeMs() - handoffStartMs));
+    }
+}
+
+/*
+-- Reactor 0 with every reactor parked: send it all and wait for the ack
+-- Return value: 0 if the new server has the clients, -1 if we keep them
+*/
+static int sendHandoff()
+{
+    HandoffWriter_t *writer = (HandoffWriter_t *)sCalloc(1, sizeof(HandoffWriter_t));
+    HandoffHeader_t header;
+    int numConnections = 0;
+
+    for (int i = 0; i < getNumReactors(); i++)
+    {
+        numConnections += getReactor(i)->numConnections;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic = HANDOFF_MAGIC;
+    header.version = HANDOFF_VERSION;
+    header.numReactors = handoffListeners.numReactors;
+    header.numConnections = numConnections;
+    header.nextStreamId = getStreamIdCounter();
+    header.hasShmListener = (handoffListeners.shmListenSocket >= 0);
+
+    writer->socketNum = handoffSocket;
+    for (int i = 0; i < handoffListeners.numReactors; i++)
+    {
+        putFd(writer, handoffListeners.serverSockets[i]);
+    }
+    if (header.hasShmListener)
+    {
+        putFd(writer, handoffListeners.shmListenSocket);
+    }
+    putFd(writer, handoffListeners.handoffListenSocket);
+    putBytes(writer, &header, sizeof(header));
+
+    for (int i = 0; i < getNumReactors(); i++)
+    {
+        Reactor_t *reactor = getReactor(i);
+        for (int j = 0; j < reactor->numConnections; j++)
+        {
+            putConnection(writer, reactor->connections[j]);
+        }
+    }
+    if (writer->len > 0 || writer->numFds > 0)
+    {
+        sendPacket(writer);
+    }
+
+    int failed = writer->failed;
+    free(writer);
+    if (failed)
+    {
+        LOG_ERROR("Handoff: send failed: %s, keeping the clients\n", strerror(errno));
+        return -1;
+    }
+
+    // The new server has to say it got all of it, it may yet fail to parse it
+    struct pollfd pfd = {handoffSocket, POLLIN, 0};
+    char ack = 0;
+    if (poll(&pfd, 1, HANDOFF_ACK_TIMEOUT_MS) != 1 || recv(handoffSocket, &ack, 1, 0) != 1 || ack != 'K')
+    {
+        LOG_ERROR("Handoff: the new server didn't take the clients, keeping them\n");
+        return -1;
+    }
+    LOG_INFO("Handoff: sent %d connections\n", numConnections);
+    return 0;
+}
+
+static void putConnection(HandoffWriter_t *writer, Connection_t *conn)
+{
+    HandoffConn_t record;
+
+    memset(&record, 0, sizeof(record));
+    record.reactorId = conn->reactorId;
+    record.isShm = (conn->shm != NULL);
+    record.loggedIn = (conn->state == CONN_LOGGED_IN);
+    record.capabilities = conn->capabilities;
+    record.handleLen = record.loggedIn ? conn->handleLen : 0;
+    record.recvLen = conn->recvLen;
+    record.sendLen = conn->queuedBytes;
+    record.numChannels = conn->numChannels;
+    record.numStreams = conn->numStreams;
+
+    putFd(writer, conn->socketNum);
+    if (conn->shm != NULL)
+    {
+        putFd(writer, conn->shm->memFd);
+        putFd(writer, conn->shm->wakeFd);
+        putFd(writer, conn->shm->peerWakeFd);
+    }
+    putBytes(writer, &record, sizeof(record));
+    putBytes(writer, conn->handle, record.handleLen);
+    if (conn->recvLen > 0)
+    {
+        putBytes(writer, conn->recvBuffer->data, conn->recvLen);
+    }
+
+    // What's left of the head PDU, then the rest of the queue
+    for (int i = 0; i < conn->sendCount; i++)
+    {
+        OutBuffer_t *out = &conn->sendQueue[(conn->sendHead + i) % conn->sendQueueSize];
+        int skip = (i == 0) ? conn->sendOffset : 0;
+        putBytes(writer, out->data + skip, out->len - skip);
+    }
+
+    for (int i = 0; i < conn->numChannels; i++)
+    {
+        Channel_t *channel = conn->channels[i].channel;
+        uint8_t nameLen = channel->nameLen;
+        putBytes(writer, &nameLen, 1);
+        putBytes(writer, channel->name, nameLen);
+    }
+
+    for (int i = 0; i < conn->numStreams; i++)
+    {
+        Stream_t *stream = &conn->streams[i];
+        HandoffStream_t record;
+
+        memset(&record, 0, sizeof(record));
+        record.clientId = stream->clientId;
+        record.serverId = stream->serverId;
+        record.remaining = stream->remaining;
+        record.destHandleLen = stream->destHandleLen;
+        memcpy(record.destHandle, stream->destHandle, stream->destHandleLen);
+        putBytes(writer, &record, sizeof(record));
+    }
+}
+
+static void putFd(HandoffWriter_t *writer, int fd)
+{
+    if (writer->numFds == HANDOFF_MAX_FDS)
+    {
+        sendPacket(writer);
+    }
+    writer->fds[writer->numFds++] = fd;
+}
+
+static void putBytes(HandoffWriter_t *writer, const void *data, int len)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+
+    while (len > 0)
+    {
+        if (writer->len == HANDOFF_PACKET_SIZE)
+        {
+            sendPacket(writer);
+        }
+        int chunk = HANDOFF_PACKET_SIZE - writer->len;
+        if (chunk > len)
+        {
+            chunk = len;
+        }
+        memcpy(writer->buffer + writer->len, bytes, chunk);
+        writer->len += chunk;
+        bytes += chunk;
+        len -= chunk;
+    }
+}
+
+// One packet with what's buffered. It always has bytes in it: fds are only
+// flushed early when HANDOFF_MAX_FDS pile up, and every record adds bytes after its fds.
+static void sendPacket(HandoffWriter_t *writer)
+{
+    struct iovec iov = {writer->buffer, writer->len};
+    union
+    {
+        char buffer[CMSG_SPACE(sizeof(writer->fds))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr message;
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    if (writer->numFds > 0)
+    {
+        message.msg_control = control.buffer;
+        message.msg_controllen = CMSG_SPACE(writer->numFds * sizeof(int));
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(writer->numFds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), writer->fds, writer->numFds * sizeof(int));
+    }
+
+    if (!writer->failed && sendmsg(writer->socketNum, &message, 0) < 0)
+    {
+        writer->failed = 1;
+    }
+    writer->len = 0;
+    writer->numFds = 0;
+}
+
+// One connection's record and everything after it, NULL if it's cut short or doesn't add up
+static RestoredConn_t *getRestoredConn(HandoffReader_t *reader, int numReactors)
+{
+    RestoredConn_t *restored = (RestoredConn_t *)sCalloc(1, sizeof(RestoredConn_t));
+    HandoffConn_t *record = &restored->record;
+
+    if (getBytes(reader, record, sizeof(*record)) < 0)
+    {
+        goto fail;
+    }
+    if (record->reactorId >= (uint32_t)numReactors || record->handleLen >= MAX_TABLE_HANDLE_LEN ||
+        record->recvLen > CONN_RECV_BUFFER_SIZE || record->numChannels > MAX_CHANNELS_PER_CONN ||
+        record->numStreams > MAX_STREAMS_PER_CONN)
+    {
+        LOG_ERROR("Handoff: connection record doesn't add up\n");
+        goto fail;
+    }
+
+    for (int i = 0; i < (record->isShm ? 4 : 1); i++)
+    {
+        if ((restored->fds[i] = getFd(reader)) < 0)
+        {
+            goto fail;
+        }
+    }
+    if (getBytes(reader, restored->handle, record->handleLen) < 0)
+    {
+        goto fail;
+    }
+    if (record->recvLen > 0)
+    {
+        restored->recvData = (uint8_t *)sCalloc(1, record->recvLen);
+        if (getBytes(reader, restored->recvData, record->recvLen) < 0)
+        {
+            goto fail;
+        }
+    }
+    if (record->sendLen > 0)
+    {
+        restored->sendData = (uint8_t *)sCalloc(1, record->sendLen);
+        if (getBytes(reader, restored->sendData, record->sendLen) < 0)
+        {
+            goto fail;
+        }
+    }
+    if (record->numChannels > 0)
+    {
+        restored->channelNames = (uint8_t *)sCalloc(record->numChannels, 1 + MAX_CHANNEL_NAME_LEN);
+        for (int i = 0; i < record->numChannels; i++)
+        {
+            uint8_t *name = restored->channelNames + i * (1 + MAX_CHANNEL_NAME_LEN);
+            if (getBytes(reader, name, 1) < 0 || name[0] >= MAX_CHANNEL_NAME_LEN || getBytes(reader, name + 1, name[0]) < 0)
+            {
+                goto fail;
+            }
+        }
+    }
+    if (record->numStreams > 0)
+    {
+        restored->streams = (HandoffStream_t *)sCalloc(record->numStreams, sizeof(HandoffStream_t));
+        for (int i = 0; i < record->numStreams; i++)
+        {
+            if (getBytes(reader, &restored->streams[i], sizeof(HandoffStream_t)) < 0 ||
+                restored->streams[i].destHandleLen >= MAX_TABLE_HANDLE_LEN)
+            {
+                goto fail;
+            }
+        }
+    }
+    return restored;
+
+fail:
+    freeRestored(restored);
+    return NULL;
+}
+
+static int getFd(HandoffReader_t *reader)
+{
+    // Sent no later than the packet the record's first byte was in, which we've read by now
+    if (reader->nextFd == reader->numFds)
+    {
+        reader->failed = 1;
+        return -1;
+    }
+    return reader->fds[reader->nextFd++];
+}
+
+static int getBytes(HandoffReader_t *reader, void *data, int len)
+{
+    uint8_t *bytes = (uint8_t *)data;
+
+    while (len > 0)
+    {
+        if (reader->pos == reader->len && readPacket(reader) < 0)
+        {
+            reader->failed = 1;
+            return -1;
+        }
+        int chunk = reader->len - reader->pos;
+        if (chunk > len)
+        {
+            chunk = len;
+        }
+        memcpy(bytes, reader->buffer + reader->pos, chunk);
+        reader->pos += chunk;
+        bytes += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+// The next packet and its descriptors, -1 if the old server went away or sent more than we can take
+static int readPacket(HandoffReader_t *reader)
+{
+    union
+    {
+        char buffer[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {reader->buffer, HANDOFF_PACKET_SIZE};
+    struct msghdr message;
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    int received = recvmsg(reader->socketNum, &message, MSG_CMSG_CLOEXEC);
+    if (received <= 0 || (message.msg_flags & (MSG_CTRUNC | MSG_TRUNC)))
+    {
+        return -1;
+    }
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL; cmsg = CMSG_NXTHDR(&message, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        {
+            continue;
+        }
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (reader->numFds + count > reader->fdsSize)
+        {
+            reader->fdsSize = (reader->numFds + count) * 2;
+            reader->fds = (int *)srealloc(reader->fds, reader->fdsSize * sizeof(int));
+        }
+        memcpy(reader->fds + reader->numFds, CMSG_DATA(cmsg), count * sizeof(int));
+        reader->numFds += count;
+    }
+
+    reader->len = received;
+    reader->pos = 0;
+    return 0;
+}
+
+static void freeRestored(RestoredConn_t *restored)
+{
+    free(restored->recvData);
+    free(restored->sendData);
+    free(restored->channelNames);
+    free(restored->streams);
+    free(restored);
+}
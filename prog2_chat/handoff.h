@@ -0,0 +1,35 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdint.h>
+
+#include "connection.h"
+#include "reactor.h"
+
+#define HANDOFF_MAGIC 0x46444e48     // "HNDF"
+#define HANDOFF_VERSION 1            // bump when anything written by sendHandoff() changes
+#define HANDOFF_PACKET_SIZE (64 * 1024)
+#define HANDOFF_MAX_FDS 250          // descriptors per packet, the kernel takes at most 253
+#define HANDOFF_ACK_TIMEOUT_MS 10000 // how long the old server waits for the new one to say it has everything
+
+// The listening sockets that go to the new server along with the clients
+typedef struct
+{
+    int numReactors;
+    int serverSockets[MAX_REACTORS]; // one per reactor, all on the same port
+    int shmListenSocket;             // -1 if there is none (-U)
+    int handoffListenSocket;
+} HandoffListeners_t;
+
+void initHandoff(int numReactors);
+int handoffListen(const char *path);
+int handoffConnect(const char *path);
+
+void beginHandoff(int socketNum, HandoffListeners_t *listeners);
+int handoffPending();
+void parkForHandoff(Reactor_t *reactor, void (*closeConnection)(int socketNum));
+
+int receiveHandoff(int socketNum, HandoffListeners_t *listeners);
+void restoreConnections(Reactor_t *reactor, void (*watch)(Connection_t *conn));
+
+#endif
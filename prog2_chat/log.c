@@ -0,0 +1,414 @@
+// --------------- log.c -----------------
+/*
+Asynchronous logger for the chat server.
+
+A LOG_xxx() call copies its format pointer and arguments into a fixed size
+record in a lock-free ring (bounded multi-producer queue, Vyukov style) and
+returns; it never formats, never takes a lock and never touches stdout. A
+background thread pulls records off the ring, does the printf formatting
+and writes the text out in large batches with one write() each.
+
+If the ring is full the record is dropped and counted rather than making a
+reactor thread wait on the terminal.
+
+When the ring is empty the thread blocks on an eventfd. Only the producer
+that finds it asleep (the ring going from empty to not) writes to it, so an
+idle server's log thread never wakes and a busy one costs no syscalls.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
+#include "log.h"
+
+#define LOG_RING_SIZE 4096       // records, must be a power of 2
+#define LOG_STRING_SPACE 352     // bytes of copied string arguments per record
+#define LOG_BATCH_SIZE (64 * 1024)
+#define LOG_FLUSH_SLEEP_NS 1000000
+
+typedef struct
+{
+    uint64_t sequence;           // ring slot sequence number
+    int level;
+    int numArgs;
+    const char *fmt;
+    LogArg_t args[LOG_MAX_ARGS]; // string arguments point into strings (as an offset)
+    char strings[LOG_STRING_SPACE];
+} LogRecord_t;
+
+int logLevel = DEFAULT_LOG_LEVEL;
+
+static LogRecord_t *ring = NULL;
+static uint64_t enqueuePos __attribute__((aligned(64))) = 0;
+static uint64_t dequeuePos __attribute__((aligned(64))) = 0; // only the log thread moves it
+static uint64_t writtenPos = 0;                               // everything before this is out
+static uint64_t droppedRecords = 0;
+static pthread_t logThread;
+static int wakeFd = -1;                                       // the log thread waits on it once it's caught up
+static int sleeping = 0;                                      // set while it does (or is about to)
+
+static void *logThreadMain(void *arg);
+static int formatRecord(LogRecord_t *record, char *out, int space);
+static int64_t argAsInt(LogArg_t *arg);
+static void writeAll(const char *text, int len);
+
+void initLog(int level)
+{
+    logLevel = level;
+
+    ring = (LogRecord_t *)calloc(LOG_RING_SIZE, sizeof(LogRecord_t));
+    if (ring == NULL)
+    {
+        perror("calloc");
+        exit(-1);
+    }
+    for (uint64_t i = 0; i < LOG_RING_SIZE; i++)
+    {
+        ring[i].sequence = i;
+    }
+    wakeFd = eventfd(0, EFD_CLOEXEC);
+    if (wakeFd < 0)
+    {
+        perror("eventfd");
+        exit(-1);
+    }
+
+    if (pthread_create(&logThread, NULL, logThreadMain, NULL) != 0)
+    {
+        perror("pthread_create");
+        exit(-1);
+    }
+    pthread_detach(logThread);
+
+    // Whatever is still in the ring goes out before an exit()
+    atexit(logFlush);
+}
+
+void setLogLevel(int level)
+{
+    logLevel = level;
+}
+
+// Called by the LOG_xxx() macros once the level check passed
+void logWrite(int level, const char *fmt, LogArg_t *args, int numArgs)
+{
+    if (ring == NULL)
+    {
+        return; // initLog() hasn't run
+    }
+
+    // Claim a slot
+    uint64_t pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+    LogRecord_t *record;
+    while (1)
+    {
+        record = &ring[pos & (LOG_RING_SIZE - 1)];
+        uint64_t sequence = __atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)sequence - (int64_t)pos;
+
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&enqueuePos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            __atomic_add_fetch(&droppedRecords, 1, __ATOMIC_RELAXED); // full
+            return;
+        }
+        else
+        {
+            pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+        }
+    }
+
+    record->level = level;
+    record->fmt = fmt;
+    record->numArgs = numArgs < LOG_MAX_ARGS ? numArgs : LOG_MAX_ARGS;
+
+    // Strings are copied now, the caller's buffer may be gone by the time this is formatted
+    int used = 0;
+    for (int i = 0; i < record->numArgs; i++)
+    {
+        record->args[i] = args[i];
+        if (args[i].type == LOG_ARG_CSTR || args[i].type == LOG_ARG_STR)
+        {
+            int len = 0;
+            if (args[i].s == NULL)
+            {
+                args[i].s = "(null)";
+                args[i].type = LOG_ARG_CSTR;
+            }
+            if (args[i].type == LOG_ARG_CSTR)
+            {
+                len = strnlen(args[i].s, LOG_STRING_SPACE);
+            }
+            else
+            {
+                len = args[i].len > 0 ? args[i].len : 0;
+            }
+            if (len > LOG_STRING_SPACE - 1 - used)
+            {
+                len = LOG_STRING_SPACE - 1 - used; // truncated
+            }
+
+            memcpy(record->strings + used, args[i].s, len);
+            record->strings[used + len] = '\0';
+            record->args[i].type = LOG_ARG_STR;
+            record->args[i].len = len;
+            record->args[i].u = used;
+            used += len + 1;
+        }
+    }
+
+    __atomic_store_n(&record->sequence, pos + 1, __ATOMIC_RELEASE);
+
+    // Only the first producer since the log thread went to sleep wakes it
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); // the record before the flag, against its flag before the ring
+    if (__atomic_load_n(&sleeping, __ATOMIC_RELAXED) && __atomic_exchange_n(&sleeping, 0, __ATOMIC_ACQ_REL))
+    {
+        uint64_t one = 1;
+        if (write(wakeFd, &one, sizeof(one)) < 0)
+        {
+            perror("eventfd write");
+        }
+    }
+}
+
+// Wait (briefly) for the log thread to write out everything logged so far
+void logFlush()
+{
+    if (ring == NULL)
+    {
+        return;
+    }
+
+    uint64_t target = __atomic_load_n(&enqueuePos, __ATOMIC_ACQUIRE);
+    for (int tries = 0; tries < 1000 && __atomic_load_n(&writtenPos, __ATOMIC_ACQUIRE) < target; tries++)
+    {
+        struct timespec pause = {0, LOG_FLUSH_SLEEP_NS};
+        nanosleep(&pause, NULL);
+    }
+}
+
+static void *logThreadMain(void *arg)
+{
+    static char batch[LOG_BATCH_SIZE];
+    int batchLen = 0;
+    uint64_t reportedDrops = 0;
+
+    while (1)
+    {
+        LogRecord_t *record = &ring[dequeuePos & (LOG_RING_SIZE - 1)];
+        uint64_t sequence = __atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE);
+
+        if (sequence == dequeuePos + 1)
+        {
+            // Room for the longest line we'll make, otherwise write what we have first
+            if (LOG_BATCH_SIZE - batchLen < 4096)
+            {
+                writeAll(batch, batchLen);
+                batchLen = 0;
+            }
+            batchLen += formatRecord(record, batch + batchLen, LOG_BATCH_SIZE - batchLen);
+
+            // Hand the slot back to the producers
+            __atomic_store_n(&record->sequence, dequeuePos + LOG_RING_SIZE, __ATOMIC_RELEASE);
+            dequeuePos++;
+            continue;
+        }
+
+        // Caught up: write the batch out and sleep until there's more
+        uint64_t drops = __atomic_load_n(&droppedRecords, __ATOMIC_RELAXED);
+        if (drops != reportedDrops)
+        {
+            batchLen += snprintf(batch + batchLen, LOG_BATCH_SIZE - batchLen, "log: %llu messages dropped (ring full)\n",
+                                 (unsigned long long)(drops - reportedDrops));
+            reportedDrops = drops;
+        }
+        if (batchLen > 0)
+        {
+            writeAll(batch, batchLen);
+            batchLen = 0;
+        }
+        __atomic_store_n(&writtenPos, dequeuePos, __ATOMIC_RELEASE);
+
+        // Say so before looking one last time, so a record logged in between either is seen here or wakes us
+        __atomic_store_n(&sleeping, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) == dequeuePos + 1)
+        {
+            __atomic_store_n(&sleeping, 0, __ATOMIC_RELAXED); // a producer may still write, that's one spare wakeup
+            continue;
+        }
+        uint64_t wakeups;
+        if (read(wakeFd, &wakeups, sizeof(wakeups)) < 0 && errno != EINTR)
+        {
+            perror("eventfd read");
+        }
+    }
+    return NULL;
+}
+
+/*
+-- printf() the record's format with its captured arguments into out
+-- Each conversion is handed to snprintf() on its own with the length
+   modifier swapped for the type the argument was captured as
+-- Return value: bytes written to out (never more than space - 1)
+*/
+static int formatRecord(LogRecord_t *record, char *out, int space)
+{
+    const char *f = record->fmt;
+    int len = 0;
+    int argIndex = 0;
+
+    while (*f != '\0' && len < space - 1)
+    {
+        if (*f != '%')
+        {
+            out[len++] = *f++;
+            continue;
+        }
+        if (f[1] == '%')
+        {
+            out[len++] = '%';
+            f += 2;
+            continue;
+        }
+
+        // flags, width and precision as written ('*' takes an argument)
+        char spec[48];
+        int specLen = 0;
+        spec[specLen++] = *f++;
+        while (*f != '\0' && strchr("-+ #0123456789.*", *f) != NULL && specLen < 32)
+        {
+            if (*f == '*')
+            {
+                int64_t value = argIndex < record->numArgs ? argAsInt(&record->args[argIndex++]) : 0;
+                specLen += snprintf(spec + specLen, sizeof(spec) - specLen, "%d", (int)value);
+                f++;
+                continue;
+            }
+            spec[specLen++] = *f++;
+        }
+        while (*f != '\0' && strchr("hlLqjzt", *f) != NULL)
+        {
+            f++;
+        }
+        if (*f == '\0')
+        {
+            break;
+        }
+        char conversion = *f++;
+
+        if (argIndex >= record->numArgs)
+        {
+            len += snprintf(out + len, space - len, "<missing>");
+            continue;
+        }
+        LogArg_t *arg = &record->args[argIndex++];
+        int n = 0;
+
+        switch (conversion)
+        {
+        case 'd':
+        case 'i':
+            spec[specLen++] = 'l';
+            spec[specLen++] = 'l';
+            spec[specLen++] = conversion;
+            spec[specLen] = '\0';
+            n = snprintf(out + len, space - len, spec, (long long)argAsInt(arg));
+            break;
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+            spec[specLen++] = 'l';
+            spec[specLen++] = 'l';
+            spec[specLen++] = conversion;
+            spec[specLen] = '\0';
+            n = snprintf(out + len, space - len, spec, (unsigned long long)argAsInt(arg));
+            break;
+        case 'c':
+            spec[specLen++] = 'c';
+            spec[specLen] = '\0';
+            n = snprintf(out + len, space - len, spec, (int)argAsInt(arg));
+            break;
+        case 'e':
+        case 'E':
+        case 'f':
+        case 'F':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            spec[specLen++] = conversion;
+            spec[specLen] = '\0';
+            n = snprintf(out + len, space - len, spec, arg->type == LOG_ARG_DOUBLE ? arg->d : (double)argAsInt(arg));
+            break;
+        case 's':
+            spec[specLen++] = 's';
+            spec[specLen] = '\0';
+            n = snprintf(out + len, space - len, spec, arg->type == LOG_ARG_STR ? record->strings + arg->u : "?");
+            break;
+        case 'p':
+            n = snprintf(out + len, space - len, "%p", arg->p);
+            break;
+        default:
+            n = snprintf(out + len, space - len, "%%%c", conversion);
+            break;
+        }
+
+        if (n > space - 1 - len)
+        {
+            n = space - 1 - len; // truncated
+        }
+        len += n;
+    }
+    out[len] = '\0';
+    return len;
+}
+
+static int64_t argAsInt(LogArg_t *arg)
+{
+    switch (arg->type)
+    {
+    case LOG_ARG_INT:
+        return arg->i;
+    case LOG_ARG_UINT:
+        return (int64_t)arg->u;
+    case LOG_ARG_DOUBLE:
+        return (int64_t)arg->d;
+    case LOG_ARG_PTR:
+        return (int64_t)(intptr_t)arg->p;
+    default:
+        return 0;
+    }
+}
+
+static void writeAll(const char *text, int len)
+{
+    while (len > 0)
+    {
+        ssize_t written = write(STDOUT_FILENO, text, len);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return; // nowhere to complain to
+        }
+        text += written;
+        len -= written;
+    }
+}
@@ -0,0 +1,116 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+#define LOG_LEVEL_TRACE 4
+
+// Log calls above this level are compiled out completely (make LOG_LEVEL=n)
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_TRACE
+#endif
+
+#define DEFAULT_LOG_LEVEL LOG_LEVEL_INFO
+#define LOG_MAX_ARGS 8
+
+typedef enum
+{
+    LOG_ARG_INT,
+    LOG_ARG_UINT,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_PTR,
+    LOG_ARG_CSTR,  // null terminated, copied into the record
+    LOG_ARG_STR    // pointer + length (LOG_STR()), copied into the record
+} LogArgType;
+
+// One argument of a log call, captured by value so the formatting can happen later
+typedef struct
+{
+    LogArgType type;
+    int len;
+    union
+    {
+        int64_t i;
+        uint64_t u;
+        double d;
+        const void *p;
+        const char *s;
+    };
+} LogArg_t;
+
+extern int logLevel;
+
+void initLog(int level);
+void setLogLevel(int level);
+void logWrite(int level, const char *fmt, LogArg_t *args, int numArgs);
+void logFlush();
+
+#define LOG_ENABLED(level) ((level) <= LOG_COMPILE_LEVEL && (level) <= logLevel)
+
+/*
+Usage is printf-like: LOG_INFO("Socket %d: closed\n", socketNum);
+The arguments are copied into a fixed size record and formatted later by the
+log thread, so strings go in by value: %s arguments are copied up to their
+null terminator, and a string that isn't terminated (a handle inside a PDU)
+is passed as LOG_STR(pointer, length) instead of with %.*s. At most
+LOG_MAX_ARGS arguments. When the level is off none of them are evaluated.
+*/
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_TRACE(...) LOG_AT(LOG_LEVEL_TRACE, __VA_ARGS__)
+
+#define LOG_STR(str, length) ((LogArg_t){.type = LOG_ARG_STR, .len = (length), .s = (const char *)(str)})
+
+#define LOG_AT(level, ...)                                                                  \
+    do                                                                                      \
+    {                                                                                       \
+        if (LOG_ENABLED(level))                                                             \
+        {                                                                                   \
+            LogArg_t logArgs_[] = {{0} LOG_MAP_ARGS(__VA_ARGS__)};                          \
+            logWrite((level), LOG_FORMAT(__VA_ARGS__, ""), logArgs_ + 1,                    \
+                     sizeof(logArgs_) / sizeof(logArgs_[0]) - 1);                           \
+        }                                                                                   \
+    } while (0)
+
+// ---- argument capture plumbing ----
+
+static inline LogArg_t logArgInt(int64_t value) { LogArg_t arg = {.type = LOG_ARG_INT, .i = value}; return arg; }
+static inline LogArg_t logArgUint(uint64_t value) { LogArg_t arg = {.type = LOG_ARG_UINT, .u = value}; return arg; }
+static inline LogArg_t logArgDouble(double value) { LogArg_t arg = {.type = LOG_ARG_DOUBLE, .d = value}; return arg; }
+static inline LogArg_t logArgPtr(const void *value) { LogArg_t arg = {.type = LOG_ARG_PTR, .p = value}; return arg; }
+static inline LogArg_t logArgCstr(const char *value) { LogArg_t arg = {.type = LOG_ARG_CSTR, .s = value}; return arg; }
+static inline LogArg_t logArgSelf(LogArg_t value) { return value; }
+
+#define LOG_ARG(x) _Generic((x),                                                            \
+    LogArg_t: logArgSelf,                                                                   \
+    char: logArgInt, signed char: logArgInt, short: logArgInt, int: logArgInt,              \
+    long: logArgInt, long long: logArgInt,                                                  \
+    unsigned char: logArgUint, unsigned short: logArgUint, unsigned int: logArgUint,        \
+    unsigned long: logArgUint, unsigned long long: logArgUint,                              \
+    float: logArgDouble, double: logArgDouble,                                              \
+    char *: logArgCstr, const char *: logArgCstr,                                           \
+    default: logArgPtr)(x)
+
+#define LOG_FORMAT(fmt, ...) fmt
+#define LOG_COUNT(...) LOG_COUNT_(__VA_ARGS__, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define LOG_COUNT_(_1, _2, _3, _4, _5, _6, _7, _8, _9, n, ...) n
+#define LOG_CONCAT(a, b) LOG_CONCAT_(a, b)
+#define LOG_CONCAT_(a, b) a##b
+#define LOG_MAP_ARGS(...) LOG_CONCAT(LOG_MAP_, LOG_COUNT(__VA_ARGS__))(__VA_ARGS__)
+#define LOG_MAP_1(f)
+#define LOG_MAP_2(f, a) , LOG_ARG(a)
+#define LOG_MAP_3(f, a, b) , LOG_ARG(a), LOG_ARG(b)
+#define LOG_MAP_4(f, a, b, c) , LOG_ARG(a), LOG_ARG(b), LOG_ARG(c)
+#define LOG_MAP_5(f, a, b, c, d) , LOG_ARG(a), LOG_ARG(b), LOG_ARG(c), LOG_ARG(d)
+#define LOG_MAP_6(f, a, b, c, d, e) LOG_MAP_5(f, a, b, c, d), LOG_ARG(e)
+#define LOG_MAP_7(f, a, b, c, d, e, g) LOG_MAP_6(f, a, b, c, d, e), LOG_ARG(g)
+#define LOG_MAP_8(f, a, b, c, d, e, g, h) LOG_MAP_7(f, a, b, c, d, e, g), LOG_ARG(h)
+#define LOG_MAP_9(f, a, b, c, d, e, g, h, k) LOG_MAP_8(f, a, b, c, d, e, g, h), LOG_ARG(k)
+
+#endif
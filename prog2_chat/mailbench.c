@@ -0,0 +1,262 @@
+/******************************************************************************
+ * mailbench.c
+ *
+ * Write throughput of the offline mailbox (mailbox.c) on its own, no sockets.
+ *
+ * For each commit time in -c it starts from an empty -d directory, has -t
+ * threads append -n %m PDUs each (-s bytes of text, spread over -h handles)
+ * the way reactor threads store messages for clients that are away, and
+ * prints messages and MB a second up to the last one being on disk, how many
+ * msync() rounds that took and how many messages each one covered.  Then it
+ * opens the log again (the recovery a restarted server does) and delivers
+ * every handle's messages, timing both.  A commit time of 0 syncs every
+ * message on its own, so that run appends at most MAILBENCH_SYNC_RECORDS per
+ * thread.
+ *
+ *   ./mailbench -d /var/tmp/mailbench -t 4 -n 100000 -c 0,1,5,20
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#include "shared.h"
+#include "pduCodec.h"
+#include "mailbox.h"
+#include "benchUtil.h"
+#include "log.h"
+
+#define DEFAULT_MAIL_DIR "./mailbench.d"
+#define DEFAULT_MAIL_THREADS 4
+#define DEFAULT_MAIL_RECORDS 100000
+#define DEFAULT_MAIL_TEXT_SIZE 100
+#define DEFAULT_MAIL_HANDLES 1000
+#define DEFAULT_MAIL_COMMITS "0,1,5,20"
+#define MAILBENCH_SYNC_RECORDS 1000
+#define MAILBENCH_MAX_THREADS 64
+
+char sender_handle[MAX_HANDLE_LEN] = {0}; // makePDU.c builds PDUs for this handle
+
+// What one appending thread does
+typedef struct
+{
+    pthread_t threadId;
+    int index;
+    int numRecords;
+    int failed;
+} Appender_t;
+
+static char *mailDir = DEFAULT_MAIL_DIR;
+static int numHandles = DEFAULT_MAIL_HANDLES;
+static int textLen = DEFAULT_MAIL_TEXT_SIZE;
+static long delivered = 0; // counted by the deliver handler, the mailbox lock is held around it
+
+static void usage(char *name);
+static void runCommit(int commitMs, int numThreads, int numRecords);
+static void *appendMessages(void *arg);
+static void countDelivered(void *context, uint8_t *pdu, int pduLen);
+static void handleName(char *handle, int index);
+static void clearDir();
+
+int main(int argc, char *argv[])
+{
+    int numThreads = DEFAULT_MAIL_THREADS;
+    int numRecords = DEFAULT_MAIL_RECORDS;
+    char *commits = DEFAULT_MAIL_COMMITS;
+    int option;
+
+    while ((option = getopt(argc, argv, "d:t:n:s:h:c:")) != -1)
+    {
+        switch (option)
+        {
+        case 'd':
+            mailDir = optarg;
+            break;
+        case 't':
+            numThreads = atoi(optarg);
+            break;
+        case 'n':
+            numRecords = atoi(optarg);
+            break;
+        case 's':
+            textLen = atoi(optarg);
+            break;
+        case 'h':
+            numHandles = atoi(optarg);
+            break;
+        case 'c':
+            commits = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (numThreads < 1 || numThreads > MAILBENCH_MAX_THREADS || numRecords < 1 || textLen < 0 ||
+        textLen > MAX_MSG_SIZE || numHandles < 1)
+    {
+        usage(argv[0]);
+    }
+
+    initLog(LOG_LEVEL_WARN);
+    initHandleTable(); // empty, mailboxStore() looks every handle up in it like the server's
+    printf("%-10s %10s %12s %10s %10s %12s %12s %14s\n", "commit ms", "messages", "msgs/s", "MB/s", "commits",
+           "msgs/commit", "reopen ms", "delivered/s");
+    for (char *commit = strtok(commits, ","); commit != NULL; commit = strtok(NULL, ","))
+    {
+        int commitMs = atoi(commit);
+        if (commitMs < 0)
+        {
+            usage(argv[0]);
+        }
+        runCommit(commitMs, numThreads, (commitMs == 0 && numRecords > MAILBENCH_SYNC_RECORDS) ? MAILBENCH_SYNC_RECORDS : numRecords);
+    }
+    clearDir();
+    return 0;
+}
+
+static void usage(char *name)
+{
+    fprintf(stderr, "Usage: %s [-d directory] [-t threads, up to %d] [-n messages per thread] [-s text size, up to %d] [-h handles] [-c commit ms,commit ms,...]\n",
+            name, MAILBENCH_MAX_THREADS, MAX_MSG_SIZE);
+    exit(1);
+}
+
+// One row: append from every thread, reopen, deliver
+static void runCommit(int commitMs, int numThreads, int numRecords)
+{
+    Appender_t appenders[MAILBENCH_MAX_THREADS];
+    char handle[MAX_HANDLE_LEN];
+    MailboxStats_t stats;
+
+    clearDir();
+    if (openMailbox(mailDir, commitMs) < 0)
+    {
+        exit(-1);
+    }
+    for (int i = 0; i < numHandles; i++)
+    {
+        handleName(handle, i);
+        mailboxRegister(handle, strlen(handle));
+    }
+
+    uint64_t start = benchNowNanos();
+    for (int i = 0; i < numThreads; i++)
+    {
+        appenders[i].index = i;
+        appenders[i].numRecords = numRecords;
+        appenders[i].failed = 0;
+        if (pthread_create(&appenders[i].threadId, NULL, appendMessages, &appenders[i]) != 0)
+        {
+            perror("pthread_create");
+            exit(-1);
+        }
+    }
+    int failed = 0;
+    for (int i = 0; i < numThreads; i++)
+    {
+        pthread_join(appenders[i].threadId, NULL);
+        failed += appenders[i].failed;
+    }
+    mailboxCommit(); // whatever the last group hasn't synced yet
+    uint64_t appended = benchNowNanos();
+    getMailboxStats(&stats);
+    closeMailbox();
+    if (failed > 0)
+    {
+        fprintf(stderr, "%d messages weren't stored\n", failed);
+    }
+
+    // A restarted server's view of the same log
+    uint64_t reopenStart = benchNowNanos();
+    if (openMailbox(mailDir, commitMs) < 0)
+    {
+        exit(-1);
+    }
+    uint64_t reopened = benchNowNanos();
+    delivered = 0;
+    for (int i = 0; i < numHandles; i++)
+    {
+        handleName(handle, i);
+        mailboxDeliver(handle, strlen(handle), countDelivered, NULL);
+    }
+    uint64_t deliverEnd = benchNowNanos();
+    closeMailbox();
+    if (delivered != (long)stats.stored)
+    {
+        fprintf(stderr, "%ld messages delivered after reopening, %llu were stored\n", delivered,
+                (unsigned long long)stats.stored);
+    }
+
+    double seconds = (appended - start) / 1e9;
+    printf("%-10d %10llu %12.0f %10.1f %10llu %12.1f %12.1f %14.0f\n", commitMs, (unsigned long long)stats.stored,
+           stats.stored / seconds, stats.bytes / seconds / 1e6, (unsigned long long)stats.commits,
+           stats.commits > 0 ? (double)stats.committed / stats.commits : 0.0, (reopened - reopenStart) / 1e6,
+           delivered / ((deliverEnd - reopened) / 1e9));
+}
+
+// An appender: %m PDUs to the handles in turn, stored the way the server stores them
+static void *appendMessages(void *arg)
+{
+    Appender_t *appender = (Appender_t *)arg;
+    char text[MAX_MSG_SIZE];
+    char handle[MAX_HANDLE_LEN];
+    uint8_t pdu[MAXBUF];
+    PduView_t view;
+
+    memset(text, 'a' + appender->index % 26, sizeof(text));
+    for (int i = 0; i < appender->numRecords; i++)
+    {
+        handleName(handle, (appender->index * appender->numRecords + i) % numHandles);
+        pduStart(&view, 0x05);
+        pduAddHandle(&view, "mailbench", 9);
+        pduAddHandle(&view, handle, strlen(handle));
+        pduSetText(&view, text, textLen);
+        int pduLen = pduEncode(pdu, sizeof(pdu), PDU_TO_SERVER, &view);
+
+        ConnRef_t dest;
+        if (mailboxStore(handle, strlen(handle), pdu, pduLen, &dest) != 0)
+        {
+            appender->failed++;
+        }
+    }
+    return NULL;
+}
+
+static void countDelivered(void *context, uint8_t *pdu, int pduLen)
+{
+    delivered++;
+}
+
+static void handleName(char *handle, int index)
+{
+    snprintf(handle, MAX_HANDLE_LEN, "away%d", index);
+}
+
+// The mailbox's own files only, anything else in -d is left alone
+static void clearDir()
+{
+    DIR *dir = opendir(mailDir);
+    struct dirent *file;
+    char path[4096];
+
+    if (dir == NULL)
+    {
+        return;
+    }
+    while ((file = readdir(dir)) != NULL)
+    {
+        int nameLen = strlen(file->d_name);
+        if (strcmp(file->d_name, "lock") == 0 || strcmp(file->d_name, "handles") == 0 || (nameLen > 4 && strcmp(file->d_name + nameLen - 4, ".log") == 0))
+        {
+            snprintf(path, sizeof(path), "%s/%s", mailDir, file->d_name);
+            unlink(path);
+        }
+    }
+    closedir(dir);
+    rmdir(mailDir);
+}
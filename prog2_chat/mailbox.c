@@ -0,0 +1,807 @@
+// --------------- mailbox.c -----------------
+/*
+Offline mailbox (-M dir): a %m or %c to a handle that isn't logged in is
+kept here instead of being answered with 0x07, and handed to the handle
+the next time it logs in.
+
+Everything is one append-only log of records, split into
+MAILBOX_SEGMENT_SIZE files (dir/00000001.log, ...) that are each mapped
+whole, so an append is a memcpy under the mailbox lock and nothing else:
+    [length 4][checksum 4][type][handle len][handle][payload]
+A message record's payload is the PDU as it came in. A delivered record's
+is the position of the last message handed over, everything up to it for
+that handle is done with. Lengths are in host order, the files never
+leave the machine. The length is written last, and a record whose
+checksum doesn't match (a crash part way through one) ends the segment.
+
+An index hashed by handle keeps the positions of each handle's pending
+messages, so a login hands them over in order without reading anything
+else. At startup the index is rebuilt by reading the segments through.
+The handles themselves are appended to dir/handles the first time each
+one logs in ([len][handle], synced with the next commit), so a restarted
+server still keeps messages for a handle that has nothing waiting.
+
+Group commit: reactor threads never wait for the disk. A commit thread
+wakes on the first append, waits commitMs for more to join it, then
+msync()s everything appended since the last commit at once. With a
+commit time of 0 every append is synced before it returns instead.
+Segments at the head of the log whose messages have all been delivered
+are deleted (only from the head, so a delivered record is never gone
+while the messages it covers are still there).
+
+The directory is locked with flock(), so a new server taking over with -X
+waits here for the old one to exit before reading the log.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include "mailbox.h"
+#include "handle_table.h"
+#include "safeUtil.h"
+#include "log.h"
+
+#define RECORD_HEADER_LEN 10        // length, checksum, type, handle length
+#define RECORD_MESSAGE 1
+#define RECORD_DELIVERED 2
+
+#define POSITION(seq, offset) (((uint64_t)(seq) << 32) | (uint32_t)(offset))
+#define POSITION_SEQ(position) ((uint32_t)((position) >> 32))
+#define POSITION_OFFSET(position) ((uint32_t)(position))
+
+// One log file
+typedef struct
+{
+    uint32_t seq;
+    int fd;
+    uint8_t *map;
+    uint32_t size;
+    uint32_t used;                  // bytes of records in it
+    uint32_t synced;                // bytes of those known to be on disk
+    int pending;                    // messages in it not delivered yet
+} Segment_t;
+
+// A handle the mailbox keeps messages for, and where they are
+typedef struct MailboxEntry
+{
+    struct MailboxEntry *next;      // next entry in the same bucket
+    uint32_t hash;
+    int handleLen;
+    char handle[MAX_TABLE_HANDLE_LEN];
+    uint64_t *positions;            // pending messages, oldest first
+    int numPending;
+    int capacity;
+} MailboxEntry_t;
+
+static int enabled = 0;
+static int commitMs = MAILBOX_DEFAULT_COMMIT_MS;
+static char *directory = NULL;
+static int dirFd = -1;
+static int lockFd = -1;
+static int handlesFd = -1;            // dir/handles, every handle that has logged in
+static int handlesDirty = 0;          // written to since the last commit
+static long pageSize = 4096;
+
+static pthread_mutex_t mailboxLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t appendedCond = PTHREAD_COND_INITIALIZER;
+static pthread_t commitThreadId;
+static int commitThreadRunning = 0;
+static int stopping = 0;
+
+static Segment_t **segments = NULL;   // oldest first, the last one is appended to
+static int numSegments = 0;
+static int segmentCapacity = 0;
+static MailboxEntry_t **buckets = NULL;
+static MailboxStats_t stats;
+
+static void *commitThread(void *arg);
+static void commitAppended();
+static void reclaimSegments();
+static uint64_t appendRecord(uint8_t type, const char *handle, int handleLen, const void *payload, int payloadLen);
+static Segment_t *openSegment(uint32_t seq, int create);
+static Segment_t *findSegment(uint32_t seq);
+static int readSegment(Segment_t *segment);
+static int readHandles();
+static int compareSeqs(const void *a, const void *b);
+static MailboxEntry_t *findEntry(const char *handle, int handleLen, int create);
+static void dropPending(MailboxEntry_t *entry, uint64_t upTo);
+static uint32_t checksum(const uint8_t *data, int len);
+static uint32_t hashHandle(const char *handle, int handleLen);
+static void closeAtExit();
+
+/*
+-- Open (or make) the mailbox in dir and read what's already in it
+-- commitMs: how long a commit waits for more appends, 0 to sync each one
+-- Return value: 0, -1 if dir can't be used or another server has it
+*/
+int openMailbox(const char *dir, int commitTime)
+{
+    static int atExitSet = 0;
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+    {
+        LOG_ERROR("Mailbox %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    dirFd = open(dir, O_RDONLY | O_DIRECTORY);
+    char lockPath[4096];
+    snprintf(lockPath, sizeof(lockPath), "%s/lock", dir);
+    lockFd = open(lockPath, O_RDWR | O_CREAT, 0644);
+    if (dirFd < 0 || lockFd < 0)
+    {
+        LOG_ERROR("Mailbox %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    int tries = 0;
+    while (flock(lockFd, LOCK_EX | LOCK_NB) < 0)
+    {
+        if (++tries == MAILBOX_LOCK_TRIES)
+        {
+            LOG_ERROR("Mailbox %s is in use by another server\n", dir);
+            close(lockFd);
+            close(dirFd);
+            return -1;
+        }
+        usleep(100000);
+    }
+
+    directory = strdup(dir);
+    commitMs = commitTime;
+    pageSize = sysconf(_SC_PAGESIZE);
+    buckets = (MailboxEntry_t **)sCalloc(MAILBOX_INDEX_BUCKETS, sizeof(MailboxEntry_t *));
+    memset(&stats, 0, sizeof(stats));
+    if (readHandles() < 0)
+    {
+        LOG_ERROR("Mailbox %s/handles: %s\n", dir, strerror(errno));
+        return -1;
+    }
+
+    // Every segment there, oldest first
+    DIR *dirStream = fdopendir(dup(dirFd));
+    uint32_t *seqs = NULL;
+    int numSeqs = 0;
+    struct dirent *file;
+    while (dirStream != NULL && (file = readdir(dirStream)) != NULL)
+    {
+        uint32_t seq;
+        char suffix[8];
+        if (sscanf(file->d_name, "%8u.%7s", &seq, suffix) == 2 && strcmp(suffix, "log") == 0 && seq > 0)
+        {
+            seqs = (uint32_t *)srealloc(seqs, (numSeqs + 1) * sizeof(uint32_t));
+            seqs[numSeqs++] = seq;
+        }
+    }
+    if (dirStream != NULL)
+    {
+        closedir(dirStream);
+    }
+    if (numSeqs > 0)
+    {
+        qsort(seqs, numSeqs, sizeof(uint32_t), compareSeqs);
+    }
+
+    for (int i = 0; i < numSeqs; i++)
+    {
+        Segment_t *segment = openSegment(seqs[i], 0);
+        if (segment != NULL && readSegment(segment) < 0 && i < numSeqs - 1)
+        {
+            LOG_WARN("Mailbox segment %u ends in a damaged record, the rest of it is skipped\n", seqs[i]);
+        }
+    }
+    free(seqs);
+
+    if (numSegments > 0)
+    {
+        // The end of the log might be the remains of a record cut off by a crash, appends go over it
+        Segment_t *last = segments[numSegments - 1];
+        memset(last->map + last->used, 0, last->size - last->used);
+    }
+    enabled = 1;
+    reclaimSegments();
+    LOG_INFO("Mailbox %s: %llu messages waiting in %d segments\n", dir, (unsigned long long)stats.pending, numSegments);
+
+    stopping = 0;
+    if (commitMs > 0)
+    {
+        if (pthread_create(&commitThreadId, NULL, commitThread, NULL) != 0)
+        {
+            perror("pthread_create");
+            exit(-1);
+        }
+        commitThreadRunning = 1;
+    }
+    if (!atExitSet)
+    {
+        // An exit() (the old server's after a handoff too) commits what's been appended
+        atexit(closeAtExit);
+        atExitSet = 1;
+    }
+    return 0;
+}
+
+// Commit everything, stop the commit thread and let go of the directory
+void closeMailbox()
+{
+    pthread_mutex_lock(&mailboxLock);
+    if (!enabled)
+    {
+        pthread_mutex_unlock(&mailboxLock);
+        return;
+    }
+    stopping = 1;
+    pthread_cond_signal(&appendedCond);
+    pthread_mutex_unlock(&mailboxLock);
+    if (commitThreadRunning)
+    {
+        pthread_join(commitThreadId, NULL);
+        commitThreadRunning = 0;
+    }
+
+    pthread_mutex_lock(&mailboxLock);
+    commitAppended();
+    enabled = 0;
+    for (int i = 0; i < numSegments; i++)
+    {
+        munmap(segments[i]->map, segments[i]->size);
+        close(segments[i]->fd);
+        free(segments[i]);
+    }
+    free(segments);
+    segments = NULL;
+    numSegments = segmentCapacity = 0;
+    for (int i = 0; i < MAILBOX_INDEX_BUCKETS; i++)
+    {
+        while (buckets[i] != NULL)
+        {
+            MailboxEntry_t *entry = buckets[i];
+            buckets[i] = entry->next;
+            free(entry->positions);
+            free(entry);
+        }
+    }
+    free(buckets);
+    buckets = NULL;
+    free(directory);
+    directory = NULL;
+    close(handlesFd);
+    close(dirFd);
+    close(lockFd); // and the lock with it
+    pthread_mutex_unlock(&mailboxLock);
+}
+
+int mailboxEnabled()
+{
+    return enabled;
+}
+
+// A handle that logged in: from now on messages to it are kept while it's away
+void mailboxRegister(const char *handle, int handleLen)
+{
+    pthread_mutex_lock(&mailboxLock);
+    if (enabled && findEntry(handle, handleLen, 0) == NULL && findEntry(handle, handleLen, 1) != NULL)
+    {
+        // New to the mailbox: remembered in dir/handles for the next start
+        uint8_t record[1 + MAX_TABLE_HANDLE_LEN];
+        record[0] = handleLen;
+        memcpy(record + 1, handle, handleLen);
+        if (write(handlesFd, record, 1 + handleLen) != 1 + handleLen)
+        {
+            LOG_ERROR("Mailbox %s/handles: %s\n", directory, strerror(errno));
+        }
+        if (commitMs == 0)
+        {
+            fdatasync(handlesFd);
+        }
+        else
+        {
+            handlesDirty = 1;
+            pthread_cond_signal(&appendedCond);
+        }
+    }
+    pthread_mutex_unlock(&mailboxLock);
+}
+
+/*
+-- Keep pdu (flag and on) for handle until it logs in
+-- The handle is looked up again with the mailbox locked: a login adds its
+   handle before mailboxDeliver() takes the lock, so one that came in since
+   the sender's lookup is either seen here or finds the message there
+-- Return value: 0, 1 if the handle is logged in after all (dest is where,
+   the caller sends it on), -1 if the mailbox doesn't know the handle,
+   already holds MAILBOX_MAX_PENDING for it or the log can't grow
+*/
+int mailboxStore(const char *handle, int handleLen, const uint8_t *pdu, int pduLen, ConnRef_t *dest)
+{
+    int result = -1;
+
+    pthread_mutex_lock(&mailboxLock);
+    if (enabled && lookupHandle(handle, handleLen, dest) == 0)
+    {
+        pthread_mutex_unlock(&mailboxLock);
+        return 1;
+    }
+    MailboxEntry_t *entry = enabled ? findEntry(handle, handleLen, 0) : NULL;
+    if (entry != NULL && entry->numPending < MAILBOX_MAX_PENDING)
+    {
+        uint64_t position = appendRecord(RECORD_MESSAGE, handle, handleLen, pdu, pduLen);
+        if (position != 0)
+        {
+            if (entry->numPending == entry->capacity)
+            {
+                entry->capacity = entry->capacity ? entry->capacity * 2 : 8;
+                entry->positions = (uint64_t *)srealloc(entry->positions, entry->capacity * sizeof(uint64_t));
+            }
+            entry->positions[entry->numPending++] = position;
+            segments[numSegments - 1]->pending++;
+            stats.stored++;
+            stats.pending++;
+            result = 0;
+        }
+    }
+    pthread_mutex_unlock(&mailboxLock);
+    return result;
+}
+
+/*
+-- Hand every message waiting for handle to handler, oldest first, then
+   log that they're delivered
+-- handler gets the PDU where it sits in the log, and is called with the
+   mailbox locked (it must not call back in here)
+-- Return value: how many there were
+*/
+int mailboxDeliver(const char *handle, int handleLen, PDUHandler handler, void *context)
+{
+    int delivered = 0;
+
+    pthread_mutex_lock(&mailboxLock);
+    MailboxEntry_t *entry = enabled ? findEntry(handle, handleLen, 0) : NULL;
+    if (entry != NULL && entry->numPending > 0)
+    {
+        for (int i = 0; i < entry->numPending; i++)
+        {
+            Segment_t *segment = findSegment(POSITION_SEQ(entry->positions[i]));
+            uint8_t *record = segment->map + POSITION_OFFSET(entry->positions[i]);
+            uint32_t recordLen;
+
+            memcpy(&recordLen, record, 4);
+            handler(context, record + RECORD_HEADER_LEN + record[9], recordLen - RECORD_HEADER_LEN - record[9]);
+            segment->pending--;
+        }
+        uint64_t last = entry->positions[entry->numPending - 1];
+        appendRecord(RECORD_DELIVERED, handle, handleLen, &last, sizeof(last));
+
+        delivered = entry->numPending;
+        entry->numPending = 0;
+        stats.delivered += delivered;
+        stats.pending -= delivered;
+        if (commitMs == 0)
+        {
+            reclaimSegments(); // no commit thread to do it
+        }
+    }
+    pthread_mutex_unlock(&mailboxLock);
+    return delivered;
+}
+
+// Sync whatever has been appended now instead of at the next commit
+void mailboxCommit()
+{
+    pthread_mutex_lock(&mailboxLock);
+    if (enabled)
+    {
+        commitAppended();
+    }
+    pthread_mutex_unlock(&mailboxLock);
+}
+
+void getMailboxStats(MailboxStats_t *out)
+{
+    pthread_mutex_lock(&mailboxLock);
+    *out = stats;
+    out->segments = numSegments;
+    pthread_mutex_unlock(&mailboxLock);
+}
+
+// Group commit: wake on an append, give others commitMs to join it, sync them all together
+static void *commitThread(void *arg)
+{
+    struct timespec wait = {commitMs / 1000, (commitMs % 1000) * 1000000L};
+
+    pthread_mutex_lock(&mailboxLock);
+    while (!stopping)
+    {
+        if (stats.committed == stats.records && !handlesDirty)
+        {
+            pthread_cond_wait(&appendedCond, &mailboxLock);
+            continue;
+        }
+        pthread_mutex_unlock(&mailboxLock);
+        nanosleep(&wait, NULL);
+        pthread_mutex_lock(&mailboxLock);
+
+        commitAppended();
+        reclaimSegments();
+    }
+    pthread_mutex_unlock(&mailboxLock);
+    return NULL;
+}
+
+/*
+-- msync() everything appended since the last commit (called locked, the
+   lock is let go while the disk works so appends carry on)
+-- Only the commit thread and closeMailbox() get here with a commit thread
+   running, and only they unmap segments, so none goes away under an msync()
+*/
+static void commitAppended()
+{
+    Segment_t *toSync[MAILBOX_SYNC_BATCH];
+    uint32_t syncTo[MAILBOX_SYNC_BATCH];
+    int numToSync = 0;
+    uint64_t records = stats.records;
+    int syncHandles = handlesDirty;
+
+    for (int i = 0; i < numSegments && numToSync < MAILBOX_SYNC_BATCH; i++)
+    {
+        if (segments[i]->synced < segments[i]->used)
+        {
+            toSync[numToSync] = segments[i];
+            syncTo[numToSync++] = segments[i]->used;
+        }
+    }
+    if (numToSync == 0 && !syncHandles)
+    {
+        stats.committed = records;
+        return;
+    }
+    handlesDirty = 0;
+    if (numToSync == MAILBOX_SYNC_BATCH)
+    {
+        records = stats.committed; // more than one round's worth, the next one finishes it
+    }
+
+    pthread_mutex_unlock(&mailboxLock);
+    if (syncHandles && fdatasync(handlesFd) < 0)
+    {
+        LOG_ERROR("Mailbox handles: fdatasync: %s\n", strerror(errno));
+    }
+    for (int i = 0; i < numToSync; i++)
+    {
+        uint32_t from = toSync[i]->synced & ~(pageSize - 1);
+        if (msync(toSync[i]->map + from, syncTo[i] - from, MS_SYNC) < 0)
+        {
+            LOG_ERROR("Mailbox segment %u: msync: %s\n", toSync[i]->seq, strerror(errno));
+        }
+    }
+    pthread_mutex_lock(&mailboxLock);
+
+    for (int i = 0; i < numToSync; i++)
+    {
+        if (syncTo[i] > toSync[i]->synced)
+        {
+            toSync[i]->synced = syncTo[i];
+        }
+    }
+    if (records > stats.committed)
+    {
+        stats.committed = records;
+    }
+    stats.commits++;
+}
+
+// Delete segments off the head of the log once everything in them has been delivered
+static void reclaimSegments()
+{
+    int removed = 0;
+
+    while (removed < numSegments - 1 && segments[removed]->pending == 0)
+    {
+        Segment_t *segment = segments[removed++];
+        char path[4096];
+
+        snprintf(path, sizeof(path), "%s/%08u.log", directory, segment->seq);
+        munmap(segment->map, segment->size);
+        close(segment->fd);
+        unlink(path);
+        LOG_DEBUG("Mailbox segment %u deleted\n", segment->seq);
+        free(segment);
+    }
+    if (removed > 0)
+    {
+        memmove(segments, segments + removed, (numSegments - removed) * sizeof(Segment_t *));
+        numSegments -= removed;
+    }
+}
+
+/*
+-- Add a record to the end of the log (locked), starting a new segment if
+   it doesn't fit in this one
+-- Return value: its position, 0 if a new segment couldn't be made
+*/
+static uint64_t appendRecord(uint8_t type, const char *handle, int handleLen, const void *payload, int payloadLen)
+{
+    uint32_t recordLen = RECORD_HEADER_LEN + handleLen + payloadLen;
+    Segment_t *segment = (numSegments > 0) ? segments[numSegments - 1] : NULL;
+
+    if (segment == NULL || segment->used + recordLen > segment->size)
+    {
+        segment = openSegment((segment != NULL) ? segment->seq + 1 : 1, 1);
+        if (segment == NULL)
+        {
+            return 0;
+        }
+    }
+
+    uint8_t *record = segment->map + segment->used;
+    record[8] = type;
+    record[9] = handleLen;
+    memcpy(record + RECORD_HEADER_LEN, handle, handleLen);
+    memcpy(record + RECORD_HEADER_LEN + handleLen, payload, payloadLen);
+    uint32_t sum = checksum(record + 8, recordLen - 8);
+    memcpy(record + 4, &sum, 4);
+    __atomic_store_n((uint32_t *)record, recordLen, __ATOMIC_RELEASE); // last, it's what makes the record there
+
+    uint64_t position = POSITION(segment->seq, segment->used);
+    segment->used += recordLen;
+    stats.bytes += recordLen;
+    stats.records++;
+
+    if (commitMs == 0)
+    {
+        uint32_t from = POSITION_OFFSET(position) & ~(pageSize - 1);
+        msync(segment->map + from, segment->used - from, MS_SYNC);
+        segment->synced = segment->used;
+        stats.committed = stats.records;
+        stats.commits++;
+    }
+    else if (stats.records == stats.committed + 1)
+    {
+        pthread_cond_signal(&appendedCond); // the first since the last commit
+    }
+    return position;
+}
+
+// Map segment seq, making it (MAILBOX_SEGMENT_SIZE of zeros) if create is set, and add it to the end
+static Segment_t *openSegment(uint32_t seq, int create)
+{
+    char path[4096];
+    struct stat info;
+
+    snprintf(path, sizeof(path), "%s/%08u.log", directory, seq);
+    int fd = open(path, O_RDWR | (create ? O_CREAT | O_EXCL : 0), 0644);
+    if (fd < 0 || (create && ftruncate(fd, MAILBOX_SEGMENT_SIZE) < 0) || fstat(fd, &info) < 0 ||
+        info.st_size < RECORD_HEADER_LEN || info.st_size > UINT32_MAX)
+    {
+        LOG_ERROR("Mailbox segment %s: %s\n", path, (fd < 0 || create) ? strerror(errno) : "bad size");
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return NULL;
+    }
+    uint8_t *map = (uint8_t *)mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        LOG_ERROR("Mailbox segment %s: mmap: %s\n", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    if (create)
+    {
+        fsync(dirFd); // the new file's name has to survive a crash too
+    }
+
+    Segment_t *segment = (Segment_t *)sCalloc(1, sizeof(Segment_t));
+    segment->seq = seq;
+    segment->fd = fd;
+    segment->map = map;
+    segment->size = info.st_size;
+
+    if (numSegments == segmentCapacity)
+    {
+        segmentCapacity = segmentCapacity ? segmentCapacity * 2 : 16;
+        segments = (Segment_t **)srealloc(segments, segmentCapacity * sizeof(Segment_t *));
+    }
+    segments[numSegments++] = segment;
+    return segment;
+}
+
+// Segments are in seq order (with a gap only if one couldn't be opened at startup)
+static Segment_t *findSegment(uint32_t seq)
+{
+    int low = 0;
+    int high = numSegments - 1;
+
+    while (low <= high)
+    {
+        int middle = (low + high) / 2;
+        if (segments[middle]->seq == seq)
+        {
+            return segments[middle];
+        }
+        if (segments[middle]->seq < seq)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle - 1;
+        }
+    }
+    return NULL;
+}
+
+/*
+-- Read a segment's records into the index at startup
+-- Return value: 0, -1 if it stopped at a damaged record before the end
+*/
+static int readSegment(Segment_t *segment)
+{
+    uint32_t offset = 0;
+
+    while (segment->size - offset >= RECORD_HEADER_LEN)
+    {
+        uint8_t *record = segment->map + offset;
+        uint32_t recordLen, sum;
+
+        memcpy(&recordLen, record, 4);
+        memcpy(&sum, record + 4, 4);
+        if (recordLen == 0)
+        {
+            break; // the end
+        }
+        if (recordLen < RECORD_HEADER_LEN || recordLen > segment->size - offset ||
+            RECORD_HEADER_LEN + record[9] > recordLen || sum != checksum(record + 8, recordLen - 8))
+        {
+            segment->used = segment->synced = offset;
+            return -1;
+        }
+
+        const char *handle = (const char *)record + RECORD_HEADER_LEN;
+        int handleLen = record[9];
+        MailboxEntry_t *entry = findEntry(handle, handleLen, 1);
+        if (record[8] == RECORD_MESSAGE && entry != NULL)
+        {
+            if (entry->numPending == entry->capacity)
+            {
+                entry->capacity = entry->capacity ? entry->capacity * 2 : 8;
+                entry->positions = (uint64_t *)srealloc(entry->positions, entry->capacity * sizeof(uint64_t));
+            }
+            entry->positions[entry->numPending++] = POSITION(segment->seq, offset);
+            segment->pending++;
+            stats.pending++;
+        }
+        else if (record[8] == RECORD_DELIVERED && entry != NULL && recordLen - RECORD_HEADER_LEN - handleLen == 8)
+        {
+            uint64_t upTo;
+            memcpy(&upTo, record + RECORD_HEADER_LEN + handleLen, 8);
+            dropPending(entry, upTo);
+        }
+        offset += recordLen;
+    }
+    segment->used = segment->synced = offset;
+    return 0;
+}
+
+/*
+-- Open dir/handles and make an entry for every handle in it
+-- A handle cut off part way (a crash in the middle of writing it) is
+   dropped, the next one is written over it
+-- Return value: 0, -1 if it can't be opened
+*/
+static int readHandles()
+{
+    char path[4096];
+    struct stat info;
+
+    snprintf(path, sizeof(path), "%s/handles", directory);
+    handlesFd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (handlesFd < 0 || fstat(handlesFd, &info) < 0)
+    {
+        return -1;
+    }
+    uint8_t *handles = (uint8_t *)sCalloc(1, info.st_size + 1);
+    int size = (pread(handlesFd, handles, info.st_size, 0) == info.st_size) ? info.st_size : 0;
+    int offset = 0;
+
+    while (offset < size && handles[offset] > 0 && handles[offset] < MAX_TABLE_HANDLE_LEN &&
+           offset + 1 + handles[offset] <= size)
+    {
+        findEntry((const char *)handles + offset + 1, handles[offset], 1);
+        offset += 1 + handles[offset];
+    }
+    if (offset < info.st_size && ftruncate(handlesFd, offset) < 0)
+    {
+        LOG_WARN("Mailbox %s: can't drop a damaged handle: %s\n", path, strerror(errno));
+    }
+    free(handles);
+    return 0;
+}
+
+static int compareSeqs(const void *a, const void *b)
+{
+    uint32_t first = *(const uint32_t *)a;
+    uint32_t second = *(const uint32_t *)b;
+    return (first > second) - (first < second);
+}
+
+// The handle's entry (locked), made if create is set. NULL if there isn't one or the handle is too long
+static MailboxEntry_t *findEntry(const char *handle, int handleLen, int create)
+{
+    if (handleLen <= 0 || handleLen >= MAX_TABLE_HANDLE_LEN)
+    {
+        return NULL;
+    }
+    uint32_t hash = hashHandle(handle, handleLen);
+    MailboxEntry_t **bucket = &buckets[hash & (MAILBOX_INDEX_BUCKETS - 1)];
+
+    for (MailboxEntry_t *entry = *bucket; entry != NULL; entry = entry->next)
+    {
+        if (entry->hash == hash && entry->handleLen == handleLen && memcmp(entry->handle, handle, handleLen) == 0)
+        {
+            return entry;
+        }
+    }
+    if (!create)
+    {
+        return NULL;
+    }
+    MailboxEntry_t *entry = (MailboxEntry_t *)sCalloc(1, sizeof(MailboxEntry_t));
+    entry->hash = hash;
+    entry->handleLen = handleLen;
+    memcpy(entry->handle, handle, handleLen);
+    entry->next = *bucket;
+    *bucket = entry;
+    return entry;
+}
+
+// A delivered record read at startup: the messages up to it are done with
+static void dropPending(MailboxEntry_t *entry, uint64_t upTo)
+{
+    int dropped = 0;
+
+    while (dropped < entry->numPending && entry->positions[dropped] <= upTo)
+    {
+        Segment_t *segment = findSegment(POSITION_SEQ(entry->positions[dropped]));
+        if (segment != NULL)
+        {
+            segment->pending--;
+        }
+        dropped++;
+    }
+    memmove(entry->positions, entry->positions + dropped, (entry->numPending - dropped) * sizeof(uint64_t));
+    entry->numPending -= dropped;
+    stats.pending -= dropped;
+}
+
+// FNV-1a, enough to tell a whole record from one a crash cut short
+static uint32_t checksum(const uint8_t *data, int len)
+{
+    uint32_t hash = 2166136261u;
+
+    for (int i = 0; i < len; i++)
+    {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t hashHandle(const char *handle, int handleLen)
+{
+    return checksum((const uint8_t *)handle, handleLen);
+}
+
+static void closeAtExit()
+{
+    closeMailbox();
+}
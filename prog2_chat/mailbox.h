@@ -0,0 +1,37 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include <stdint.h>
+#include "sendreceive.h"
+#include "handle_table.h"
+
+#define MAILBOX_SEGMENT_SIZE (16 * 1024 * 1024)  // each log file, mapped whole
+#define MAILBOX_DEFAULT_COMMIT_MS 5             // how long a commit waits for more records to join it
+#define MAILBOX_MAX_PENDING 10000               // messages kept for one handle, more are refused
+#define MAILBOX_INDEX_BUCKETS 4096              // must be a power of 2
+#define MAILBOX_SYNC_BATCH 16                   // segments synced by one commit
+#define MAILBOX_LOCK_TRIES 50                   // 100 ms apart, for the server we took over from to exit
+
+// How the log is doing, for the admin socket and mailbench
+typedef struct
+{
+    uint64_t stored;              // messages appended
+    uint64_t delivered;
+    uint64_t pending;             // stored and not delivered yet
+    uint64_t bytes;               // appended to the log, every kind of record
+    uint64_t records;
+    uint64_t commits;             // msync() rounds
+    uint64_t committed;           // records made durable by them
+    int segments;                 // log files on disk
+} MailboxStats_t;
+
+int openMailbox(const char *dir, int commitMs);
+void closeMailbox();
+int mailboxEnabled();
+void mailboxRegister(const char *handle, int handleLen);
+int mailboxStore(const char *handle, int handleLen, const uint8_t *pdu, int pduLen, ConnRef_t *dest);
+int mailboxDeliver(const char *handle, int handleLen, PDUHandler handler, void *context);
+void mailboxCommit();
+void getMailboxStats(MailboxStats_t *stats);
+
+#endif
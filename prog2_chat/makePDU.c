@@ -4,6 +4,7 @@
 /*
 This code creates a PDU (Protocol Data Unit) for sending messages in a chat application.
 Each PDU is different depending on the flags and the type of message being sent.
+The layouts themselves live in pduCodec.c, these just fill in what goes in them.
 */
 
 #include <stdio.h>
@@ -12,6 +13,7 @@ Each PDU is different depending on the flags and the type of message being sent.
 #include <stdint.h>
 #include "makePDU.h"
 #include "sendreceive.h"
+#include "pduCodec.h"
 
 /*
 Format:
@@ -20,60 +22,38 @@ Format:
 1 byte: command type (0x01 for the first PDU)
 1 byte: sender handle length
 x bytes: sender handle name
+1 byte: capabilities asked for (LOGIN_CAP_*, 0 for none)
 -------------------------------------------------
 */
 
-// Global variable to store the sender handle
-
-uint8_t *makeInitialPDU()
+uint8_t *makeInitialPDU(uint8_t capabilities)
 {
-    int sender_handle_len = strlen(sender_handle);
     uint8_t static pdu[MAXBUF]; // Static array to hold the PDU
-    uint8_t flag = 1;
-
-    // memcpy the flag into the PDU
-    memcpy(pdu, &flag, 1);
-
-    // memcpy the sender handle length into the PDU
-    memcpy(pdu + 1, &sender_handle_len, 1);
+    PduView_t login;
 
-    // memcpy the sender handle into the PDU
-    memcpy(pdu + 2, sender_handle, sender_handle_len);
-
-    printf("\n");
+    // the handle, then what we'd like the server to let us do
+    pduStart(&login, 0x01);
+    pduAddHandle(&login, sender_handle, strlen(sender_handle));
+    pduAddByte(&login, capabilities);
+    pduEncode(pdu, sizeof(pdu), PDU_TO_SERVER, &login);
 
     return pdu;
 }
 
+// %c: [0x06][len][sender][count]([len][destination])*[text], returns its length (-1 if it won't fit)
 int constructMulticastPDU(uint8_t* multicastPDU, int socketNum, char* sender_handle,int numHandles, DestHandle_t* handles, char* message)
 {
-    int offset = 0;
-    multicastPDU[0] = 0x06; // Command type for %c
-    offset++;
-
-    uint8_t sender_handle_len = strlen(sender_handle);
-    multicastPDU[offset++] = sender_handle_len;
-    memcpy(multicastPDU + offset, sender_handle, sender_handle_len);
-    offset += sender_handle_len;
-
-    multicastPDU[offset++] = numHandles; // Number of destination handles
+    PduView_t multicast;
 
+    pduStart(&multicast, 0x06); // Command type for %c
+    pduAddHandle(&multicast, sender_handle, strlen(sender_handle));
     for (int i = 0; i < numHandles; i++)
     {
-        uint8_t dest_handle_len = strlen(handles[i].handle_name);
-        multicastPDU[offset++] = dest_handle_len;
-        memcpy(multicastPDU + offset, handles[i].handle_name, dest_handle_len);
-        offset += dest_handle_len;
+        pduAddHandle(&multicast, handles[i].handle_name, strlen(handles[i].handle_name));
     }
+    pduSetText(&multicast, message, strlen(message));
 
-    // Copy the message into the PDU
-    int message_len = strlen(message);
-    memcpy(multicastPDU + offset, message, message_len);
-    offset += message_len;
-
-    // Now that the PDU is constructed, we can send it
-    int pdu_length = offset; // Length of the PDU
-    return pdu_length;
+    return pduEncode(multicastPDU, MAXBUF, PDU_TO_SERVER, &multicast);
 }
 
 MessagePacket_t constructMessagePacket(char destinationHandle[100], int text_message_len, uint8_t text_message[199], int socketNum)
@@ -82,39 +62,22 @@ MessagePacket_t constructMessagePacket(char destinationHandle[100], int text_mes
     // Create a packet info structure to hold the packet and its length
     MessagePacket_t packetInfo;
     static uint8_t message_packet[MAXBUF];
-    int destinationHandleLen = strlen(destinationHandle);
-    int senderHandleLen = strlen(sender_handle);
+    PduView_t message;
 
-    int total_len = 1 + 1 + senderHandleLen + 1 + 1 + destinationHandleLen + text_message_len; // 1 byte for flag, 1 byte for sender handle length, 1 byte for destination handle flag, 1 byte for destination handle length, and the length of the text message
+    // [0x05][len][sender][1][len][destination][text]
+    pduStart(&message, 0x05); // Command type for %m
+    pduAddHandle(&message, sender_handle, strlen(sender_handle));
+    pduAddHandle(&message, destinationHandle, strlen(destinationHandle));
+    pduSetText(&message, text_message, text_message_len);
 
-    if (total_len > MAXBUF)
+    int total_len = pduEncode(message_packet, sizeof(message_packet), PDU_TO_SERVER, &message);
+    if (total_len < 0)
     {
         printf("Error: Message length exceeds maximum buffer size.\n");
         packetInfo.packet = NULL;
         packetInfo.packet_len = -1;
         return packetInfo;
     }
-    int offset = 0;
-    // First packet is the flag
-    uint8_t flag = 0x05; // Command type for %m
-    message_packet[offset++] = flag;
-
-    // 1 byte for the sender handle length
-    message_packet[offset++] = senderHandleLen;
-    // Copy the sender handle into the packet
-    memcpy(message_packet + offset, sender_handle, senderHandleLen);
-    offset += senderHandleLen;
-
-    // 1 byte for the destination handle flag (always 1)
-    message_packet[offset++] = 0x01;
-    // 1 byte for the destination handle length
-    message_packet[offset++] = destinationHandleLen;
-    // Copy the destination handle into the packet
-    memcpy(message_packet + offset, destinationHandle, destinationHandleLen);
-    offset += destinationHandleLen;
-    // Text message starts here
-    memcpy(message_packet + offset, text_message, text_message_len);
-    offset += text_message_len;
 
     // Fill the packet info structure
     packetInfo.packet = message_packet;
@@ -5,7 +5,7 @@
 #include "cclient.h"
 
 
-uint8_t* makeInitialPDU();
+uint8_t* makeInitialPDU(uint8_t capabilities);
 MessagePacket_t constructMessagePacket(char destinationHandle[100], int text_message_len, uint8_t text_message[199], int socketNum);
 int constructMulticastPDU(uint8_t* multicastPDU, int socketNum, char* sender_handle,int numHandles, DestHandle_t* handles, char* message);
 
@@ -0,0 +1,497 @@
+// --------------- metrics.c -----------------
+/*
+Live counters for the chat server, and the admin socket that reports them.
+
+Each reactor thread counts into its own ThreadMetrics_t: PDUs and bytes in
+(by flag), PDUs and bytes out, wakeups, inbox messages, rate limiting, and
+histograms of fan-out, send queue size at flush, events per wakeup and how
+long each pass over them took. A slot is only ever written by its thread
+and is cache line aligned, so counting is a plain add with nothing shared.
+
+Nothing adds them up until someone asks. ./server -A /tmp/chat-admin.sock
+starts a thread that listens on that Unix socket; a connection that sends
+"text" (or nothing) gets one name/value line per metric, one that sends
+"json" gets the same as a JSON object, and then it's closed. The same
+thread takes a sample every second, so every counter also comes with its
+rate over the last second.
+*/
+
+#define _GNU_SOURCE // accept4()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+#include "reactor.h"
+#include "connection.h"
+#include "handle_table.h"
+#include "mailbox.h"
+#include "log.h"
+
+// Filled in as the reply is built, cut short (never overrun) if it doesn't fit
+typedef struct
+{
+    char text[ADMIN_REPLY_SIZE];
+    int len;
+} AdminReply_t;
+
+static ThreadMetrics_t slots[MAX_REACTORS];
+static ThreadMetrics_t unattached;           // whatever threads other than the reactors count, never reported
+static int numSlots = 0;
+static uint64_t startMs = 0;
+
+__thread ThreadMetrics_t *threadMetrics = &unattached;
+
+// Only the admin thread touches these
+static int adminSocket = -1;
+static pthread_t adminThreadId;
+static ThreadMetrics_t newer;                // the last two samples, METRIC_SAMPLE_MS apart
+static ThreadMetrics_t older;
+static uint64_t newerMs = 0;
+static uint64_t olderMs = 0;
+
+static const char *flagNames[256] = {
+    [0x01] = "login",
+    [0x04] = "broadcast",
+    [0x05] = "message",
+    [0x06] = "multicast",
+    [0x0A] = "list",
+    [0x0E] = "list_page",
+    [KEEPALIVE_PING_FLAG] = "ping",
+    [KEEPALIVE_PONG_FLAG] = "pong",
+    [CHANNEL_JOIN_FLAG] = "channel_join",
+    [CHANNEL_LEAVE_FLAG] = "channel_leave",
+    [CHANNEL_MESSAGE_FLAG] = "channel_message",
+    [BATCH_FLAG] = "batch",
+    [STREAM_START_FLAG] = "stream_start",
+    [STREAM_DATA_FLAG] = "stream_data",
+    [STREAM_ABORT_FLAG] = "stream_abort",
+};
+
+static void *adminThread(void *arg);
+static void answerQuery(int socketNum);
+static void sumMetrics(ThreadMetrics_t *total);
+static double perSecond(size_t offset);
+static void writeText(AdminReply_t *reply, ThreadMetrics_t *total);
+static void writeJson(AdminReply_t *reply, ThreadMetrics_t *total);
+static void textHistogram(AdminReply_t *reply, const char *name, Histogram_t *histogram);
+static void jsonHistogram(AdminReply_t *reply, const char *name, Histogram_t *histogram);
+static uint64_t percentile(Histogram_t *histogram, double fraction);
+static uint64_t bucketLimit(int bucket);
+static int64_t queuedBytes();
+static void append(AdminReply_t *reply, const char *fmt, ...);
+
+void initMetrics(int numThreads)
+{
+    numSlots = numThreads;
+    startMs = getTimeMs();
+}
+
+// The calling reactor thread counts into its own slot from now on
+void attachMetrics(int reactorId)
+{
+    threadMetrics = &slots[reactorId];
+}
+
+// A wakeup with numEvents ready. Return value: when it started (ns), for endPassMetrics()
+uint64_t startPassMetrics(int numEvents)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    metricAdd(&threadMetrics->wakeups, 1);
+    metricRecord(&threadMetrics->wakeupEvents, numEvents);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// Everything from that wakeup has been handled and flushed
+void endPassMetrics(uint64_t passStartNs, int numConnections)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    uint64_t endNs = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+    metricRecord(&threadMetrics->passMicros, (endNs - passStartNs) / 1000);
+    __atomic_store_n(&threadMetrics->connections, (uint64_t)numConnections, __ATOMIC_RELAXED);
+}
+
+/*
+-- Listen for queries on the Unix socket at path (-A) and start the thread that answers them
+-- Return value: 0, -1 (errno set) if the socket couldn't be set up
+*/
+int startAdmin(const char *path)
+{
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    // Nonblocking so a query that hangs up between poll() and accept() can't stall the thread
+    adminSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (adminSocket < 0)
+    {
+        return -1;
+    }
+    unlink(path);
+    if (bind(adminSocket, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(adminSocket, 16) < 0)
+    {
+        int saved = errno;
+        close(adminSocket);
+        adminSocket = -1;
+        errno = saved;
+        return -1;
+    }
+
+    if (pthread_create(&adminThreadId, NULL, adminThread, NULL) != 0)
+    {
+        perror("pthread_create");
+        exit(-1);
+    }
+    pthread_detach(adminThreadId);
+    return 0;
+}
+
+// Take a sample every METRIC_SAMPLE_MS, answer queries in between (one at a time)
+static void *adminThread(void *arg)
+{
+    newerMs = getTimeMs();
+    sumMetrics(&newer);
+    older = newer;
+    olderMs = newerMs;
+
+    while (1)
+    {
+        uint64_t now = getTimeMs();
+        if (now >= newerMs + METRIC_SAMPLE_MS)
+        {
+            older = newer;
+            olderMs = newerMs;
+            sumMetrics(&newer);
+            newerMs = now;
+            continue;
+        }
+
+        struct pollfd pollFd = {adminSocket, POLLIN, 0};
+        if (poll(&pollFd, 1, (int)(newerMs + METRIC_SAMPLE_MS - now)) > 0)
+        {
+            int socketNum = accept4(adminSocket, NULL, NULL, SOCK_CLOEXEC);
+            if (socketNum >= 0)
+            {
+                answerQuery(socketNum);
+                close(socketNum);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Read the command (up to a newline or the other end shutting down its side), write the answer
+static void answerQuery(int socketNum)
+{
+    static AdminReply_t reply;
+    static ThreadMetrics_t total;
+    struct timeval timeout = {ADMIN_TIMEOUT_MS / 1000, (ADMIN_TIMEOUT_MS % 1000) * 1000};
+    char command[ADMIN_COMMAND_LEN];
+    int len = 0;
+
+    setsockopt(socketNum, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(socketNum, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    while (len < ADMIN_COMMAND_LEN - 1 && memchr(command, '\n', len) == NULL)
+    {
+        int bytes = recv(socketNum, command + len, ADMIN_COMMAND_LEN - 1 - len, 0);
+        if (bytes <= 0)
+        {
+            break;
+        }
+        len += bytes;
+    }
+    while (len > 0 && (command[len - 1] == '\n' || command[len - 1] == '\r' || command[len - 1] == ' '))
+    {
+        len--;
+    }
+    command[len] = '\0';
+
+    reply.len = 0;
+    sumMetrics(&total);
+    if (strcmp(command, "json") == 0)
+    {
+        writeJson(&reply, &total);
+    }
+    else if (len == 0 || strcmp(command, "text") == 0)
+    {
+        writeText(&reply, &total);
+    }
+    else
+    {
+        append(&reply, "unknown command %s, try text or json\n", command);
+    }
+
+    for (int sent = 0; sent < reply.len;)
+    {
+        int bytes = send(socketNum, reply.text + sent, reply.len - sent, MSG_NOSIGNAL);
+        if (bytes <= 0)
+        {
+            break;
+        }
+        sent += bytes;
+    }
+}
+
+// Every reactor's slot added up. Relaxed loads: each count is exact, the set of them is a moment or so apart.
+static void sumMetrics(ThreadMetrics_t *total)
+{
+    uint64_t *out = (uint64_t *)total;
+
+    memset(total, 0, sizeof(ThreadMetrics_t));
+    for (int t = 0; t < numSlots; t++)
+    {
+        uint64_t *in = (uint64_t *)&slots[t];
+        for (size_t word = 0; word < sizeof(ThreadMetrics_t) / sizeof(uint64_t); word++)
+        {
+            out[word] += __atomic_load_n(&in[word], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// The counter at offset in ThreadMetrics_t, per second over the last sample
+static double perSecond(size_t offset)
+{
+    if (newerMs == olderMs)
+    {
+        return 0;
+    }
+    uint64_t now = *(uint64_t *)((char *)&newer + offset);
+    uint64_t then = *(uint64_t *)((char *)&older + offset);
+    return (now - then) * 1000.0 / (newerMs - olderMs);
+}
+
+#define COUNTER_OFFSET(field) offsetof(ThreadMetrics_t, field)
+#define FLAG_OFFSET(flag) (offsetof(ThreadMetrics_t, pdusIn) + (flag) * sizeof(uint64_t))
+
+static void writeText(AdminReply_t *reply, ThreadMetrics_t *total)
+{
+    append(reply, "uptime_seconds %.1f\n", (getTimeMs() - startMs) / 1000.0);
+    append(reply, "threads %d\n", numSlots);
+    append(reply, "connections %llu\n", (unsigned long long)total->connections);
+    append(reply, "handles %d\n", getHandleCount());
+    append(reply, "queued_bytes %lld\n", (long long)queuedBytes());
+
+    for (int flag = 0; flag < 256; flag++)
+    {
+        if (total->pdusIn[flag] == 0)
+        {
+            continue;
+        }
+        if (flagNames[flag] != NULL)
+        {
+            append(reply, "pdus_in %s %llu %.1f/s\n", flagNames[flag], (unsigned long long)total->pdusIn[flag],
+                   perSecond(FLAG_OFFSET(flag)));
+        }
+        else
+        {
+            append(reply, "pdus_in 0x%02x %llu %.1f/s\n", flag, (unsigned long long)total->pdusIn[flag],
+                   perSecond(FLAG_OFFSET(flag)));
+        }
+    }
+    append(reply, "bytes_in %llu %.1f/s\n", (unsigned long long)total->bytesIn, perSecond(COUNTER_OFFSET(bytesIn)));
+    append(reply, "pdus_out %llu %.1f/s\n", (unsigned long long)total->pdusOut, perSecond(COUNTER_OFFSET(pdusOut)));
+    append(reply, "bytes_out %llu %.1f/s\n", (unsigned long long)total->bytesOut, perSecond(COUNTER_OFFSET(bytesOut)));
+    append(reply, "writev_calls %llu %.1f/s\n", (unsigned long long)total->writevCalls,
+           perSecond(COUNTER_OFFSET(writevCalls)));
+    append(reply, "wakeups %llu %.1f/s\n", (unsigned long long)total->wakeups, perSecond(COUNTER_OFFSET(wakeups)));
+    append(reply, "inbox_messages %llu %.1f/s\n", (unsigned long long)total->inboxMessages,
+           perSecond(COUNTER_OFFSET(inboxMessages)));
+    append(reply, "syscalls %llu %.1f/s\n", (unsigned long long)total->syscalls, perSecond(COUNTER_OFFSET(syscalls)));
+    append(reply, "rate_limited rejected %llu delayed %llu disconnected %llu\n",
+           (unsigned long long)total->rateShed[0], (unsigned long long)total->rateShed[1],
+           (unsigned long long)total->rateShed[2]);
+    append(reply, "overload entered %llu rejected %llu delayed %llu disconnected %llu\n",
+           (unsigned long long)total->overloads, (unsigned long long)total->overloadShed[0],
+           (unsigned long long)total->overloadShed[1], (unsigned long long)total->overloadShed[2]);
+    if (mailboxEnabled())
+    {
+        MailboxStats_t mailbox;
+        getMailboxStats(&mailbox);
+        append(reply, "mailbox stored %llu delivered %llu pending %llu bytes %llu commits %llu committed %llu segments %d\n",
+               (unsigned long long)mailbox.stored, (unsigned long long)mailbox.delivered,
+               (unsigned long long)mailbox.pending, (unsigned long long)mailbox.bytes,
+               (unsigned long long)mailbox.commits, (unsigned long long)mailbox.committed, mailbox.segments);
+    }
+
+    textHistogram(reply, "fan_out", &total->fanOut);
+    textHistogram(reply, "queue_bytes", &total->queueBytes);
+    textHistogram(reply, "wakeup_events", &total->wakeupEvents);
+    textHistogram(reply, "pass_micros", &total->passMicros);
+}
+
+static void writeJson(AdminReply_t *reply, ThreadMetrics_t *total)
+{
+    append(reply, "{\"uptime_seconds\":%.1f,\"threads\":%d,\"connections\":%llu,\"handles\":%d,\"queued_bytes\":%lld,",
+           (getTimeMs() - startMs) / 1000.0, numSlots, (unsigned long long)total->connections, getHandleCount(),
+           (long long)queuedBytes());
+
+    append(reply, "\"pdus_in\":{");
+    int first = 1;
+    for (int flag = 0; flag < 256; flag++)
+    {
+        if (total->pdusIn[flag] == 0)
+        {
+            continue;
+        }
+        if (flagNames[flag] != NULL)
+        {
+            append(reply, "%s\"%s\":", first ? "" : ",", flagNames[flag]);
+        }
+        else
+        {
+            append(reply, "%s\"0x%02x\":", first ? "" : ",", flag);
+        }
+        append(reply, "{\"total\":%llu,\"per_sec\":%.1f}", (unsigned long long)total->pdusIn[flag],
+               perSecond(FLAG_OFFSET(flag)));
+        first = 0;
+    }
+    append(reply, "},");
+
+    append(reply, "\"bytes_in\":{\"total\":%llu,\"per_sec\":%.1f},", (unsigned long long)total->bytesIn,
+           perSecond(COUNTER_OFFSET(bytesIn)));
+    append(reply, "\"pdus_out\":{\"total\":%llu,\"per_sec\":%.1f},", (unsigned long long)total->pdusOut,
+           perSecond(COUNTER_OFFSET(pdusOut)));
+    append(reply, "\"bytes_out\":{\"total\":%llu,\"per_sec\":%.1f},", (unsigned long long)total->bytesOut,
+           perSecond(COUNTER_OFFSET(bytesOut)));
+    append(reply, "\"writev_calls\":{\"total\":%llu,\"per_sec\":%.1f},", (unsigned long long)total->writevCalls,
+           perSecond(COUNTER_OFFSET(writevCalls)));
+    append(reply, "\"wakeups\":{\"total\":%llu,\"per_sec\":%.1f},", (unsigned long long)total->wakeups,
+           perSecond(COUNTER_OFFSET(wakeups)));
+    append(reply, "\"inbox_messages\":{\"total\":%llu,\"per_sec\":%.1f},", (unsigned long long)total->inboxMessages,
+           perSecond(COUNTER_OFFSET(inboxMessages)));
+    append(reply, "\"syscalls\":{\"total\":%llu,\"per_sec\":%.1f},", (unsigned long long)total->syscalls,
+           perSecond(COUNTER_OFFSET(syscalls)));
+    append(reply, "\"rate_limited\":{\"rejected\":%llu,\"delayed\":%llu,\"disconnected\":%llu},",
+           (unsigned long long)total->rateShed[0], (unsigned long long)total->rateShed[1],
+           (unsigned long long)total->rateShed[2]);
+    append(reply, "\"overload\":{\"entered\":%llu,\"rejected\":%llu,\"delayed\":%llu,\"disconnected\":%llu},",
+           (unsigned long long)total->overloads, (unsigned long long)total->overloadShed[0],
+           (unsigned long long)total->overloadShed[1], (unsigned long long)total->overloadShed[2]);
+    if (mailboxEnabled())
+    {
+        MailboxStats_t mailbox;
+        getMailboxStats(&mailbox);
+        append(reply, "\"mailbox\":{\"stored\":%llu,\"delivered\":%llu,\"pending\":%llu,\"bytes\":%llu,"
+               "\"commits\":%llu,\"committed\":%llu,\"segments\":%d},",
+               (unsigned long long)mailbox.stored, (unsigned long long)mailbox.delivered,
+               (unsigned long long)mailbox.pending, (unsigned long long)mailbox.bytes,
+               (unsigned long long)mailbox.commits, (unsigned long long)mailbox.committed, mailbox.segments);
+    }
+
+    append(reply, "\"histograms\":{");
+    jsonHistogram(reply, "fan_out", &total->fanOut);
+    append(reply, ",");
+    jsonHistogram(reply, "queue_bytes", &total->queueBytes);
+    append(reply, ",");
+    jsonHistogram(reply, "wakeup_events", &total->wakeupEvents);
+    append(reply, ",");
+    jsonHistogram(reply, "pass_micros", &total->passMicros);
+    append(reply, "}}\n");
+}
+
+// name count=.. mean=.. p50<=.. p99<=.. then low-high:count for every bucket with anything in it
+static void textHistogram(AdminReply_t *reply, const char *name, Histogram_t *histogram)
+{
+    append(reply, "%s count=%llu mean=%.1f p50<=%llu p99<=%llu", name, (unsigned long long)histogram->count,
+           histogram->count > 0 ? (double)histogram->sum / histogram->count : 0.0,
+           (unsigned long long)percentile(histogram, 0.5), (unsigned long long)percentile(histogram, 0.99));
+    for (int bucket = 0; bucket < METRIC_BUCKETS; bucket++)
+    {
+        if (histogram->buckets[bucket] > 0)
+        {
+            append(reply, " %llu-%llu:%llu", (unsigned long long)(bucket == 0 ? 0 : bucketLimit(bucket - 1) + 1),
+                   (unsigned long long)bucketLimit(bucket), (unsigned long long)histogram->buckets[bucket]);
+        }
+    }
+    append(reply, "\n");
+}
+
+static void jsonHistogram(AdminReply_t *reply, const char *name, Histogram_t *histogram)
+{
+    append(reply, "\"%s\":{\"count\":%llu,\"sum\":%llu,\"p50\":%llu,\"p99\":%llu,\"buckets\":[", name,
+           (unsigned long long)histogram->count, (unsigned long long)histogram->sum,
+           (unsigned long long)percentile(histogram, 0.5), (unsigned long long)percentile(histogram, 0.99));
+    int first = 1;
+    for (int bucket = 0; bucket < METRIC_BUCKETS; bucket++)
+    {
+        if (histogram->buckets[bucket] > 0)
+        {
+            append(reply, "%s{\"le\":%llu,\"count\":%llu}", first ? "" : ",", (unsigned long long)bucketLimit(bucket),
+                   (unsigned long long)histogram->buckets[bucket]);
+            first = 0;
+        }
+    }
+    append(reply, "]}");
+}
+
+// Upper limit of the bucket the fraction'th value falls in
+static uint64_t percentile(Histogram_t *histogram, double fraction)
+{
+    uint64_t wanted = (uint64_t)(histogram->count * fraction);
+    uint64_t seen = 0;
+
+    for (int bucket = 0; bucket < METRIC_BUCKETS; bucket++)
+    {
+        seen += histogram->buckets[bucket];
+        if (seen > wanted)
+        {
+            return bucketLimit(bucket);
+        }
+    }
+    return 0;
+}
+
+// Biggest value bucket counts (the last one takes everything above too)
+static uint64_t bucketLimit(int bucket)
+{
+    return (bucket == 0) ? 0 : (1ull << bucket) - 1;
+}
+
+static int64_t queuedBytes()
+{
+    int64_t queued = 0;
+
+    for (int i = 0; i < numSlots; i++)
+    {
+        queued += __atomic_load_n(&getReactor(i)->queuedBytes, __ATOMIC_RELAXED);
+    }
+    return queued;
+}
+
+static void append(AdminReply_t *reply, const char *fmt, ...)
+{
+    va_list args;
+    int space = ADMIN_REPLY_SIZE - reply->len;
+
+    if (space <= 1)
+    {
+        return;
+    }
+    va_start(args, fmt);
+    int written = vsnprintf(reply->text + reply->len, space, fmt, args);
+    va_end(args);
+    reply->len += (written < space) ? written : space - 1;
+}
@@ -0,0 +1,67 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+#define METRIC_BUCKETS 32               // bucket 0 counts zeros, bucket i values from 2^(i-1) up to 2^i - 1
+#define METRIC_SAMPLE_MS 1000           // the per second rates are over the last whole sample
+#define ADMIN_COMMAND_LEN 64
+#define ADMIN_TIMEOUT_MS 1000           // a query that doesn't send its command (or read the answer) in time is dropped
+#define ADMIN_REPLY_SIZE (64 * 1024)
+
+// Power of two histogram
+typedef struct
+{
+    uint64_t buckets[METRIC_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+} Histogram_t;
+
+// Everything one reactor thread counts. Only that thread writes it (no
+// atomic read-modify-writes, no sharing a cache line with another thread's),
+// the admin thread adds all of them up when it's asked. Every field is a
+// 64 bit count, so they add up word by word.
+typedef struct
+{
+    uint64_t pdusIn[256];               // by flag, batch frames and what was in them both counted
+    uint64_t bytesIn;
+    uint64_t pdusOut;                   // written out completely
+    uint64_t bytesOut;
+    uint64_t writevCalls;
+    uint64_t wakeups;
+    uint64_t inboxMessages;             // handed over by other reactors (and the cluster thread)
+    uint64_t syscalls;                  // waits, reads, writes, accepts and epoll_ctl()s (io_uring_enter()s with -E uring)
+    uint64_t rateShed[3];               // by ShedAction, PDUs over a -R/-B limit
+    uint64_t overloadShed[3];           // by ShedAction, PDUs shed while overloaded
+    uint64_t overloads;                 // times this thread saw the server become overloaded
+    uint64_t connections;               // gauge, as of the end of the last pass
+    Histogram_t fanOut;                 // clients each message from a client was sent to
+    Histogram_t queueBytes;             // a client's send queue each time it's flushed
+    Histogram_t wakeupEvents;           // epoll events per wakeup
+    Histogram_t passMicros;             // handling those events, wakeup to the end of the last flush
+} __attribute__((aligned(64))) ThreadMetrics_t;
+
+extern __thread ThreadMetrics_t *threadMetrics;
+
+// Single writer, so a plain add; the store is atomic only so the admin thread never reads half of it
+static inline void metricAdd(uint64_t *counter, uint64_t n)
+{
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static inline void metricRecord(Histogram_t *histogram, uint64_t value)
+{
+    int bucket = (value == 0) ? 0 : 64 - __builtin_clzll(value);
+
+    metricAdd(&histogram->buckets[bucket < METRIC_BUCKETS ? bucket : METRIC_BUCKETS - 1], 1);
+    metricAdd(&histogram->count, 1);
+    metricAdd(&histogram->sum, value);
+}
+
+void initMetrics(int numThreads);
+void attachMetrics(int reactorId);
+uint64_t startPassMetrics(int numEvents);
+void endPassMetrics(uint64_t passStartNs, int numConnections);
+int startAdmin(const char *path);
+
+#endif
@@ -70,6 +70,70 @@ int tcpServerSetup(int serverPort)
 	return mainServerSocket;
 }
 
+// Same as tcpServerSetup() but with SO_REUSEPORT set, so several sockets
+// (one per server thread) can listen on the same port.  Pass the port the
+// first one got to the rest.  Prints the port if debugFlag is set.
+
+int tcpServerSetupReusePort(int serverPort, int debugFlag)
+{
+	int mainServerSocket = 0;
+	int on = 1;
+	struct sockaddr_in6 serverAddress;     
+
+	mainServerSocket= socket(AF_INET6, SOCK_STREAM, 0);
+	if(mainServerSocket < 0)
+	{
+		perror("socket call");
+		exit(1);
+	}
+
+	if (setsockopt(mainServerSocket, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+	{
+		perror("setsockopt SO_REUSEPORT");
+		exit(-1);
+	}
+
+	memset(&serverAddress, 0, sizeof(struct sockaddr_in6));
+	serverAddress.sin6_family= AF_INET6;         		
+	serverAddress.sin6_addr = in6addr_any;   
+	serverAddress.sin6_port= htons(serverPort);         
+
+	// bind the name (address) to a port 
+	if (bind(mainServerSocket, (struct sockaddr *) &serverAddress, sizeof(serverAddress)) < 0)
+	{
+		perror("bind call");
+		exit(-1);
+	}
+
+	if (listen(mainServerSocket, LISTEN_BACKLOG) < 0)
+	{
+		perror("listen call");
+		exit(-1);
+	}
+
+	if (debugFlag)
+	{
+		printf("Server Port Number %d \n", getServerPort(mainServerSocket));
+	}
+
+	return mainServerSocket;
+}
+
+// Returns the port number a socket is bound to
+
+int getServerPort(int serverSocket)
+{
+	struct sockaddr_in6 serverAddress;
+	socklen_t serverAddressLen = sizeof(serverAddress);
+
+	if (getsockname(serverSocket, (struct sockaddr*)&serverAddress, &serverAddressLen) < 0)
+	{
+		perror("getsockname call");
+		exit(-1);
+	}
+	return ntohs(serverAddress.sin6_port);
+}
+
 // This function waits for a client to ask for services.  It returns
 // the client socket number.   
 
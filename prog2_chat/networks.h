@@ -16,10 +16,12 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 
-#define LISTEN_BACKLOG 10
+#define LISTEN_BACKLOG 4096 // big enough to soak up a connection storm (the kernel caps it at somaxconn)
 
 // for the TCP server side
 int tcpServerSetup(int serverPort);
+int tcpServerSetupReusePort(int serverPort, int debugFlag);
+int getServerPort(int serverSocket);
 int tcpAccept(int mainServerSocket, int debugFlag);
 
 // for the TCP client side
@@ -0,0 +1,90 @@
+// --------------- pduBuffer.c -----------------
+/*
+Reference counted wire PDUs for the server's send queues.
+
+A broadcast or multicast builds its PDU once with createPDUBuffer() and
+every recipient's send queue holds a reference to that same buffer, so the
+cost of a fan-out is one copy of the message plus one small queue entry
+per recipient instead of one full copy per recipient.
+
+Client receive buffers are PDUBuffer_ts too, so a forwarded message can
+be queued as a slice of the bytes it arrived in without copying it.
+
+Buffers come out of per-thread slabs in a few size classes (see slab.c),
+so building and freeing them on the message path never calls malloc().
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+
+#include "pduBuffer.h"
+#include "shared.h"
+#include "slab.h"
+
+// Data sizes the buffers are pooled in: small replies, most chat PDUs, a
+// full MAXBUF PDU and a connection's receive buffer. Anything bigger is malloc()ed.
+#define NUM_PDU_SIZE_CLASSES 4
+static const int pduSizeClasses[NUM_PDU_SIZE_CLASSES] = {64, 256, MAXBUF + 2, 4 * MAXBUF};
+static const char *pduSlabNames[NUM_PDU_SIZE_CLASSES] = {"pdu64", "pdu256", "pduMax", "recvBuffer"};
+static __thread Slab_t *pduSlabs[NUM_PDU_SIZE_CLASSES];
+
+// A buffer with room for size bytes of data from the smallest class that fits
+static PDUBuffer_t *newPDUBuffer(int size)
+{
+    for (int i = 0; i < NUM_PDU_SIZE_CLASSES; i++)
+    {
+        if (size <= pduSizeClasses[i])
+        {
+            if (pduSlabs[i] == NULL)
+            {
+                pduSlabs[i] = createSlab(pduSlabNames[i], sizeof(PDUBuffer_t) + pduSizeClasses[i]);
+            }
+            return (PDUBuffer_t *)slabAlloc(pduSlabs[i]);
+        }
+    }
+    return (PDUBuffer_t *)slabAllocUnpooled(sizeof(PDUBuffer_t) + size);
+}
+
+/*
+-- Same arguments as sendPDU(): builds the 2 byte length + data once
+-- The caller owns the one reference it comes back with
+*/
+PDUBuffer_t *createPDUBuffer(uint8_t *dataBuffer, int lengthOfData)
+{
+    uint16_t pdu_length = lengthOfData + 2;
+    uint16_t length_bytes = htons(pdu_length);
+
+    PDUBuffer_t *pduBuffer = newPDUBuffer(pdu_length);
+    pduBuffer->refCount = 1;
+    pduBuffer->len = pdu_length;
+    memcpy(pduBuffer->data, &length_bytes, sizeof(length_bytes));
+    memcpy(pduBuffer->data + 2, dataBuffer, lengthOfData);
+
+    return pduBuffer;
+}
+
+// An empty buffer of size bytes to be filled in place (a receive buffer)
+PDUBuffer_t *allocPDUBuffer(int size)
+{
+    PDUBuffer_t *pduBuffer = newPDUBuffer(size);
+    pduBuffer->refCount = 1;
+    pduBuffer->len = size;
+    return pduBuffer;
+}
+
+// The count is atomic: a fan-out can leave references on several reactor threads
+void retainPDUBuffer(PDUBuffer_t *pduBuffer)
+{
+    __atomic_add_fetch(&pduBuffer->refCount, 1, __ATOMIC_RELAXED);
+}
+
+void releasePDUBuffer(PDUBuffer_t *pduBuffer)
+{
+    if (__atomic_sub_fetch(&pduBuffer->refCount, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        slabFree(pduBuffer);
+    }
+}
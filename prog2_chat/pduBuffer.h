@@ -0,0 +1,29 @@
+#ifndef PDUBUFFER_H
+#define PDUBUFFER_H
+
+#include <stdint.h>
+
+// A PDU ready to go on the wire (2 byte length included) that any number of
+// send queues can share. Freed when the last queue is done writing it.
+typedef struct
+{
+    int refCount;
+    int len;
+    uint8_t data[];
+} PDUBuffer_t;
+
+// Some bytes inside a PDUBuffer_t: all of it, or one PDU out of a client's
+// receive buffer. Whoever holds a slice holds a reference to pduBuffer.
+typedef struct
+{
+    PDUBuffer_t *pduBuffer;
+    uint8_t *data;
+    int len;
+} PDUSlice_t;
+
+PDUBuffer_t *createPDUBuffer(uint8_t *dataBuffer, int lengthOfData);
+PDUBuffer_t *allocPDUBuffer(int size);
+void retainPDUBuffer(PDUBuffer_t *pduBuffer);
+void releasePDUBuffer(PDUBuffer_t *pduBuffer);
+
+#endif
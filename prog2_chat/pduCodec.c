@@ -0,0 +1,349 @@
+// --------------- pduCodec.c -----------------
+/*
+Every PDU's layout, written down once. Each flag (each way, a few are
+laid out differently going to the server than coming from it) is a list
+of fields, and the same list drives both directions of the codec:
+
+pduParse() walks the fields over a received PDU once, checking every
+length against the end of the PDU before it is used, and leaves a
+PduView_t of slices pointing into the buffer it was given. Nothing is
+copied, so the buffer has to outlive the view.
+
+pduEncode() walks them the other way, writing a PduView_t (usually
+slices of the caller's own strings) straight into the caller's buffer,
+flag and on, the same bytes sendPDU() and queuePDU() take.
+
+A PDU that doesn't fit its layout (a length running past the end,
+bytes left over, more than MAX_DEST_HANDLES destinations) is an error
+both ways, never a read or write outside the buffer.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+
+#include "pduCodec.h"
+
+typedef struct
+{
+    int known;                          // 0 for a flag that doesn't go this way
+    PduField fields[PDU_MAX_FIELDS];    // FIELD_END terminated
+} PduLayout_t;
+
+#define LAYOUT(...) { 1, { __VA_ARGS__ } }
+
+static const PduLayout_t layouts[2][256] = {
+    [PDU_TO_SERVER] = {
+        [0x01] = LAYOUT(FIELD_HANDLE, FIELD_OPT_BYTE),                 // login: handle, capabilities
+        [0x04] = LAYOUT(FIELD_HANDLE, FIELD_TEXT),                     // %b: sender, text
+        [0x05] = LAYOUT(FIELD_HANDLE, FIELD_HANDLE_LIST, FIELD_TEXT),  // %m: sender, [1] destination, text
+        [0x06] = LAYOUT(FIELD_HANDLE, FIELD_HANDLE_LIST, FIELD_TEXT),  // %c: sender, destinations, text
+        [0x0A] = LAYOUT(FIELD_END),
+        [LIST_PAGE_REQUEST_FLAG] = LAYOUT(FIELD_U32),                  // cursor
+        [KEEPALIVE_PING_FLAG] = LAYOUT(FIELD_END),
+        [KEEPALIVE_PONG_FLAG] = LAYOUT(FIELD_END),
+        [CHANNEL_JOIN_FLAG] = LAYOUT(FIELD_CHANNEL),
+        [CHANNEL_LEAVE_FLAG] = LAYOUT(FIELD_CHANNEL),
+        [CHANNEL_MESSAGE_FLAG] = LAYOUT(FIELD_CHANNEL, FIELD_TEXT),
+        [BATCH_FLAG] = LAYOUT(FIELD_TEXT),                             // the PDUs, lengths and all
+        [STREAM_START_FLAG] = LAYOUT(FIELD_U32, FIELD_U32, FIELD_HANDLE, FIELD_HANDLE), // id, length, sender, destination
+        [STREAM_DATA_FLAG] = LAYOUT(FIELD_U32, FIELD_TEXT),            // id, segment
+        [STREAM_ABORT_FLAG] = LAYOUT(FIELD_U32, FIELD_BYTE),           // id, reason
+    },
+    [PDU_TO_CLIENT] = {
+        [0x02] = LAYOUT(FIELD_OPT_BYTE),                               // login accepted, capabilities granted
+        [0x03] = LAYOUT(FIELD_OPT_BYTE),                               // handle taken
+        [0x04] = LAYOUT(FIELD_HANDLE, FIELD_TEXT),
+        [0x05] = LAYOUT(FIELD_HANDLE, FIELD_HANDLE_LIST, FIELD_TEXT),
+        [0x06] = LAYOUT(FIELD_HANDLE, FIELD_HANDLE_LIST, FIELD_TEXT),
+        [0x07] = LAYOUT(FIELD_TEXT),                                   // no such handle (nothing after the flag)
+        [0x0B] = LAYOUT(FIELD_U32),                                    // handle count
+        [0x0C] = LAYOUT(FIELD_HANDLE),
+        [0x0D] = LAYOUT(FIELD_END),
+        [LIST_PAGE_FLAG] = LAYOUT(FIELD_U32, FIELD_U32, FIELD_BYTE, FIELD_TEXT), // total, next cursor, count, handles
+        [KEEPALIVE_PING_FLAG] = LAYOUT(FIELD_END),
+        [KEEPALIVE_PONG_FLAG] = LAYOUT(FIELD_END),
+        [CHANNEL_MESSAGE_FLAG] = LAYOUT(FIELD_CHANNEL, FIELD_HANDLE, FIELD_TEXT), // channel, sender, text
+        [CHANNEL_REPLY_FLAG] = LAYOUT(FIELD_BYTE, FIELD_CHANNEL, FIELD_U32),      // status, channel, members
+        [STREAM_START_FLAG] = LAYOUT(FIELD_U32, FIELD_U32, FIELD_HANDLE, FIELD_HANDLE),
+        [STREAM_DATA_FLAG] = LAYOUT(FIELD_U32, FIELD_TEXT),
+        [STREAM_ABORT_FLAG] = LAYOUT(FIELD_U32, FIELD_BYTE),
+        [RATE_LIMITED_FLAG] = LAYOUT(FIELD_BYTE, FIELD_BYTE),          // reason, flag dropped
+    },
+};
+
+static int takeSlice(const uint8_t **at, const uint8_t *end, PduBytes_t *slice);
+static int putSlice(uint8_t *out, int outSize, int *offset, const PduBytes_t *slice);
+
+/*
+-- Take a PDU (flag and on, no length) apart into view, in one pass
+-- The view's slices point into pdu
+-- Return value: 0, -1 if the flag isn't one that goes this way or the PDU
+   doesn't fit its layout
+*/
+int pduParse(const uint8_t *pdu, int pduLen, int direction, PduView_t *view)
+{
+    if (pduLen < 1 || !layouts[direction][pdu[0]].known)
+    {
+        return -1;
+    }
+    const PduField *field = layouts[direction][pdu[0]].fields;
+    const uint8_t *at = pdu + 1;
+    const uint8_t *end = pdu + pduLen;
+    uint32_t number;
+
+    pduStart(view, pdu[0]);
+    for (; *field != FIELD_END; field++)
+    {
+        switch (*field)
+        {
+        case FIELD_OPT_BYTE:
+            if (at == end)
+            {
+                break;
+            }
+            // fall through
+        case FIELD_BYTE:
+            if (at == end)
+            {
+                return -1;
+            }
+            view->bytes[view->numBytes++] = *at++;
+            break;
+        case FIELD_U32:
+            if (end - at < 4)
+            {
+                return -1;
+            }
+            memcpy(&number, at, 4);
+            view->numbers[view->numNumbers++] = ntohl(number);
+            at += 4;
+            break;
+        case FIELD_HANDLE:
+            if (takeSlice(&at, end, &view->handles[view->numHandles++]) < 0)
+            {
+                return -1;
+            }
+            break;
+        case FIELD_HANDLE_LIST:
+        {
+            if (at == end || *at > MAX_DEST_HANDLES)
+            {
+                return -1;
+            }
+            int count = *at++;
+            for (int i = 0; i < count; i++)
+            {
+                if (takeSlice(&at, end, &view->handles[view->numHandles++]) < 0)
+                {
+                    return -1;
+                }
+            }
+            break;
+        }
+        case FIELD_CHANNEL:
+            if (takeSlice(&at, end, &view->channel) < 0)
+            {
+                return -1;
+            }
+            break;
+        default: // FIELD_TEXT
+            view->text.data = at;
+            view->text.len = end - at;
+            at = end;
+            break;
+        }
+    }
+    return (at == end) ? 0 : -1;
+}
+
+/*
+-- Write view as a PDU (flag and on, no length) into out
+-- A FIELD_HANDLE_LIST takes all the handles the fields before it didn't
+-- Return value: the PDU's length, -1 if it doesn't fit in outSize, the
+   flag doesn't go this way or the view is missing a field
+*/
+int pduEncode(uint8_t *out, int outSize, int direction, const PduView_t *view)
+{
+    if (outSize < 1 || !layouts[direction][view->flag].known)
+    {
+        return -1;
+    }
+    const PduField *field = layouts[direction][view->flag].fields;
+    int offset = 0;
+    int handle = 0;
+    int number = 0;
+    int byte = 0;
+    uint32_t networkNumber;
+
+    out[offset++] = view->flag;
+    for (; *field != FIELD_END; field++)
+    {
+        switch (*field)
+        {
+        case FIELD_OPT_BYTE:
+            if (byte == view->numBytes)
+            {
+                break;
+            }
+            // fall through
+        case FIELD_BYTE:
+            if (byte == view->numBytes || offset == outSize)
+            {
+                return -1;
+            }
+            out[offset++] = view->bytes[byte++];
+            break;
+        case FIELD_U32:
+            if (number == view->numNumbers || outSize - offset < 4)
+            {
+                return -1;
+            }
+            networkNumber = htonl(view->numbers[number++]);
+            memcpy(out + offset, &networkNumber, 4);
+            offset += 4;
+            break;
+        case FIELD_HANDLE:
+            if (handle == view->numHandles || putSlice(out, outSize, &offset, &view->handles[handle++]) < 0)
+            {
+                return -1;
+            }
+            break;
+        case FIELD_HANDLE_LIST:
+            if (view->numHandles - handle > MAX_DEST_HANDLES || offset == outSize)
+            {
+                return -1;
+            }
+            out[offset++] = view->numHandles - handle;
+            for (; handle < view->numHandles; handle++)
+            {
+                if (putSlice(out, outSize, &offset, &view->handles[handle]) < 0)
+                {
+                    return -1;
+                }
+            }
+            break;
+        case FIELD_CHANNEL:
+            if (putSlice(out, outSize, &offset, &view->channel) < 0)
+            {
+                return -1;
+            }
+            break;
+        default: // FIELD_TEXT
+            if (view->text.len > outSize - offset)
+            {
+                return -1;
+            }
+            if (view->text.len > 0)
+            {
+                memcpy(out + offset, view->text.data, view->text.len);
+            }
+            offset += view->text.len;
+            break;
+        }
+    }
+    return offset;
+}
+
+// An empty view of a flag, for pduEncode()
+void pduStart(PduView_t *view, uint8_t flag)
+{
+    view->flag = flag;
+    view->numHandles = 0;
+    view->numNumbers = 0;
+    view->numBytes = 0;
+    view->channel.data = NULL;
+    view->channel.len = 0;
+    view->text.data = NULL;
+    view->text.len = 0;
+}
+
+// The next FIELD_HANDLE (or the next one in a FIELD_HANDLE_LIST), the bytes aren't copied
+void pduAddHandle(PduView_t *view, const void *handle, int len)
+{
+    if (view->numHandles < PDU_MAX_HANDLES)
+    {
+        view->handles[view->numHandles].data = handle;
+        view->handles[view->numHandles].len = len;
+        view->numHandles++;
+    }
+}
+
+void pduAddNumber(PduView_t *view, uint32_t number)
+{
+    if (view->numNumbers < PDU_MAX_NUMBERS)
+    {
+        view->numbers[view->numNumbers++] = number;
+    }
+}
+
+void pduAddByte(PduView_t *view, uint8_t byte)
+{
+    if (view->numBytes < PDU_MAX_BYTES)
+    {
+        view->bytes[view->numBytes++] = byte;
+    }
+}
+
+void pduSetChannel(PduView_t *view, const void *name, int len)
+{
+    view->channel.data = name;
+    view->channel.len = len;
+}
+
+void pduSetText(PduView_t *view, const void *text, int len)
+{
+    view->text.data = text;
+    view->text.len = len;
+}
+
+/*
+-- Take the next [len][handle] off the front of list (a 0x0F page's text)
+-- Return value: 1 with handle set, 0 at the end of the list, -1 if the
+   last one runs past the end
+*/
+int pduNextHandle(PduBytes_t *list, PduBytes_t *handle)
+{
+    if (list->len == 0)
+    {
+        return 0;
+    }
+    const uint8_t *at = list->data;
+    if (takeSlice(&at, list->data + list->len, handle) < 0)
+    {
+        return -1;
+    }
+    list->len -= at - list->data;
+    list->data = at;
+    return 1;
+}
+
+// [len][bytes] at *at, moving *at past it
+static int takeSlice(const uint8_t **at, const uint8_t *end, PduBytes_t *slice)
+{
+    if (*at == end || **at > end - *at - 1)
+    {
+        return -1;
+    }
+    slice->len = **at;
+    slice->data = *at + 1;
+    *at += 1 + slice->len;
+    return 0;
+}
+
+static int putSlice(uint8_t *out, int outSize, int *offset, const PduBytes_t *slice)
+{
+    if (slice->len > 255 || 1 + slice->len > outSize - *offset)
+    {
+        return -1;
+    }
+    out[(*offset)++] = slice->len;
+    if (slice->len > 0)
+    {
+        memcpy(out + *offset, slice->data, slice->len);
+    }
+    *offset += slice->len;
+    return 0;
+}
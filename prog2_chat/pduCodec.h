@@ -0,0 +1,65 @@
+#ifndef PDUCODEC_H
+#define PDUCODEC_H
+
+#include <stdint.h>
+#include "shared.h"
+
+// Which way a PDU is going, the same flag can be laid out differently each way
+#define PDU_TO_SERVER 0
+#define PDU_TO_CLIENT 1
+
+#define PDU_MAX_FIELDS 6
+#define PDU_MAX_HANDLES (1 + MAX_DEST_HANDLES)   // a sender and its destinations
+#define PDU_MAX_NUMBERS 2
+#define PDU_MAX_BYTES 2
+
+// One part of a PDU after the flag, in the order it is on the wire
+typedef enum
+{
+    FIELD_END = 0,
+    FIELD_BYTE,          // 1 byte (status, reason, count) -> bytes[]
+    FIELD_OPT_BYTE,      // 1 byte if the PDU has one (login capabilities), last only
+    FIELD_U32,           // 4 bytes in network order -> numbers[] in host order
+    FIELD_HANDLE,        // [len][handle] -> handles[]
+    FIELD_HANDLE_LIST,   // [count]([len][handle])*, up to MAX_DEST_HANDLES -> handles[]
+    FIELD_CHANNEL,       // [len][name] -> channel
+    FIELD_TEXT           // whatever is left -> text, last only
+} PduField;
+
+// Bytes somewhere in a PDU, never copied and never null terminated
+typedef struct
+{
+    const uint8_t *data;
+    int len;
+} PduBytes_t;
+
+/*
+A PDU taken apart (pduParse()) or about to be put together (pduEncode()).
+Each field fills the next free slot of its kind, so for a %c handles[0]
+is the sender and handles[1..] the destinations, and for a stream start
+numbers[0] is the id and numbers[1] the length.
+*/
+typedef struct
+{
+    uint8_t flag;
+    int numHandles;
+    PduBytes_t handles[PDU_MAX_HANDLES];
+    int numNumbers;
+    uint32_t numbers[PDU_MAX_NUMBERS];
+    int numBytes;
+    uint8_t bytes[PDU_MAX_BYTES];
+    PduBytes_t channel;
+    PduBytes_t text;
+} PduView_t;
+
+int pduParse(const uint8_t *pdu, int pduLen, int direction, PduView_t *view);
+int pduEncode(uint8_t *out, int outSize, int direction, const PduView_t *view);
+void pduStart(PduView_t *view, uint8_t flag);
+void pduAddHandle(PduView_t *view, const void *handle, int len);
+void pduAddNumber(PduView_t *view, uint32_t number);
+void pduAddByte(PduView_t *view, uint8_t byte);
+void pduSetChannel(PduView_t *view, const void *name, int len);
+void pduSetText(PduView_t *view, const void *text, int len);
+int pduNextHandle(PduBytes_t *list, PduBytes_t *handle);
+
+#endif
@@ -8,6 +8,7 @@
 //    are using pthreads do NOT use this code.
 // 2. pollCall() always returns the lowest available file descriptor 
 //    which could cause higher file descriptors to never be processed
+//    (pollCallAll() returns all of them)
 //
 // This is for student projects so I don't intend on improving this. 
 
@@ -31,6 +32,10 @@ void setupPollSet()
 {
 	currentPollSetSize = POLL_SET_SIZE;
 	pollFileDescriptors = (struct pollfd *) sCalloc(POLL_SET_SIZE, sizeof(struct pollfd));
+	for (int i = 0; i < POLL_SET_SIZE; i++)
+	{
+		pollFileDescriptors[i].fd = -1; // poll() skips it, fd 0 would report stdin's hangups
+	}
 }
 
 
@@ -56,7 +61,7 @@ void addToPollSet(int socketNumber)
 
 void removeFromPollSet(int socketNumber)
 {
-	pollFileDescriptors[socketNumber].fd = 0;
+	pollFileDescriptors[socketNumber].fd = -1;
 	pollFileDescriptors[socketNumber].events = 0;
 }
 
@@ -101,6 +106,28 @@ int pollCall(int timeInMilliSeconds)
 	return returnValue;
 }
 
+// Like pollCall() but fills readyFds with every ready file descriptor (up to maxReady)
+// returns how many, 0 if timeout occurred
+int pollCallAll(int timeInMilliSeconds, int *readyFds, int maxReady)
+{
+	int numReady = 0;
+	
+	if (poll(pollFileDescriptors, maxFileDescriptor, timeInMilliSeconds) < 0)
+	{
+		perror("pollCallAll");
+		exit(-1);
+	}
+	
+	for (int i = 0; i < maxFileDescriptor && numReady < maxReady; i++)
+	{
+		if (pollFileDescriptors[i].revents > 0)
+		{
+			readyFds[numReady++] = i;
+		}
+	}
+	return numReady;
+}
+
 static void growPollSet(int newSetSize)
 {
 	int i = 0;
@@ -119,7 +146,7 @@ static void growPollSet(int newSetSize)
 	// zero out the new poll set elements
 	for (i = currentPollSetSize; i < newSetSize; i++)
 	{
-		pollFileDescriptors[i].fd = 0;
+		pollFileDescriptors[i].fd = -1;
 		pollFileDescriptors[i].events = 0;
 	}
 	
@@ -18,5 +18,6 @@ void setupPollSet();
 void addToPollSet(int socketNumber);
 void removeFromPollSet(int socketNumber);
 int pollCall(int timeInMilliSeconds);
+int pollCallAll(int timeInMilliSeconds, int *readyFds, int maxReady);
 
 #endif
\ No newline at end of file
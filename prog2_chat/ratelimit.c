@@ -0,0 +1,279 @@
+// --------------- ratelimit.c -----------------
+/*
+Per-client rate limits and overload shedding for the server.
+
+Every logged in client has two token buckets, one counting PDUs (-R) and
+one counting bytes (-B). Nothing refills them on a timer: each PDU tops
+its client's buckets up for the time since the last one and takes its cost
+out, using a clock read once per event loop pass (updateRateLimits()). That
+is a few adds and multiplies per PDU, and no syscall.
+
+A client over its limit gets what -S says. reject drops the PDU and tells
+the client with a RATE_LIMITED_FLAG. delay (the default) handles it on
+credit, then doesn't read the client again until its buckets have paid the
+debt back. disconnect closes it. Stream segments are always delayed:
+dropping one would leave the destination with a broken message.
+
+Each reactor also adds up the bytes waiting in every reactor's send queues
+once per pass. Over -Q the server is overloaded, and until the queues
+drain to half that it sheds the PDUs that fan out to other clients (%m,
+%c, %b, channel messages, stream starts) with the same action. Logins,
+listings, keepalives and channel joins still go through.
+
+Every action taken is counted in the reactor's metrics (metrics.c) and
+printed with the SIGUSR1 stats.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ratelimit.h"
+#include "reactor.h"
+#include "metrics.h"
+#include "log.h"
+
+static int messageRate = 0;       // PDUs a second, 0 for no limit
+static int64_t messageBurst = 0;  // bucket size, thousandths of a PDU
+static int byteRate = 0;          // bytes a second, 0 for no limit
+static int64_t byteBurst = 0;
+static int64_t overloadBytes = 0; // queued in all send queues before shedding starts, 0 never
+static ShedAction shedAction = SHED_DELAY;
+
+static __thread uint64_t passMs = 0;     // the clock as of this pass
+static __thread int overloaded = 0;
+
+static void refillBucket(RateBucket_t *bucket, int rate, int64_t burst);
+static uint64_t debtMs(RateBucket_t *bucket, int rate);
+static int fansOut(uint8_t flag);
+static int shed(Connection_t *conn, uint8_t flag, uint8_t reason, uint64_t *counters);
+
+// A burst of 0 means one second's worth. The byte bucket always holds at least one full PDU.
+void setRateLimits(int messagesPerSecond, int messageBurstSize, int bytesPerSecond, int byteBurstSize)
+{
+    messageRate = messagesPerSecond;
+    messageBurst = (int64_t)(messageBurstSize > 0 ? messageBurstSize : messagesPerSecond) * 1000;
+    if (messageBurst < 1000)
+    {
+        messageBurst = 1000;
+    }
+
+    byteRate = bytesPerSecond;
+    byteBurst = (int64_t)(byteBurstSize > 0 ? byteBurstSize : bytesPerSecond) * 1000;
+    if (byteBurst < (int64_t)MAXBUF * 1000)
+    {
+        byteBurst = (int64_t)MAXBUF * 1000;
+    }
+}
+
+void setOverloadLimit(int queuedBytes)
+{
+    overloadBytes = queuedBytes;
+}
+
+// -S reject|delay|disconnect. Return value: 0, -1 if it's none of those
+int setShedAction(char *name)
+{
+    if (strcmp(name, "reject") == 0)
+    {
+        shedAction = SHED_REJECT;
+    }
+    else if (strcmp(name, "delay") == 0)
+    {
+        shedAction = SHED_DELAY;
+    }
+    else if (strcmp(name, "disconnect") == 0)
+    {
+        shedAction = SHED_DISCONNECT;
+    }
+    else
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+-- Once per event loop pass, after the wait: nowMs is the clock every PDU in
+   the pass is charged against. Also sees whether the server is (still) overloaded.
+*/
+void updateRateLimits(uint64_t nowMs)
+{
+    passMs = nowMs;
+    if (overloadBytes == 0)
+    {
+        return;
+    }
+
+    int64_t queued = 0;
+    for (int i = 0; i < getNumReactors(); i++)
+    {
+        queued += __atomic_load_n(&getReactor(i)->queuedBytes, __ATOMIC_RELAXED);
+    }
+
+    if (!overloaded && queued > overloadBytes)
+    {
+        overloaded = 1;
+        metricAdd(&threadMetrics->overloads, 1);
+        LOG_WARN("Reactor %d: %lld bytes waiting to go out, shedding messages\n", getCurrentReactor()->reactorId,
+                 (long long)queued);
+    }
+    else if (overloaded && queued <= overloadBytes / 2)
+    {
+        overloaded = 0;
+        LOG_INFO("Reactor %d: send queues drained, no longer shedding\n", getCurrentReactor()->reactorId);
+    }
+}
+
+// Logged in: both buckets start full
+void startRateLimit(Connection_t *conn)
+{
+    conn->messageBucket.tokens = messageBurst;
+    conn->messageBucket.refilledMs = passMs;
+    conn->byteBucket.tokens = byteBurst;
+    conn->byteBucket.refilledMs = passMs;
+}
+
+/*
+-- Charge a PDU from a logged in client to its buckets, and shed it if the
+   client is over a limit or the PDU fans out while the server is overloaded
+-- Keepalives are never limited, a client that's being delayed still has to
+   be able to answer a ping
+-- Return value: 1 to handle it, 0 if it was dropped (or the client is being closed)
+*/
+int admitPDU(Connection_t *conn, uint8_t *pdu, int pduLen)
+{
+    if (conn->closeAfterRead)
+    {
+        return 0; // the rest of what it sent goes nowhere
+    }
+    if (pdu[0] == KEEPALIVE_PING_FLAG || pdu[0] == KEEPALIVE_PONG_FLAG)
+    {
+        return 1;
+    }
+
+    if (overloaded && fansOut(pdu[0]))
+    {
+        if (!shed(conn, pdu[0], RATE_OVERLOADED, threadMetrics->overloadShed))
+        {
+            return 0;
+        }
+        delayReading(conn, passMs + OVERLOAD_DELAY_MS);
+    }
+
+    if (messageRate > 0 || byteRate > 0)
+    {
+        int64_t messageCost = (messageRate > 0) ? 1000 : 0;
+        int64_t byteCost = (byteRate > 0) ? (int64_t)(pduLen + 2) * 1000 : 0;
+
+        refillBucket(&conn->messageBucket, messageRate, messageBurst);
+        refillBucket(&conn->byteBucket, byteRate, byteBurst);
+
+        if (conn->messageBucket.tokens < messageCost || conn->byteBucket.tokens < byteCost)
+        {
+            uint8_t reason = (conn->messageBucket.tokens < messageCost) ? RATE_LIMIT_MESSAGES : RATE_LIMIT_BYTES;
+            if (!shed(conn, pdu[0], reason, threadMetrics->rateShed))
+            {
+                return 0;
+            }
+
+            // Handled on credit, the client isn't read again until that's paid back
+            conn->messageBucket.tokens -= messageCost;
+            conn->byteBucket.tokens -= byteCost;
+            uint64_t messageWait = debtMs(&conn->messageBucket, messageRate);
+            uint64_t byteWait = debtMs(&conn->byteBucket, byteRate);
+            delayReading(conn, passMs + (messageWait > byteWait ? messageWait : byteWait));
+            return 1;
+        }
+        conn->messageBucket.tokens -= messageCost;
+        conn->byteBucket.tokens -= byteCost;
+    }
+
+    conn->rateNotified = 0;
+    return 1;
+}
+
+// This reactor's counts, after its connection table in the SIGUSR1 dump
+void printRateStats(FILE *out)
+{
+    ThreadMetrics_t *metrics = threadMetrics;
+
+    flockfile(out);
+    fprintf(out, "reactor %d rate limited: %llu rejected %llu delayed %llu disconnected\n",
+            getCurrentReactor()->reactorId, (unsigned long long)metrics->rateShed[SHED_REJECT],
+            (unsigned long long)metrics->rateShed[SHED_DELAY], (unsigned long long)metrics->rateShed[SHED_DISCONNECT]);
+    fprintf(out, "reactor %d overload%s: entered %llu times, %llu rejected %llu delayed %llu disconnected\n",
+            getCurrentReactor()->reactorId, overloaded ? " (now)" : "", (unsigned long long)metrics->overloads,
+            (unsigned long long)metrics->overloadShed[SHED_REJECT], (unsigned long long)metrics->overloadShed[SHED_DELAY],
+            (unsigned long long)metrics->overloadShed[SHED_DISCONNECT]);
+    fflush(out);
+    funlockfile(out);
+}
+
+// rate a second is rate thousandths a millisecond
+static void refillBucket(RateBucket_t *bucket, int rate, int64_t burst)
+{
+    uint64_t elapsed = passMs - bucket->refilledMs;
+
+    if (elapsed == 0 || rate == 0)
+    {
+        return;
+    }
+    if (elapsed > RATE_MAX_REFILL_MS)
+    {
+        elapsed = RATE_MAX_REFILL_MS;
+    }
+    bucket->tokens += (int64_t)elapsed * rate;
+    if (bucket->tokens > burst)
+    {
+        bucket->tokens = burst;
+    }
+    bucket->refilledMs = passMs;
+}
+
+// ms until a bucket in debt is back to empty
+static uint64_t debtMs(RateBucket_t *bucket, int rate)
+{
+    if (rate == 0 || bucket->tokens >= 0)
+    {
+        return 0;
+    }
+    return (uint64_t)((-bucket->tokens + rate - 1) / rate);
+}
+
+// The PDUs that queue something for other clients, the ones shed when overloaded
+static int fansOut(uint8_t flag)
+{
+    return flag == 0x04 || flag == 0x05 || flag == 0x06 || flag == CHANNEL_MESSAGE_FLAG || flag == STREAM_START_FLAG;
+}
+
+/*
+-- Do what -S says with a PDU over a limit, counting it in counters[action]
+-- Return value: 1 if it's still to be handled (delayed), 0 if not
+*/
+static int shed(Connection_t *conn, uint8_t flag, uint8_t reason, uint64_t *counters)
+{
+    // Dropping a segment (or an abort) would leave the destination with a broken message
+    ShedAction action = (flag == STREAM_DATA_FLAG || flag == STREAM_ABORT_FLAG) ? SHED_DELAY : shedAction;
+
+    conn->stats.rateLimited++;
+    metricAdd(&counters[action], 1);
+    switch (action)
+    {
+    case SHED_REJECT:
+        if (!conn->rateNotified)
+        {
+            uint8_t notice[3] = {RATE_LIMITED_FLAG, reason, flag};
+            queuePDU(conn, notice, sizeof(notice));
+            conn->rateNotified = 1;
+        }
+        return 0;
+    case SHED_DISCONNECT:
+        LOG_INFO("Socket %d: %s, disconnecting\n", conn->socketNum,
+                 reason == RATE_OVERLOADED ? "shed while overloaded" : "over its rate limit");
+        conn->closeAfterRead = 1;
+        return 0;
+    default:
+        return 1;
+    }
+}
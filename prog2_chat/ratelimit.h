@@ -0,0 +1,28 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "connection.h"
+
+#define OVERLOAD_DELAY_MS 100        // how long a client shed by delay isn't read while overloaded
+#define RATE_MAX_REFILL_MS (60 * 60 * 1000) // longer than this idle refills the same, keeps the math in range
+
+// What happens to a PDU over a limit (-S), also the index of its count in ThreadMetrics_t
+typedef enum
+{
+    SHED_REJECT,                     // dropped, the client gets a RATE_LIMITED_FLAG
+    SHED_DELAY,                      // handled, then the client isn't read until it's back under
+    SHED_DISCONNECT                  // the client is closed
+} ShedAction;
+
+void setRateLimits(int messagesPerSecond, int messageBurst, int bytesPerSecond, int byteBurst);
+void setOverloadLimit(int queuedBytes);
+int setShedAction(char *name);
+void updateRateLimits(uint64_t nowMs);
+void startRateLimit(Connection_t *conn);
+int admitPDU(Connection_t *conn, uint8_t *pdu, int pduLen);
+void printRateStats(FILE *out);
+
+#endif
@@ -0,0 +1,257 @@
+// --------------- reactor.c -----------------
+/*
+Reactor threads for the chat server.
+
+Each reactor is one thread with its own SO_REUSEPORT listening socket (the
+kernel spreads new connections across them) and its own epoll set. A
+connection is only ever touched by the reactor that accepted it. When a
+client on one reactor sends to a client on another, the PDU goes into the
+other reactor's inbox - a lock-free MPSC queue - and an eventfd wakes that
+reactor up. The eventfd is only written when the reactor isn't already
+due to look at its inbox, so a burst of messages costs one wakeup.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "reactor.h"
+#include "networks.h"
+#include "safeUtil.h"
+#include "slab.h"
+#include "metrics.h"
+
+static Reactor_t reactors[MAX_REACTORS];
+static int numReactors = 0;
+static void (*reactorEventLoop)(Reactor_t *reactor) = NULL;
+
+static __thread Reactor_t *currentReactor = NULL;
+static __thread Slab_t *inboxSlab = NULL; // this thread's InboxMessage_ts
+
+static void initInboxQueue(InboxQueue_t *queue);
+static void pushInboxQueue(InboxQueue_t *queue, InboxMessage_t *message);
+static InboxMessage_t *popInboxQueue(InboxQueue_t *queue);
+static void *reactorThread(void *arg);
+
+// Set up the reactors and their listening sockets (all bound to the same port),
+// or take over the ones in listenSockets (from the server we replaced) if it isn't NULL
+void initReactors(int count, int serverPort, int *listenSockets)
+{
+    if (count < 1 || count > MAX_REACTORS)
+    {
+        printf("Error: number of reactor threads must be 1 to %d\n", MAX_REACTORS);
+        exit(-1);
+    }
+    numReactors = count;
+
+    for (int i = 0; i < numReactors; i++)
+    {
+        Reactor_t *reactor = &reactors[i];
+
+        memset(reactor, 0, sizeof(Reactor_t));
+        reactor->reactorId = i;
+
+        if (listenSockets != NULL)
+        {
+            reactor->serverSocket = listenSockets[i];
+        }
+        else
+        {
+            // The first socket picks the port if we were given 0, the rest share it
+            reactor->serverSocket = tcpServerSetupReusePort(serverPort, i == 0);
+            serverPort = getServerPort(reactor->serverSocket);
+        }
+
+        if ((reactor->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        {
+            perror("eventfd");
+            exit(-1);
+        }
+        initInboxQueue(&reactor->inbox);
+    }
+}
+
+// Start every reactor running eventLoop, the calling thread becomes reactor 0
+void runReactors(void (*eventLoop)(Reactor_t *reactor))
+{
+    reactorEventLoop = eventLoop;
+
+    for (int i = 1; i < numReactors; i++)
+    {
+        if (pthread_create(&reactors[i].thread, NULL, reactorThread, &reactors[i]) != 0)
+        {
+            perror("pthread_create");
+            exit(-1);
+        }
+    }
+
+    reactors[0].thread = pthread_self();
+    reactorThread(&reactors[0]);
+}
+
+int getNumReactors()
+{
+    return numReactors;
+}
+
+Reactor_t *getReactor(int reactorId)
+{
+    return &reactors[reactorId];
+}
+
+// The reactor running on this thread
+Reactor_t *getCurrentReactor()
+{
+    return currentReactor;
+}
+
+InboxMessage_t *createInboxMessage(InboxType type, ConnRef_t *dest, ConnRef_t *sender, PDUSlice_t *pdu)
+{
+    if (inboxSlab == NULL)
+    {
+        inboxSlab = createSlab("inbox", sizeof(InboxMessage_t));
+    }
+    InboxMessage_t *message = (InboxMessage_t *)slabAlloc(inboxSlab);
+    memset(message, 0, sizeof(InboxMessage_t));
+
+    message->type = type;
+    if (dest != NULL)
+    {
+        message->dest = *dest;
+    }
+    if (sender != NULL)
+    {
+        message->sender = *sender;
+    }
+    if (pdu != NULL)
+    {
+        retainPDUBuffer(pdu->pduBuffer); // dropped by the receiving reactor
+        message->pdu = *pdu;
+    }
+    return message;
+}
+
+// Hand a message to another reactor (safe from any thread)
+void postToReactor(int reactorId, InboxMessage_t *message)
+{
+    Reactor_t *reactor = &reactors[reactorId];
+
+    pushInboxQueue(&reactor->inbox, message);
+
+    // Only the first producer since the reactor last looked needs to wake it
+    if (__atomic_exchange_n(&reactor->wakePending, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        uint64_t one = 1;
+        if (write(reactor->wakeFd, &one, sizeof(one)) < 0)
+        {
+            perror("eventfd write");
+        }
+        metricAdd(&threadMetrics->syscalls, 1);
+    }
+}
+
+// Run handler on everything in this reactor's inbox (called by the owning thread)
+void drainInbox(Reactor_t *reactor, void (*handler)(InboxMessage_t *message))
+{
+    uint64_t count;
+
+    // Clear the flag before draining so a producer that pushes after this point wakes us again
+    if (read(reactor->wakeFd, &count, sizeof(count)) < 0)
+    {
+        count = 0; // nothing written, we're just checking
+    }
+    metricAdd(&threadMetrics->syscalls, 1);
+    __atomic_store_n(&reactor->wakePending, 0, __ATOMIC_RELEASE);
+
+    InboxMessage_t *message;
+    while ((message = popInboxQueue(&reactor->inbox)) != NULL)
+    {
+        handler(message);
+        if (message->pdu.pduBuffer != NULL)
+        {
+            releasePDUBuffer(message->pdu.pduBuffer);
+        }
+        slabFree(message); // back to the sending thread's slab
+    }
+}
+
+// Poke every reactor's eventfd (async-signal-safe, used from signal handlers)
+void wakeAllReactors()
+{
+    uint64_t one = 1;
+
+    for (int i = 0; i < numReactors; i++)
+    {
+        if (write(reactors[i].wakeFd, &one, sizeof(one)) < 0)
+        {
+            // nothing we can do from a signal handler
+        }
+    }
+}
+
+static void *reactorThread(void *arg)
+{
+    currentReactor = (Reactor_t *)arg;
+    reactorEventLoop(currentReactor);
+    return NULL;
+}
+
+static void initInboxQueue(InboxQueue_t *queue)
+{
+    queue->stub.next = NULL;
+    queue->head = &queue->stub;
+    queue->tail = &queue->stub;
+}
+
+// Any thread: swap ourselves in as the new head, then link the old head to us
+static void pushInboxQueue(InboxQueue_t *queue, InboxMessage_t *message)
+{
+    __atomic_store_n(&message->next, NULL, __ATOMIC_RELAXED);
+    InboxMessage_t *previous = __atomic_exchange_n(&queue->head, message, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&previous->next, message, __ATOMIC_RELEASE);
+}
+
+// Owning thread only: returns NULL when empty, or when a producer is half way
+// through a push (it will wake us again once it has finished)
+static InboxMessage_t *popInboxQueue(InboxQueue_t *queue)
+{
+    InboxMessage_t *tail = queue->tail;
+    InboxMessage_t *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == &queue->stub)
+    {
+        if (next == NULL)
+        {
+            return NULL;
+        }
+        queue->tail = next;
+        tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next != NULL)
+    {
+        queue->tail = next;
+        return tail;
+    }
+
+    if (tail != __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+
+    // tail is the last message, put the stub back behind it so it can be taken
+    pushInboxQueue(queue, &queue->stub);
+
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next != NULL)
+    {
+        queue->tail = next;
+        return tail;
+    }
+    return NULL;
+}
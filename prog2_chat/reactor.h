@@ -0,0 +1,72 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "handle_table.h"
+#include "pduBuffer.h"
+#include "timerWheel.h"
+
+#define MAX_REACTORS 64
+
+typedef enum
+{
+    INBOX_DELIVER,   // queue pdu for dest (sent by sender)
+    INBOX_BROADCAST, // queue pdu for every local client except sender
+    INBOX_CHANNEL,   // queue pdu for channel's local members except sender
+    INBOX_PAUSE,     // stop reading dest, it sent to a backed up client
+    INBOX_RESUME     // that client drained, read dest again
+} InboxType;
+
+// Work handed from one reactor thread to another
+typedef struct InboxMessage
+{
+    struct InboxMessage *next;
+    InboxType type;
+    ConnRef_t dest;
+    ConnRef_t sender;
+    PDUSlice_t pdu;
+    struct Channel *channel; // INBOX_CHANNEL, holds a reference
+} InboxMessage_t;
+
+// Lock-free multi-producer single-consumer queue (intrusive, Vyukov style)
+typedef struct
+{
+    InboxMessage_t *head;   // producers swap themselves in here
+    InboxMessage_t *tail;   // only the owning reactor touches this
+    InboxMessage_t stub;
+} InboxQueue_t;
+
+// One event loop thread: its own listening socket, epoll set and inbox
+typedef struct Reactor
+{
+    int reactorId;
+    pthread_t thread;
+    int serverSocket;
+    int wakeFd;             // eventfd, readable when the inbox has work
+    int wakePending;        // set by the producer that wrote wakeFd, cleared by the reactor
+    InboxQueue_t inbox;
+
+    struct Connection **connections; // every connection this thread owns
+    int numConnections;
+    int connectionsSize;
+
+    TimerWheel_t timers;             // login, idle and keepalive timers of this thread's connections
+    int64_t queuedBytes;             // waiting in those connections' send queues, only this thread
+                                     // writes it, the others read it once per pass (ratelimit.c)
+    int uringUnarmed;                // -E uring: the accept and polls server.c couldn't (re)arm yet, the ring was full
+} Reactor_t;
+
+void initReactors(int numReactors, int serverPort, int *listenSockets);
+void runReactors(void (*eventLoop)(Reactor_t *reactor));
+int getNumReactors();
+Reactor_t *getReactor(int reactorId);
+Reactor_t *getCurrentReactor();
+
+void postToReactor(int reactorId, InboxMessage_t *message);
+InboxMessage_t *createInboxMessage(InboxType type, ConnRef_t *dest, ConnRef_t *sender, PDUSlice_t *pdu);
+void drainInbox(Reactor_t *reactor, void (*handler)(InboxMessage_t *message));
+void wakeAllReactors();
+
+#endif
@@ -109,3 +109,35 @@ int recvPDU(int socketNumber, uint8_t *dataBuffer, int bufferSize) {
     return received_bytes;
 }
 
+/*
+-- Pull every complete PDU out of a buffer of bytes read from a stream
+-- Each PDU is the 2 byte length (which counts itself) followed by the data
+-- handler() gets the data without the 2 byte length, like recvPDU() returns it
+-- Stops at the first partial PDU so the caller can keep it for the next read
+-- return value: number of bytes used up by complete PDUs
+-- return value == -1 if a length is shorter than a flag or bigger than maxPDULen
+*/
+int parsePDUs(uint8_t *buffer, int bufferLen, int maxPDULen, PDUHandler handler, void *context)
+{
+    int offset = 0;
+
+    while (bufferLen - offset >= 2)
+    {
+        uint16_t pdu_length;
+        memcpy(&pdu_length, buffer + offset, sizeof(pdu_length));
+        pdu_length = ntohs(pdu_length);
+
+        if (pdu_length < 3 || pdu_length > maxPDULen)
+        {
+            return -1; // the caller says so, through its own logging
+        }
+        if (bufferLen - offset < pdu_length)
+        {
+            break; // partial PDU, wait for the rest of it
+        }
+
+        handler(context, buffer + offset + 2, pdu_length - 2);
+        offset += pdu_length;
+    }
+    return offset;
+}
@@ -6,8 +6,12 @@
 // include types
 #include <stdio.h>
 
+// Called with each complete PDU found by parsePDUs() (pdu/pduLen same as recvPDU() gives)
+typedef void (*PDUHandler)(void *context, uint8_t *pdu, int pduLen);
+
 int sendPDU(int clientSocket, uint8_t * dataBuffer, int lengthOfData);
 int recvPDU(int socketNumber, uint8_t * dataBuffer, int bufferSize); 
+int parsePDUs(uint8_t *buffer, int bufferLen, int maxPDULen, PDUHandler handler, void *context);
 void printPacket(const uint8_t *packet, size_t length);
 
 #endif
\ No newline at end of file
@@ -6,6 +6,8 @@
  *
  *****************************************************************************/
 
+#define _GNU_SOURCE // accept4()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -21,49 +23,133 @@
 #include <netdb.h>
 #include <stdint.h>
 #include <poll.h> // Include poll.h for pollfd structure
+#include <signal.h>
+#include <errno.h>
 
 #include "networks.h"
 #include "safeUtil.h"
 #include "sendreceive.h"
-#include "pollLib.h"
+#include "epollLib.h"
 #include "handle_table.h"
 #include "shared.h"
 #include "makePDU.h"
+#include "connection.h"
+#include "pduBuffer.h"
+#include "reactor.h"
+#include "handleList.h"
+#include "log.h"
+#include "slab.h"
+#include "channel.h"
+#include "stream.h"
+#include "shmRing.h"
+#include "handoff.h"
+#include "cluster.h"
+#include "ratelimit.h"
+#include "metrics.h"
+#include "uring.h"
+#include "pduCodec.h"
+#include "mailbox.h"
 
 #define DEBUG_FLAG 1
 #define POLL_SET_SIZE 10 // Define the size of the poll set
+#define ACCEPT_BATCH 256 // most connections accepted per wakeup, so a storm can't starve the clients we have
+
+// -E uring: the reactor's own requests, a bit each in reactor->uringUnarmed while they need (re)arming
+#define ARM_ACCEPT 0x01
+#define ARM_WAKE 0x02
+#define ARM_EPOLL 0x04
+
+// epoll tag for a shared memory client's socket and eventfd: its socket number
+// with the connection id on top, so an event still waiting for one that closed
+// earlier in the same pass (two descriptors report for it) is recognized
+#define SHM_EPOLL_TAG(conn) (((uint64_t)(conn)->connId << 32) | (uint32_t)(conn)->socketNum)
 
 void printPacket(const uint8_t *packet, size_t length);
 void recvFromClient(int clientSocket);
 int checkArgs_s(int argc, char *argv[]);
-void serverControl(int serverSocket);
+void printUsage(char *name);
+void serverControl(Reactor_t *reactor);
 int processClient(int socketNum);
+void processClientEvents(int socketNum, uint32_t events);
+void removeClient(int socketNum);
+void dispatchPDU(void *context, uint8_t *pdu, int pduLen);
 int addNewSocket(int socketNum);
+void acceptClient(int newSocket);
+void processEpollEvents(Reactor_t *reactor, struct epoll_event *events, int numReady);
+void armUring(Reactor_t *reactor);
+void rearmUring(Reactor_t *reactor);
+void processUringEvents(Reactor_t *reactor, UringEvent_t *events, int numReady);
+void processUringEvent(Reactor_t *reactor, UringEvent_t *event);
+void quiesceUring(Reactor_t *reactor, UringEvent_t *events);
+int addNewShmClient(int socketNum);
+void watchConnection(Connection_t *conn);
+void acceptHandoff(int socketNum);
+void processShmClientEvents(int socketNum, uint32_t connId, uint32_t events);
+void handleLogin(Connection_t *conn, uint8_t *buffer, int messageLen);
+void queueLoginReply(Connection_t *conn, PduView_t *reply, uint8_t capabilities, uint8_t *response);
+void dispatchBatch(Connection_t *conn, uint8_t *pdu, int pduLen);
 void forwardMessage(int socketNum, uint8_t *buffer, int messageLen);
 void handleFlags(int socketNum, uint8_t flag, uint8_t *buffer, int messageLen);
-int handleBroadcastMessage_s(int socketNum, const char *buffer);
+int handleBroadcastMessage_s(int socketNum, uint8_t *buffer, int messageLen);
 int validateMessage(uint8_t *buffer, int messageLen, int sender_socketNum);
 int validateMulticastMessage(uint8_t *buffer , int socketNum, int messageLen);
 int sendClientResponse(int socketNum, uint8_t flag, uint8_t handle_len, char *handle);
 int handleListHandles_s(int socketNum, char *buffer);
+int sendListPDU(int socketNum);
+int sendListPage(int socketNum, uint8_t *buffer, int messageLen);
+void handleChannelPDU(int socketNum, uint8_t *buffer, int messageLen);
+void handleStreamPDU(int socketNum, uint8_t *buffer, int messageLen);
+void sendChannelReply(Connection_t *conn, uint8_t status, uint8_t *name, int nameLen, int memberCount);
+void queueMailboxPDU(void *context, uint8_t *pdu, int pduLen);
 
 
 
 #define MAX_HANDLE_LEN 100
 // Define MAX_HANDLE_LEN with an appropriate value
 
+static int numThreads = 1; // reactor threads (-t)
+static int verbosity = DEFAULT_LOG_LEVEL; // log level (-v)
+static char *shmPath = NULL; // Unix socket for shared memory clients (-U), NULL for none
+static int shmListenSocket = -1; // shared by every reactor
+static char *handoffPath = NULL; // Unix socket a new server takes our clients over on (-X), NULL for none
+static HandoffListeners_t listeners; // what a new server gets along with the clients
+static int nodeId = 0; // this server's id in a cluster (-N), 0 if it's on its own
+static int clusterPort = 0; // where the other nodes connect (-C)
+static char *clusterPeers = NULL; // nodes we connect to (-P id@host:port,...)
+static char *adminPath = NULL; // Unix socket that answers with the live metrics (-A), NULL for none
+static int uringBackend = 0; // TCP clients read and written through io_uring instead of epoll (-E uring)
+static char *mailboxPath = NULL; // directory messages to handles that are away are kept in (-M), NULL for none
+static int mailboxCommitMs = MAILBOX_DEFAULT_COMMIT_MS; // how long a mailbox commit waits for more messages to join it
+
+static volatile sig_atomic_t statsGeneration = 0; // bumped by SIGUSR1, each reactor prints once per bump
+
+static void requestStats(int signalNumber)
+{
+    statsGeneration++;
+    wakeAllReactors();
+}
+
 void printPacket(const uint8_t *packet, size_t length)
 {
-    printf("Packet (%zu bytes):\n", length);
-    for (size_t i = 0; i < length; i++)
+    // Hex dumps are trace level only, so don't even build the lines otherwise
+    if (!LOG_ENABLED(LOG_LEVEL_TRACE))
+    {
+        return;
+    }
+
+    LOG_TRACE("Packet (%zu bytes):\n", length);
+    for (size_t i = 0; i < length; i += 16)
     {
-        printf("%02x ", packet[i]); // Print each byte in hexadecimal format
-        if ((i + 1) % 16 == 0)
+        char line[16 * 3 + 1];
+        int lineLen = 0;
+
+        // Print each byte in hexadecimal format, a line every 16 bytes for readability
+        for (size_t j = i; j < length && j < i + 16; j++)
         {
-            printf("\n"); // Add a newline every 16 bytes for readability
+            lineLen += snprintf(line + lineLen, sizeof(line) - lineLen, "%02x ", packet[j]);
         }
+        LOG_TRACE("%s\n", line);
     }
-    printf("\n");
 }
 
 int main(int argc, char *argv[])
@@ -74,15 +160,93 @@ int main(int argc, char *argv[])
     // Parse command line arguments
     portNumber = checkArgs_s(argc, argv);
 
-    // Create the server socket
-    mainServerSocket = tcpServerSetup(portNumber);
+    // Everything after this logs through the log thread instead of printf()
+    initLog(verbosity);
+
+    if (uringBackend && !uringSupported())
+    {
+        LOG_WARN("io_uring isn't available here (kernel too old, or not allowed), using epoll\n");
+        uringBackend = 0;
+    }
+    setUringBackend(uringBackend);
+
+    // A client that disappears mid-write should be an error return, not a signal that kills us
+    signal(SIGPIPE, SIG_IGN);
+    // kill -USR1 <pid> dumps the per-connection send queue and slab stats
+    signal(SIGUSR1, requestStats);
+
     initHandleTable(); // Initialize the handle table
+    initChannelTable();
+    initConnectionTable(); // Per-client receive buffers
+
+    if (nodeId > 0 && initCluster(nodeId, clusterPort, clusterPeers != NULL ? clusterPeers : "") < 0)
+    {
+        LOG_ERROR("Bad cluster peer list, expected -P id@host:port,id@host:port with ids 1-%d\n", MAX_CLUSTER_NODES);
+        exit(-1);
+    }
+
+    listeners.shmListenSocket = -1;
+    listeners.handoffListenSocket = -1;
 
-    // Set up the poll set
-    setupPollSet();
+    int oldServer = (handoffPath != NULL) ? handoffConnect(handoffPath) : -1;
+    if (oldServer >= 0)
+    {
+        // A server is already running at -X: take over its listening sockets and clients
+        if (receiveHandoff(oldServer, &listeners) < 0)
+        {
+            exit(-1);
+        }
+        close(oldServer);
+        if (numThreads != listeners.numReactors)
+        {
+            LOG_WARN("Running %d reactor threads like the server we took over from, not %d\n", listeners.numReactors, numThreads);
+            numThreads = listeners.numReactors;
+        }
+        shmListenSocket = listeners.shmListenSocket;
+    }
+    else
+    {
+        if (shmPath != NULL && (shmListenSocket = shmListen(shmPath)) < 0)
+        {
+            LOG_ERROR("Can't listen on %s: %s\n", shmPath, strerror(errno));
+            exit(-1);
+        }
+        if (handoffPath != NULL && (listeners.handoffListenSocket = handoffListen(handoffPath)) < 0)
+        {
+            LOG_ERROR("Can't listen on %s: %s\n", handoffPath, strerror(errno));
+            exit(-1);
+        }
+        listeners.shmListenSocket = shmListenSocket;
+    }
+    if (mailboxPath != NULL)
+    {
+        // After a handoff this waits for the old server to exit and let go of the directory
+        // (its clients are registered as the reactors restore them)
+        if (openMailbox(mailboxPath, mailboxCommitMs) < 0)
+        {
+            exit(-1);
+        }
+    }
+    initHandoff(numThreads);
+    initMetrics(numThreads);
+
+    // Create the server sockets, one per reactor thread on the same port (or carry on with the old server's)
+    initReactors(numThreads, portNumber, (oldServer >= 0) ? listeners.serverSockets : NULL);
+    mainServerSocket = getReactor(0)->serverSocket;
+    listeners.numReactors = numThreads;
+    for (int i = 0; i < numThreads; i++)
+    {
+        listeners.serverSockets[i] = getReactor(i)->serverSocket;
+    }
+    startCluster();
+    if (adminPath != NULL && startAdmin(adminPath) < 0)
+    {
+        LOG_ERROR("Can't listen on %s: %s\n", adminPath, strerror(errno));
+        exit(-1);
+    }
 
-    // Start the server control loop to handle client connections
-    serverControl(mainServerSocket);
+    // Start the server control loop on every reactor to handle client connections
+    runReactors(serverControl);
 
     // Close the server socket when done
     close(mainServerSocket);
@@ -99,7 +263,7 @@ void recvFromClient(int clientSocket)
     // Receive data from the client_socket
     if ((messageLen = recvPDU(clientSocket, dataBuffer, MAXBUF)) < 0)
     {
-        perror("recv call failed");
+        LOG_ERROR("recv call failed: %s\n", strerror(errno));
         exit(-1);
     }
     if (messageLen > 0)
@@ -109,211 +273,856 @@ void recvFromClient(int clientSocket)
     }
     else
     {
-        printf("Socket %d: Connection closed by other side\n", clientSocket);
+        LOG_INFO("Socket %d: Connection closed by other side\n", clientSocket);
     }
 }
 
 
-int handleBroadcastMessage_s(int socketNum, const char *buffer)
+int handleBroadcastMessage_s(int socketNum, uint8_t *buffer, int messageLen)
 {
+    PduView_t broadcast;
+
     // Handle the broadcast message command
-    printf("Handle broadcast message command.\n");
-    printf("------------------- broadcast message -------------------\n");
-    // Construct broadcast packet
-    printPacket((uint8_t *)buffer, strlen(buffer));
-    Handle_t *handle = getHandleTable();
-    int handleCount = getHandleCount();
-    for (int i = 0; i < handleCount; i++)
+    if (pduParse(buffer, messageLen, PDU_TO_SERVER, &broadcast) < 0)
     {
-        if (handle[i].socketNum != socketNum)
-        {
-            // Send the broadcast message to all clients except the sender
-            int sent = sendPDU(handle[i].socketNum, (uint8_t *)buffer, strlen(buffer));
-            if (sent < 0)
-            {
-                printf("Error sending broadcast message to socket %d\n", handle[i].socketNum);
-            }
-        }
+        LOG_WARN("Invalid broadcast message on socket %d\n", socketNum);
+        return -1;
     }
-    printf("--------------------------------------------------------\n");
+    LOG_DEBUG("Handle broadcast message command.\n");
+    LOG_DEBUG("------------------- broadcast message -------------------\n");
+    printPacket(buffer, messageLen);
+
+    // Build the wire PDU once, every other client's send queue shares it
+    PDUBuffer_t *broadcastPDU = createPDUBuffer(buffer, messageLen);
+    metricRecord(&threadMetrics->fanOut, getHandleCount() - 1);
+
+    // Send the broadcast message to all clients except the sender (every reactor fans out to its own)
+    broadcastPDUBuffer(getConnection(socketNum), broadcastPDU);
+    releasePDUBuffer(broadcastPDU);
+    LOG_DEBUG("--------------------------------------------------------\n");
     
     return 0;
 }
 
+void printUsage(char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [-t threads] [-v log level 0-4] [-l login timeout seconds] [-i idle seconds]\n"
+            "    [-H high watermark bytes] [-L low watermark bytes] [-U shared memory socket path]\n"
+            "    [-X handoff socket path] [-N node id -C cluster port -P id@host:port,...]\n"
+            "    [-R messages/sec[:burst]] [-B bytes/sec[:burst]] [-Q overload queued bytes]\n"
+            "    [-S reject|delay|disconnect] [-A admin socket path] [-E epoll|uring]\n"
+            "    [-M mailbox dir[:commit ms]] [optional port number]\n",
+            name);
+}
+
 // Function to check command-line arguments and return the port number
 int checkArgs_s(int argc, char *argv[])
 {
     int portNumber = 0;
+    int highWatermark = DEFAULT_HIGH_WATERMARK;
+    int lowWatermark = DEFAULT_LOW_WATERMARK;
+    int option = 0;
+
+    int loginTimeout = DEFAULT_LOGIN_TIMEOUT;
+    int idleTimeout = DEFAULT_IDLE_TIMEOUT;
+    int messageRate = 0, messageBurst = 0;
+    int byteRate = 0, byteBurst = 0;
+    int overloadBytes = 0;
+    int badShedAction = 0;
+    int badBackend = 0;
+
+    while ((option = getopt(argc, argv, "H:L:t:l:i:v:U:X:N:C:P:R:B:Q:S:A:E:M:")) != -1)
+    {
+        switch (option)
+        {
+        case 'v':
+            verbosity = atoi(optarg);
+            break;
+        case 'l':
+            loginTimeout = atoi(optarg);
+            break;
+        case 'i':
+            idleTimeout = atoi(optarg);
+            break;
+        case 't':
+            numThreads = atoi(optarg);
+            break;
+        case 'H':
+            highWatermark = atoi(optarg);
+            break;
+        case 'L':
+            lowWatermark = atoi(optarg);
+            break;
+        case 'U':
+            shmPath = optarg;
+            break;
+        case 'X':
+            handoffPath = optarg;
+            break;
+        case 'N':
+            nodeId = atoi(optarg);
+            break;
+        case 'C':
+            clusterPort = atoi(optarg);
+            break;
+        case 'P':
+            clusterPeers = optarg;
+            break;
+        case 'R':
+            sscanf(optarg, "%d:%d", &messageRate, &messageBurst);
+            break;
+        case 'B':
+            sscanf(optarg, "%d:%d", &byteRate, &byteBurst);
+            break;
+        case 'Q':
+            overloadBytes = atoi(optarg);
+            break;
+        case 'S':
+            badShedAction = (setShedAction(optarg) < 0);
+            break;
+        case 'A':
+            adminPath = optarg;
+            break;
+        case 'E':
+            uringBackend = (strcmp(optarg, "uring") == 0);
+            badBackend = !uringBackend && strcmp(optarg, "epoll") != 0;
+            break;
+        case 'M':
+            mailboxPath = strtok(optarg, ":");
+            char *commitMs = strtok(NULL, ":");
+            if (commitMs != NULL)
+            {
+                mailboxCommitMs = atoi(commitMs);
+            }
+            break;
+        default:
+            printUsage(argv[0]);
+            exit(-1);
+        }
+    }
 
-    if (argc > 2)
+    int badArgs = (argc - optind > 1);
+    badArgs |= (numThreads < 1 || numThreads > MAX_REACTORS);
+    badArgs |= (verbosity < LOG_LEVEL_ERROR || verbosity > LOG_LEVEL_TRACE);
+    badArgs |= (highWatermark <= 0 || lowWatermark < 0 || lowWatermark > highWatermark);
+    badArgs |= (loginTimeout < 1 || idleTimeout < 0);
+    badArgs |= (nodeId < 0 || nodeId > MAX_CLUSTER_NODES);
+    badArgs |= ((clusterPort != 0 || clusterPeers != NULL) && nodeId == 0); // -C and -P need -N
+    badArgs |= (messageRate < 0 || messageBurst < 0 || byteRate < 0 || byteBurst < 0 || overloadBytes < 0);
+    badArgs |= (badShedAction || badBackend || mailboxCommitMs < 0);
+    if (badArgs)
     {
-        fprintf(stderr, "Usage: %s [optional port number]\n", argv[0]);
+        printUsage(argv[0]);
         exit(-1);
     }
 
-    if (argc == 2)
+    if (argc - optind == 1)
     {
-        portNumber = atoi(argv[1]);
+        portNumber = atoi(argv[optind]);
     }
 
+    setWriteWatermarks(highWatermark, lowWatermark);
+    setLoginTimeout(loginTimeout);
+    setIdleTimeout(idleTimeout);
+    setRateLimits(messageRate, messageBurst, byteRate, byteBurst);
+    setOverloadLimit(overloadBytes);
     return portNumber;
 }
 
 // Main server control function to handle new connections and client data
-void serverControl(int serverSocket)
+// (runs on every reactor thread, each with its own listening socket and epoll set,
+// and with -E uring its own io_uring that the epoll set is just one more thing on)
+void serverControl(Reactor_t *reactor)
 {
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    UringEvent_t *uringEvents = NULL;
+    int numReady = 0;
+    int serverSocket = reactor->serverSocket;
+    sig_atomic_t lastStatsGeneration = statsGeneration;
+
+    setupEpollSet();
+    attachMetrics(reactor->reactorId);
+    initTimerWheel(&reactor->timers, getTimeMs());
+    setNonBlocking(serverSocket); // so accept4() can drain the backlog until EAGAIN
+    if (uringBackend)
+    {
+        // Clients come in through a multishot accept, the inbox and the
+        // epoll set (everything that isn't a TCP client) are polled on the ring
+        uringEvents = (UringEvent_t *)sCalloc(URING_MAX_EVENTS, sizeof(UringEvent_t));
+        setupUring();
+        armUring(reactor);
+    }
+    else
+    {
+        addToEpollSet(serverSocket, EPOLLIN);
+        addToEpollSet(reactor->wakeFd, EPOLLIN);
+    }
+    if (shmListenSocket >= 0)
+    {
+        // Every reactor waits on the one Unix socket, EPOLLEXCLUSIVE wakes just one of them per client
+        addToEpollSet(shmListenSocket, EPOLLIN | EPOLLEXCLUSIVE);
+    }
+    if (reactor->reactorId == 0 && listeners.handoffListenSocket >= 0)
+    {
+        addToEpollSet(listeners.handoffListenSocket, EPOLLIN);
+    }
 
-    addToPollSet(serverSocket);
-    int returned_socket;
+    // Clients the server we took over from had on this reactor
+    updateRateLimits(getTimeMs());
+    restoreConnections(reactor, watchConnection);
 
     while (1)
     {
-        // Call poll to monitor the file descriptors in 'fds'
-        returned_socket = pollCall(-1); // Block indefinitely until an event occurs
+        // Login deadlines and keepalives that are due, and sleep no longer than the next one
+        int timeout = runConnectionTimers(removeClient);
+        if (uringBackend)
+        {
+            // Parked PDUs are charged to the rate limits now, not when the last pass started
+            updateRateLimits(getTimeMs());
+            resumeConnections(dispatchPDU, removeClient);
+        }
+        flushPendingConnections(removeClient);
+
+        // Block until at least one socket is ready, then service all of them
+        // (or just look, if a handoff started after the wakeup was already read)
+        if (uringBackend)
+        {
+            // (a flush that took a client off a pause leaves it to be resumed right
+            // away, and so is a poll the ring had no room for tried again)
+            rearmUring(reactor);
+            numReady = uringCall((handoffPending() || resumePending() || reactor->uringUnarmed) ? 0 : timeout, uringEvents,
+                                 URING_MAX_EVENTS);
+        }
+        else
+        {
+            numReady = epollCall(handoffPending() ? 0 : timeout, events, EPOLL_MAX_EVENTS);
+            metricAdd(&threadMetrics->syscalls, 1);
+        }
+        uint64_t passStart = startPassMetrics(numReady);
+        updateRateLimits(passStart / 1000000); // the clock every PDU this pass is charged against
+
+        if (handoffPending())
+        {
+            // A new server is taking the clients (-X). If it doesn't, these
+            // events come back next time round: everything is level triggered.
+            // Completions aren't, so those are handled first, and then every
+            // recv on the ring is stopped before anything is handed over.
+            if (uringBackend)
+            {
+                processUringEvents(reactor, uringEvents, numReady);
+                quiesceUring(reactor, uringEvents);
+            }
+            parkForHandoff(reactor, removeClient);
+            if (uringBackend)
+            {
+                restartReceiving();
+                armUring(reactor);
+            }
+            continue;
+        }
+
+        if (uringBackend)
+        {
+            processUringEvents(reactor, uringEvents, numReady);
+        }
+        else
+        {
+            processEpollEvents(reactor, events, numReady);
+        }
 
-        printf("poll() returned socket: %d\n", returned_socket);
+        // Everything queued during this pass goes out now, one writev() per client
+        // (with -E uring it's queued on the ring, and goes in with the next wait)
+        flushPendingConnections(removeClient);
+        endPassMetrics(passStart, reactor->numConnections);
 
-        if (returned_socket == serverSocket)
+        if (lastStatsGeneration != statsGeneration)
         {
-            // If the returned socket is the server socket, a new client is connecting
-            addNewSocket(serverSocket); // Accept new client and add to poll set
+            lastStatsGeneration = statsGeneration;
+            printConnectionStats(stdout);
+            printRateStats(stdout);
+            if (reactor->reactorId == 0)
+            {
+                printSlabStats(stdout);
+            }
         }
-        else if (returned_socket > 0)
+    }
+}
+
+// Everything one epoll_wait() returned
+void processEpollEvents(Reactor_t *reactor, struct epoll_event *events, int numReady)
+{
+    int serverSocket = reactor->serverSocket;
+    int acceptPending = 0;
+    int shmAcceptPending = 0;
+    int handoffAcceptPending = 0;
+
+    for (int i = 0; i < numReady; i++)
+    {
+        int returned_socket = (int)(uint32_t)events[i].data.u64;
+        uint32_t shmConnId = (uint32_t)(events[i].data.u64 >> 32);
+
+        if (shmConnId != 0)
+        {
+            // A shared memory client's rings have something for us, or it hung up
+            processShmClientEvents(returned_socket, shmConnId, events[i].events);
+        }
+        else if (returned_socket == serverSocket)
+        {
+            // Accept after the client sockets in this batch are done so a
+            // socket closed earlier in the batch can't be reused by accept()
+            // while a stale event for it is still waiting in the array
+            acceptPending = 1;
+        }
+        else if (returned_socket == shmListenSocket)
         {
-            // If the returned socket is a client socket, process its data
-            printf("Processing client socket: %d\n", returned_socket);
-            processClient(returned_socket);
+            shmAcceptPending = 1;
+        }
+        else if (returned_socket == listeners.handoffListenSocket)
+        {
+            handoffAcceptPending = 1;
+        }
+        else if (returned_socket == reactor->wakeFd)
+        {
+            // Other reactors handed us PDUs for our clients (or pause/resume requests)
+            drainInbox(reactor, handleInboxMessage);
         }
         else
         {
-            printf("The returned socket was not a server or client socket!\n");
+            // If the returned socket is a client socket, write out / read in its data
+            processClientEvents(returned_socket, events[i].events);
+        }
+    }
+
+    if (acceptPending)
+    {
+        // New clients are connecting
+        addNewSocket(serverSocket); // Accept a batch of new clients and add them to the epoll set
+    }
+    if (shmAcceptPending)
+    {
+        addNewShmClient(shmListenSocket);
+    }
+    if (handoffAcceptPending)
+    {
+        acceptHandoff(listeners.handoffListenSocket);
+    }
+}
+
+// -E uring: the multishot accept, and the polls on the inbox's eventfd and the epoll set
+void armUring(Reactor_t *reactor)
+{
+    reactor->uringUnarmed = ARM_ACCEPT | ARM_WAKE | ARM_EPOLL;
+    rearmUring(reactor);
+}
+
+// Whichever of those has stopped, each stays marked until the ring has room for it
+void rearmUring(Reactor_t *reactor)
+{
+    if ((reactor->uringUnarmed & ARM_ACCEPT) && uringAccept(reactor->serverSocket) == 0)
+    {
+        reactor->uringUnarmed &= ~ARM_ACCEPT;
+    }
+    if ((reactor->uringUnarmed & ARM_WAKE) && uringWaitReadable(reactor->wakeFd) == 0)
+    {
+        reactor->uringUnarmed &= ~ARM_WAKE;
+    }
+    if ((reactor->uringUnarmed & ARM_EPOLL) && uringWaitReadable(getEpollFd()) == 0)
+    {
+        reactor->uringUnarmed &= ~ARM_EPOLL;
+    }
+}
+
+// Everything one uringCall() returned
+void processUringEvents(Reactor_t *reactor, UringEvent_t *events, int numReady)
+{
+    for (int i = 0; i < numReady; i++)
+    {
+        processUringEvent(reactor, &events[i]);
+    }
+}
+
+/*
+-- One io_uring completion: a client accepted, bytes received, a send done,
+   a full socket with room again, or the inbox or epoll set ready
+-- Completions for a socket that has been closed since (and maybe reused)
+   don't match its connection id and are dropped, their buffer goes back
+-- While a handoff is stopping the ring nothing that finishes is re-armed
+*/
+void processUringEvent(Reactor_t *reactor, UringEvent_t *event)
+{
+    Connection_t *conn = NULL;
+    int stopping = handoffPending();
+
+    if (event->connId != 0)
+    {
+        conn = getConnection(event->fd);
+        if (conn == NULL || conn->connId != event->connId)
+        {
+            uringReleaseBuffer(event);
             return;
         }
     }
+
+    switch (event->op)
+    {
+    case URING_ACCEPT:
+        if (event->res >= 0)
+        {
+            acceptClient(event->res);
+        }
+        else if (event->res != -ECANCELED)
+        {
+            LOG_ERROR("Failed to accept client: %s\n", strerror(-event->res));
+        }
+        if (!uringEventMore(event) && !stopping)
+        {
+            reactor->uringUnarmed |= ARM_ACCEPT;
+            rearmUring(reactor);
+        }
+        break;
+    case URING_RECV:
+    {
+        int status = receivedConnection(conn, uringEventBuffer(event), event->res, uringEventMore(event), dispatchPDU);
+        uringReleaseBuffer(event);
+        if (status < 0)
+        {
+            LOG_INFO("Socket %d: Connection closed by client\n", event->fd);
+            removeClient(event->fd);
+        }
+        break;
+    }
+    case URING_SEND:
+        if (sendCompleted(conn, event->res) < 0)
+        {
+            LOG_INFO("Socket %d: write failed, closing\n", event->fd);
+            removeClient(event->fd);
+        }
+        break;
+    case URING_WRITABLE:
+        connectionWritable(conn);
+        break;
+    case URING_READABLE:
+        if (event->fd == reactor->wakeFd)
+        {
+            // Other reactors handed us PDUs for our clients (or pause/resume requests)
+            drainInbox(reactor, handleInboxMessage);
+        }
+        else
+        {
+            // The shared memory clients and the other Unix sockets
+            struct epoll_event events[EPOLL_MAX_EVENTS];
+            int numReady = epollCall(0, events, EPOLL_MAX_EVENTS);
+            metricAdd(&threadMetrics->syscalls, 1);
+            processEpollEvents(reactor, events, numReady);
+        }
+        if (!stopping)
+        {
+            reactor->uringUnarmed |= (event->fd == reactor->wakeFd) ? ARM_WAKE : ARM_EPOLL;
+            rearmUring(reactor);
+        }
+        break;
+    default:
+        break; // a cancel finished
+    }
+}
+
+/*
+-- -E uring, a handoff is starting: cancel everything on the ring and handle
+   what comes back until nothing is left running, then whatever got parked
+-- After this nothing more can be read from a client behind the new server's back
+*/
+void quiesceUring(Reactor_t *reactor, UringEvent_t *events)
+{
+    stopReceiving();
+    while (uringCancelAll() < 0)
+    {
+        // The ring is full: submit what's queued and take what has completed, without waiting on clients that are quiet
+        int numReady = uringCall(0, events, URING_MAX_EVENTS);
+        processUringEvents(reactor, events, numReady);
+    }
+    while (uringInFlight() > 0)
+    {
+        int numReady = uringCall(URING_WAIT_FOREVER, events, URING_MAX_EVENTS);
+        processUringEvents(reactor, events, numReady);
+    }
+    handleParked(dispatchPDU, removeClient);
 }
 
+/*
+-- Accept every connection waiting on the listening socket (up to ACCEPT_BATCH)
+-- Nothing here waits on a client: the login PDU is read by the event loop
+   like any other PDU (see handleLogin()), and a client that never sends one
+   is closed when its login timer runs out
+*/
 int addNewSocket(int socketNum)
 {
-    // Accept the new client connection
-    int newSocket = accept(socketNum, NULL, NULL);
+    int accepted = 0;
 
-    if (newSocket <= 0)
+    while (accepted < ACCEPT_BATCH)
     {
-        perror("Failed to accept client");
-        return -1;
-    }
+        int newSocket = accept4(socketNum, NULL, NULL, SOCK_NONBLOCK);
+        metricAdd(&threadMetrics->syscalls, 1);
 
-    // Add the new client socket to the poll set
-    addToPollSet(newSocket); // This adds the socket to the global poll set
+        if (newSocket < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                LOG_ERROR("Failed to accept client: %s\n", strerror(errno));
+            }
+            break; // backlog is empty (or out of descriptors, try again next wakeup)
+        }
 
-    // Get the handle len from the initial packet
-    uint8_t buffer[MAXBUF];
-    int received_bytes = recvPDU(newSocket, buffer, MAXBUF);
+        acceptClient(newSocket);
+        accepted++;
+    }
+    return accepted;
+}
 
-    if (received_bytes <= 0)
+// A new client: add its socket to the epoll set (or start reading it on the ring) and start its login timer
+void acceptClient(int newSocket)
+{
+    Connection_t *conn = createConnection(newSocket);
+    if (conn == NULL)
     {
-        perror("Failed to receive handle length");
         close(newSocket);
-        return -1;
+        return;
     }
+    watchConnection(conn);
+    startLoginTimer(conn);
 
-    uint8_t flag = buffer[0];
-    uint8_t handle_len = buffer[1];
+    LOG_INFO("New client connected at socket num %d\n", newSocket);
+}
 
-    if (handle_len + 2 > MAXBUF)
+/*
+-- Accept shared memory clients waiting on the Unix socket (up to ACCEPT_BATCH)
+   and hand each its rings
+-- From here on it is an ordinary connection keyed by the Unix socket's
+   number. The socket is only watched for hangups, the eventfd the client
+   signals goes in the epoll set under the same tag.
+*/
+int addNewShmClient(int socketNum)
+{
+    int accepted = 0;
+
+    while (accepted < ACCEPT_BATCH)
     {
-        printf("Error: handle_len is too large to fit in buffer\n");
-        close(newSocket);
-        return -1;
+        int newSocket = accept4(socketNum, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (newSocket < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                LOG_ERROR("Failed to accept shared memory client: %s\n", strerror(errno));
+            }
+            break; // none left, or another reactor got there first
+        }
+
+        ShmEndpoint_t *shm = shmAccept(newSocket);
+        if (shm == NULL)
+        {
+            LOG_ERROR("Shared memory setup failed: %s\n", strerror(errno));
+            close(newSocket);
+            continue;
+        }
+        Connection_t *conn = createConnection(newSocket);
+        if (conn == NULL)
+        {
+            shmClose(shm);
+            close(newSocket);
+            continue;
+        }
+        conn->shm = shm;
+        watchConnection(conn);
+        startLoginTimer(conn);
+        accepted++;
+
+        LOG_INFO("New shared memory client at socket num %d\n", newSocket);
+    }
+    return accepted;
+}
+
+// Put a new connection's descriptors in this reactor's epoll set
+void watchConnection(Connection_t *conn)
+{
+    if (conn->shm == NULL && uringBackend)
+    {
+        startReceiving(conn);
+        return;
+    }
+    if (conn->shm == NULL)
+    {
+        addToEpollSet(conn->socketNum, EPOLLIN);
+        return;
+    }
+    // A shared memory client's socket is only watched for hangups, the
+    // eventfd it signals goes in under the same tag
+    addToEpollSetTagged(conn->socketNum, EPOLLRDHUP, SHM_EPOLL_TAG(conn));
+    addToEpollSetTagged(conn->shm->wakeFd, EPOLLIN, SHM_EPOLL_TAG(conn));
+}
+
+// Reactor 0: a new server connected to -X and wants our clients (see handoff.c)
+void acceptHandoff(int socketNum)
+{
+    int newSocket = accept4(socketNum, NULL, NULL, SOCK_CLOEXEC);
+
+    if (newSocket < 0)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            LOG_ERROR("Failed to accept handoff: %s\n", strerror(errno));
+        }
+        return;
     }
+    beginHandoff(newSocket, &listeners);
+}
 
-    // Save the handle from the buffer
-    char handle[handle_len + 1]; // +1 for null terminator
-    memcpy(handle, buffer + 2, handle_len);
-    handle[handle_len] = '\0'; // Null terminate the string
+// What this server lets a client turn on at login
+#define SERVER_CAPABILITIES (LOGIN_CAP_BATCH | LOGIN_CAP_STREAM)
+
+// The first PDU from a connection: [1][handle len][handle][capabilities (optional)]
+void handleLogin(Connection_t *conn, uint8_t *buffer, int messageLen)
+{
+    PduView_t login;
+
+    if (pduParse(buffer, messageLen, PDU_TO_SERVER, &login) < 0 || login.flag != 1)
+    {
+        LOG_WARN("Socket %d: expected a login PDU, got flag %d, closing\n", conn->socketNum, buffer[0]);
+        conn->closeAfterRead = 1; // the read path closes it, it's still parsing this buffer
+        return;
+    }
+    char *handle = (char *)login.handles[0].data;
+    int handle_len = login.handles[0].len;
 
     // Print flag, handle length, and handle
-    printf("Flag: %d, Handle Length: %d, Handle: %s\n", flag, handle_len, handle);
+    LOG_DEBUG("Flag: %d, Handle Length: %d, Handle: %s\n", login.flag, handle_len, LOG_STR(handle, handle_len));
+
+    // Only clients that asked for something get the capabilities byte back,
+    // older ones read a fixed size reply
+    uint8_t capabilities = (login.numBytes > 0) ? login.bytes[0] & SERVER_CAPABILITIES : 0;
 
-    uint8_t response[3]; // 3 bytes: 2 for length, 1 for flag
+    // The reply carries its own length, and goes out with another length in front of
+    // it (cclient reads the result from byte 2)
+    uint8_t response[4]; // 2 for length, 1 for flag, then the capabilities granted
+    PduView_t reply;
 
-    uint16_t length_bytes = 3;                              // 2 bytes for the PDU length and 1 byte for the flag
-    uint16_t length_in_network_order = htons(length_bytes); // Convert length to network order
+    // The handle table's copy carries them, so senders on any reactor can check
+    conn->capabilities = capabilities;
+    ConnRef_t ref;
+    getConnRef(conn, &ref);
 
-    // check for segfault
-    if (length_in_network_order == 0)
+    if (addHandle(handle, handle_len, &ref) < 0)
     {
-        printf("Error: length_in_network_order is zero\n");
-        close(newSocket);
-        return -1;
+        LOG_INFO("Error adding handle to table\n");
+        LOG_DEBUG("Sending error response to client\n");
+        pduStart(&reply, 3); // Error flag (set the flag to indicate an error)
+        queueLoginReply(conn, &reply, capabilities, response);
+        return; // still waiting for a login it can use, the timer keeps running
+    }
+
+    pduStart(&reply, 2); // Success flag (set the flag to indicate success)
+    conn->state = CONN_LOGGED_IN;
+    conn->handleLen = handle_len;
+    memcpy(conn->handle, handle, handle_len);
+    conn->handle[handle_len] = '\0';
+    clusterAnnounceHandle(&ref, conn->handle, handle_len);
+    startIdleTimer(conn);
+    startRateLimit(conn);
+    LOG_INFO("Handle added successfully\n");
+    LOG_DEBUG("Sending success response to client\n");
+    queueLoginReply(conn, &reply, capabilities, response);
+
+    if (mailboxEnabled())
+    {
+        // From now on messages to it are kept while it's away, and whatever was kept goes out behind the reply
+        mailboxRegister(handle, handle_len);
+        int delivered = mailboxDeliver(handle, handle_len, queueMailboxPDU, conn);
+        if (delivered > 0)
+        {
+            LOG_INFO("%s: %d messages from the mailbox\n", LOG_STR(handle, handle_len), delivered);
+        }
+    }
+}
+
+// mailboxDeliver() handler: one kept message (flag and on) onto the client's send queue
+void queueMailboxPDU(void *context, uint8_t *pdu, int pduLen)
+{
+    queuePDU((Connection_t *)context, pdu, pduLen);
+}
+
+// [len][2 or 3][capabilities granted, if any] behind its own length, in response (4 bytes)
+void queueLoginReply(Connection_t *conn, PduView_t *reply, uint8_t capabilities, uint8_t *response)
+{
+    if (capabilities)
+    {
+        pduAddByte(reply, capabilities);
     }
+    uint16_t responseLen = 2 + pduEncode(response + 2, 2, PDU_TO_CLIENT, reply);
+    uint16_t length_in_network_order = htons(responseLen);
 
     memcpy(response, &length_in_network_order, 2); // Copy PDU length (2 bytes)
-    response[2] = flag; // Set the flag in the response
+    queuePDU(conn, response, responseLen);
+}
 
-    if (addHandle(newSocket, handle, handle_len) < 0)
+// Function to handle one epoll event for a client socket
+void processClientEvents(int socketNum, uint32_t events)
+{
+    if (events & EPOLLOUT)
     {
-        printf("Error adding handle to table\n");
-        printf("Sending error response to client\n");
-        response[2] = 3; // Error flag (set the flag to indicate an error)
-        sendPDU(newSocket, response, sizeof(response));
+        // The socket has room again, keep draining its send queue
+        Connection_t *conn = getConnection(socketNum);
+        if (conn != NULL && flushConnection(conn) < 0)
+        {
+            LOG_INFO("Socket %d: write failed, closing\n", socketNum);
+            removeClient(socketNum);
+            return;
+        }
     }
-    else
+
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
     {
-        response[2] = 2; // Success flag (set the flag to indicate success)
-        printf("Handle added successfully\n");
-        printf("Sending success response to client\n");
-        sendPDU(newSocket, response, sizeof(response));
+        processClient(socketNum);
     }
+}
 
-    printf("New client connected at socket num %d\n", newSocket);
-    return newSocket;
+// An event on a shared memory client's socket (only ever a hangup) or eventfd
+void processShmClientEvents(int socketNum, uint32_t connId, uint32_t events)
+{
+    Connection_t *conn = getConnection(socketNum);
+    if (conn == NULL || conn->connId != connId)
+    {
+        return; // closed earlier in this pass, and the number may be someone else's now
+    }
+
+    if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+    {
+        LOG_INFO("Socket %d: shared memory client hung up\n", socketNum);
+        removeClient(socketNum);
+        return;
+    }
+
+    // Room in its ring for what's queued, or something to read (or both)
+    shmClearWakeup(conn->shm);
+    if (conn->sendCount > 0 && flushConnection(conn) < 0)
+    {
+        removeClient(socketNum);
+        return;
+    }
+    processClient(socketNum);
 }
 
 // Function to process client data
 int processClient(int socketNum)
 {
-    uint8_t buffer[MAXBUF];
-    int messageLen = 0;
-    uint8_t flag;
-
-    // save the pdu into the buffer
-    messageLen = recvPDU(socketNum, buffer, MAXBUF);
-    if (messageLen < 0)
+    Connection_t *conn = getConnection(socketNum);
+    if (conn == NULL)
     {
-        perror("recvPDU failed");
+        LOG_WARN("Socket %d: no connection state, dropping it\n", socketNum);
+        removeFromEpollSet(socketNum);
+        close(socketNum);
         return -1;
     }
 
-    // Extract the flag from the buffer
-    flag = buffer[0]; // First byte is the flag
+    // Read whatever is there and handle every complete PDU in it
+    if (readConnection(conn, dispatchPDU) < 0)
+    {
+        LOG_INFO("Socket %d: Connection closed by client\n", socketNum);
+        removeClient(socketNum);
+    }
+    return 0;
+}
 
+// Called by readConnection() for each complete PDU
+void dispatchPDU(void *context, uint8_t *pdu, int pduLen)
+{
+    Connection_t *conn = (Connection_t *)context;
 
-    if (messageLen == 0)
+    LOG_DEBUG("PDU Received: %d bytes\n", pduLen);
+    metricAdd(&threadMetrics->pdusIn[pdu[0]], 1);
+    metricAdd(&threadMetrics->bytesIn, pduLen + 2);
+    if (conn->closeAfterRead)
+    {
+        return; // being closed, the rest of what it sent goes nowhere
+    }
+    if (conn->state == CONN_AWAITING_LOGIN)
+    {
+        handleLogin(conn, pdu, pduLen);
+        return;
+    }
+    if (pdu[0] == BATCH_FLAG && (conn->capabilities & LOGIN_CAP_BATCH))
     {
-        printf("Socket %d: Connection closed by client\n", socketNum);
+        dispatchBatch(conn, pdu, pduLen); // each PDU in it is charged on its own
+        return;
+    }
+    if (!admitPDU(conn, pdu, pduLen))
+    {
+        return; // over its rate limit, or shed while overloaded
+    }
+    handleFlags(conn->socketNum, pdu[0], pdu, pduLen);
+}
 
-        // Remove the client from the poll set and close the socket
-        removeFromPollSet(socketNum);
-        close(socketNum);
-        removeHandle(socketNum); // Remove the handle from the table
-        return 0;
+// One PDU out of a batch, a batch inside a batch isn't allowed
+static void dispatchBatchedPDU(void *context, uint8_t *pdu, int pduLen)
+{
+    Connection_t *conn = (Connection_t *)context;
+
+    if (pdu[0] == BATCH_FLAG)
+    {
+        LOG_WARN("Socket %d: batch inside a batch, ignored\n", conn->socketNum);
+        return;
     }
-    else if (messageLen < 0)
+    metricAdd(&threadMetrics->pdusIn[pdu[0]], 1);
+    if (!admitPDU(conn, pdu, pduLen))
     {
-        perror("Receiving the PDU() failed\n");
+        return;
+    }
+    handleFlags(conn->socketNum, pdu[0], pdu, pduLen);
+}
 
-        // Remove the client from the poll set and close the socket
-        removeFromPollSet(socketNum);
-        close(socketNum);
-        return -1;
+/*
+-- [0x16] followed by complete PDUs: handle each one as if it came on its own
+-- They are still in the receive buffer with their lengths, so %m ones are
+   forwarded out of it without a copy same as always
+*/
+void dispatchBatch(Connection_t *conn, uint8_t *pdu, int pduLen)
+{
+    int consumed = parsePDUs(pdu + 1, pduLen - 1, MAXBUF, dispatchBatchedPDU, conn);
+
+    LOG_DEBUG("Socket %d: batch of %d bytes\n", conn->socketNum, pduLen);
+    if (consumed != pduLen - 1)
+    {
+        LOG_WARN("Socket %d: batch has %d bytes that aren't a whole PDU, ignored\n", conn->socketNum,
+                 consumed < 0 ? pduLen - 1 : pduLen - 1 - consumed);
     }
-    else
+}
+
+void removeClient(int socketNum)
+{
+    Connection_t *conn = getConnection(socketNum);
+
+    // Remove the handle from the table
+    if (conn != NULL && conn->state == CONN_LOGGED_IN)
     {
-        printf("PDU Received: %d bytes\n", messageLen);
-        handleFlags(socketNum, flag, buffer, messageLen);
+        removeHandle(conn->handle, conn->handleLen, conn->connId);
+        clusterWithdrawHandle(conn->connId, conn->handle, conn->handleLen);
     }
-    return 0;
+
+    // Remove the client from the epoll set (or stop what the ring has running on it) and close the socket
+    if (uringBackend && conn != NULL && conn->shm == NULL && uringCancelFd(socketNum) < 0)
+    {
+        shutdown(socketNum, SHUT_RDWR); // no room for the cancel: what's running on it finishes now instead
+    }
+    removeFromEpollSet(socketNum);
+    destroyConnection(socketNum);
+    close(socketNum);
 }
 
 void multicastMessage(int socketNum, uint8_t *buffer, int messageLen)
@@ -321,21 +1130,21 @@ void multicastMessage(int socketNum, uint8_t *buffer, int messageLen)
     // Check if the message is valid
     if (messageLen < 3)
     {
-        printf("Invalid multicast message: too short\n");
+        LOG_WARN("Invalid multicast message: too short\n");
         return;
     }
 
     // Print the multicast message
-    printf("Multicast message received on socket %d\n", socketNum);
+    LOG_DEBUG("Multicast message received on socket %d\n", socketNum);
 
     // Call the function to handle the multicast message
     int valid = validateMulticastMessage(buffer, socketNum, messageLen);
     if (valid < 0)
     {
-        printf("Invalid multicast message format\n");
+        LOG_WARN("Invalid multicast message format\n");
         return;
     }
-    printf("Multicast message received on socket %d\n", socketNum);
+    LOG_DEBUG("Multicast message received on socket %d\n", socketNum);
 }
 
 void handleFlags(int socketNum, uint8_t flag, uint8_t *buffer, int messageLen)
@@ -344,43 +1153,156 @@ void handleFlags(int socketNum, uint8_t flag, uint8_t *buffer, int messageLen)
     {
     case 0x04:
         // Handle the command type 0x04
-        printf("Command type 0x04 received\n");
-        fflush(stdout);
-        handleBroadcastMessage_s(socketNum, (char*)buffer);
+        LOG_DEBUG("Command type 0x04 received\n");
+        handleBroadcastMessage_s(socketNum, buffer, messageLen);
         break;
     case 0x05:
         // Handle the command type 0x05
-        printf("Command type 0x05 received\n");
-        fflush(stdout);
+        LOG_DEBUG("Command type 0x05 received\n");
         forwardMessage(socketNum, buffer, messageLen);
         break;
     case 0x06:
         // Handle the command type 0x06
-        printf("Command type 0x06 received\n");
-        fflush(stdout);
+        LOG_DEBUG("Command type 0x06 received\n");
         multicastMessage(socketNum, buffer, messageLen);
         break;
     case 0xA:
         // Handle the command type 0xA
-        printf("Command type 0xA received, list handles!\n");
-        fflush(stdout);
+        LOG_DEBUG("Command type 0xA received, list handles!\n");
         handleListHandles_s(socketNum, (char*)buffer);
         break;
+    case LIST_PAGE_REQUEST_FLAG:
+        LOG_DEBUG("Command type 0xE received, list handles page\n");
+        sendListPage(socketNum, buffer, messageLen);
+        break;
+    case CHANNEL_JOIN_FLAG:
+    case CHANNEL_LEAVE_FLAG:
+    case CHANNEL_MESSAGE_FLAG:
+        LOG_DEBUG("Command type 0x%x received, channel\n", flag);
+        handleChannelPDU(socketNum, buffer, messageLen);
+        break;
+    case STREAM_START_FLAG:
+    case STREAM_DATA_FLAG:
+    case STREAM_ABORT_FLAG:
+        handleStreamPDU(socketNum, buffer, messageLen);
+        break;
+    case KEEPALIVE_PING_FLAG:
+    {
+        // A client checking on us gets the same answer we want from it
+        uint8_t pong = KEEPALIVE_PONG_FLAG;
+        queueSendPDU(socketNum, &pong, 1);
+        break;
+    }
+    case KEEPALIVE_PONG_FLAG:
+        LOG_DEBUG("Socket %d: keepalive answered\n", socketNum);
+        break; // reading it already counted as activity
 
     default:
         // Handle unknown command
-        printf("Unknown command detected.\n");
+        LOG_WARN("Unknown command detected.\n");
         break;
     }
 }
 
+/*
+-- Join (0x12), leave (0x13) or send to (0x14) a channel: [flag][len][channel]...
+-- Joins, leaves and failed sends are answered with a 0x15 reply
+*/
+void handleChannelPDU(int socketNum, uint8_t *buffer, int messageLen)
+{
+    Connection_t *conn = getConnection(socketNum);
+    if (conn == NULL)
+    {
+        return;
+    }
+
+    PduView_t channelPDU;
+    if (pduParse(buffer, messageLen, PDU_TO_SERVER, &channelPDU) < 0)
+    {
+        LOG_WARN("Invalid channel PDU on socket %d\n", socketNum);
+        return;
+    }
+    uint8_t *name = (uint8_t *)channelPDU.channel.data;
+    int nameLen = channelPDU.channel.len;
+    int memberCount = 0;
+    int status;
+
+    switch (channelPDU.flag)
+    {
+    case CHANNEL_JOIN_FLAG:
+        status = joinChannel(conn, (char *)name, nameLen, &memberCount);
+        break;
+    case CHANNEL_LEAVE_FLAG:
+        status = leaveChannel(conn, (char *)name, nameLen, &memberCount);
+        break;
+    default:
+    {
+        uint8_t *text = (uint8_t *)channelPDU.text.data;
+        int textLen = channelPDU.text.len;
+
+        // What goes out adds the sender's handle, it has to stay a legal PDU
+        if (textLen < 1 || 2 + messageLen + 1 + conn->handleLen > MAXBUF)
+        {
+            LOG_WARN("Invalid channel message on socket %d\n", socketNum);
+            return;
+        }
+        status = sendToChannel(conn, (char *)name, nameLen, text, textLen);
+        if (status == CHANNEL_SENT)
+        {
+            return;
+        }
+        break;
+    }
+    }
+
+    sendChannelReply(conn, status, name, nameLen, memberCount);
+}
+
+// Streamed message start/segment/abort (0x17/0x18/0x19), only from clients that asked for it at login
+void handleStreamPDU(int socketNum, uint8_t *buffer, int messageLen)
+{
+    Connection_t *conn = getConnection(socketNum);
+    if (conn == NULL || !(conn->capabilities & LOGIN_CAP_STREAM))
+    {
+        LOG_WARN("Socket %d: stream PDU without LOGIN_CAP_STREAM\n", socketNum);
+        return;
+    }
+
+    switch (buffer[0])
+    {
+    case STREAM_START_FLAG:
+        startStream(conn, buffer, messageLen);
+        break;
+    case STREAM_DATA_FLAG:
+        streamData(conn, buffer, messageLen);
+        break;
+    default:
+        cancelStream(conn, buffer, messageLen);
+        break;
+    }
+}
+
+// [0x15][status][len][channel][members 4 bytes]
+void sendChannelReply(Connection_t *conn, uint8_t status, uint8_t *name, int nameLen, int memberCount)
+{
+    uint8_t reply[3 + 255 + 4];
+    PduView_t replyView;
+
+    pduStart(&replyView, CHANNEL_REPLY_FLAG);
+    pduAddByte(&replyView, status);
+    pduSetChannel(&replyView, name, nameLen);
+    pduAddNumber(&replyView, memberCount);
+
+    queuePDU(conn, reply, pduEncode(reply, sizeof(reply), PDU_TO_CLIENT, &replyView));
+}
+
 int handleListHandles_s(int socketNum, char *buffer)
 {
     // Handle the list handles command
     uint8_t flag = buffer[0];
     if (flag != 0xA)
     {
-        printf("Invalid flag for list handles: %d\n", flag);
+        LOG_WARN("Invalid flag for list handles: %d\n", flag);
         return -1;
     }
 
@@ -388,88 +1310,185 @@ int handleListHandles_s(int socketNum, char *buffer)
     return 0;
 }
 
+int sendListPDU(int socketNum)
+{
+    uint8_t listPDU[MAXBUF];
+    int offset = 0;
+    // send back to the client a packet with the a flag == 12 for each handle
+    uint8_t flag = 0x0B; // Command type for sending back from the server
+    listPDU[0] = flag;
+    offset++;
+    // Copy the handles out of the handle table (other threads keep logging in and out)
+    int maxHandles = getHandleCount();
+    Handle_t *handleTable = (Handle_t *)sCalloc(maxHandles > 0 ? maxHandles : 1, sizeof(Handle_t));
+    int handleCount = copyHandles(handleTable, maxHandles);
+    LOG_DEBUG("Number of handles: %d\n", handleCount);
+
+    uint32_t networkOrderCount = htonl(handleCount);
+    memcpy(listPDU + 1, &networkOrderCount, sizeof(uint32_t)); // Copy the handle count to the PDU
+    offset += sizeof(uint32_t);
+
+    // queue it for the client
+    int sent = queueSendPDU(socketNum, listPDU, offset);
+    if (sent < 0)
+    {
+        LOG_ERROR("Error sending list PDU to socket %d\n", socketNum);
+        free(handleTable);
+        return -1;
+    }
+    else
+    {
+        LOG_DEBUG("List PDU sent to socket %d\n", socketNum);
+    }
+
+    for (int i = 0; i < handleCount; i++)
+    {
+        // send a PDU for each handle
+        uint8_t handlePDU[MAXBUF];
+        uint8_t handleFlag = 0x0C; // Command type for sending back from the server
+        handlePDU[0] = handleFlag;
+        int handleLen = handleTable[i].handleLen; // Get the handle length
+
+        handlePDU[1] = handleLen; // Set the handle length
+        memcpy(handlePDU + 2, handleTable[i].handle, handleLen); // Copy the handle to the PDU
+
+        int handlePDU_len = 2 + handleLen; // Length of the PDU
+
+        int sent = queueSendPDU(socketNum, handlePDU, handlePDU_len);
+        if (sent < 0)
+        {
+            LOG_ERROR("Error sending handle PDU to socket %d\n", socketNum);
+            free(handleTable);
+            return -1;
+        }
+        else
+        {
+            LOG_DEBUG("Handle PDU sent to socket %d\n", socketNum);
+        }
+    }
+
+    // lastly send a PDU with the flag == 0x0D to indicate end of list
+    uint8_t endPDU[MAXBUF];
+    uint8_t endFlag = 0x0D; // Command type for sending back from the server
+    endPDU[0] = endFlag;
+    queueSendPDU(socketNum, endPDU, 1);
+    LOG_DEBUG("End PDU sent to socket %d\n", socketNum);
+    free(handleTable);
+    return 0;
+}
+
+// Paged list: queue one page of the shared snapshot, cursor 0 starts over with the current one
+int sendListPage(int socketNum, uint8_t *buffer, int messageLen)
+{
+    Connection_t *conn = getConnection(socketNum);
+    PduView_t request;
+
+    if (conn == NULL || pduParse(buffer, messageLen, PDU_TO_SERVER, &request) < 0)
+    {
+        LOG_WARN("Invalid list page request from socket %d\n", socketNum);
+        return -1;
+    }
+    uint32_t cursor = request.numbers[0];
+
+    // Keep paging through the same snapshot so the client sees one consistent list
+    if (cursor == 0 || conn->listSnapshot == NULL || cursor >= (uint32_t)conn->listSnapshot->numPages)
+    {
+        if (conn->listSnapshot != NULL)
+        {
+            releaseHandleSnapshot(conn->listSnapshot);
+        }
+        conn->listSnapshot = getHandleSnapshot();
+        cursor = 0;
+    }
+
+    queuePDUBuffer(conn, conn->listSnapshot->pages[cursor]);
+    LOG_DEBUG("List page %u of %d sent to socket %d\n", cursor + 1, conn->listSnapshot->numPages, socketNum);
+
+    if (cursor + 1 == (uint32_t)conn->listSnapshot->numPages)
+    {
+        releaseHandleSnapshot(conn->listSnapshot);
+        conn->listSnapshot = NULL;
+    }
+    return 0;
+}
+
 void forwardMessage(int socketNum, uint8_t *buffer, int messageLen)
 {
     int valid = validateMessage(buffer, messageLen, socketNum);
 
     if (valid < 0)
     {
-        printf("Invalid message format\n");
+        LOG_WARN("Invalid message format\n");
         return;
     }
 }
 
 int validateMulticastMessage(uint8_t *buffer, int socketNum, int messageLen)
 {
-    printf("Validating multicast message\n");
-    int offset = 0;
-    // First read the buffer to get the sender handle length
-    uint8_t flag = buffer[0];
+    LOG_DEBUG("Validating multicast message\n");
+    PduView_t multicast;
 
-    if (flag != 0x06)
+    // [0x06][len][sender][count]([len][destination])*[text], the destinations are handles[1..]
+    if (pduParse(buffer, messageLen, PDU_TO_SERVER, &multicast) < 0 || multicast.flag != 0x06)
     {
-        printf("Invalid flag for multicast message: %d\n", flag);
+        LOG_WARN("Invalid multicast message: %d bytes, flag %d\n", messageLen, buffer[0]);
         return -1;
     }
-    offset++;
-
-    uint8_t senderHandleLen = buffer[1];
-    offset++;
 
-    char senderHandle[senderHandleLen + 1];
-    memcpy(senderHandle, buffer + 2, senderHandleLen);
-    offset += senderHandleLen;
-    // read the byte for num of destination handles
-    uint8_t numDestHandles = buffer[2 + senderHandleLen];
-    offset++;
-    DestHandle_t destHandles[MAX_DEST_HANDLES];
-
-    for (int i = 0; i < numDestHandles; i++)
+    LOG_DEBUG("Destination handles:\n");
+    for (int i = 1; i < multicast.numHandles; i++)
     {
-        destHandles[i].dest_handle_len = buffer[offset++];
-        memcpy(destHandles[i].handle_name, buffer + offset, destHandles[i].dest_handle_len);
-        destHandles[i].handle_name[destHandles[i].dest_handle_len] = '\0'; // Null-terminate the handle
-        offset += destHandles[i].dest_handle_len;
+        LOG_DEBUG("Handle %d: %s\n", i, LOG_STR(multicast.handles[i].data, multicast.handles[i].len));
     }
+    PDUBuffer_t *multicastPDU = NULL; // built the first time a destination is found, then shared
+    int delivered = 0;
 
-    printf("Destination handles:\n");
-    for (int i = 0; i < numDestHandles; i++)
-    {
-        printf("Handle %d: %s\n", i + 1, destHandles[i].handle_name);
-    }
-    int sent_bytes = 0;
     // Check if the read handles are valid through the handle table
-    for (int i = 0; i < numDestHandles; i++)
+    for (int i = 1; i < multicast.numHandles; i++)
     {
-        int dest_socketNum = 0;
-        if (getSocket(destHandles[i].handle_name, &dest_socketNum) < 0)
+        char *destHandle = (char *)multicast.handles[i].data;
+        int destHandleLen = multicast.handles[i].len;
+        ConnRef_t dest;
+        int found = (lookupHandle(destHandle, destHandleLen, &dest) == 0);
+        if (!found && mailboxEnabled())
         {
-            printf("Error: destination handle %s not found in the table.\n", destHandles[i].handle_name);
-            sent_bytes = sendClientResponse(socketNum, 0x07, destHandles[i].dest_handle_len, destHandles[i].handle_name); // Send error response to client
+            int kept = mailboxStore(destHandle, destHandleLen, buffer, messageLen, &dest);
+            if (kept == 0)
+            {
+                LOG_DEBUG("%s is away, message kept in the mailbox\n", LOG_STR(destHandle, destHandleLen));
+                continue;
+            }
+            found = (kept == 1); // logged in since the lookup
+        }
+        if (!found)
+        {
+            LOG_INFO("Error: destination handle %s not found in the table.\n", LOG_STR(destHandle, destHandleLen));
+            sendClientResponse(socketNum, 0x07, destHandleLen, destHandle); // Send error response to client
         }
         else
         {
-            printf("Destination handle %s found in the table with socket number %d\n", destHandles[i].handle_name, dest_socketNum);
-            sent_bytes = sendPDU(dest_socketNum, buffer, messageLen); // Send the message to the destination handle
-
-            if (sent_bytes < 0)
-            {
-                printf("Error sending message to socket %d\n", socketNum);
-                return -1;
-            }
-            else
+            LOG_DEBUG("Destination handle %s found in the table with socket number %d\n", LOG_STR(destHandle, destHandleLen), dest.socketNum);
+            if (multicastPDU == NULL)
             {
-                printf("Message sent to socket %d\n", socketNum);
+                multicastPDU = createPDUBuffer(buffer, messageLen);
             }
+            deliverPDUBuffer(getConnection(socketNum), &dest, multicastPDU); // Queue the message for the destination handle
+            delivered++;
+            LOG_DEBUG("Message sent to socket %d\n", dest.socketNum);
         }
     }
+    if (multicastPDU != NULL)
+    {
+        releasePDUBuffer(multicastPDU);
+    }
+    metricRecord(&threadMetrics->fanOut, delivered);
     // Send success response to the client
     return 0;
 }
 
 int sendClientResponse(int socketNum, uint8_t flag, uint8_t handle_len, char *handle)
 {
-    // create a 1 byte buffer with the flag, sendPDU() will send the length
+    // create a 1 byte buffer with the flag, queueSendPDU() will add the length
     uint8_t response[MAXBUF];
     response[0] = flag;
 
@@ -479,64 +1498,64 @@ int sendClientResponse(int socketNum, uint8_t flag, uint8_t handle_len, char *ha
     // copy in the handle
     memcpy(response + 2, handle, handle_len);
 
-    int sent = sendPDU(socketNum, response, 1);
+    int sent = queueSendPDU(socketNum, response, 1);
 
     if (sent < 0)
     {
-        printf("Error sending response to socket %d\n", socketNum);
+        LOG_ERROR("Error sending response to socket %d\n", socketNum);
         return -1;
     }
     else
     {
-        printf("Response sent to socket %d with flag %d\n", socketNum, flag);
+        LOG_DEBUG("Response sent to socket %d with flag %d\n", socketNum, flag);
     }
     return sent;
 }
 
 int validateMessage(uint8_t *buffer, int messageLen, int sender_socketNum)
 {
-    // Check if the message is valid
-    if (messageLen < 3)
+    PduView_t message;
+
+    // Check if the message is valid: [flag][len][sender][1][len][destination]...
+    if (pduParse(buffer, messageLen, PDU_TO_SERVER, &message) < 0 || message.numHandles != 2)
     {
-        printf("Invalid message: too short\n");
+        LOG_WARN("Invalid message: lengths exceed message length\n");
         return -1;
     }
 
-    // Extract the sender handle length and destination handle length
-    uint8_t senderHandleLen = buffer[1];
-    uint8_t destinationHandleLen = buffer[3 + senderHandleLen];
-
-    // Extract the sender handle and destination handle
-    char senderHandle[senderHandleLen + 1];
-    char destinationHandle[destinationHandleLen + 1];
+    // The handles are looked at where they sit in the receive buffer, no copies
+    uint8_t senderHandleLen = message.handles[0].len;
+    const char *senderHandle = (const char *)message.handles[0].data;
+    uint8_t destinationHandleLen = message.handles[1].len;
+    char *destinationHandle = (char *)message.handles[1].data;
 
-    memcpy(senderHandle, buffer + 2, senderHandleLen);
-    memcpy(destinationHandle, buffer + 4 + senderHandleLen, destinationHandleLen);
+    LOG_DEBUG("Sender Handle: %s, Destination Handle: %s\n", LOG_STR(senderHandle, senderHandleLen), LOG_STR(destinationHandle, destinationHandleLen));
 
-    // Null-terminate the handles
-    senderHandle[senderHandleLen] = '\0';
-    destinationHandle[destinationHandleLen] = '\0';
-
-    printf("Sender Handle: %s, Destination Handle: %s\n", senderHandle, destinationHandle);
-
-    int socketNum = 0;
+    ConnRef_t dest;
     // Check if the destination handle exists in the handle table
-    if (getSocket(destinationHandle, &socketNum) < 0)
+    int found = (lookupHandle(destinationHandle, destinationHandleLen, &dest) == 0);
+    if (!found && mailboxEnabled())
     {
-        printf("Error: destination handle %s not found in the table.\n", destinationHandle);
+        int kept = mailboxStore(destinationHandle, destinationHandleLen, buffer, messageLen, &dest);
+        if (kept == 0)
+        {
+            LOG_DEBUG("%s is away, message kept in the mailbox\n", LOG_STR(destinationHandle, destinationHandleLen));
+            return 0;
+        }
+        found = (kept == 1); // logged in since the lookup
+    }
+    if (!found)
+    {
+        LOG_INFO("Error: destination handle %s not found in the table.\n", LOG_STR(destinationHandle, destinationHandleLen));
         sendClientResponse(sender_socketNum, 0x07, destinationHandleLen, destinationHandle); // Send error response to client
         return -1;
     }
-    printf("Destination handle %s found in the table with socket number %d\n", destinationHandle, socketNum);
+    LOG_DEBUG("Destination handle %s found in the table with socket number %d\n", LOG_STR(destinationHandle, destinationHandleLen), dest.socketNum);
 
-    sendPDU(socketNum, buffer, messageLen); // Send the message to the destination handle
-    printf("Message sent to socket %d\n", socketNum);
+    // Queue the bytes we received (length and all) for the destination, through its reactor's inbox if it isn't ours
+    forwardReceivedPDU(getConnection(sender_socketNum), &dest, buffer, messageLen);
+    metricRecord(&threadMetrics->fanOut, 1);
+    LOG_DEBUG("Message queued for socket %d\n", dest.socketNum);
 
-    // Check if the lengths are within bounds
-    if (senderHandleLen + destinationHandleLen + 4 > messageLen)
-    {
-        printf("Invalid message: lengths exceed message length\n");
-        return -1;
-    }
     return 0; // Return 0 for valid message
 }
\ No newline at end of file
@@ -17,6 +17,11 @@
 
 #include "shared.h"
 #include "handle_table.h"
+#include "safeUtil.h"
+#include "pduCodec.h"
+
+int pduBatching = 0;
+int pduStreaming = 0;
 
 int makeListPDU(uint8_t *listPDU, int socketNum)
 {
@@ -31,83 +36,103 @@ int makeListPDU(uint8_t *listPDU, int socketNum)
     return sendPDU(socketNum, listPDU, 1);
 }
 
-int sendListPDU(int socketNum)
+int makeListPagePDU(uint8_t *listPDU, int socketNum, uint32_t cursor)
 {
-    uint8_t listPDU[MAXBUF];
-    int offset = 0;
-    // send back to the client a packet with the a flag == 12 for each handle
-    uint8_t flag = 0x0B; // Command type for sending back from the server
-    listPDU[0] = flag;
-    offset++;
-    // Get the handles from the handle table
-    int handleCount = showHandles();
-    printf("Number of handles: %d\n", handleCount);
-    printf("----------------------------------");
-
-    uint32_t networkOrderCount = htonl(handleCount);
-    memcpy(listPDU + 1, &networkOrderCount, sizeof(uint32_t)); // Copy the handle count to the PDU
-    offset += sizeof(uint32_t);
-
-    // sendPDU to the client
-    int sent = sendPDU(socketNum, listPDU, offset);
-    if (sent < 0)
-    {
-        printf("Error sending list PDU to socket %d\n", socketNum);
-        return -1;
-    }
-    else
-    {
-        printf("List PDU sent to socket %d\n", socketNum);
-    }
+    /*
+    Format: flag = 14, then the cursor from the last page (0 for the first page)
+    */
+    PduView_t request;
+
+    pduStart(&request, LIST_PAGE_REQUEST_FLAG);
+    pduAddNumber(&request, cursor);
+    return sendPDU(socketNum, listPDU, pduEncode(listPDU, MAXBUF, PDU_TO_SERVER, &request));
+}
+
+// Build one %b PDU: [flag][sender len][sender][message][\0], returns its length
+int makeBroadcastPDU(uint8_t *broadcastPDU, char *sender_handle, char *message, int messageLen)
+{
+    PduView_t broadcast;
 
-    
-    Handle_t *handleTable = getHandleTable();
-    int count = getHandleCount();
+    pduStart(&broadcast, 0x04); // Command type for %b
+    pduAddHandle(&broadcast, sender_handle, strlen(sender_handle));
+    pduSetText(&broadcast, message, messageLen);
 
-    if (handleTable == NULL)
+    // Room left for the terminator, which isn't in message
+    int offset = pduEncode(broadcastPDU, MAXBUF - 1, PDU_TO_SERVER, &broadcast);
+    if (offset < 0)
     {
-        printf("Error: handle table is NULL\n");
         return -1;
     }
+    broadcastPDU[offset++] = '\0'; // Null-terminate the message
 
-    for (int i = 0; i < count; i++)
-    {
-        // send a PDU for each handle
-        uint8_t handlePDU[MAXBUF];
-        uint8_t handleFlag = 0x0C; // Command type for sending back from the server
-        handlePDU[0] = handleFlag;
-        int handleLen = handleTable[i].handleLen; // Get the handle length
+    return offset;
+}
 
-        handlePDU[1] = handleLen; // Set the handle length
-        memcpy(handlePDU + 2, handleTable[i].handle, handleLen); // Copy the handle to the PDU
+ int sendBroadcastPDU(uint8_t *broadcastPDU, int socketNum, char *message, char *sender_handle)
+ {
+    int text_message_len = strlen(message);
+    PDUBatch_t batch;
+    initPDUBatch(&batch, socketNum);
 
-        int handlePDU_len = 2 + handleLen; // Length of the PDU
+    int bytesSent = 0;
+    while (bytesSent < text_message_len)
+    {
+        int chunkSize = MAX_MSG_SIZE;
 
-        int sent = sendPDU(socketNum, handlePDU, handlePDU_len);
-        if (sent < 0)
+        if (text_message_len - bytesSent < MAX_MSG_SIZE)
         {
-            printf("Error sending handle PDU to socket %d\n", socketNum);
-            return -1;
+            chunkSize = text_message_len - bytesSent;
         }
-        else
+        // construct the packet for this chunk of the message
+        int offset = makeBroadcastPDU(broadcastPDU, sender_handle, message + bytesSent, chunkSize);
+
+        // Send the broadcast PDU to the server (all the chunks together if it takes batches)
+        if (offset < 0 || batchPDU(&batch, broadcastPDU, offset) < 0)
         {
-            printf("Handle PDU sent to socket %d\n", socketNum);
+            printf("Error sending broadcast PDU to socket %d\n", socketNum);
+            return -1;
         }
+
+        bytesSent += chunkSize;
     }
+        return flushPDUBatch(&batch);
+ }
 
-    // lastly send a PDU with the flag == 0x0D to indicate end of list
-    uint8_t endPDU[MAXBUF];
-    uint8_t endFlag = 0x0D; // Command type for sending back from the server
-    endPDU[0] = endFlag;
-    sendPDU(socketNum, endPDU, 1);
-    printf("End PDU sent to socket %d\n", socketNum);
-    showHandles();
-    return 0;
+// Join/leave PDU: [flag][len][channel]
+int makeChannelPDU(uint8_t *channelPDU, uint8_t flag, char *channel)
+{
+    PduView_t membership;
+
+    pduStart(&membership, flag);
+    pduSetChannel(&membership, channel, strlen(channel));
+    return pduEncode(channelPDU, MAXBUF, PDU_TO_SERVER, &membership);
 }
 
- int sendBroadcastPDU(uint8_t *broadcastPDU, int socketNum, char *message, char *sender_handle)
- {
+// Channel message PDU: [0x14][len][channel][text][\0], the server adds the sender
+int makeChannelMessagePDU(uint8_t *channelPDU, char *channel, char *message, int messageLen)
+{
+    PduView_t channelMessage;
+
+    pduStart(&channelMessage, CHANNEL_MESSAGE_FLAG);
+    pduSetChannel(&channelMessage, channel, strlen(channel));
+    pduSetText(&channelMessage, message, messageLen);
+
+    int offset = pduEncode(channelPDU, MAXBUF - 1, PDU_TO_SERVER, &channelMessage);
+    if (offset < 0)
+    {
+        return -1;
+    }
+    channelPDU[offset++] = '\0';
+
+    return offset;
+}
+
+// Send message to a channel in MAX_MSG_SIZE chunks, same as a broadcast
+int sendChannelMessagePDU(uint8_t *channelPDU, int socketNum, char *channel, char *message)
+{
     int text_message_len = strlen(message);
+    PDUBatch_t batch;
+    initPDUBatch(&batch, socketNum);
 
     int bytesSent = 0;
     while (bytesSent < text_message_len)
@@ -118,33 +143,126 @@ int sendListPDU(int socketNum)
         {
             chunkSize = text_message_len - bytesSent;
         }
-        // construct the packet
-        int offset = 0;
-        // First byte is the flag
-        uint8_t flag = 0x04 ; // Command type for %b
-        broadcastPDU[offset++] = flag;
-
-        // 1 byte for the sender handle length
-        broadcastPDU[offset++] = strlen(sender_handle);
-
-        // Copy the sender handle into the packet
-        memcpy(broadcastPDU + offset, sender_handle, strlen(sender_handle));
-        offset += strlen(sender_handle);
-
-        // Copy the text message into the PDU
-        memcpy(broadcastPDU + offset, message, text_message_len);
-        offset += chunkSize;
-        broadcastPDU[offset] = '\0'; // Null-terminate the message
-        offset += 1;
-        // Send the broadcast PDU to the server
-        int sent = sendPDU(socketNum, broadcastPDU, offset);
-        if (sent < 0)
+        int offset = makeChannelMessagePDU(channelPDU, channel, message + bytesSent, chunkSize);
+
+        if (offset < 0 || batchPDU(&batch, channelPDU, offset) < 0)
         {
-            printf("Error sending broadcast PDU to socket %d\n", socketNum);
+            printf("Error sending channel PDU to socket %d\n", socketNum);
             return -1;
         }
 
         bytesSent += chunkSize;
     }
+    return flushPDUBatch(&batch);
+}
+
+void initPDUBatch(PDUBatch_t *batch, int socketNum)
+{
+    batch->socketNum = socketNum;
+    batch->batching = pduBatching;
+    batch->buffer[2] = BATCH_FLAG;
+    batch->len = 3;
+    batch->count = 0;
+}
+
+/*
+-- Add a PDU (flag and on, like sendPDU() takes) to the batch, sending what
+   is already there first if it won't fit
+-- Without LOGIN_CAP_BATCH it just goes out with sendPDU()
+-- Return value: pduLen, -1 on a send error
+*/
+int batchPDU(PDUBatch_t *batch, uint8_t *pdu, int pduLen)
+{
+    if (!batch->batching || 3 + 2 + pduLen > MAXBUF)
+    {
+        if (flushPDUBatch(batch) < 0)
+        {
+            return -1;
+        }
+        return sendPDU(batch->socketNum, pdu, pduLen);
+    }
+
+    if (batch->len + 2 + pduLen > MAXBUF && flushPDUBatch(batch) < 0)
+    {
+        return -1;
+    }
+
+    uint16_t pduLength = htons(pduLen + 2);
+    memcpy(batch->buffer + batch->len, &pduLength, 2);
+    memcpy(batch->buffer + batch->len + 2, pdu, pduLen);
+    batch->len += 2 + pduLen;
+    batch->count++;
+    return pduLen;
+}
+
+// Send whatever is batched up, one PDU on its own goes out without the batch around it
+int flushPDUBatch(PDUBatch_t *batch)
+{
+    uint8_t *frame = batch->buffer;
+    int frameLen = batch->len;
+
+    if (batch->count == 0)
+    {
         return 0;
- }
\ No newline at end of file
+    }
+    if (batch->count == 1)
+    {
+        frame += 3; // it already has its own length
+        frameLen -= 3;
+    }
+    else
+    {
+        uint16_t batchLength = htons(frameLen);
+        memcpy(frame, &batchLength, 2);
+    }
+
+    int sent = safeSend(batch->socketNum, frame, frameLen, 0);
+    batch->len = 3;
+    batch->count = 0;
+
+    if (sent != frameLen)
+    {
+        printf("Error: Sent %d bytes, but expected to send %d bytes\n", sent, frameLen);
+        return -1;
+    }
+    return 0;
+}
+
+// [0x17][id][length][slen][sender][dlen][destination], the segments follow in 0x18 PDUs
+int makeStreamStartPDU(uint8_t *streamPDU, uint32_t streamId, uint32_t length, char *sender_handle, char *destination)
+{
+    PduView_t start;
+
+    pduStart(&start, STREAM_START_FLAG);
+    pduAddNumber(&start, streamId);
+    pduAddNumber(&start, length);
+    pduAddHandle(&start, sender_handle, strlen(sender_handle));
+    pduAddHandle(&start, destination, strlen(destination));
+    return pduEncode(streamPDU, MAXBUF, PDU_TO_SERVER, &start);
+}
+
+/*
+-- Write data into out as 0x18 PDUs (lengths included, ready for send()),
+   STREAM_SEGMENT_SIZE bytes each except the last
+-- out needs room for dataLen plus STREAM_HEADER_LEN + 2 per segment
+-- Return value: bytes written to out
+*/
+int appendStreamData(uint8_t *out, uint32_t streamId, uint8_t *data, int dataLen)
+{
+    PduView_t segment;
+    int offset = 0;
+
+    pduStart(&segment, STREAM_DATA_FLAG);
+    pduAddNumber(&segment, streamId);
+    for (int done = 0; done < dataLen; done += STREAM_SEGMENT_SIZE)
+    {
+        int segmentLen = (dataLen - done < STREAM_SEGMENT_SIZE) ? dataLen - done : STREAM_SEGMENT_SIZE;
+
+        // Each segment goes right where it is sent from, behind its length
+        pduSetText(&segment, data + done, segmentLen);
+        uint16_t pduLength = htons(2 + pduEncode(out + offset + 2, STREAM_HEADER_LEN + segmentLen, PDU_TO_SERVER, &segment));
+        memcpy(out + offset, &pduLength, 2);
+        offset += 2 + STREAM_HEADER_LEN + segmentLen;
+    }
+    return offset;
+}
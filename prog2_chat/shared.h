@@ -10,10 +10,88 @@
 #define MAX_DEST_HANDLES 10
 #define MAXBUF 1400
 
+// Paged %L: many handles per PDU. The old 0x0A -> 0x0B/0x0C.../0x0D exchange still works.
+#define LIST_PAGE_REQUEST_FLAG 0x0E // [flag][cursor 4 bytes]  cursor 0 starts a new listing
+#define LIST_PAGE_FLAG 0x0F         // [flag][total 4 bytes][next cursor 4 bytes][count][len][handle]...
+#define LIST_PAGE_HEADER_LEN 10     // flag + total + next cursor + count
+
+// Keepalive: the server pings a client that has been quiet, the client answers with a pong
+#define KEEPALIVE_PING_FLAG 0x10    // [flag]
+#define KEEPALIVE_PONG_FLAG 0x11    // [flag]
+
+// Named channels
+#define CHANNEL_JOIN_FLAG 0x12      // [flag][len][channel]
+#define CHANNEL_LEAVE_FLAG 0x13     // [flag][len][channel]
+#define CHANNEL_MESSAGE_FLAG 0x14   // to the server: [flag][len][channel][text]
+                                    // to members:    [flag][len][channel][len][sender][text]
+#define CHANNEL_REPLY_FLAG 0x15     // [flag][status][len][channel][members 4 bytes]
+
+#define MAX_CHANNEL_NAME_LEN 32     // names are shorter than this
+
+// CHANNEL_REPLY_FLAG status
+#define CHANNEL_JOINED 0
+#define CHANNEL_LEFT 1
+#define CHANNEL_NOT_MEMBER 2        // left or sent to a channel it isn't in
+#define CHANNEL_TOO_MANY 3          // already in MAX_CHANNELS_PER_CONN channels
+#define CHANNEL_BAD_NAME 4
+#define CHANNEL_SENT 5              // never sent back, sendToChannel() worked
+
+// Batches: many PDUs under one length, so a client can hand over a whole
+// chunked message (or whatever it has queued up) in one send()
+#define BATCH_FLAG 0x16             // [flag]([len][flag]...)*  complete PDUs, their lengths included
+
+// Login capabilities: [1][len][handle][capabilities]. A server that grants any
+// answers with [len][2][capabilities] instead of [len][2].
+#define LOGIN_CAP_BATCH 0x01        // the client may send BATCH_FLAG frames
+#define LOGIN_CAP_STREAM 0x02       // the client sends and takes streamed messages
+
+// Streamed messages: one message of up to 4GB, sent as a start PDU and then
+// segments the server passes on as they come in, never holding the whole thing
+#define STREAM_START_FLAG 0x17      // [flag][id 4][length 4][slen][sender][dlen][destination]
+#define STREAM_DATA_FLAG 0x18       // [flag][id 4][up to STREAM_SEGMENT_SIZE bytes]
+#define STREAM_ABORT_FLAG 0x19      // [flag][id 4][reason]
+#define STREAM_SEGMENT_SIZE 1024
+#define STREAM_HEADER_LEN 5         // flag + id
+
+// STREAM_ABORT_FLAG reason
+#define STREAM_NO_DEST 1            // no such handle
+#define STREAM_NOT_SUPPORTED 2      // the destination didn't ask for LOGIN_CAP_STREAM
+#define STREAM_TOO_MANY 3           // sender already has MAX_STREAMS_PER_CONN going
+#define STREAM_BAD_DATA 4           // more data than the start said, or an id that isn't going
+#define STREAM_GONE 5               // the other end disconnected
+
+// Rate limits: a PDU the server dropped because the client is over its -R/-B
+// limit or the server is overloaded (-S reject only). Sent for the first one
+// dropped, then not again until a PDU gets through.
+#define RATE_LIMITED_FLAG 0x1A      // [flag][reason][flag of the PDU that was dropped]
+#define RATE_LIMIT_MESSAGES 1       // too many PDUs a second
+#define RATE_LIMIT_BYTES 2          // too many bytes a second
+#define RATE_OVERLOADED 3           // the server is shedding messages to other clients
+
+// Fills up a BATCH_FLAG frame, sent when the next PDU won't fit or on flushPDUBatch()
+typedef struct {
+    int socketNum;
+    int batching;                   // 0: every PDU goes out on its own (server didn't grant LOGIN_CAP_BATCH)
+    uint8_t buffer[MAXBUF];         // [len][BATCH_FLAG] then the PDUs
+    int len;
+    int count;
+} PDUBatch_t;
+
+extern int pduBatching;             // the server granted LOGIN_CAP_BATCH at login
+extern int pduStreaming;            // and LOGIN_CAP_STREAM
 
-int sendListPDU(int socketNum);
 int makeListPDU(uint8_t* listPDU, int socketNum);
+int makeListPagePDU(uint8_t* listPDU, int socketNum, uint32_t cursor);
+int makeBroadcastPDU(uint8_t* broadcastPDU, char* sender_handle, char* message, int messageLen);
 int sendBroadcastPDU(uint8_t* broadcastPDU, int socketNum, char* message, char* sender_handle);
+int makeChannelPDU(uint8_t* channelPDU, uint8_t flag, char* channel);
+int makeChannelMessagePDU(uint8_t* channelPDU, char* channel, char* message, int messageLen);
+int sendChannelMessagePDU(uint8_t* channelPDU, int socketNum, char* channel, char* message);
+void initPDUBatch(PDUBatch_t* batch, int socketNum);
+int batchPDU(PDUBatch_t* batch, uint8_t* pdu, int pduLen);
+int flushPDUBatch(PDUBatch_t* batch);
+int makeStreamStartPDU(uint8_t* streamPDU, uint32_t streamId, uint32_t length, char* sender_handle, char* destination);
+int appendStreamData(uint8_t* out, uint32_t streamId, uint8_t* data, int dataLen);
 
 
 
@@ -57,7 +135,11 @@ typedef enum {
     CMD_MULTICAST_MESSAGE,
     CMD_LIST_HANDLES,
     CMD_INVALID, 
-    CMD_SEND_MESSAGE
+    CMD_SEND_MESSAGE,
+    CMD_JOIN_CHANNEL,
+    CMD_LEAVE_CHANNEL,
+    CMD_CHANNEL_MESSAGE,
+    CMD_SEND_FILE
 } CommandType;
 
 
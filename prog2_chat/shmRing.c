@@ -0,0 +1,536 @@
+// --------------- shmRing.c -----------------
+/*
+Shared memory transport for clients on the same host as the server.
+
+The client connects to the server's Unix socket (-U) and gets back three
+descriptors over SCM_RIGHTS: a memfd holding two single-producer
+single-consumer byte rings (one each way) and two eventfds, one to wake
+the server and one to wake the client. After that the socket carries
+nothing; its only job is telling each side when the other goes away. The
+bytes in the rings are the same PDUs a TCP client sends, so the server
+parses and dispatches them exactly the same way.
+
+Each ring's head and tail are free-running byte counts on their own cache
+lines. A side only signals the other's eventfd when the other said it was
+about to sleep (consumerWaiting, producerWaiting), and re-checks the ring
+after saying so, so a busy pair moves PDUs without a single syscall and an
+idle one never misses a wakeup.
+
+Everything in the region can be scribbled on by the other process: counts
+that don't add up are an error, never an out of bounds copy, and the
+server copies PDUs out before looking at them. The memfd is sealed so the
+client can't shrink it under the server's mapping.
+*/
+
+#define _GNU_SOURCE // memfd_create(), F_ADD_SEALS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#include "shmRing.h"
+#include "safeUtil.h"
+
+#define SHM_RING_MASK (SHM_RING_SIZE - 1)
+#define SHM_NUM_FDS 3                // memfd, server's eventfd, client's eventfd
+
+// Sent with the descriptors
+typedef struct
+{
+    uint32_t magic;
+    uint32_t regionSize;
+} ShmHello_t;
+
+static int copyIn(ShmRing_t *ring, uint32_t head, const struct iovec *iov, int iovcnt, int skip, int room);
+static void signalIfWaiting(ShmEndpoint_t *ep, uint32_t *waiting);
+static int waitForPeer(ShmEndpoint_t *ep);
+
+// Non-blocking listening Unix socket at path (an old socket file there is replaced), -1 on error
+int shmListen(const char *path)
+{
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int socketNum = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (socketNum < 0)
+    {
+        return -1;
+    }
+    unlink(path);
+    if (bind(socketNum, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(socketNum, SOMAXCONN) < 0)
+    {
+        int saved = errno;
+        close(socketNum);
+        errno = saved;
+        return -1;
+    }
+    return socketNum;
+}
+
+/*
+-- Server side: make the rings and eventfds for a client that just connected
+   to the Unix socket and send them to it
+-- Return value: the server's end, NULL (errno set) if any of it failed
+*/
+ShmEndpoint_t *shmAccept(int socketNum)
+{
+    ShmEndpoint_t *ep = (ShmEndpoint_t *)sCalloc(1, sizeof(ShmEndpoint_t));
+    int memFd = memfd_create("chat-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+    ep->socketNum = socketNum;
+    ep->memFd = memFd;
+    ep->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ep->peerWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (memFd < 0 || ep->wakeFd < 0 || ep->peerWakeFd < 0 || ftruncate(memFd, sizeof(ShmRegion_t)) < 0 ||
+        fcntl(memFd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0)
+    {
+        goto fail;
+    }
+
+    ep->region = mmap(NULL, sizeof(ShmRegion_t), PROT_READ | PROT_WRITE, MAP_SHARED, memFd, 0);
+    if (ep->region == MAP_FAILED)
+    {
+        ep->region = NULL;
+        goto fail;
+    }
+    ep->rx = &ep->region->toServer;
+    ep->tx = &ep->region->toClient;
+
+    // Both readers start out asleep, the first write to either ring signals
+    ep->region->toServer.consumerWaiting = 1;
+    ep->region->toClient.consumerWaiting = 1;
+
+    ShmHello_t hello = {SHM_MAGIC, sizeof(ShmRegion_t)};
+    struct iovec iov = {&hello, sizeof(hello)};
+    int fds[SHM_NUM_FDS] = {memFd, ep->wakeFd, ep->peerWakeFd};
+    union
+    {
+        char buffer[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr message;
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    // A fresh socket always has room for this much
+    if (sendmsg(socketNum, &message, MSG_NOSIGNAL) != sizeof(hello))
+    {
+        goto fail;
+    }
+    return ep;
+
+fail:
+    {
+        int saved = errno;
+        shmClose(ep);
+        errno = saved;
+    }
+    return NULL;
+}
+
+// Server side: map the rings of a client the old server handed over (see handoff.c), NULL if that fails
+ShmEndpoint_t *shmAdopt(int socketNum, int memFd, int wakeFd, int peerWakeFd)
+{
+    ShmEndpoint_t *ep = (ShmEndpoint_t *)sCalloc(1, sizeof(ShmEndpoint_t));
+
+    ep->socketNum = socketNum;
+    ep->memFd = memFd;
+    ep->wakeFd = wakeFd;
+    ep->peerWakeFd = peerWakeFd;
+    ep->region = mmap(NULL, sizeof(ShmRegion_t), PROT_READ | PROT_WRITE, MAP_SHARED, memFd, 0);
+    if (ep->region == MAP_FAILED)
+    {
+        ep->region = NULL;
+        shmClose(ep);
+        return NULL;
+    }
+    ep->rx = &ep->region->toServer;
+    ep->tx = &ep->region->toClient;
+    return ep;
+}
+
+/*
+-- Client side: connect to the server's Unix socket at path and map the
+   rings it sends back (blocking)
+-- Return value: the client's end, NULL (errno set) if it failed
+*/
+ShmEndpoint_t *shmConnect(const char *path)
+{
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int socketNum = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (socketNum < 0)
+    {
+        return NULL;
+    }
+    if (connect(socketNum, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        int saved = errno;
+        close(socketNum);
+        errno = saved;
+        return NULL;
+    }
+
+    ShmHello_t hello;
+    struct iovec iov = {&hello, sizeof(hello)};
+    int fds[SHM_NUM_FDS] = {-1, -1, -1};
+    union
+    {
+        char buffer[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr message;
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    ssize_t got = recvmsg(socketNum, &message, MSG_CMSG_CLOEXEC);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(fds)))
+    {
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    }
+
+    ShmEndpoint_t *ep = (ShmEndpoint_t *)sCalloc(1, sizeof(ShmEndpoint_t));
+    ep->socketNum = socketNum;
+    ep->memFd = -1;
+    ep->wakeFd = fds[2];
+    ep->peerWakeFd = fds[1];
+
+    if (got != sizeof(hello) || hello.magic != SHM_MAGIC || hello.regionSize != sizeof(ShmRegion_t) || fds[0] < 0)
+    {
+        errno = EPROTO;
+        goto fail;
+    }
+
+    ep->region = mmap(NULL, sizeof(ShmRegion_t), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if (ep->region == MAP_FAILED)
+    {
+        ep->region = NULL;
+        goto fail;
+    }
+    close(fds[0]);
+    ep->rx = &ep->region->toClient;
+    ep->tx = &ep->region->toServer;
+    return ep;
+
+fail:
+    {
+        int saved = errno;
+        if (fds[0] >= 0)
+        {
+            close(fds[0]);
+        }
+        shmClose(ep);
+        close(socketNum);
+        errno = saved;
+    }
+    return NULL;
+}
+
+// Unmap and close everything but the socket (which is the caller's)
+void shmClose(ShmEndpoint_t *ep)
+{
+    if (ep->region != NULL)
+    {
+        munmap(ep->region, sizeof(ShmRegion_t));
+    }
+    if (ep->memFd >= 0)
+    {
+        close(ep->memFd);
+    }
+    if (ep->wakeFd >= 0)
+    {
+        close(ep->wakeFd);
+    }
+    if (ep->peerWakeFd >= 0)
+    {
+        close(ep->peerWakeFd);
+    }
+    free(ep);
+}
+
+/*
+-- Copy up to maxLen bytes out of our receive ring, telling the other side
+   if it was waiting for room
+-- Return value: bytes copied, 0 if the ring is empty,
+                 -1 if the counts in it are garbage
+*/
+int shmRead(ShmEndpoint_t *ep, uint8_t *buffer, int maxLen)
+{
+    ShmRing_t *ring = ep->rx;
+    uint32_t tail = ring->tail;
+    uint32_t used = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+
+    if (used > SHM_RING_SIZE)
+    {
+        return -1;
+    }
+    if (used > (uint32_t)maxLen)
+    {
+        used = maxLen;
+    }
+    if (used == 0)
+    {
+        return 0;
+    }
+
+    uint32_t offset = tail & SHM_RING_MASK;
+    uint32_t first = (used < SHM_RING_SIZE - offset) ? used : SHM_RING_SIZE - offset;
+    memcpy(buffer, ring->data + offset, first);
+    memcpy(buffer + first, ring->data, used - first);
+    __atomic_store_n(&ring->tail, tail + used, __ATOMIC_RELEASE);
+
+    signalIfWaiting(ep, &ring->producerWaiting);
+    return used;
+}
+
+/*
+-- Copy as much of iov as fits into our send ring (like writev()), telling
+   the other side if it was waiting for data
+-- Return value: bytes copied, less than all of them if the ring filled up
+                 (the other side signals once it has made room),
+                 -1 if the counts in it are garbage
+*/
+int shmWrite(ShmEndpoint_t *ep, const struct iovec *iov, int iovcnt)
+{
+    ShmRing_t *ring = ep->tx;
+    uint32_t head = ring->head;
+    int wanted = 0;
+    int written = 0;
+
+    for (int i = 0; i < iovcnt; i++)
+    {
+        wanted += iov[i].iov_len;
+    }
+
+    while (written < wanted)
+    {
+        uint32_t used = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (used > SHM_RING_SIZE)
+        {
+            return -1;
+        }
+        if (used == SHM_RING_SIZE)
+        {
+            // Full: ask to be told when there's room, unless some turned up while asking
+            __atomic_store_n(&ring->producerWaiting, 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == SHM_RING_SIZE)
+            {
+                break;
+            }
+            __atomic_store_n(&ring->producerWaiting, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        int copied = copyIn(ring, head, iov, iovcnt, written, SHM_RING_SIZE - used);
+        head += copied;
+        written += copied;
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    }
+
+    if (written > 0)
+    {
+        signalIfWaiting(ep, &ring->consumerWaiting);
+    }
+    return written;
+}
+
+/*
+-- Call when shmRead() comes back empty, before going to sleep on wakeFd
+-- Return value: 0 if the other side will now signal the next write,
+                 1 if something was written meanwhile (read again instead)
+*/
+int shmArmWakeup(ShmEndpoint_t *ep)
+{
+    ShmRing_t *ring = ep->rx;
+
+    __atomic_store_n(&ring->consumerWaiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != ring->tail)
+    {
+        __atomic_store_n(&ring->consumerWaiting, 0, __ATOMIC_RELAXED);
+        return 1;
+    }
+    return 0;
+}
+
+// Reset wakeFd after it went readable
+void shmClearWakeup(ShmEndpoint_t *ep)
+{
+    uint64_t count;
+    while (read(ep->wakeFd, &count, sizeof(count)) < 0 && errno == EINTR)
+    {
+    }
+}
+
+// Make our own wakeFd readable, to come back to a ring that still has data in it
+void shmWakeSelf(ShmEndpoint_t *ep)
+{
+    uint64_t one = 1;
+    if (write(ep->wakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    {
+        perror("shmWakeSelf");
+    }
+}
+
+/*
+-- Blocking send of all len bytes, for simple clients
+-- Return value: len, -1 if the server went away or the ring is broken
+*/
+int shmSendAll(ShmEndpoint_t *ep, uint8_t *buffer, int len)
+{
+    int sent = 0;
+
+    while (sent < len)
+    {
+        struct iovec iov = {buffer + sent, len - sent};
+        int written = shmWrite(ep, &iov, 1);
+
+        if (written < 0)
+        {
+            return -1;
+        }
+        sent += written;
+        if (sent < len && waitForPeer(ep) < 0)
+        {
+            return -1;
+        }
+    }
+    return len;
+}
+
+/*
+-- Blocking receive of whatever is in the ring (at least one byte), for simple clients
+-- Return value: bytes copied, 0 if the server went away, -1 if the ring is broken
+*/
+int shmRecvWait(ShmEndpoint_t *ep, uint8_t *buffer, int maxLen)
+{
+    while (1)
+    {
+        int got = shmRead(ep, buffer, maxLen);
+        if (got != 0)
+        {
+            return got;
+        }
+        if (shmArmWakeup(ep))
+        {
+            continue;
+        }
+        if (waitForPeer(ep) < 0)
+        {
+            return 0;
+        }
+    }
+}
+
+// Copy iov (skipping the first skip bytes) into the ring at head, at most room bytes
+static int copyIn(ShmRing_t *ring, uint32_t head, const struct iovec *iov, int iovcnt, int skip, int room)
+{
+    int copied = 0;
+
+    for (int i = 0; i < iovcnt && copied < room; i++)
+    {
+        int len = iov[i].iov_len;
+        if (skip >= len)
+        {
+            skip -= len;
+            continue;
+        }
+
+        const uint8_t *from = (const uint8_t *)iov[i].iov_base + skip;
+        len -= skip;
+        skip = 0;
+        if (len > room - copied)
+        {
+            len = room - copied;
+        }
+
+        uint32_t offset = (head + copied) & SHM_RING_MASK;
+        int first = (len < (int)(SHM_RING_SIZE - offset)) ? len : (int)(SHM_RING_SIZE - offset);
+        memcpy(ring->data + offset, from, first);
+        memcpy(ring->data, from + first, len - first);
+        copied += len;
+    }
+    return copied;
+}
+
+// Pairs with the fence in shmArmWakeup() (and the full ring check in shmWrite()):
+// either the other side sees what we just did, or we see that it is asleep
+static void signalIfWaiting(ShmEndpoint_t *ep, uint32_t *waiting)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_RELAXED) && __atomic_exchange_n(waiting, 0, __ATOMIC_ACQ_REL))
+    {
+        uint64_t one = 1;
+        if (write(ep->peerWakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        {
+            perror("shm signal");
+        }
+        ep->signals++;
+    }
+}
+
+// Sleep until the other side signals us, -1 if it hung up instead
+static int waitForPeer(ShmEndpoint_t *ep)
+{
+    struct pollfd fds[2] = {{ep->wakeFd, POLLIN, 0}, {ep->socketNum, POLLIN, 0}};
+
+    while (poll(fds, 2, -1) < 0)
+    {
+        if (errno != EINTR)
+        {
+            return -1;
+        }
+    }
+    // Nothing is ever sent on the socket after the rings, readable means closed
+    if (fds[1].revents != 0)
+    {
+        return -1;
+    }
+    shmClearWakeup(ep);
+    return 0;
+}
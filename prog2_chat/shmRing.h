@@ -0,0 +1,60 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define SHM_RING_SIZE (256 * 1024)   // bytes each way, must be a power of 2
+#define SHM_CACHE_LINE 64
+#define SHM_MAGIC 0x4d534843         // "CHSM"
+
+// One direction: a single producer and a single consumer (byte stream, same PDUs as TCP)
+typedef struct
+{
+    // Written by the producer
+    uint32_t head __attribute__((aligned(SHM_CACHE_LINE)));   // bytes ever written
+    uint32_t producerWaiting;                                 // ring was full, signal it when there's room
+
+    // Written by the consumer
+    uint32_t tail __attribute__((aligned(SHM_CACHE_LINE)));   // bytes ever read
+    uint32_t consumerWaiting;                                 // ring was empty, signal it when there's data
+
+    uint8_t data[SHM_RING_SIZE] __attribute__((aligned(SHM_CACHE_LINE)));
+} ShmRing_t;
+
+// What the memfd holds
+typedef struct
+{
+    ShmRing_t toServer;
+    ShmRing_t toClient;
+} ShmRegion_t;
+
+// One side's view of a client's rings
+typedef struct
+{
+    ShmRegion_t *region;
+    ShmRing_t *rx;                   // the ring we read
+    ShmRing_t *tx;                   // the ring we write
+    int wakeFd;                      // eventfd the other side signals us on
+    int peerWakeFd;                  // eventfd we signal the other side on
+    int socketNum;                   // the Unix socket the rings came over, not closed by shmClose()
+    int memFd;                       // server side, kept to hand the rings to a new server (-X), -1 in the client
+    uint64_t signals;                // times peerWakeFd was written (for the benchmarks)
+} ShmEndpoint_t;
+
+int shmListen(const char *path);
+ShmEndpoint_t *shmAccept(int socketNum);
+ShmEndpoint_t *shmAdopt(int socketNum, int memFd, int wakeFd, int peerWakeFd);
+ShmEndpoint_t *shmConnect(const char *path);
+void shmClose(ShmEndpoint_t *ep);
+
+int shmRead(ShmEndpoint_t *ep, uint8_t *buffer, int maxLen);
+int shmWrite(ShmEndpoint_t *ep, const struct iovec *iov, int iovcnt);
+int shmArmWakeup(ShmEndpoint_t *ep);
+void shmClearWakeup(ShmEndpoint_t *ep);
+void shmWakeSelf(ShmEndpoint_t *ep);
+
+int shmSendAll(ShmEndpoint_t *ep, uint8_t *buffer, int len);
+int shmRecvWait(ShmEndpoint_t *ep, uint8_t *buffer, int maxLen);
+
+#endif
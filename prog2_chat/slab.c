@@ -0,0 +1,176 @@
+// --------------- slab.c -----------------
+/*
+Fixed size object pools for the server's per-connection state and PDU
+buffers.
+
+Each slab hands out objects of one size from big mmap()ed chunks and keeps
+the ones that come back on a free list, so once a reactor has warmed up,
+connecting, logging in and passing messages around never calls malloc().
+A slab belongs to the thread that created it (every reactor makes its own
+the first time it needs one). That thread allocates and frees with plain
+pointer pushes and pops. A PDU buffer or inbox message is often let go on
+another reactor, so those frees are pushed onto the slab's remoteFree
+stack instead and the owner takes the whole stack back in one exchange
+when its own free list runs dry.
+
+Chunks are never given back, the pools only grow to the high water mark.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/mman.h>
+
+#include "slab.h"
+#include "safeUtil.h"
+
+#define SLAB_HEADER_SIZE offsetof(SlabObject_t, data)
+
+// Its address identifies the thread a slab belongs to
+static __thread int slabThreadToken;
+
+static Slab_t *allSlabs = NULL;
+static pthread_mutex_t allSlabsLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int growSlab(Slab_t *slab);
+
+// A slab for this thread of objectSize byte objects (name is only for the stats)
+Slab_t *createSlab(const char *name, int objectSize)
+{
+    Slab_t *slab = (Slab_t *)sCalloc(1, sizeof(Slab_t));
+
+    slab->name = name;
+    slab->objectSize = (objectSize + 7) & ~7;
+    if (slab->objectSize < (int)sizeof(SlabObject_t *))
+    {
+        slab->objectSize = sizeof(SlabObject_t *); // room for the free list link
+    }
+
+    int stride = SLAB_HEADER_SIZE + slab->objectSize;
+    slab->objectsPerChunk = SLAB_CHUNK_SIZE / stride;
+    if (slab->objectsPerChunk < 16)
+    {
+        slab->objectsPerChunk = 16;
+    }
+    slab->owner = &slabThreadToken;
+
+    pthread_mutex_lock(&allSlabsLock);
+    slab->nextSlab = allSlabs;
+    allSlabs = slab;
+    pthread_mutex_unlock(&allSlabsLock);
+
+    return slab;
+}
+
+// One object from the slab, contents undefined (owning thread only)
+void *slabAlloc(Slab_t *slab)
+{
+    if (slab->freeList == NULL)
+    {
+        // Take back everything the other threads freed, carve a new chunk if that's nothing
+        slab->freeList = __atomic_exchange_n(&slab->remoteFree, NULL, __ATOMIC_ACQUIRE);
+        for (SlabObject_t *object = slab->freeList; object != NULL; object = object->next)
+        {
+            slab->freed++;
+        }
+        if (slab->freeList == NULL && growSlab(slab) < 0)
+        {
+            perror("mmap");
+            exit(-1);
+        }
+    }
+
+    SlabObject_t *object = slab->freeList;
+    slab->freeList = object->next;
+    slab->allocated++;
+    return object->data;
+}
+
+// For the odd object bigger than any slab's size, slabFree() knows to free() it
+void *slabAllocUnpooled(int size)
+{
+    SlabObject_t *object = (SlabObject_t *)malloc(SLAB_HEADER_SIZE + size);
+    if (object == NULL)
+    {
+        perror("malloc");
+        exit(-1);
+    }
+    object->slab = NULL;
+    return object->data;
+}
+
+// Give an object back to the slab it came from (any thread)
+void slabFree(void *data)
+{
+    SlabObject_t *object = (SlabObject_t *)((uint8_t *)data - SLAB_HEADER_SIZE);
+    Slab_t *slab = object->slab;
+
+    if (slab == NULL)
+    {
+        free(object);
+        return;
+    }
+
+    if (slab->owner == &slabThreadToken)
+    {
+        object->next = slab->freeList;
+        slab->freeList = object;
+        slab->freed++;
+        return;
+    }
+
+    // Another thread's slab: push onto its remote stack (the owner only ever
+    // takes the whole stack, so there is no ABA to worry about)
+    SlabObject_t *head = __atomic_load_n(&slab->remoteFree, __ATOMIC_RELAXED);
+    do
+    {
+        object->next = head;
+    } while (!__atomic_compare_exchange_n(&slab->remoteFree, &head, object, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// One line per slab: objects in use and the memory its chunks take
+void printSlabStats(FILE *out)
+{
+    pthread_mutex_lock(&allSlabsLock);
+    flockfile(out);
+    fprintf(out, "%-14s %6s %10s %10s %12s\n", "slab", "size", "in use", "chunks", "bytes");
+    for (Slab_t *slab = allSlabs; slab != NULL; slab = slab->nextSlab)
+    {
+        uint64_t chunks = __atomic_load_n(&slab->chunks, __ATOMIC_RELAXED);
+        uint64_t inUse = __atomic_load_n(&slab->allocated, __ATOMIC_RELAXED) - __atomic_load_n(&slab->freed, __ATOMIC_RELAXED);
+        uint64_t bytes = chunks * slab->objectsPerChunk * (SLAB_HEADER_SIZE + slab->objectSize);
+
+        fprintf(out, "%-14s %6d %10llu %10llu %12llu\n", slab->name, slab->objectSize,
+                (unsigned long long)inUse, (unsigned long long)chunks, (unsigned long long)bytes);
+    }
+    fflush(out);
+    funlockfile(out);
+    pthread_mutex_unlock(&allSlabsLock);
+}
+
+// Carve a new chunk into objects on the free list
+static int growSlab(Slab_t *slab)
+{
+    int stride = SLAB_HEADER_SIZE + slab->objectSize;
+    size_t chunkBytes = (size_t)stride * slab->objectsPerChunk;
+
+    uint8_t *chunk = mmap(NULL, chunkBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (chunk == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    // Link them so the lowest addresses go out first
+    for (int i = slab->objectsPerChunk - 1; i >= 0; i--)
+    {
+        SlabObject_t *object = (SlabObject_t *)(chunk + (size_t)i * stride);
+        object->slab = slab;
+        object->next = slab->freeList;
+        slab->freeList = object;
+    }
+    __atomic_add_fetch(&slab->chunks, 1, __ATOMIC_RELAXED);
+    return 0;
+}
@@ -0,0 +1,48 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Bytes the slab carves at a time (more if that isn't 16 objects)
+#define SLAB_CHUNK_SIZE (64 * 1024)
+
+// Objects are handed out with an 8 byte header in front pointing back at their slab
+typedef struct SlabObject
+{
+    struct Slab *slab;        // NULL for an unpooled (too big for any slab) allocation
+    union
+    {
+        struct SlabObject *next; // free list link while the object is free
+        uint8_t data[0];         // what the caller gets while it is in use
+    };
+} SlabObject_t;
+
+// A pool of same size objects for one thread. Only the owning thread
+// allocates; any thread can free, objects freed by other threads come back
+// through remoteFree.
+typedef struct Slab
+{
+    const char *name;
+    int objectSize;             // caller's size rounded up to 8
+    int objectsPerChunk;
+
+    SlabObject_t *freeList;     // owning thread only
+    SlabObject_t *remoteFree __attribute__((aligned(64))); // pushed by other threads, taken all at once by the owner
+    void *owner;                // the owning thread's token (see slab.c)
+
+    uint64_t chunks __attribute__((aligned(64))); // chunks carved so far
+    uint64_t allocated;         // objects handed out (owner only)
+    uint64_t freed;             // objects returned, local + collected remote (owner only)
+
+    struct Slab *nextSlab;      // every slab ever made, for the stats
+} Slab_t;
+
+Slab_t *createSlab(const char *name, int objectSize);
+void *slabAlloc(Slab_t *slab);
+void *slabAllocUnpooled(int size);
+void slabFree(void *object);
+void printSlabStats(FILE *out);
+
+#endif
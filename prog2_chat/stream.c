@@ -0,0 +1,263 @@
+// --------------- stream.c -----------------
+/*
+Streamed messages: a client that logged in with LOGIN_CAP_STREAM can send
+one message of any size up to 4GB to another such client without cutting
+it into 199 byte %m chunks.
+
+The sender sends a start PDU with the 32 bit length and the two handles,
+then the text in STREAM_SEGMENT_SIZE segments. Nothing is put back
+together here: each segment is passed on to the destination as soon as it
+has been read, straight out of the receive buffer like a %m, so a message
+in flight costs one Stream_t however big it is. A destination that reads
+slower than the sender writes pauses the sender through the send queue
+watermarks, same as for any other client.
+
+The id in every start and segment PDU is swapped (in place, before it is
+forwarded) for one that is unique on the server, so a client getting
+streams from several senders at once can tell them apart. If either end
+goes away part way through, the other gets a 0x19 abort.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+
+#include "stream.h"
+#include "safeUtil.h"
+#include "log.h"
+#include "pduCodec.h"
+
+static uint32_t nextStreamId = 1;
+
+static Stream_t *findStream(Connection_t *conn, uint32_t clientId);
+static void addStream(Connection_t *conn, uint32_t clientId, uint32_t serverId, uint32_t length, ConnRef_t *destRef,
+                      char *dest, int destLen);
+static void removeStream(Connection_t *conn, Stream_t *stream);
+static void sendAbort(Connection_t *sender, ConnRef_t *dest, uint32_t streamId, uint8_t reason);
+
+/*
+-- [0x17][id 4][length 4][slen][sender][dlen][destination]
+-- Passes it on with our id in it, or answers with an abort if it can't go
+*/
+void startStream(Connection_t *conn, uint8_t *pdu, int pduLen)
+{
+    PduView_t start;
+
+    if (pduParse(pdu, pduLen, PDU_TO_SERVER, &start) < 0)
+    {
+        LOG_WARN("Socket %d: invalid stream start\n", conn->socketNum);
+        return;
+    }
+    uint32_t clientId = htonl(start.numbers[0]); // ids are kept as they are on the wire
+    uint32_t length = start.numbers[1];
+
+    uint8_t *dest = (uint8_t *)start.handles[1].data;
+    int destLen = start.handles[1].len;
+    ConnRef_t destRef;
+
+    if (lookupHandle((char *)dest, destLen, &destRef) < 0)
+    {
+        LOG_INFO("Stream to %s: no such handle\n", LOG_STR(dest, destLen));
+        sendAbort(conn, NULL, clientId, STREAM_NO_DEST);
+        return;
+    }
+    if (!(destRef.capabilities & LOGIN_CAP_STREAM))
+    {
+        sendAbort(conn, NULL, clientId, STREAM_NOT_SUPPORTED);
+        return;
+    }
+    if (findStream(conn, clientId) != NULL || conn->numStreams == MAX_STREAMS_PER_CONN)
+    {
+        sendAbort(conn, NULL, clientId, STREAM_TOO_MANY);
+        return;
+    }
+
+    uint32_t serverId = htonl(__atomic_fetch_add(&nextStreamId, 1, __ATOMIC_RELAXED));
+    memcpy(pdu + 1, &serverId, 4);
+
+    if (length > 0)
+    {
+        addStream(conn, clientId, serverId, length, &destRef, (char *)dest, destLen);
+    }
+
+    LOG_DEBUG("Stream %u: %u bytes to %s\n", ntohl(serverId), length, LOG_STR(dest, destLen));
+    forwardReceivedPDU(conn, &destRef, pdu, pduLen);
+}
+
+// [0x18][id 4][data], passed on as it is (with our id) the moment it comes in
+void streamData(Connection_t *conn, uint8_t *pdu, int pduLen)
+{
+    PduView_t segment;
+
+    if (pduParse(pdu, pduLen, PDU_TO_SERVER, &segment) < 0 || segment.text.len == 0)
+    {
+        LOG_WARN("Socket %d: empty or invalid stream segment\n", conn->socketNum);
+        return;
+    }
+    uint32_t clientId = htonl(segment.numbers[0]);
+
+    Stream_t *stream = findStream(conn, clientId);
+    if (stream == NULL)
+    {
+        // Already aborted (the sender has been told), or never started
+        LOG_DEBUG("Socket %d: segment for stream %u that isn't going\n", conn->socketNum, ntohl(clientId));
+        return;
+    }
+
+    uint32_t dataLen = segment.text.len;
+    if (dataLen > stream->remaining)
+    {
+        LOG_WARN("Socket %d: stream %u is longer than it said\n", conn->socketNum, ntohl(clientId));
+        sendAbort(conn, NULL, stream->clientId, STREAM_BAD_DATA);
+        sendAbort(conn, &stream->dest, stream->serverId, STREAM_BAD_DATA);
+        removeStream(conn, stream);
+        return;
+    }
+
+    // Every so often make sure there is still someone there to send it to
+    if (++stream->segments == STREAM_CHECK_SEGMENTS)
+    {
+        ConnRef_t destRef;
+        stream->segments = 0;
+        if (lookupHandle(stream->destHandle, stream->destHandleLen, &destRef) < 0 || destRef.connId != stream->dest.connId)
+        {
+            LOG_INFO("Stream %u: %s went away\n", ntohl(stream->serverId), LOG_STR(stream->destHandle, stream->destHandleLen));
+            sendAbort(conn, NULL, stream->clientId, STREAM_GONE);
+            removeStream(conn, stream);
+            return;
+        }
+    }
+
+    memcpy(pdu + 1, &stream->serverId, 4);
+    forwardReceivedPDU(conn, &stream->dest, pdu, pduLen);
+
+    stream->remaining -= dataLen;
+    if (stream->remaining == 0)
+    {
+        LOG_DEBUG("Stream %u done\n", ntohl(stream->serverId));
+        removeStream(conn, stream);
+    }
+}
+
+// The sender gave up on one: [0x19][id 4][reason], the destination is told
+void cancelStream(Connection_t *conn, uint8_t *pdu, int pduLen)
+{
+    PduView_t abort;
+
+    if (pduParse(pdu, pduLen, PDU_TO_SERVER, &abort) < 0)
+    {
+        return;
+    }
+
+    Stream_t *stream = findStream(conn, htonl(abort.numbers[0]));
+    if (stream != NULL)
+    {
+        sendAbort(conn, &stream->dest, stream->serverId, abort.bytes[0]);
+        removeStream(conn, stream);
+    }
+}
+
+// The connection is going away (owning reactor only), whoever it was streaming to gets an abort
+void abortAllStreams(Connection_t *conn)
+{
+    while (conn->numStreams > 0)
+    {
+        Stream_t *stream = &conn->streams[conn->numStreams - 1];
+        sendAbort(conn, &stream->dest, stream->serverId, STREAM_GONE);
+        removeStream(conn, stream);
+    }
+}
+
+// One a connection was part way through when the old server handed it over
+// (handoff.c): the destination is looked up again, the sender is told if it's gone
+void adoptStream(Connection_t *conn, uint32_t clientId, uint32_t serverId, uint32_t remaining, char *dest, int destLen)
+{
+    ConnRef_t destRef;
+
+    if (lookupHandle(dest, destLen, &destRef) < 0 || conn->numStreams == MAX_STREAMS_PER_CONN)
+    {
+        sendAbort(conn, NULL, clientId, STREAM_GONE);
+        return;
+    }
+    addStream(conn, clientId, serverId, remaining, &destRef, dest, destLen);
+}
+
+// Next id startStream() hands out, so a new server carries on from the old one's
+uint32_t getStreamIdCounter()
+{
+    return __atomic_load_n(&nextStreamId, __ATOMIC_RELAXED);
+}
+
+void setStreamIdCounter(uint32_t next)
+{
+    __atomic_store_n(&nextStreamId, next, __ATOMIC_RELAXED);
+}
+
+static Stream_t *findStream(Connection_t *conn, uint32_t clientId)
+{
+    for (int i = 0; i < conn->numStreams; i++)
+    {
+        if (conn->streams[i].clientId == clientId)
+        {
+            return &conn->streams[i];
+        }
+    }
+    return NULL;
+}
+
+static void addStream(Connection_t *conn, uint32_t clientId, uint32_t serverId, uint32_t length, ConnRef_t *destRef,
+                      char *dest, int destLen)
+{
+    // Only held while there is a stream going
+    if (conn->streams == NULL)
+    {
+        conn->streams = (Stream_t *)sCalloc(MAX_STREAMS_PER_CONN, sizeof(Stream_t));
+    }
+    Stream_t *stream = &conn->streams[conn->numStreams++];
+    stream->clientId = clientId;
+    stream->serverId = serverId;
+    stream->remaining = length;
+    stream->segments = 0;
+    stream->dest = *destRef;
+    stream->destHandleLen = destLen;
+    memcpy(stream->destHandle, dest, destLen);
+}
+
+// Swap the last one into its place, the array goes back once nothing is streaming
+static void removeStream(Connection_t *conn, Stream_t *stream)
+{
+    *stream = conn->streams[--conn->numStreams];
+    if (conn->numStreams == 0)
+    {
+        free(conn->streams);
+        conn->streams = NULL;
+    }
+}
+
+// [0x19][id 4][reason] to dest, or back to the sender itself if dest is NULL (id in network order)
+static void sendAbort(Connection_t *sender, ConnRef_t *dest, uint32_t streamId, uint8_t reason)
+{
+    uint8_t abort[STREAM_HEADER_LEN + 1];
+    PduView_t abortView;
+
+    pduStart(&abortView, STREAM_ABORT_FLAG);
+    pduAddNumber(&abortView, ntohl(streamId));
+    pduAddByte(&abortView, reason);
+    pduEncode(abort, sizeof(abort), PDU_TO_CLIENT, &abortView);
+
+    if (dest == NULL)
+    {
+        queuePDU(sender, abort, sizeof(abort));
+        return;
+    }
+
+    PDUBuffer_t *pduBuffer = allocPDUBuffer(2 + sizeof(abort));
+    uint16_t pduLength = htons(2 + sizeof(abort));
+    memcpy(pduBuffer->data, &pduLength, 2);
+    memcpy(pduBuffer->data + 2, abort, sizeof(abort));
+
+    deliverPDUBuffer(sender, dest, pduBuffer);
+    releasePDUBuffer(pduBuffer);
+}
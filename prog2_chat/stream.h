@@ -0,0 +1,31 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdint.h>
+
+#include "connection.h"
+
+#define MAX_STREAMS_PER_CONN 8
+#define STREAM_CHECK_SEGMENTS 64     // look the destination up again every this many segments
+
+// A message a client is streaming through us, kept by the sender's connection
+typedef struct Stream
+{
+    uint32_t clientId;               // the id the sender picked
+    uint32_t serverId;               // unique, what the destination sees instead
+    uint32_t remaining;              // bytes still to come
+    uint32_t segments;               // since the destination was last checked
+    ConnRef_t dest;
+    int destHandleLen;
+    char destHandle[MAX_TABLE_HANDLE_LEN];
+} Stream_t;
+
+void startStream(Connection_t *conn, uint8_t *pdu, int pduLen);
+void streamData(Connection_t *conn, uint8_t *pdu, int pduLen);
+void cancelStream(Connection_t *conn, uint8_t *pdu, int pduLen);
+void abortAllStreams(Connection_t *conn);
+void adoptStream(Connection_t *conn, uint32_t clientId, uint32_t serverId, uint32_t remaining, char *dest, int destLen);
+uint32_t getStreamIdCounter();
+void setStreamIdCounter(uint32_t next);
+
+#endif
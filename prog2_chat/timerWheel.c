@@ -0,0 +1,214 @@
+// --------------- timerWheel.c -----------------
+/*
+Hierarchical timing wheel (Varghese & Lauck) for the server's per
+connection timeouts.
+
+Arming a timer hashes its expiry into a slot: level 0 holds everything due
+in the next 64 ticks, one slot per tick, level 1 everything in the next
+64 * 64 ticks, 64 ticks per slot, and so on. Arming and cancelling are a
+list insert/unlink, and expiring is popping the current level 0 slot, so
+the cost doesn't depend on how many timers there are. Every 64 ticks the
+next level 1 slot is emptied back into the wheel (cascaded), and so on up
+the levels.
+
+The event loop drives it: expireTimers() runs everything due and says how
+long epoll_wait() can sleep before the wheel needs turning again. The
+occupied bitmaps let that skip straight to the next slot with anything in
+it, so an idle server doesn't wake every tick.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "timerWheel.h"
+
+#define TIMER_SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+static void addTimer(TimerWheel_t *wheel, Timer_t *timer);
+static void unlinkTimer(TimerWheel_t *wheel, Timer_t *timer);
+static void cascade(TimerWheel_t *wheel, int level);
+static int ticksToNextEvent(TimerWheel_t *wheel);
+
+void initTimerWheel(TimerWheel_t *wheel, uint64_t nowMs)
+{
+    memset(wheel, 0, sizeof(TimerWheel_t));
+    wheel->currentTick = nowMs / TIMER_TICK_MS;
+}
+
+// Arm (or re-arm) timer to go off at expiresMs (same clock as expireTimers())
+void startTimer(TimerWheel_t *wheel, Timer_t *timer, uint64_t expiresMs)
+{
+    if (timer->pprev != NULL)
+    {
+        unlinkTimer(wheel, timer);
+        wheel->count--;
+    }
+
+    // Round up so it never fires early, anything already due goes on the next tick
+    timer->expires = (expiresMs + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if (timer->expires <= wheel->currentTick)
+    {
+        timer->expires = wheel->currentTick + 1;
+    }
+
+    addTimer(wheel, timer);
+    wheel->count++;
+}
+
+// Disarm, fine to call on a timer that isn't armed
+void stopTimer(TimerWheel_t *wheel, Timer_t *timer)
+{
+    if (timer->pprev == NULL)
+    {
+        return;
+    }
+    unlinkTimer(wheel, timer);
+    wheel->count--;
+}
+
+int timerPending(Timer_t *timer)
+{
+    return timer->pprev != NULL;
+}
+
+/*
+-- Turn the wheel up to nowMs, calling handler(timer, context) for every
+   timer that came due (it is disarmed first, so the handler can re-arm it)
+-- Return value: ms until the wheel next has something to do (the epoll
+   timeout), -1 if no timers are armed
+*/
+int expireTimers(TimerWheel_t *wheel, uint64_t nowMs, TimerHandler handler, void *context)
+{
+    uint64_t nowTick = nowMs / TIMER_TICK_MS;
+
+    if (wheel->count == 0)
+    {
+        wheel->currentTick = nowTick; // nothing to run in between
+        return -1;
+    }
+
+    while (wheel->currentTick < nowTick)
+    {
+        wheel->currentTick++;
+
+        // Crossing a slot boundary on a level brings its next slot down
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; level++)
+        {
+            if ((wheel->currentTick & ((1ull << (TIMER_WHEEL_BITS * level)) - 1)) != 0)
+            {
+                break;
+            }
+            cascade(wheel, level);
+        }
+
+        // Pop one at a time, a handler may stop or re-arm other timers
+        Timer_t **slot = &wheel->slots[0][wheel->currentTick & TIMER_SLOT_MASK];
+        while (*slot != NULL)
+        {
+            Timer_t *timer = *slot;
+            unlinkTimer(wheel, timer);
+            wheel->count--;
+            handler(timer, context);
+        }
+    }
+
+    if (wheel->count == 0)
+    {
+        return -1;
+    }
+    uint64_t nextMs = (wheel->currentTick + ticksToNextEvent(wheel)) * TIMER_TICK_MS;
+    return nextMs > nowMs ? (int)(nextMs - nowMs) : 0;
+}
+
+// Put the timer in the slot for how far away it is
+static void addTimer(TimerWheel_t *wheel, Timer_t *timer)
+{
+    uint64_t delta = timer->expires - wheel->currentTick;
+    int level = 0;
+
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1ull << (TIMER_WHEEL_BITS * (level + 1))))
+    {
+        level++;
+    }
+    if (level == TIMER_WHEEL_LEVELS - 1 && delta >= (1ull << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)))
+    {
+        // Further out than the wheel reaches, clamp it to the furthest tick it can hold
+        timer->expires = wheel->currentTick + (1ull << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+    }
+
+    int slot = (timer->expires >> (TIMER_WHEEL_BITS * level)) & TIMER_SLOT_MASK;
+    Timer_t **head = &wheel->slots[level][slot];
+
+    timer->level = level;
+    timer->slot = slot;
+    timer->next = *head;
+    if (*head != NULL)
+    {
+        (*head)->pprev = &timer->next;
+    }
+    timer->pprev = head;
+    *head = timer;
+    wheel->occupied[level] |= 1ull << slot;
+}
+
+static void unlinkTimer(TimerWheel_t *wheel, Timer_t *timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next != NULL)
+    {
+        timer->next->pprev = timer->pprev;
+    }
+    if (wheel->slots[timer->level][timer->slot] == NULL)
+    {
+        wheel->occupied[timer->level] &= ~(1ull << timer->slot);
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+// Re-file everything in this level's current slot, it all lands on a lower level now
+static void cascade(TimerWheel_t *wheel, int level)
+{
+    int slot = (wheel->currentTick >> (TIMER_WHEEL_BITS * level)) & TIMER_SLOT_MASK;
+    Timer_t *timer = wheel->slots[level][slot];
+
+    wheel->slots[level][slot] = NULL;
+    wheel->occupied[level] &= ~(1ull << slot);
+
+    while (timer != NULL)
+    {
+        Timer_t *next = timer->next;
+        addTimer(wheel, timer);
+        timer = next;
+    }
+}
+
+// Ticks until the next level 0 slot with timers in it or the next cascade, whichever is first
+static int ticksToNextEvent(TimerWheel_t *wheel)
+{
+    int untilCascade = TIMER_WHEEL_SLOTS - (wheel->currentTick & TIMER_SLOT_MASK);
+    uint64_t bits = wheel->occupied[0];
+    uint64_t higher = 0;
+
+    for (int level = 1; level < TIMER_WHEEL_LEVELS; level++)
+    {
+        higher |= wheel->occupied[level];
+    }
+    if (higher == 0)
+    {
+        untilCascade = TIMER_WHEEL_SLOTS; // nothing up there to bring down
+    }
+
+    if (bits == 0)
+    {
+        return untilCascade;
+    }
+
+    // Rotate so bit 0 is the slot for the next tick
+    int shift = (wheel->currentTick + 1) & TIMER_SLOT_MASK;
+    uint64_t rotated = (shift == 0) ? bits : (bits >> shift) | (bits << (TIMER_WHEEL_SLOTS - shift));
+    int ticks = __builtin_ctzll(rotated) + 1;
+
+    return ticks < untilCascade ? ticks : untilCascade;
+}
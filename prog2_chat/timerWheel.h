@@ -0,0 +1,41 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+
+#define TIMER_TICK_MS 10          // resolution, timers never fire early but may be up to a tick late
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4      // 64^4 ticks (about 46 hours) before a timer gets clamped
+
+// Embed one of these in whatever needs a timeout. Zeroed means not armed.
+typedef struct Timer
+{
+    struct Timer *next;
+    struct Timer **pprev;         // whatever points at us, so unlinking needs no search
+    uint64_t expires;             // tick it is due on
+    uint8_t level;
+    uint8_t slot;
+    uint8_t kind;                 // the owner's, tells its timers apart in the handler (never touched here)
+} Timer_t;
+
+// One per reactor: a hierarchy of 64 slot wheels, each slot 64 times
+// coarser than the level below. Timers cascade down a level as their
+// time comes closer.
+typedef struct
+{
+    Timer_t *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    uint64_t occupied[TIMER_WHEEL_LEVELS]; // bit per slot that has timers
+    uint64_t currentTick;                  // every tick up to this one has been run
+    int count;                             // armed timers
+} TimerWheel_t;
+
+typedef void (*TimerHandler)(Timer_t *timer, void *context);
+
+void initTimerWheel(TimerWheel_t *wheel, uint64_t nowMs);
+void startTimer(TimerWheel_t *wheel, Timer_t *timer, uint64_t expiresMs);
+void stopTimer(TimerWheel_t *wheel, Timer_t *timer);
+int timerPending(Timer_t *timer);
+int expireTimers(TimerWheel_t *wheel, uint64_t nowMs, TimerHandler handler, void *context);
+
+#endif
@@ -0,0 +1,492 @@
+// --------------- uring.c -----------------
+/*
+io_uring version of the chat server's event loop calls (-E uring).
+
+Same idea as epollLib - a thin per thread wrapper the event loop calls
+instead of the syscalls - but the reactor asks for the I/O itself rather
+than being told a socket is ready:
+
+- a multishot accept on its listening socket hands back new clients,
+- one multishot recv per client fills buffers out of a ring the reactor
+  provides (URING_BUFFERS of URING_BUFFER_SIZE, shared by all its clients)
+  and hands them back as they fill, so an idle client holds no buffer,
+- a sendmsg per client per pass writes its send queue (MSG_DONTWAIT: a full
+  socket comes back -EAGAIN, and a POLLOUT is armed instead), and
+- the epoll set, still holding the shared memory clients and the other
+  Unix sockets, is itself just one more descriptor polled through the ring.
+
+Nothing is submitted as it's asked for. Every request made during a pass
+sits in the submission queue until uringCall(), which submits them all and
+waits for completions in the same io_uring_enter(). A wakeup that reads
+from twenty clients and writes to fifty costs that one syscall instead of
+seventy.
+
+Talks to the kernel directly through <linux/io_uring.h> (no liburing).
+The ring is set up SINGLE_ISSUER | DEFER_TASKRUN, so completions are only
+ever produced while the reactor itself is in io_uring_enter().
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+#include "uring.h"
+#include "metrics.h"
+#include "safeUtil.h"
+#include "log.h"
+
+#define URING_SETUP_FLAGS (IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_SUBMIT_ALL | \
+                           IORING_SETUP_CQSIZE)
+#define URING_MAX_IOV 64               // iovecs one send can hand over (CONN_MAX_IOV)
+
+// One reactor's ring and everything the kernel reads out of our memory
+typedef struct
+{
+    int ringFd;
+
+    unsigned *sqHead;                  // advanced by the kernel as it takes entries
+    unsigned *sqTail;
+    unsigned sqMask;
+    unsigned sqEntries;
+    unsigned sqLocalTail;              // entries filled in, handed over at the next enter
+    struct io_uring_sqe *sqes;
+
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe *cqes;
+
+    struct io_uring_buf_ring *bufRing; // the buffers the kernel can pick from
+    uint8_t *buffers;
+    unsigned short bufTail;
+
+    int inFlight;                      // submitted (or about to be) and not finished
+
+    // A sendmsg's header and iovecs have to stay put until it's submitted
+    struct msghdr sendMsgs[URING_MAX_SENDS];
+    struct iovec sendIov[URING_MAX_SENDS][URING_MAX_IOV];
+    int numSends;
+} Uring_t;
+
+static __thread Uring_t *ring = NULL;
+
+static struct io_uring_sqe *getSqe(uint8_t opcode, UringOp op, int fd, uint32_t connId);
+static int enterRing(int getEvents, unsigned minComplete, int timeInMilliSeconds);
+static void addBuffer(unsigned short bid);
+static uint64_t userData(UringOp op, int fd, uint32_t connId);
+
+/*
+-- Can this kernel run the backend (and will the sandbox, if any, let us)?
+-- Return value: 1 if a ring with the flags we use can be set up, 0 if not
+*/
+int uringSupported()
+{
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+    params.flags = URING_SETUP_FLAGS;
+    params.cq_entries = 8;
+    int fd = syscall(__NR_io_uring_setup, 4, &params);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    close(fd);
+    return (params.features & IORING_FEAT_EXT_ARG) != 0;
+}
+
+// The calling reactor's ring and receive buffers
+void setupUring()
+{
+    struct io_uring_params params;
+
+    ring = (Uring_t *)sCalloc(1, sizeof(Uring_t));
+    memset(&params, 0, sizeof(params));
+    params.flags = URING_SETUP_FLAGS;
+    params.cq_entries = URING_ENTRIES * URING_CQ_FACTOR;
+    if ((ring->ringFd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params)) < 0)
+    {
+        perror("io_uring_setup");
+        exit(-1);
+    }
+
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        sqSize = cqSize = (sqSize > cqSize) ? sqSize : cqSize;
+    }
+    uint8_t *sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringFd,
+                       IORING_OFF_SQ_RING);
+    uint8_t *cq = sq;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) && sq != MAP_FAILED)
+    {
+        cq = mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringFd, IORING_OFF_CQ_RING);
+    }
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->ringFd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        perror("mmap io_uring");
+        exit(-1);
+    }
+
+    ring->sqHead = (unsigned *)(sq + params.sq_off.head);
+    ring->sqTail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sqMask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sqEntries = params.sq_entries;
+    ring->sqLocalTail = *ring->sqTail;
+    ring->cqHead = (unsigned *)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cqMask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // Entry i of the submission queue is always sqes[i]
+    unsigned *array = (unsigned *)(sq + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++)
+    {
+        array[i] = i;
+    }
+
+    // The provided buffer ring, and the buffers it points into
+    ring->bufRing = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring->buffers = mmap(NULL, (size_t)URING_BUFFERS * URING_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->bufRing == MAP_FAILED || ring->buffers == MAP_FAILED)
+    {
+        perror("mmap io_uring buffers");
+        exit(-1);
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->bufRing;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, ring->ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        perror("io_uring_register PBUF_RING");
+        exit(-1);
+    }
+    for (int bid = 0; bid < URING_BUFFERS; bid++)
+    {
+        addBuffer(bid);
+    }
+}
+
+/*
+-- The requests below are only prepared, they go in with the next submit
+-- Each returns 0, or -1 if the submission queue is full and the kernel
+   didn't take any of it (EBUSY/EAGAIN): nothing was queued, try again next pass
+*/
+
+// Multishot: one completion per client accepted (nonblocking), re-armed by the caller once it stops
+int uringAccept(int listenSocket)
+{
+    struct io_uring_sqe *sqe = getSqe(IORING_OP_ACCEPT, URING_ACCEPT, listenSocket, 0);
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    return 0;
+}
+
+// One shot POLLIN on a descriptor the reactor reads itself
+int uringWaitReadable(int fd)
+{
+    struct io_uring_sqe *sqe = getSqe(IORING_OP_POLL_ADD, URING_READABLE, fd, 0);
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+
+    sqe->poll32_events = POLLIN;
+    return 0;
+}
+
+// Multishot recv into the provided buffers, until it's cancelled, fails or runs out of buffers
+int uringRecv(int socketNum, uint32_t connId)
+{
+    struct io_uring_sqe *sqe = getSqe(IORING_OP_RECV, URING_RECV, socketNum, connId);
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    return 0;
+}
+
+/*
+-- Write iov (at most URING_MAX_IOV) to the socket at the next submit
+-- The bytes have to stay where they are until then, the iovecs are copied
+-- Never waits for room: a full socket completes with -EAGAIN
+-- Return value: 0 if it is prepared, -1 if the queue (or every header) is
+   still waiting for a submit the kernel didn't take, try again next pass
+*/
+int uringSend(int socketNum, uint32_t connId, struct iovec *iov, int numIov)
+{
+    if (ring->numSends == URING_MAX_SENDS)
+    {
+        enterRing(0, 0, 0);
+        if (ring->numSends == URING_MAX_SENDS)
+        {
+            return -1;
+        }
+    }
+
+    // The entry first: getting one can submit, and that starts the headers over
+    struct io_uring_sqe *sqe = getSqe(IORING_OP_SENDMSG, URING_SEND, socketNum, connId);
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+    int slot = ring->numSends++;
+    struct msghdr *msg = &ring->sendMsgs[slot];
+    memset(msg, 0, sizeof(*msg));
+    memcpy(ring->sendIov[slot], iov, numIov * sizeof(struct iovec));
+    msg->msg_iov = ring->sendIov[slot];
+    msg->msg_iovlen = numIov;
+
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+    return 0;
+}
+
+// One shot POLLOUT, the socket filled up
+int uringWaitWritable(int socketNum, uint32_t connId)
+{
+    struct io_uring_sqe *sqe = getSqe(IORING_OP_POLL_ADD, URING_WRITABLE, socketNum, connId);
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+
+    sqe->poll32_events = POLLOUT;
+    return 0;
+}
+
+// Stop a connection's multishot recv, its last completion comes back -ECANCELED (or with data)
+int uringCancelRecv(int socketNum, uint32_t connId)
+{
+    struct io_uring_sqe *sqe = getSqe(IORING_OP_ASYNC_CANCEL, URING_CANCEL, -1, 0);
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+
+    sqe->addr = userData(URING_RECV, socketNum, connId);
+    return 0;
+}
+
+/*
+-- Everything running on a socket that is about to be closed, submitted
+   now: a request holds its own reference to the socket, so close() alone
+   wouldn't stop it (or let the client see the connection close)
+-- Anything queued before it (a send to this socket) goes in first
+-- Return value: 0, or -1 if the queue is full and the cancel couldn't go in
+*/
+int uringCancelFd(int socketNum)
+{
+    struct io_uring_sqe *sqe = getSqe(IORING_OP_ASYNC_CANCEL, URING_CANCEL, socketNum, 0);
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    enterRing(0, 0, 0);
+    return 0;
+}
+
+// Every request on the ring (a handoff), wait for uringInFlight() to get to 0
+int uringCancelAll()
+{
+    struct io_uring_sqe *sqe = getSqe(IORING_OP_ASYNC_CANCEL, URING_CANCEL, -1, 0);
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+    return 0;
+}
+
+// Requests submitted (or queued) that haven't had their last completion yet
+int uringInFlight()
+{
+    return ring->inFlight;
+}
+
+/*
+-- Submit everything queued since the last call, then wait up to
+   timeInMilliSeconds (URING_WAIT_FOREVER, or 0 to just look) for completions
+-- Return value: the number copied into events, 0 on a timeout or a signal
+*/
+int uringCall(int timeInMilliSeconds, UringEvent_t *events, int maxEvents)
+{
+    unsigned head = *ring->cqHead;
+
+    if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+    {
+        enterRing(1, timeInMilliSeconds == 0 ? 0 : 1, timeInMilliSeconds);
+    }
+    else if (ring->sqLocalTail != *ring->sqTail)
+    {
+        enterRing(0, 0, 0); // the completions waiting are reason enough not to wait, just submit
+    }
+
+    unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+    int numEvents = 0;
+    while (head != tail && numEvents < maxEvents)
+    {
+        struct io_uring_cqe *cqe = &ring->cqes[head & ring->cqMask];
+        UringEvent_t *event = &events[numEvents++];
+
+        event->op = (UringOp)((cqe->user_data >> 24) & 0xFF);
+        event->fd = (int)(cqe->user_data & 0xFFFFFF);
+        event->connId = (uint32_t)(cqe->user_data >> 32);
+        event->res = cqe->res;
+        event->flags = cqe->flags;
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+        {
+            ring->inFlight--;
+        }
+        head++;
+    }
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+    return numEvents;
+}
+
+// Will a multishot request keep going after this completion?
+int uringEventMore(UringEvent_t *event)
+{
+    return (event->flags & IORING_CQE_F_MORE) != 0;
+}
+
+// Where a recv completion's bytes are, NULL if it didn't use a buffer
+uint8_t *uringEventBuffer(UringEvent_t *event)
+{
+    if (!(event->flags & IORING_CQE_F_BUFFER))
+    {
+        return NULL;
+    }
+    return ring->buffers + (size_t)(event->flags >> IORING_CQE_BUFFER_SHIFT) * URING_BUFFER_SIZE;
+}
+
+// Done with a recv completion's buffer (whether or not anyone wanted the bytes), the kernel can fill it again
+void uringReleaseBuffer(UringEvent_t *event)
+{
+    if (event->flags & IORING_CQE_F_BUFFER)
+    {
+        addBuffer(event->flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+}
+
+/*
+-- The next submission queue entry, cleared and tagged. A full queue is submitted first.
+-- Return value: NULL if the kernel took none of it, the oldest entry is still waiting in the slot
+*/
+static struct io_uring_sqe *getSqe(uint8_t opcode, UringOp op, int fd, uint32_t connId)
+{
+    if (ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) == ring->sqEntries)
+    {
+        enterRing(0, 0, 0);
+        if (ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) == ring->sqEntries)
+        {
+            return NULL;
+        }
+    }
+
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sqLocalTail & ring->sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = userData(op, fd, connId);
+    ring->sqLocalTail++;
+    ring->inFlight++;
+    return sqe;
+}
+
+/*
+-- Hand the kernel everything queued and, with getEvents, wait for
+   minComplete completions (at most timeInMilliSeconds, -1 for no limit)
+-- Once the kernel has taken every queued entry the send headers can be reused
+-- Return value: what io_uring_enter() returned, -1 on a timeout or a signal
+*/
+static int enterRing(int getEvents, unsigned minComplete, int timeInMilliSeconds)
+{
+    unsigned toSubmit = ring->sqLocalTail - *ring->sqTail;
+    struct __kernel_timespec timeout;
+    struct io_uring_getevents_arg arg;
+    unsigned flags = 0;
+    void *argp = NULL;
+    size_t argSize = 0;
+
+    __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+    if (getEvents)
+    {
+        flags = IORING_ENTER_GETEVENTS;
+        if (timeInMilliSeconds >= 0 && minComplete > 0)
+        {
+            timeout.tv_sec = timeInMilliSeconds / 1000;
+            timeout.tv_nsec = (long long)(timeInMilliSeconds % 1000) * 1000000;
+            memset(&arg, 0, sizeof(arg));
+            arg.sigmask_sz = _NSIG / 8;
+            arg.ts = (uint64_t)(uintptr_t)&timeout;
+            flags |= IORING_ENTER_EXT_ARG;
+            argp = &arg;
+            argSize = sizeof(arg);
+        }
+    }
+
+    metricAdd(&threadMetrics->syscalls, 1);
+    int ret = syscall(__NR_io_uring_enter, ring->ringFd, toSubmit, minComplete, flags, argp, argSize);
+    if (ret < 0 && errno != ETIME && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+    {
+        perror("io_uring_enter");
+        exit(-1);
+    }
+
+    if (__atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) == ring->sqLocalTail)
+    {
+        ring->numSends = 0;
+    }
+    return ret;
+}
+
+// Give a buffer (back) to the kernel
+static void addBuffer(unsigned short bid)
+{
+    struct io_uring_buf *buf = &ring->bufRing->bufs[ring->bufTail & (URING_BUFFERS - 1)];
+
+    buf->addr = (uint64_t)(uintptr_t)(ring->buffers + (size_t)bid * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = bid;
+    ring->bufTail++;
+    __atomic_store_n(&ring->bufRing->tail, ring->bufTail, __ATOMIC_RELEASE);
+}
+
+// [connId 32][op 8][fd 24]: a completion for a socket that has since been closed and reused is told apart by connId
+static uint64_t userData(UringOp op, int fd, uint32_t connId)
+{
+    return ((uint64_t)connId << 32) | ((uint64_t)op << 24) | ((uint32_t)fd & 0xFFFFFF);
+}
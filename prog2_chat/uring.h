@@ -0,0 +1,53 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define URING_ENTRIES 512              // submission queue, the completion queue is URING_CQ_FACTOR times that
+#define URING_CQ_FACTOR 4
+#define URING_BUFFERS 512              // provided receive buffers per reactor, a power of 2
+#define URING_BUFFER_SIZE 4096
+#define URING_BUFFER_GROUP 0
+#define URING_MAX_EVENTS 256           // completions handed back by one uringCall()
+#define URING_MAX_SENDS 256            // sends prepared between two submits
+#define URING_WAIT_FOREVER -1
+
+// What a completion is for (from the user_data it was submitted with)
+typedef enum
+{
+    URING_ACCEPT = 1,   // multishot accept on a listening socket, res is the new socket
+    URING_RECV,         // multishot recv, res bytes are in a provided buffer
+    URING_SEND,         // sendmsg of part of a connection's send queue
+    URING_WRITABLE,     // POLLOUT: the socket has room again
+    URING_READABLE,     // POLLIN on anything else (the epoll set, the inbox eventfd)
+    URING_CANCEL        // a cancel request is done, nothing to do
+} UringOp;
+
+// One completion, copied out of the ring
+typedef struct
+{
+    UringOp op;
+    int fd;
+    uint32_t connId;    // what the fd was when it was submitted (0 for listeners and eventfds)
+    int res;            // the operation's result, -errno if it failed
+    uint32_t flags;     // IORING_CQE_F_*
+} UringEvent_t;
+
+int uringSupported();
+void setupUring();
+int uringAccept(int listenSocket);
+int uringWaitReadable(int fd);
+int uringRecv(int socketNum, uint32_t connId);
+int uringSend(int socketNum, uint32_t connId, struct iovec *iov, int numIov);
+int uringWaitWritable(int socketNum, uint32_t connId);
+int uringCancelRecv(int socketNum, uint32_t connId);
+int uringCancelFd(int socketNum);
+int uringCancelAll();
+int uringInFlight();
+int uringCall(int timeInMilliSeconds, UringEvent_t *events, int maxEvents);
+int uringEventMore(UringEvent_t *event);
+uint8_t *uringEventBuffer(UringEvent_t *event);
+void uringReleaseBuffer(UringEvent_t *event);
+
+#endif